@@ -23,6 +23,8 @@ int ceph_arch_intel_ssse3 = 0;
 int ceph_arch_intel_sse3 = 0;
 int ceph_arch_intel_sse2 = 0;
 int ceph_arch_intel_aesni = 0;
+int ceph_arch_intel_avx2 = 0;
+int ceph_arch_intel_avx512 = 0;
 
 #ifdef __x86_64__
 #include <cpuid.h>
@@ -36,6 +38,24 @@ int ceph_arch_intel_aesni = 0;
 #define CPUID_SSE3	(1)
 #define CPUID_SSE2	(1 << 26)
 #define CPUID_AESNI (1 << 25)
+#define CPUID_OSXSAVE	(1 << 27)
+
+/* http://en.wikipedia.org/wiki/CPUID#EAX.3D7.2C_ECX.3D0:_Extended_Features */
+
+#define CPUID7_AVX2	(1 << 5)
+#define CPUID7_AVX512F	(1 << 16)
+#define CPUID7_AVX512DQ	(1 << 17)
+
+/* XCR0 state components the OS must save for us to use the registers */
+#define XCR0_YMM	0x06	/* sse + avx */
+#define XCR0_ZMM	0xe6	/* sse + avx + opmask + zmm */
+
+static unsigned long long xgetbv0(void)
+{
+	unsigned int eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+}
 
 int ceph_arch_intel_probe(void)
 {
@@ -66,6 +86,21 @@ int ceph_arch_intel_probe(void)
           ceph_arch_intel_aesni = 1;
   }
 
+	if ((ecx & CPUID_OSXSAVE) != 0 &&
+	    __get_cpuid_max(0, NULL) >= 7) {
+		unsigned long long xcr0 = xgetbv0();
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		if ((ebx & CPUID7_AVX2) != 0 &&
+		    (xcr0 & XCR0_YMM) == XCR0_YMM) {
+			ceph_arch_intel_avx2 = 1;
+		}
+		if ((ebx & CPUID7_AVX512F) != 0 &&
+		    (ebx & CPUID7_AVX512DQ) != 0 &&
+		    (xcr0 & XCR0_ZMM) == XCR0_ZMM) {
+			ceph_arch_intel_avx512 = 1;
+		}
+	}
+
 	return 0;
 }
 
@@ -5,6 +5,7 @@
 #define CEPH_OS_BLUESTORE_CHECKSUMMER
 
 #include "xxHash/xxhash.h"
+#include "common/csum_blocks.h"
 
 class Checksummer {
 public:
@@ -44,6 +45,32 @@ public:
     return -EINVAL;
   }
 
+  /// blocks handed to a multi-block kernel at once
+  enum { BLOCK_BATCH = 16 };
+
+  /// run a ceph_csum_*_blocks kernel, storing (masked) values as V
+  template<typename V, typename R, typename K>
+  static void calc_blocks_batched(
+    K kernel,
+    R init_value,
+    size_t block_size,
+    size_t blocks,
+    const char *data,
+    V *out,
+    R mask = -1) {
+    R v[BLOCK_BATCH];
+    while (blocks > 0) {
+      size_t n = std::min<size_t>(blocks, BLOCK_BATCH);
+      kernel(init_value, (unsigned char const *)data, block_size, n, v);
+      for (size_t i = 0; i < n; ++i) {
+	out[i] = v[i] & mask;
+      }
+      out += n;
+      data += n * block_size;
+      blocks -= n;
+    }
+  }
+
   static size_t get_csum_init_value_size(int csum_type) {
     switch (csum_type) {
     case CSUM_NONE: return 0;
@@ -86,6 +113,15 @@ public:
       ) {
       return p.crc32c(len, init_value);
     }
+    static void calc_blocks(
+      init_value_t init_value,
+      size_t block_size,
+      size_t blocks,
+      const char *data,
+      value_t *out) {
+      calc_blocks_batched(ceph_csum_crc32c_blocks, init_value,
+			  block_size, blocks, data, out);
+    }
   };
 
   struct crc32c_16 {
@@ -107,6 +143,15 @@ public:
       ) {
       return p.crc32c(len, init_value) & 0xffff;
     }
+    static void calc_blocks(
+      init_value_t init_value,
+      size_t block_size,
+      size_t blocks,
+      const char *data,
+      value_t *out) {
+      calc_blocks_batched(ceph_csum_crc32c_blocks, init_value,
+			  block_size, blocks, data, out, 0xffffu);
+    }
   };
 
   struct crc32c_8 {
@@ -128,6 +173,15 @@ public:
       ) {
       return p.crc32c(len, init_value) & 0xff;
     }
+    static void calc_blocks(
+      init_value_t init_value,
+      size_t block_size,
+      size_t blocks,
+      const char *data,
+      value_t *out) {
+      calc_blocks_batched(ceph_csum_crc32c_blocks, init_value,
+			  block_size, blocks, data, out, 0xffu);
+    }
   };
 
   struct xxhash32 {
@@ -157,6 +211,15 @@ public:
       }
       return XXH32_digest(state);
     }
+    static void calc_blocks(
+      init_value_t init_value,
+      size_t block_size,
+      size_t blocks,
+      const char *data,
+      value_t *out) {
+      calc_blocks_batched(ceph_csum_xxhash32_blocks, init_value,
+			  block_size, blocks, data, out);
+    }
   };
 
   struct xxhash64 {
@@ -186,6 +249,15 @@ public:
       }
       return XXH64_digest(state);
     }
+    static void calc_blocks(
+      init_value_t init_value,
+      size_t block_size,
+      size_t blocks,
+      const char *data,
+      value_t *out) {
+      calc_blocks_batched(ceph_csum_xxhash64_blocks, init_value,
+			  block_size, blocks, data, out);
+    }
   };
 
   template<class Alg>
@@ -221,9 +293,23 @@ public:
     typename Alg::value_t *pv =
       reinterpret_cast<typename Alg::value_t*>(csum_data->c_str());
     pv += offset / csum_block_size;
-    while (blocks--) {
-      *pv = Alg::calc(state, init_value, csum_block_size, p);
-      ++pv;
+    while (blocks > 0) {
+      // whole blocks within the current buffer go to the multi-block
+      // kernel; a block straddling two buffers is done on its own
+      const char *data;
+      size_t l = p.get_ptr_and_advance(blocks * csum_block_size, &data);
+      size_t n = l / csum_block_size;
+      if (n) {
+	Alg::calc_blocks(init_value, csum_block_size, n, data, pv);
+	pv += n;
+	blocks -= n;
+      }
+      if (l % csum_block_size) {
+	p.seek(p.get_off() - l % csum_block_size);
+	*pv = Alg::calc(state, init_value, csum_block_size, p);
+	++pv;
+	--blocks;
+      }
     }
     Alg::fini(&state);
     return 0;
@@ -249,18 +335,34 @@ public:
       reinterpret_cast<const typename Alg::value_t*>(csum_data.c_str());
     pv += offset / csum_block_size;
     size_t pos = offset;
+    typename Alg::value_t v[BLOCK_BATCH];
     while (length > 0) {
-      typename Alg::value_t v = Alg::calc(state, -1, csum_block_size, p);
-      if (*pv != v) {
-	if (bad_csum) {
-	  *bad_csum = v;
+      const char *data;
+      size_t l = p.get_ptr_and_advance(
+	std::min<size_t>(length, BLOCK_BATCH * csum_block_size), &data);
+      size_t n = l / csum_block_size;
+      if (n) {
+	Alg::calc_blocks(-1, csum_block_size, n, data, v);
+      }
+      if (l % csum_block_size) {
+	p.seek(p.get_off() - l % csum_block_size);
+	if (!n) {
+	  v[0] = Alg::calc(state, -1, csum_block_size, p);
+	  n = 1;
+	}
+      }
+      for (size_t i = 0; i < n; ++i) {
+	if (pv[i] != v[i]) {
+	  if (bad_csum) {
+	    *bad_csum = v[i];
+	  }
+	  Alg::fini(&state);
+	  return pos + i * csum_block_size;
 	}
-	Alg::fini(&state);
-	return pos;
       }
-      ++pv;
-      pos += csum_block_size;
-      length -= csum_block_size;
+      pv += n;
+      pos += n * csum_block_size;
+      length -= n * csum_block_size;
     }
     Alg::fini(&state);
     return -1;  // no errors
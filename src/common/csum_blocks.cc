@@ -0,0 +1,402 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <string.h>
+
+#include "common/csum_blocks.h"
+#include "include/crc32c.h"
+#include "arch/probe.h"
+#include "arch/intel.h"
+#include "xxHash/xxhash.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CSUM_BLOCKS_X86 1
+#include <immintrin.h>
+#endif
+
+// ---------------------------------------------------------------------
+// scalar
+
+void ceph_csum_crc32c_blocks_scalar(
+  uint32_t init, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out)
+{
+  while (blocks--) {
+    *out++ = ceph_crc32c(init, data, block_size);
+    data += block_size;
+  }
+}
+
+void ceph_csum_xxhash32_blocks_scalar(
+  uint32_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out)
+{
+  while (blocks--) {
+    *out++ = XXH32(data, block_size, seed);
+    data += block_size;
+  }
+}
+
+void ceph_csum_xxhash64_blocks_scalar(
+  uint64_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint64_t *out)
+{
+  while (blocks--) {
+    *out++ = XXH64(data, block_size, seed);
+    data += block_size;
+  }
+}
+
+#ifdef HAVE_CSUM_BLOCKS_X86
+
+// xxhash constants and the scalar tail of the algorithm; the vector
+// kernels below only run the stripe loop, with block_size a multiple of
+// the stripe so there are never leftover bytes to mix in.
+
+static const uint32_t PRIME32_1 = 2654435761U;
+static const uint32_t PRIME32_2 = 2246822519U;
+static const uint32_t PRIME32_3 = 3266489917U;
+
+static const uint64_t PRIME64_1 = 11400714785074694791ULL;
+static const uint64_t PRIME64_2 = 14029467366897019727ULL;
+static const uint64_t PRIME64_3 = 1609587929392839161ULL;
+static const uint64_t PRIME64_4 = 9650029242287828579ULL;
+
+static inline uint32_t rotl32(uint32_t x, int r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint32_t xxh32_finish(const uint32_t *v, size_t len)
+{
+  uint32_t h = rotl32(v[0], 1) + rotl32(v[1], 7) +
+    rotl32(v[2], 12) + rotl32(v[3], 18);
+  h += (uint32_t)len;
+  h ^= h >> 15;
+  h *= PRIME32_2;
+  h ^= h >> 13;
+  h *= PRIME32_3;
+  h ^= h >> 16;
+  return h;
+}
+
+static inline uint64_t xxh64_merge(uint64_t h, uint64_t v)
+{
+  v *= PRIME64_2;
+  v = rotl64(v, 31);
+  v *= PRIME64_1;
+  h ^= v;
+  return h * PRIME64_1 + PRIME64_4;
+}
+
+static inline uint64_t xxh64_finish(const uint64_t *v, size_t len)
+{
+  uint64_t h = rotl64(v[0], 1) + rotl64(v[1], 7) +
+    rotl64(v[2], 12) + rotl64(v[3], 18);
+  for (int i = 0; i < 4; ++i) {
+    h = xxh64_merge(h, v[i]);
+  }
+  h += len;
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+// crc32c: the crc32 instruction has a latency of 3 cycles but a
+// throughput of 1, so run four independent blocks through it at once.
+
+__attribute__((target("sse4.2")))
+void ceph_csum_crc32c_blocks_sse42(
+  uint32_t init, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out)
+{
+  if (block_size % 8 == 0) {
+    for (; blocks >= 4; blocks -= 4) {
+      unsigned char const *d0 = data;
+      unsigned char const *d1 = d0 + block_size;
+      unsigned char const *d2 = d1 + block_size;
+      unsigned char const *d3 = d2 + block_size;
+      uint64_t c0 = init, c1 = init, c2 = init, c3 = init;
+      for (size_t i = 0; i < block_size; i += 8) {
+	uint64_t w0, w1, w2, w3;
+	memcpy(&w0, d0 + i, 8);
+	memcpy(&w1, d1 + i, 8);
+	memcpy(&w2, d2 + i, 8);
+	memcpy(&w3, d3 + i, 8);
+	c0 = _mm_crc32_u64(c0, w0);
+	c1 = _mm_crc32_u64(c1, w1);
+	c2 = _mm_crc32_u64(c2, w2);
+	c3 = _mm_crc32_u64(c3, w3);
+      }
+      out[0] = c0;
+      out[1] = c1;
+      out[2] = c2;
+      out[3] = c3;
+      out += 4;
+      data += 4 * block_size;
+    }
+  }
+  ceph_csum_crc32c_blocks_scalar(init, data, block_size, blocks, out);
+}
+
+// xxhash32: a 16 byte stripe feeds the four 32-bit accumulators of one
+// block, so a 256-bit register holds two blocks; keep two registers (four
+// blocks) in flight to hide the multiply latency.
+
+__attribute__((target("avx2")))
+static inline __m256i xxh32_round_avx2(__m256i acc, __m256i in)
+{
+  const __m256i p1 = _mm256_set1_epi32(PRIME32_1);
+  const __m256i p2 = _mm256_set1_epi32(PRIME32_2);
+  acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(in, p2));
+  acc = _mm256_or_si256(_mm256_slli_epi32(acc, 13),
+			_mm256_srli_epi32(acc, 19));
+  return _mm256_mullo_epi32(acc, p1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i load_2x128(unsigned char const *a,
+				 unsigned char const *b)
+{
+  return _mm256_inserti128_si256(
+    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)a)),
+    _mm_loadu_si128((const __m128i*)b), 1);
+}
+
+__attribute__((target("avx2")))
+void ceph_csum_xxhash32_blocks_avx2(
+  uint32_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out)
+{
+  if (block_size >= 16 && block_size % 16 == 0) {
+    const __m256i init = _mm256_setr_epi32(
+      seed + PRIME32_1 + PRIME32_2, seed + PRIME32_2, seed, seed - PRIME32_1,
+      seed + PRIME32_1 + PRIME32_2, seed + PRIME32_2, seed, seed - PRIME32_1);
+    for (; blocks >= 4; blocks -= 4) {
+      unsigned char const *d0 = data;
+      unsigned char const *d1 = d0 + block_size;
+      unsigned char const *d2 = d1 + block_size;
+      unsigned char const *d3 = d2 + block_size;
+      __m256i a01 = init, a23 = init;
+      for (size_t i = 0; i < block_size; i += 16) {
+	a01 = xxh32_round_avx2(a01, load_2x128(d0 + i, d1 + i));
+	a23 = xxh32_round_avx2(a23, load_2x128(d2 + i, d3 + i));
+      }
+      uint32_t v[16];
+      _mm256_storeu_si256((__m256i*)v, a01);
+      _mm256_storeu_si256((__m256i*)(v + 8), a23);
+      for (int j = 0; j < 4; ++j) {
+	out[j] = xxh32_finish(v + 4 * j, block_size);
+      }
+      out += 4;
+      data += 4 * block_size;
+    }
+  }
+  ceph_csum_xxhash32_blocks_scalar(seed, data, block_size, blocks, out);
+}
+
+// with avx-512 a register holds four blocks' xxhash32 accumulators or two
+// blocks' xxhash64 ones (which needs avx512dq for the 64-bit multiply).
+
+__attribute__((target("avx512f")))
+static inline __m512i load_4x128(unsigned char const *a,
+				 unsigned char const *b,
+				 unsigned char const *c,
+				 unsigned char const *d)
+{
+  __m512i r = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i*)a));
+  r = _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i*)b), 1);
+  r = _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i*)c), 2);
+  return _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i*)d), 3);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i xxh32_round_avx512(__m512i acc, __m512i in)
+{
+  const __m512i p1 = _mm512_set1_epi32(PRIME32_1);
+  const __m512i p2 = _mm512_set1_epi32(PRIME32_2);
+  acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(in, p2));
+  // shift/or like the avx2 kernel; the unmasked shifts (and rol) pass an
+  // undefined source that trips -Wmaybe-uninitialized, so use all-ones masks
+  acc = _mm512_or_si512(_mm512_maskz_slli_epi32(0xffff, acc, 13),
+			_mm512_maskz_srli_epi32(0xffff, acc, 19));
+  return _mm512_mullo_epi32(acc, p1);
+}
+
+__attribute__((target("avx512f")))
+void ceph_csum_xxhash32_blocks_avx512(
+  uint32_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out)
+{
+  if (block_size >= 16 && block_size % 16 == 0) {
+    const __m512i init = _mm512_setr_epi32(
+      seed + PRIME32_1 + PRIME32_2, seed + PRIME32_2, seed, seed - PRIME32_1,
+      seed + PRIME32_1 + PRIME32_2, seed + PRIME32_2, seed, seed - PRIME32_1,
+      seed + PRIME32_1 + PRIME32_2, seed + PRIME32_2, seed, seed - PRIME32_1,
+      seed + PRIME32_1 + PRIME32_2, seed + PRIME32_2, seed, seed - PRIME32_1);
+    for (; blocks >= 8; blocks -= 8) {
+      unsigned char const *d[8];
+      for (int j = 0; j < 8; ++j) {
+	d[j] = data + j * block_size;
+      }
+      __m512i a0 = init, a1 = init;
+      for (size_t i = 0; i < block_size; i += 16) {
+	a0 = xxh32_round_avx512(
+	  a0, load_4x128(d[0] + i, d[1] + i, d[2] + i, d[3] + i));
+	a1 = xxh32_round_avx512(
+	  a1, load_4x128(d[4] + i, d[5] + i, d[6] + i, d[7] + i));
+      }
+      uint32_t v[32];
+      _mm512_storeu_si512(v, a0);
+      _mm512_storeu_si512(v + 16, a1);
+      for (int j = 0; j < 8; ++j) {
+	out[j] = xxh32_finish(v + 4 * j, block_size);
+      }
+      out += 8;
+      data += 8 * block_size;
+    }
+  }
+  ceph_csum_xxhash32_blocks_avx2(seed, data, block_size, blocks, out);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static inline __m512i xxh64_round_avx512(__m512i acc, __m512i in)
+{
+  const __m512i p1 = _mm512_set1_epi64(PRIME64_1);
+  const __m512i p2 = _mm512_set1_epi64(PRIME64_2);
+  acc = _mm512_add_epi64(acc, _mm512_mullo_epi64(in, p2));
+  acc = _mm512_or_si512(_mm512_maskz_slli_epi64(0xff, acc, 31),
+			_mm512_maskz_srli_epi64(0xff, acc, 33));
+  return _mm512_mullo_epi64(acc, p1);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i load_2x256(unsigned char const *a,
+				 unsigned char const *b)
+{
+  return _mm512_maskz_inserti64x4(
+    0xff, _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i*)a)),
+    _mm256_loadu_si256((const __m256i*)b), 1);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+void ceph_csum_xxhash64_blocks_avx512(
+  uint64_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint64_t *out)
+{
+  if (block_size >= 32 && block_size % 32 == 0) {
+    const __m512i init = _mm512_setr_epi64(
+      seed + PRIME64_1 + PRIME64_2, seed + PRIME64_2, seed, seed - PRIME64_1,
+      seed + PRIME64_1 + PRIME64_2, seed + PRIME64_2, seed, seed - PRIME64_1);
+    for (; blocks >= 4; blocks -= 4) {
+      unsigned char const *d0 = data;
+      unsigned char const *d1 = d0 + block_size;
+      unsigned char const *d2 = d1 + block_size;
+      unsigned char const *d3 = d2 + block_size;
+      __m512i a01 = init, a23 = init;
+      for (size_t i = 0; i < block_size; i += 32) {
+	a01 = xxh64_round_avx512(a01, load_2x256(d0 + i, d1 + i));
+	a23 = xxh64_round_avx512(a23, load_2x256(d2 + i, d3 + i));
+      }
+      uint64_t v[16];
+      _mm512_storeu_si512(v, a01);
+      _mm512_storeu_si512(v + 8, a23);
+      for (int j = 0; j < 4; ++j) {
+	out[j] = xxh64_finish(v + 4 * j, block_size);
+      }
+      out += 4;
+      data += 4 * block_size;
+    }
+  }
+  ceph_csum_xxhash64_blocks_scalar(seed, data, block_size, blocks, out);
+}
+
+#else // HAVE_CSUM_BLOCKS_X86
+
+void ceph_csum_crc32c_blocks_sse42(
+  uint32_t init, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out)
+{
+  ceph_csum_crc32c_blocks_scalar(init, data, block_size, blocks, out);
+}
+
+void ceph_csum_xxhash32_blocks_avx2(
+  uint32_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out)
+{
+  ceph_csum_xxhash32_blocks_scalar(seed, data, block_size, blocks, out);
+}
+
+void ceph_csum_xxhash32_blocks_avx512(
+  uint32_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out)
+{
+  ceph_csum_xxhash32_blocks_scalar(seed, data, block_size, blocks, out);
+}
+
+void ceph_csum_xxhash64_blocks_avx512(
+  uint64_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint64_t *out)
+{
+  ceph_csum_xxhash64_blocks_scalar(seed, data, block_size, blocks, out);
+}
+
+#endif // HAVE_CSUM_BLOCKS_X86
+
+/*
+ * choose best implementation based on the CPU architecture.
+ */
+static ceph_csum_crc32c_blocks_func_t choose_crc32c_blocks(void)
+{
+  ceph_arch_probe();
+#ifdef HAVE_CSUM_BLOCKS_X86
+  if (ceph_arch_intel_sse42) {
+    return ceph_csum_crc32c_blocks_sse42;
+  }
+#endif
+  return ceph_csum_crc32c_blocks_scalar;
+}
+
+static ceph_csum_xxhash32_blocks_func_t choose_xxhash32_blocks(void)
+{
+  ceph_arch_probe();
+#ifdef HAVE_CSUM_BLOCKS_X86
+  if (ceph_arch_intel_avx512) {
+    return ceph_csum_xxhash32_blocks_avx512;
+  }
+  if (ceph_arch_intel_avx2) {
+    return ceph_csum_xxhash32_blocks_avx2;
+  }
+#endif
+  return ceph_csum_xxhash32_blocks_scalar;
+}
+
+static ceph_csum_xxhash64_blocks_func_t choose_xxhash64_blocks(void)
+{
+  ceph_arch_probe();
+#ifdef HAVE_CSUM_BLOCKS_X86
+  if (ceph_arch_intel_avx512) {
+    return ceph_csum_xxhash64_blocks_avx512;
+  }
+#endif
+  return ceph_csum_xxhash64_blocks_scalar;
+}
+
+/*
+ * static globals, effectively constant for the executing process; see
+ * ceph_crc32c_func.
+ */
+ceph_csum_crc32c_blocks_func_t ceph_csum_crc32c_blocks =
+  choose_crc32c_blocks();
+ceph_csum_xxhash32_blocks_func_t ceph_csum_xxhash32_blocks =
+  choose_xxhash32_blocks();
+ceph_csum_xxhash64_blocks_func_t ceph_csum_xxhash64_blocks =
+  choose_xxhash64_blocks();
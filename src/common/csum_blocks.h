@@ -0,0 +1,68 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_COMMON_CSUM_BLOCKS_H
+#define CEPH_COMMON_CSUM_BLOCKS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * multi-block checksum kernels: compute one checksum for each of the
+ * `blocks` consecutive `block_size` byte blocks starting at `data`, as
+ * Checksummer does for every csum chunk of a blob.  the vector versions
+ * work on several blocks at once; which one is used is chosen at startup
+ * from the cpu features, like ceph_crc32c_func.
+ */
+typedef void (*ceph_csum_crc32c_blocks_func_t)(
+  uint32_t init, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out);
+typedef void (*ceph_csum_xxhash32_blocks_func_t)(
+  uint32_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out);
+typedef void (*ceph_csum_xxhash64_blocks_func_t)(
+  uint64_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint64_t *out);
+
+extern ceph_csum_crc32c_blocks_func_t ceph_csum_crc32c_blocks;
+extern ceph_csum_xxhash32_blocks_func_t ceph_csum_xxhash32_blocks;
+extern ceph_csum_xxhash64_blocks_func_t ceph_csum_xxhash64_blocks;
+
+/*
+ * the individual implementations, for tests and benchmarks.  the vector
+ * ones may only be called if the matching ceph_arch_intel_* flag is set;
+ * where they are not compiled in they fall back to the scalar version.
+ */
+void ceph_csum_crc32c_blocks_scalar(
+  uint32_t init, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out);
+void ceph_csum_crc32c_blocks_sse42(
+  uint32_t init, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out);
+
+void ceph_csum_xxhash32_blocks_scalar(
+  uint32_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out);
+void ceph_csum_xxhash32_blocks_avx2(
+  uint32_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out);
+void ceph_csum_xxhash32_blocks_avx512(
+  uint32_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint32_t *out);
+
+void ceph_csum_xxhash64_blocks_scalar(
+  uint64_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint64_t *out);
+void ceph_csum_xxhash64_blocks_avx512(
+  uint64_t seed, unsigned char const *data, size_t block_size, size_t blocks,
+  uint64_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
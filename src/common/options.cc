@@ -752,6 +752,50 @@ std::vector<Option> get_global_options() {
     .set_default(1)
     .set_description(""),
 
+    Option("ms_async_send_preencode", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("Encode and checksum outgoing messages on the sending thread")
+    .set_long_description("Messages whose type can be re-encoded (OSD ops, replies and replication/EC sub-ops) are fully encoded by the thread calling send_message(), so the messenger worker only writes the prepared buffers. Time still spent encoding on the workers is reported by msgr_running_encode_time."),
+
+    Option("ms_async_zerocopy_threshold", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_description("Send buffers of at least this size with MSG_ZEROCOPY (0 to disable)")
+    .set_long_description("The posix stack passes large data segments to the kernel without copying them and keeps them referenced until the socket error queue reports them sent. A connection stops using zero copy once the kernel reports that it had to copy anyway, e.g. over loopback. Requires Linux 4.14 or later."),
+
+    Option("ms_async_balance_interval", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_description("Seconds between rebalancing connections over messenger workers (0 to disable)")
+    .set_long_description("Each round samples the per-worker load (see the msgr_load_* perf counters) and may move one open connection from the busiest worker to the least busy one.")
+    .add_see_also("ms_async_balance_threshold"),
+
+    Option("ms_async_balance_threshold", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(.2)
+    .set_description("Minimum difference in busy fraction between workers before a connection is moved")
+    .add_see_also("ms_async_balance_interval"),
+
+    Option("ms_async_busy_poll_us", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_description("Microseconds messenger workers keep polling after the last event before blocking (0 to disable)")
+    .set_long_description("While events keep arriving within this budget the workers poll epoll and any registered pollers without sleeping, and sockets get SO_BUSY_POLL with the same value. This trades cpu for wakeup latency; see the msgr_busy_poll_* perf counters.")
+    .add_see_also("ms_async_busy_poll_messengers"),
+
+    Option("ms_async_busy_poll_messengers", Option::TYPE_STR, Option::LEVEL_ADVANCED)
+    .set_default("")
+    .set_description("Names of the messengers that busy poll (e.g. \"cluster\"), or empty for all")
+    .set_long_description("Busy polling messengers run on a separate set of ms_async_op_threads workers.")
+    .add_see_also("ms_async_busy_poll_us"),
+
+    Option("ms_async_batch_messages", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_description("Maximum number of queued messages sent in one frame (0 or 1 to disable)")
+    .set_long_description("When the peer is an AsyncMessenger that supports batch frames, small messages waiting on a connection (e.g. replica acks and pings) are written with one tag and one sendmsg. The average batch size is reported by msgr_send_batch_messages.")
+    .add_see_also("ms_async_batch_max_bytes"),
+
+    Option("ms_async_batch_max_bytes", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(4_K)
+    .set_description("Messages with a larger payload are never batched")
+    .add_see_also("ms_async_batch_messages"),
+
     Option("ms_async_op_threads", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
     .set_default(3)
     .set_description(""),
@@ -2948,6 +2992,12 @@ std::vector<Option> get_global_options() {
     .set_default(false)
     .set_description(""),
 
+    Option("rocksdb_delete_range_threshold", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(1024)
+    .set_description("Remove key ranges holding more keys than this with a single range tombstone")
+    .set_long_description("Without rocksdb_enable_rmrange, a range removal (such as clearing an object's omap) deletes its keys one by one.  Once a range has more keys than this, it is dropped with DeleteRange instead and the range is compacted in the background, so that clearing a huge omap does not leave millions of tombstones behind.  0 always deletes keys one by one.")
+    .add_see_also("rocksdb_enable_rmrange"),
+
     Option("rocksdb_bloom_bits_per_key", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
     .set_default(20)
     .set_description("Number of bits per key to use for RocksDB's bloom filters.")
@@ -3114,6 +3164,27 @@ std::vector<Option> get_global_options() {
     .set_default(64_K)
     .set_description(""),
 
+    Option("memstore_page_set_arena", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("Allocate page set pages from a shared arena of large chunks")
+    .set_long_description("Pages are carved out of memstore_page_set_arena_chunk_size chunks and recycled on free, instead of being allocated individually from the heap.")
+    .add_see_also("memstore_page_set"),
+
+    Option("memstore_page_set_arena_chunk_size", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(2_M)
+    .set_description("Size of each chunk mapped by the page set arena"),
+
+    Option("memstore_page_set_huge_pages", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("Back the page set arena with 2MB huge pages")
+    .set_long_description("Reserved huge pages (MAP_HUGETLB) are used if available, otherwise transparent huge pages are requested with madvise.")
+    .add_see_also("memstore_page_set_arena"),
+
+    Option("memstore_page_set_stripes", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(4)
+    .set_description("Number of independently locked page trees per object")
+    .set_long_description("Runs of 16 pages are spread over this many trees, so that concurrent writers to disjoint ranges of an object don't contend on one lock."),
+
     Option("objectstore_blackhole", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
     .set_default(false)
     .set_description(""),
@@ -3137,6 +3208,17 @@ std::vector<Option> get_global_options() {
     .set_default(true)
     .set_description(""),
 
+    Option("bdev_ioengine", Option::TYPE_STR, Option::LEVEL_ADVANCED)
+    .set_default("libaio")
+    .set_enum_allowed({"libaio", "io_uring"})
+    .set_description("Interface used by KernelDevice to submit and reap async io")
+    .set_long_description("io_uring needs ceph to be built with liburing and a kernel that supports it; otherwise libaio is used.  Takes effect when the device is opened."),
+
+    Option("bdev_ioring_sqthread_poll", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("With bdev_ioengine=io_uring, have a kernel thread poll the submission queue")
+    .set_long_description("Saves the submit syscall at the cost of a kernel thread busy polling while io is in flight.  May require elevated privileges on older kernels."),
+
     Option("bdev_aio_poll_ms", Option::TYPE_INT, Option::LEVEL_ADVANCED)
     .set_default(250)
     .set_description(""),
@@ -3193,6 +3275,12 @@ std::vector<Option> get_global_options() {
     .set_default(16_M)
     .set_description(""),
 
+    Option("bluefs_log_compact_batch", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(1024)
+    .set_min(1)
+    .set_description("Files or links written out per hold of the BlueFS lock during async log compaction")
+    .set_long_description("Async compaction of the BlueFS log dumps the metadata in batches of this many entries, letting other BlueFS users (e.g. RocksDB WAL syncs) take the lock in between."),
+
     Option("bluefs_min_flush_size", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
     .set_default(512_K)
     .set_description(""),
@@ -3214,8 +3302,9 @@ std::vector<Option> get_global_options() {
     .set_description(""),
 
     Option("bluefs_preextend_wal_files", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
-    .set_default(false)
-    .set_description(""),
+    .set_default(true)
+    .set_description("Size rocksdb WAL files to their preallocated space")
+    .set_long_description("When rocksdb recycles its WAL files, sizing them to the space preallocated for them means steady-state WAL syncs are a single data write with no BlueFS metadata log update.  Requires recycle_log_file_num > 0 in bluestore_rocksdb_options and is turned off otherwise."),
 
     Option("bluestore_bluefs", Option::TYPE_BOOL, Option::LEVEL_DEV)
     .set_default(true)
@@ -3271,7 +3360,8 @@ std::vector<Option> get_global_options() {
 
     Option("bluestore_spdk_io_sleep", Option::TYPE_UINT, Option::LEVEL_DEV)
     .set_default(5)
-    .set_description("Time period to wait if there is no completed I/O from polling"),
+    .set_description("Time period to wait if there is no completed I/O from polling")
+    .set_long_description("The thread that submitted the I/O polls its own queue pair until the I/O completes, sleeping this long between empty polls.  Setting it to 0 busy-polls, which gives the lowest latency but keeps the submitting threads spinning; only do that if they have dedicated cores."),
 
     Option("bluestore_block_path", Option::TYPE_STR, Option::LEVEL_DEV)
     .set_default("")
@@ -3323,6 +3413,12 @@ std::vector<Option> get_global_options() {
     .add_see_also("bluestore_block_wal_path")
     .add_see_also("bluestore_block_wal_size"),
 
+    Option("bluestore_block_wal_pmem_emulate", Option::TYPE_BOOL, Option::LEVEL_DEV)
+    .set_default(false)
+    .set_description("Map a bluefs wal file that is not on pmem as if it were")
+    .set_long_description("For testing the persistent memory wal without pmem hardware: writes are persisted with cache line flushes as on pmem, which makes them survive an OSD crash but not a host crash.  Requires libpmem.")
+    .add_see_also("bluestore_block_wal_path"),
+
     Option("bluestore_block_preallocate_file", Option::TYPE_BOOL, Option::LEVEL_DEV)
     .set_default(false)
     .add_tag("mkfs")
@@ -3371,6 +3467,13 @@ std::vector<Option> get_global_options() {
     .set_safe()
     .set_description("Default bluestore_prefer_deferred_size for non-rotational (solid state) media"),
 
+    Option("bluestore_prefer_deferred_size_pmem", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(32768)
+    .set_safe()
+    .set_description("Default bluestore_prefer_deferred_size when the bluefs wal is on persistent memory")
+    .set_long_description("A deferred write commits together with the kv transaction, so with the rocksdb wal on pmem it is staged there and acknowledged after a cache line flush, and written to the main device in the background.")
+    .add_see_also("bluestore_block_wal_path"),
+
     Option("bluestore_compression_mode", Option::TYPE_STR, Option::LEVEL_ADVANCED)
     .set_default("none")
     .set_enum_allowed({"none", "passive", "aggressive", "force"})
@@ -3446,6 +3549,44 @@ std::vector<Option> get_global_options() {
     .set_description("Compression ratio required to store compressed data")
     .set_long_description("If we compress data and get less than this we discard the result and store the original uncompressed data."),
 
+    Option("bluestore_compression_threads", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(2)
+    .set_description("Number of threads that compress blobs on behalf of writers")
+    .set_long_description("A write that produces several compressible blobs compresses one of them itself and hands the rest to this pool, so it only waits for the slowest blob.  Zero compresses every blob inline in the writing thread."),
+
+    Option("bluestore_compression_queue_max", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(64)
+    .set_safe()
+    .set_description("Max number of blobs waiting for a compression thread")
+    .set_long_description("Blobs that would exceed this queue depth are stored uncompressed rather than delaying the write.")
+    .add_see_also("bluestore_compression_threads"),
+
+    Option("bluestore_compression_estimator_history", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(8)
+    .set_safe()
+    .set_description("Consecutive failed compression attempts after which similar writes stop being compressed")
+    .set_long_description("Outcomes are tracked per collection and object allocation hint.  Once this many blobs in a row failed bluestore_compression_required_ratio, further blobs are stored uncompressed without trying, except for periodic probes.  Zero disables the history.  Ignored in 'force' mode.")
+    .add_see_also("bluestore_compression_estimator_probe"),
+
+    Option("bluestore_compression_estimator_probe", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(16)
+    .set_min(1)
+    .set_safe()
+    .set_description("While compression is being skipped for poor history, still try every Nth blob"),
+
+    Option("bluestore_compression_entropy_sample", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(4096)
+    .set_safe()
+    .set_description("Bytes of each blob sampled to estimate its entropy before compressing it")
+    .set_long_description("Blobs whose sampled entropy exceeds bluestore_compression_entropy_max are stored uncompressed without trying.  Zero disables the check.  Ignored in 'force' mode.")
+    .add_see_also("bluestore_compression_entropy_max"),
+
+    Option("bluestore_compression_entropy_max", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(7.6)
+    .set_min_max(0.0, 8.0)
+    .set_safe()
+    .set_description("Sampled entropy (bits per byte) above which a blob is assumed incompressible"),
+
     Option("bluestore_extent_map_shard_max_size", Option::TYPE_UINT, Option::LEVEL_DEV)
     .set_default(1200)
     .set_description("Max size (bytes) for a single extent map shard before splitting"),
@@ -3466,6 +3607,24 @@ std::vector<Option> get_global_options() {
     .set_default(256)
     .set_description("Preallocated buffer for inline shards"),
 
+    Option("bluestore_extent_map_shard_segment_extents", Option::TYPE_UINT, Option::LEVEL_DEV)
+    .set_default(0)
+    .set_safe()
+    .set_description("Approximate number of extents per separately decodable segment of an extent map shard (0 = encode shards whole)")
+    .set_long_description("Shards with more extents than this are encoded as segments with an index of their logical offsets, so that a read only decodes the segments it touches rather than the whole shard.  Older versions cannot read such shards, so the first mount with this set raises the store's min_compat_ondisk_format, which is permanent; on a store that has not been raised yet, changes take effect at the next mount."),
+
+    Option("bluestore_extent_map_reshard_deferred", Option::TYPE_BOOL, Option::LEVEL_DEV)
+    .set_default(true)
+    .set_safe()
+    .set_description("Reshard extent maps that outgrew their shard sizes in the background instead of on the write path")
+    .set_long_description("Shards that are merely too big or too small are written as they are and resharded later by a background thread.  Resharding still happens inline when a blob no longer fits its shard or a shard grows past twice bluestore_extent_map_shard_max_size.")
+    .add_see_also("bluestore_extent_map_shard_max_size"),
+
+    Option("bluestore_collection_list_readahead", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(2_M)
+    .set_description("Readahead for the kv iterator when listing a collection with metadata")
+    .set_long_description("collection_list_meta walks the onode keys and values of a whole range in order, as backfill does, so the kv store may read ahead this many bytes at a time."),
+
     Option("bluestore_cache_trim_interval", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
     .set_default(.2)
     .set_description("How frequently we trim the bluestore cache"),
@@ -3512,6 +3671,23 @@ std::vector<Option> get_global_options() {
     .set_default(512_M)
     .set_description("Max memory (bytes) to devote to kv database (rocksdb)"),
 
+    Option("bluestore_cache_autotune", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("Automatically rebalance the cache between onodes, buffers and kv")
+    .set_long_description("Periodically compare the miss ratio and fill level of the onode cache, the buffer cache and the kv database (rocksdb) block cache and move memory toward the consumer under the most pressure.  bluestore_cache_meta_ratio and bluestore_cache_kv_ratio are only used as the starting point.  Block cache hit statistics are only collected if this is enabled at mount."),
+
+    Option("bluestore_cache_autotune_interval", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(5)
+    .set_description("Seconds between cache autotune passes"),
+
+    Option("bluestore_cache_autotune_chunk_size", Option::TYPE_UINT, Option::LEVEL_DEV)
+    .set_default(32_M)
+    .set_description("Bytes moved between caches in a single autotune pass"),
+
+    Option("bluestore_cache_autotune_min_ratio", Option::TYPE_FLOAT, Option::LEVEL_DEV)
+    .set_default(.02)
+    .set_description("Minimum ratio of the bluestore cache the autotuner leaves to each consumer"),
+
     Option("bluestore_kvbackend", Option::TYPE_STR, Option::LEVEL_DEV)
     .set_default("rocksdb")
     .add_tag("mkfs")
@@ -3519,8 +3695,9 @@ std::vector<Option> get_global_options() {
 
     Option("bluestore_allocator", Option::TYPE_STR, Option::LEVEL_ADVANCED)
     .set_default("stupid")
-    .set_enum_allowed({"bitmap", "stupid"})
-    .set_description("Allocator policy"),
+    .set_enum_allowed({"bitmap", "stupid", "avl"})
+    .set_description("Allocator policy")
+    .set_long_description("avl keeps free extents in trees ordered by offset and by length, so it stays fast for large allocations on a fragmented device"),
 
     Option("bluestore_freelist_blocks_per_key", Option::TYPE_INT, Option::LEVEL_DEV)
     .set_default(128)
@@ -3578,6 +3755,12 @@ std::vector<Option> get_global_options() {
     .set_default(false)
     .set_description("Try to submit metadata transaction to rocksdb in queuing thread context"),
 
+    Option("bluestore_kv_sync_threads", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(1)
+    .set_min(1)
+    .set_description("Number of kv_sync/kv_finalize thread pairs")
+    .set_long_description("Each sequencer (PG) is pinned to one pair, so transactions from different PGs can be committed to the key/value store in parallel.  Values above 1 are mainly useful on fast NVMe devices where a single kv_sync thread is CPU bound.  Takes effect on mount."),
+
     Option("bluestore_throttle_bytes", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
     .set_default(64_M)
     .set_safe()
@@ -3619,6 +3802,20 @@ std::vector<Option> get_global_options() {
     .set_safe()
     .set_description("Default bluestore_deferred_batch_ops for non-rotational (solid state) media"),
 
+    Option("bluestore_deferred_aggregate", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(true)
+    .set_safe()
+    .set_description("Merge pending deferred writes from all sequencers into a single LBA-sorted submission")
+    .set_long_description("When the deferred write queue is flushed, the pending batches of every sequencer that is not already writing are combined, sorted by device offset, coalesced into contiguous writes, and issued in one elevator pass starting from where the previous pass ended."),
+
+    Option("bluestore_deferred_max_delay", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(.1)
+    .set_min(0)
+    .set_safe()
+    .set_description("Max seconds a deferred write may wait for the deferred write queue to fill before it is flushed")
+    .set_long_description("Bounds the latency that bluestore_deferred_batch_ops adds to an idle or lightly loaded store.  Zero disables the bound.")
+    .add_see_also("bluestore_deferred_batch_ops"),
+
     Option("bluestore_nid_prealloc", Option::TYPE_INT, Option::LEVEL_DEV)
     .set_default(1024)
     .set_description("Number of unique object ids to preallocate at a time"),
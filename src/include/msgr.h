@@ -93,6 +93,8 @@ struct ceph_entity_inst {
 #define CEPH_MSGR_TAG_SEQ           13 /* 64-bit int follows with seen seq number */
 #define CEPH_MSGR_TAG_KEEPALIVE2     14
 #define CEPH_MSGR_TAG_KEEPALIVE2_ACK 15  /* keepalive reply */
+#define CEPH_MSGR_TAG_MSG_BATCH     16  /* le32 count, then that many
+					  untagged messages */
 
 
 /*
@@ -268,7 +268,7 @@ public:
   };
   typedef ceph::shared_ptr< WholeSpaceIteratorImpl > WholeSpaceIterator;
 
-private:
+protected:
   // This class filters a WholeSpaceIterator by a prefix.
   class PrefixIteratorImpl : public IteratorImpl {
     const std::string prefix;
@@ -340,6 +340,11 @@ public:
       prefix,
       get_wholespace_iterator());
   }
+  /// iterator for a long forward scan; the backend may read ahead
+  virtual Iterator get_scan_iterator(const std::string &prefix,
+				     uint64_t readahead) {
+    return get_iterator(prefix);
+  }
 
   void add_column_family(const std::string& cf_name, void *handle) {
     cf_handles.insert(std::make_pair(cf_name, handle));
@@ -358,6 +363,26 @@ public:
     return -EOPNOTSUPP;
   }
 
+  /// resize the cache of an already open db
+  virtual int set_cache_capacity(uint64_t capacity) {
+    return -EOPNOTSUPP;
+  }
+
+  /// bytes currently held by the cache
+  virtual int64_t get_cache_usage() const {
+    return -EOPNOTSUPP;
+  }
+
+  /// track cache hits and misses; call before the db is opened
+  virtual int enable_cache_hit_stats() {
+    return -EOPNOTSUPP;
+  }
+
+  /// cumulative cache hits and misses, if tracked
+  virtual int get_cache_hit_stats(uint64_t *hits, uint64_t *misses) {
+    return -EOPNOTSUPP;
+  }
+
   virtual ~KeyValueDB() {}
 
   /// compact the underlying store
@@ -333,7 +333,7 @@ int RocksDBStore::load_rocksdb_options(bool create_if_missing, rocksdb::Options&
     }
   }
 
-  if (g_conf->rocksdb_perf)  {
+  if (g_conf->rocksdb_perf || cache_hit_stats)  {
     dbstats = rocksdb::CreateDBStatistics();
     opt.statistics = dbstats;
   }
@@ -567,6 +567,10 @@ int RocksDBStore::do_open(ostream &out, bool create_if_missing,
   plb.add_time_avg(l_rocksdb_write_delay_time, "rocksdb_write_delay_time", "Rocksdb write delay time");
   plb.add_time_avg(l_rocksdb_write_pre_and_post_process_time, 
       "rocksdb_write_pre_and_post_time", "total time spent on writing a record, excluding write process");
+  plb.add_u64_counter(l_rocksdb_rmrange_keys, "rmrange_keys",
+		      "Keys removed one by one by range removals");
+  plb.add_u64_counter(l_rocksdb_rmrange_tombstones, "rmrange_tombstones",
+		      "Range tombstones written by range removals");
   logger = plb.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
 
@@ -709,6 +713,42 @@ void RocksDBStore::get_statistics(Formatter *f)
   }
 }
 
+int RocksDBStore::set_cache_capacity(uint64_t capacity)
+{
+  if (!bbt_opts.block_cache) {
+    return -ENOENT;
+  }
+  // the row cache cannot be resized; only the block cache share moves
+  uint64_t row_cache_size = cache_size * g_conf->rocksdb_cache_row_ratio;
+  uint64_t block_cache_size =
+    capacity > row_cache_size ? capacity - row_cache_size : 0;
+  dout(10) << __func__ << " block_cache size "
+	   << prettybyte_t(bbt_opts.block_cache->GetCapacity()) << " -> "
+	   << prettybyte_t(block_cache_size) << dendl;
+  bbt_opts.block_cache->SetCapacity(block_cache_size);
+  return 0;
+}
+
+int64_t RocksDBStore::get_cache_usage() const
+{
+  if (!bbt_opts.block_cache) {
+    return -ENOENT;
+  }
+  return bbt_opts.block_cache->GetUsage();
+}
+
+int RocksDBStore::get_cache_hit_stats(uint64_t *hits, uint64_t *misses)
+{
+  if (!dbstats) {
+    // tickers are only maintained with rocksdb_perf or
+    // enable_cache_hit_stats()
+    return -ENOENT;
+  }
+  *hits = dbstats->getTickerCount(rocksdb::BLOCK_CACHE_HIT);
+  *misses = dbstats->getTickerCount(rocksdb::BLOCK_CACHE_MISS);
+  return 0;
+}
+
 int RocksDBStore::submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Transaction t) 
 {
   // enable rocksdb breakdown
@@ -733,6 +773,11 @@ int RocksDBStore::submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Tra
     derr << __func__ << " error: " << s.ToString() << " code = " << s.code()
          << " Rocksdb transaction: " << rocks_txc.seen << dendl;
   }
+  if (s.ok()) {
+    for (auto& r : _t->compact_ranges) {
+      compact_range_async(r.first, r.second);
+    }
+  }
 
   if (g_conf->rocksdb_perf) {
     utime_t write_memtable_time;
@@ -911,44 +956,64 @@ void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix
   }
 }
 
+void RocksDBStore::RocksDBTransactionImpl::delete_range(
+  rocksdb::ColumnFamilyHandle *cf,
+  const string &prefix,
+  const string &start,
+  const string &end)
+{
+  if (cf) {
+    bat.DeleteRange(cf, rocksdb::Slice(start), rocksdb::Slice(end));
+  } else {
+    bat.DeleteRange(db->default_cf,
+		    rocksdb::Slice(combine_strings(prefix, start)),
+		    rocksdb::Slice(combine_strings(prefix, end)));
+  }
+  if (!db->enable_rmrange) {
+    // a large range went away; get rid of the data and the tombstone.
+    // compact_range() finds the column family from the prefix.
+    compact_ranges.push_back(make_pair(combine_strings(prefix, start),
+				       combine_strings(prefix, end)));
+  }
+  db->logger->inc(l_rocksdb_rmrange_tombstones);
+}
+
 void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
                                                          const string &start,
                                                          const string &end)
 {
   auto cf = db->get_cf_handle(prefix);
-  if (cf) {
-    if (db->enable_rmrange) {
-      bat.DeleteRange(cf, rocksdb::Slice(start), rocksdb::Slice(end));
-    } else {
-      auto it = db->get_iterator(prefix);
-      it->lower_bound(start);
-      while (it->valid()) {
-	if (it->key() >= end) {
-	  break;
-	}
-	bat.Delete(cf, rocksdb::Slice(it->key()));
-	it->next();
-      }
+  if (db->enable_rmrange) {
+    delete_range(cf, prefix, start, end);
+    return;
+  }
+
+  // a few point tombstones are cheaper for readers than a range
+  // tombstone, but past delete_range_threshold keys we drop the whole
+  // range at once.
+  vector<string> keys;
+  auto it = db->get_iterator(prefix);
+  it->lower_bound(start);
+  while (it->valid()) {
+    if (it->key() >= end) {
+      break;
     }
-  } else {
-    if (db->enable_rmrange) {
-      bat.DeleteRange(
-	db->default_cf,
-	rocksdb::Slice(combine_strings(prefix, start)),
-	rocksdb::Slice(combine_strings(prefix, end)));
+    if (db->delete_range_threshold &&
+	keys.size() >= db->delete_range_threshold) {
+      delete_range(cf, prefix, start, end);
+      return;
+    }
+    keys.push_back(it->key());
+    it->next();
+  }
+  for (auto& k : keys) {
+    if (cf) {
+      bat.Delete(cf, rocksdb::Slice(k));
     } else {
-      auto it = db->get_iterator(prefix);
-      it->lower_bound(start);
-      while (it->valid()) {
-	if (it->key() >= end) {
-	  break;
-	}
-	bat.Delete(db->default_cf,
-		   combine_strings(prefix, it->key()));
-	it->next();
-      }
+      bat.Delete(db->default_cf, combine_strings(prefix, k));
     }
   }
+  db->logger->inc(l_rocksdb_rmrange_keys, keys.size());
 }
 
 void RocksDBStore::RocksDBTransactionImpl::merge(
@@ -1211,6 +1276,23 @@ bool RocksDBStore::check_omap_dir(string &omap_dir)
 void RocksDBStore::compact_range(const string& start, const string& end)
 {
   rocksdb::CompactRangeOptions options;
+  // keys of a prefix with a column family of its own are stored there
+  // without the prefix
+  string prefix, key;
+  if (!cf_handles.empty() && split_key(start, &prefix, &key) == 0) {
+    auto cf = get_cf_handle(prefix);
+    if (cf) {
+      string end_prefix, end_key;
+      rocksdb::Slice cstart(key);
+      rocksdb::Slice cend;
+      bool bounded = split_key(end, &end_prefix, &end_key) == 0 &&
+	end_prefix == prefix;
+      if (bounded)
+	cend = rocksdb::Slice(end_key);
+      db->CompactRange(options, cf, &cstart, bounded ? &cend : nullptr);
+      return;
+    }
+  }
   rocksdb::Slice cstart(start);
   rocksdb::Slice cend(end);
   db->CompactRange(options, &cstart, &cend);
@@ -1428,3 +1510,22 @@ KeyValueDB::Iterator RocksDBStore::get_iterator(const std::string& prefix)
     return KeyValueDB::get_iterator(prefix);
   }
 }
+
+KeyValueDB::Iterator RocksDBStore::get_scan_iterator(
+  const std::string& prefix,
+  uint64_t readahead)
+{
+  rocksdb::ReadOptions opts;
+  opts.readahead_size = readahead;
+  rocksdb::ColumnFamilyHandle *cf_handle =
+    static_cast<rocksdb::ColumnFamilyHandle*>(get_cf_handle(prefix));
+  if (cf_handle) {
+    return std::make_shared<CFIteratorImpl>(
+      prefix,
+      db->NewIterator(opts, cf_handle));
+  }
+  return std::make_shared<PrefixIteratorImpl>(
+    prefix,
+    std::make_shared<RocksDBWholeSpaceIteratorImpl>(
+      db->NewIterator(opts, default_cf)));
+}
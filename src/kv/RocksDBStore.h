@@ -42,6 +42,8 @@ enum {
   l_rocksdb_write_memtable_time,
   l_rocksdb_write_delay_time,
   l_rocksdb_write_pre_and_post_process_time,
+  l_rocksdb_rmrange_keys,
+  l_rocksdb_rmrange_tombstones,
   l_rocksdb_last,
 };
 
@@ -80,6 +82,7 @@ class RocksDBStore : public KeyValueDB {
 
   uint64_t cache_size = 0;
   bool set_cache_flag = false;
+  bool cache_hit_stats = false;
 
   bool must_close_default_cf = false;
   rocksdb::ColumnFamilyHandle *default_cf = nullptr;
@@ -117,6 +120,7 @@ public:
   bool compact_on_mount;
   bool disableWAL;
   bool enable_rmrange;
+  uint64_t delete_range_threshold;
   void compact() override;
 
   int tryInterpret(const string& key, const string& val, rocksdb::Options &opt);
@@ -151,7 +155,9 @@ public:
     compact_thread(this),
     compact_on_mount(false),
     disableWAL(false),
-    enable_rmrange(cct->_conf->rocksdb_enable_rmrange)
+    enable_rmrange(cct->_conf->rocksdb_enable_rmrange),
+    delete_range_threshold(
+      cct->_conf->get_val<uint64_t>("rocksdb_delete_range_threshold"))
   {}
 
   ~RocksDBStore() override;
@@ -278,9 +284,16 @@ public:
   public:
     rocksdb::WriteBatch bat;
     RocksDBStore *db;
+    /// ranges removed with DeleteRange, to compact once committed
+    list<pair<string,string> > compact_ranges;
 
     explicit RocksDBTransactionImpl(RocksDBStore *_db);
   private:
+    void delete_range(
+      rocksdb::ColumnFamilyHandle *cf,
+      const string &prefix,
+      const string &start,
+      const string &end);
     void put_bat(
       rocksdb::WriteBatch& bat,
       rocksdb::ColumnFamilyHandle *cf,
@@ -372,6 +385,8 @@ public:
   };
 
   Iterator get_iterator(const std::string& prefix) override;
+  Iterator get_scan_iterator(const std::string& prefix,
+			     uint64_t readahead) override;
 
   /// Utility
   static string combine_strings(const string &prefix, const string &value) {
@@ -473,6 +488,14 @@ err:
     return 0;
   }
 
+  int set_cache_capacity(uint64_t capacity) override;
+  int64_t get_cache_usage() const override;
+  int enable_cache_hit_stats() override {
+    cache_hit_stats = true;
+    return 0;
+  }
+  int get_cache_hit_stats(uint64_t *hits, uint64_t *misses) override;
+
   WholeSpaceIterator get_wholespace_iterator() override;
 };
 
@@ -61,6 +61,7 @@ public:
     }
   }
 
+  bool can_preencode() const override { return true; }
   void encode_payload(uint64_t features) override {
     ::encode(pgid, payload);
     ::encode(map_epoch, payload);
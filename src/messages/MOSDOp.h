@@ -245,6 +245,7 @@ public:
   }
 
   // marshalling
+  bool can_preencode() const override { return true; }
   void encode_payload(uint64_t features) override {
     if( false == bdata_encode ) {
       OSDOp::merge_osd_op_vector_in_data(ops, data);
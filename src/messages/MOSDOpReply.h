@@ -157,6 +157,7 @@ private:
   ~MOSDOpReply() override {}
 
 public:
+  bool can_preencode() const override { return true; }
   void encode_payload(uint64_t features) override {
     if(false == bdata_encode) {
       OSDOp::merge_osd_op_vector_out_data(ops, data);
@@ -83,6 +83,7 @@ public:
     ::decode(from, p);
     final_decode_needed = false;
   }
+  bool can_preencode() const override { return true; }
   void encode_payload(uint64_t features) override {
     ::encode(map_epoch, payload);
     if (HAVE_FEATURE(features, SERVER_LUMINOUS)) {
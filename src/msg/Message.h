@@ -473,6 +473,10 @@ public:
   // virtual bits
   virtual void decode_payload() = 0;
   virtual void encode_payload(uint64_t features) = 0;
+  // true if encode_payload() can safely run again after clear_payload(),
+  // e.g. with different features, so that the sending thread may encode
+  // the message before the connection is ready to write it
+  virtual bool can_preencode() const { return false; }
   virtual const char *get_type_name() const = 0;
   virtual void print(ostream& out) const {
     out << get_type_name() << " magic: " << magic;
@@ -130,6 +130,9 @@ AsyncConnection::AsyncConnection(CephContext *cct, AsyncMessenger *m, DispatchQu
     recv_start(0), recv_end(0),
     last_active(ceph::coarse_mono_clock::now()),
     inactive_timeout_us(cct->_conf->ms_tcp_read_timeout*1000*1000),
+    send_preencode(cct->_conf->get_val<bool>("ms_async_send_preencode")),
+    batch_messages(cct->_conf->get_val<uint64_t>("ms_async_batch_messages")),
+    batch_max_bytes(cct->_conf->get_val<uint64_t>("ms_async_batch_max_bytes")),
     msg_left(0), cur_msg_size(0), got_bad_auth(false), authorizer(NULL), replacing(false),
     is_reset_from_peer(false), once_ready(false), state_buffer(NULL), state_offset(0),
     worker(w), center(&w->center)
@@ -328,6 +331,10 @@ void AsyncConnection::process()
 #endif
   bool need_dispatch_writer = false;
   std::lock_guard<std::mutex> l(lock);
+  if (!center->in_thread()) {
+    // queued before we migrated away from this worker
+    return;
+  }
   last_active = ceph::coarse_mono_clock::now();
   auto recv_start_time = ceph::mono_clock::now();
   do {
@@ -356,6 +363,9 @@ void AsyncConnection::process()
             state = STATE_OPEN_TAG_ACK;
           } else if (tag == CEPH_MSGR_TAG_MSG) {
             state = STATE_OPEN_MESSAGE_HEADER;
+          } else if (tag == CEPH_MSGR_TAG_MSG_BATCH &&
+                     HAVE_FEATURE(get_features(), MSGR_BATCH)) {
+            state = STATE_OPEN_MESSAGE_BATCH;
           } else if (tag == CEPH_MSGR_TAG_CLOSE) {
             state = STATE_OPEN_TAG_CLOSE;
           } else {
@@ -426,6 +436,30 @@ void AsyncConnection::process()
           break;
         }
 
+      case STATE_OPEN_MESSAGE_BATCH:
+        {
+          ceph_le32 *count;
+          r = read_until(sizeof(*count), state_buffer);
+          if (r < 0) {
+            ldout(async_msgr->cct, 1) << __func__ << " read batch count failed" << dendl;
+            goto fail;
+          } else if (r > 0) {
+            break;
+          }
+
+          count = (ceph_le32*)state_buffer;
+          if (*count == 0) {
+            ldout(async_msgr->cct, 0) << __func__ << " got empty message batch" << dendl;
+            goto fail;
+          }
+          batch_left = *count;
+          ldout(async_msgr->cct, 20) << __func__ << " got MSG_BATCH of "
+                                     << batch_left << " messages" << dendl;
+          logger->inc(l_msgr_recv_batch_messages, batch_left);
+          state = STATE_OPEN_MESSAGE_HEADER;
+          break;
+        }
+
       case STATE_OPEN_MESSAGE_HEADER:
         {
 #if defined(WITH_LTTNG) && defined(WITH_EVENTTRACE)
@@ -703,6 +737,10 @@ void AsyncConnection::process()
             message->put();
             if (has_feature(CEPH_FEATURE_RECONNECT_SEQ) && async_msgr->cct->_conf->ms_die_on_old_message)
               assert(0 == "old msgs despite reconnect_seq feature");
+            if (batch_left && --batch_left)
+              state = STATE_OPEN_MESSAGE_HEADER;
+            else
+              state = STATE_OPEN;
             break;
           }
           if (message->get_seq() > cur_seq + 1) {
@@ -736,10 +774,15 @@ void AsyncConnection::process()
             ack_left++;
             need_dispatch_writer = true;
           }
-          state = STATE_OPEN;
+          // the rest of a batch follows without tags
+          if (batch_left && --batch_left)
+            state = STATE_OPEN_MESSAGE_HEADER;
+          else
+            state = STATE_OPEN;
 
           logger->inc(l_msgr_recv_messages);
           logger->inc(l_msgr_recv_bytes, cur_msg_size + sizeof(ceph_msg_header) + sizeof(ceph_msg_footer));
+          traffic_bytes += cur_msg_size + sizeof(ceph_msg_header) + sizeof(ceph_msg_footer);
 
           async_msgr->ms_fast_preprocess(message);
           auto fast_dispatch_time = ceph::mono_clock::now();
@@ -996,7 +1039,9 @@ ssize_t AsyncConnection::_process_connection()
         }
         bufferlist bl;
 
-        connect_msg.features = policy.features_supported;
+        // only AsyncMessenger understands batch frames, so it advertises
+        // the bit itself instead of through CEPH_FEATURES_ALL
+        connect_msg.features = policy.features_supported | CEPH_FEATURE_MSGR_BATCH;
         connect_msg.host_type = async_msgr->get_myinst().name.type();
         connect_msg.global_seq = global_seq;
         connect_msg.connect_seq = connect_seq;
@@ -1135,11 +1180,16 @@ ssize_t AsyncConnection::_process_connection()
         peer_global_seq = connect_reply.global_seq;
         policy.lossy = connect_reply.flags & CEPH_MSG_CONNECT_LOSSY;
         state = STATE_OPEN;
+        batch_left = 0;
         once_ready = true;
         connect_seq += 1;
         assert(connect_seq == connect_reply.connect_seq);
         backoff = utime_t();
-        set_features((uint64_t)connect_reply.features & (uint64_t)connect_msg.features);
+        {
+          uint64_t old_features = get_features();
+          set_features((uint64_t)connect_reply.features & (uint64_t)connect_msg.features);
+          discard_stale_encoding(old_features);
+        }
         ldout(async_msgr->cct, 10) << __func__ << " connect success " << connect_seq
                                    << ", lossy = " << policy.lossy << ", features "
                                    << get_features() << dendl;
@@ -1321,6 +1371,7 @@ ssize_t AsyncConnection::_process_connection()
       {
         ldout(async_msgr->cct, 20) << __func__ << " accept done" << dendl;
         state = STATE_OPEN;
+        batch_left = 0;
         memset(&connect_msg, 0, sizeof(connect_msg));
 
         if (delay_state)
@@ -1764,7 +1815,7 @@ ssize_t AsyncConnection::handle_connect_msg(ceph_msg_connect &connect, bufferlis
   }
 
   // send READY reply
-  reply.features = policy.features_supported;
+  reply.features = policy.features_supported | CEPH_FEATURE_MSGR_BATCH;
   reply.global_seq = async_msgr->get_global_seq();
   reply.connect_seq = connect_seq;
   reply.flags = 0;
@@ -1772,8 +1823,12 @@ ssize_t AsyncConnection::handle_connect_msg(ceph_msg_connect &connect, bufferlis
   if (policy.lossy)
     reply.flags = reply.flags | CEPH_MSG_CONNECT_LOSSY;
 
-  set_features((uint64_t)reply.features & (uint64_t)connect.features);
-  ldout(async_msgr->cct, 10) << __func__ << " accept features " << get_features() << dendl;
+  {
+    uint64_t old_features = get_features();
+    set_features((uint64_t)reply.features & (uint64_t)connect.features);
+    ldout(async_msgr->cct, 10) << __func__ << " accept features " << get_features() << dendl;
+    discard_stale_encoding(old_features);
+  }
 
   session_security.reset(
       get_auth_session_handler(async_msgr->cct, connect.authorizer_protocol,
@@ -1903,11 +1958,19 @@ int AsyncConnection::send_message(Message *m)
   bufferlist bl;
   uint64_t f = get_features();
 
-  // TODO: Currently not all messages supports reencode like MOSDMap, so here
-  // only let fast dispatch support messages prepare message
-  bool can_fast_prepare = async_msgr->ms_can_fast_dispatch(m);
-  if (can_fast_prepare)
+  // not every message can be encoded twice (e.g. MOSDMap), so only those
+  // that can be prepared again if the features change before they are
+  // written (see below and discard_stale_encoding()) are encoded here
+  bool can_fast_prepare = async_msgr->ms_can_fast_dispatch(m) ||
+    (send_preencode && m->can_preencode());
+  if (can_fast_prepare) {
     prepare_send_message(f, m, bl);
+    // gather small fragmented messages here as well, so the worker can
+    // hand the buffer to the socket instead of copying it
+    if (send_preencode && bl.length() <= ASYNC_COALESCE_THRESHOLD &&
+        bl.buffers().size() > 1)
+      bl.rebuild();
+  }
 
   std::lock_guard<std::mutex> l(write_lock);
   // "features" changes will change the payload encoding
@@ -1948,6 +2011,26 @@ void AsyncConnection::requeue_sent()
   }
 }
 
+void AsyncConnection::discard_stale_encoding(uint64_t old_features)
+{
+  if (old_features == get_features())
+    return;
+  // queued and requeued messages may have been encoded for the previous
+  // session; those that can be re-encoded are prepared again by the worker
+  std::lock_guard<std::mutex> l(write_lock);
+  for (auto& p : out_q) {
+    for (auto& q : p.second) {
+      Message *m = q.second;
+      if (m->can_preencode() || async_msgr->ms_can_fast_dispatch(m)) {
+        q.first.clear();
+        m->get_payload().clear();
+      }
+    }
+  }
+  ldout(async_msgr->cct, 10) << __func__ << " features " << old_features
+                             << " -> " << get_features() << dendl;
+}
+
 void AsyncConnection::discard_requeued_up_to(uint64_t seq)
 {
   ldout(async_msgr->cct, 10) << __func__ << " " << seq << dendl;
@@ -2152,10 +2235,8 @@ void AsyncConnection::prepare_send_message(uint64_t features, Message *m, buffer
   bl.append(m->get_data());
 }
 
-ssize_t AsyncConnection::write_message(Message *m, bufferlist& bl, bool more)
+void AsyncConnection::_append_message(Message *m, bufferlist& bl, bool tag)
 {
-  FUNCTRACE();
-  assert(center->in_thread());
   m->set_seq(++out_seq);
 
   if (msgr->crcflags & MSG_CRC_HEADER)
@@ -2182,7 +2263,8 @@ ssize_t AsyncConnection::write_message(Message *m, bufferlist& bl, bool more)
     }
   }
   
-  outcoming_bl.append(CEPH_MSGR_TAG_MSG);
+  if (tag)
+    outcoming_bl.append(CEPH_MSGR_TAG_MSG);
   outcoming_bl.append((char*)&header, sizeof(header));
 
   ldout(async_msgr->cct, 20) << __func__ << " sending message type=" << header.type
@@ -2195,7 +2277,9 @@ ssize_t AsyncConnection::write_message(Message *m, bufferlist& bl, bool more)
     for (const auto &pb : bl.buffers()) {
       outcoming_bl.append((char*)pb.c_str(), pb.length());
     }
+    logger->inc(l_msgr_send_copy_bytes, bl.length());
   } else {
+    // larger payloads, e.g. read data, go out in the buffers they arrived in
     outcoming_bl.claim_append(bl);  
   }
 
@@ -2204,6 +2288,14 @@ ssize_t AsyncConnection::write_message(Message *m, bufferlist& bl, bool more)
   m->trace.event("async writing message");
   ldout(async_msgr->cct, 20) << __func__ << " sending " << m->get_seq()
                              << " " << m << dendl;
+}
+
+ssize_t AsyncConnection::write_message(Message *m, bufferlist& bl, bool more)
+{
+  FUNCTRACE();
+  assert(center->in_thread());
+  _append_message(m, bl, true);
+
   ssize_t total_send_size = outcoming_bl.length();
   ssize_t rc = _try_send(more);
   if (rc < 0) {
@@ -2211,6 +2303,7 @@ ssize_t AsyncConnection::write_message(Message *m, bufferlist& bl, bool more)
                               << cpp_strerror(rc) << dendl;
   } else {
     logger->inc(l_msgr_send_bytes, total_send_size - outcoming_bl.length());
+    traffic_bytes += total_send_size - outcoming_bl.length();
     ldout(async_msgr->cct, 10) << __func__ << " sending " << m << (rc ? " continuely." :" done.") << dendl;
   }
   if (m->get_type() == CEPH_MSG_OSD_OP)
@@ -2222,6 +2315,62 @@ ssize_t AsyncConnection::write_message(Message *m, bufferlist& bl, bool more)
   return rc;
 }
 
+ssize_t AsyncConnection::write_message_batch(pair<bufferlist, Message*> *msgs,
+                                             unsigned n, bool more)
+{
+  FUNCTRACE();
+  assert(center->in_thread());
+  ceph_le32 count;
+  count = n;
+  outcoming_bl.append(CEPH_MSGR_TAG_MSG_BATCH);
+  outcoming_bl.append((char*)&count, sizeof(count));
+  for (unsigned i = 0; i < n; ++i)
+    _append_message(msgs[i].second, msgs[i].first, false);
+
+  ssize_t total_send_size = outcoming_bl.length();
+  ssize_t rc = _try_send(more);
+  if (rc < 0) {
+    ldout(async_msgr->cct, 1) << __func__ << " error sending batch of " << n
+                              << ", " << cpp_strerror(rc) << dendl;
+  } else {
+    logger->inc(l_msgr_send_bytes, total_send_size - outcoming_bl.length());
+    traffic_bytes += total_send_size - outcoming_bl.length();
+    ldout(async_msgr->cct, 10) << __func__ << " sending batch of " << n
+                               << (rc ? " continuely." :" done.") << dendl;
+  }
+  logger->inc(l_msgr_send_batch_messages, n);
+  for (unsigned i = 0; i < n; ++i)
+    msgs[i].second->put();
+
+  return rc;
+}
+
+ssize_t AsyncConnection::write_messages(vector<pair<bufferlist, Message*> >& msgs,
+                                        bool more)
+{
+  ssize_t r = 0;
+  unsigned i = 0;
+  while (i < msgs.size()) {
+    // runs of small messages go out in one frame, the rest one by one
+    unsigned j = i;
+    while (j < msgs.size() && msgs[j].first.length() <= batch_max_bytes)
+      ++j;
+    if (j - i > 1) {
+      r = write_message_batch(&msgs[i], j - i, more || j < msgs.size());
+      i = j;
+    } else {
+      r = write_message(msgs[i].second, msgs[i].first,
+                        more || i + 1 < msgs.size());
+      ++i;
+    }
+    if (r < 0)
+      break;
+  }
+  for (; i < msgs.size(); ++i)
+    msgs[i].second->put();
+  return r;
+}
+
 void AsyncConnection::reset_recv_state()
 {
   // clean up state internal variables and states
@@ -2327,6 +2476,81 @@ void AsyncConnection::send_keepalive()
   }
 }
 
+void AsyncConnection::migrate(Worker *new_worker)
+{
+  assert(async_msgr->get_stack()->support_migration());
+  AsyncConnectionRef self(this);
+  EventCenter *c = center;
+  c->submit_to(c->get_id(), [self, new_worker]() mutable {
+    self->_migrate(new_worker);
+  }, true);
+}
+
+void AsyncConnection::_migrate(Worker *new_worker)
+{
+  std::lock_guard<std::mutex> l(lock);
+  // only move an open connection that is between messages; anything
+  // else will be looked at again in the next balancing round
+  if (!center->in_thread() || worker == new_worker ||
+      state != STATE_OPEN || replacing || delay_state)
+    return;
+  {
+    std::lock_guard<std::mutex> wl(write_lock);
+    if (can_write != WriteStatus::CANWRITE)
+      return;
+
+    ldout(async_msgr->cct, 1) << __func__ << " from worker " << worker->id
+                              << " to " << new_worker->id << dendl;
+    center->delete_file_event(cs.fd(), EVENT_READABLE|EVENT_WRITABLE);
+    for (auto &&t : register_time_events)
+      center->delete_time_event(t);
+    register_time_events.clear();
+    if (last_tick_id) {
+      center->delete_time_event(last_tick_id);
+      last_tick_id = 0;
+    }
+    open_write = false;
+
+    logger->inc(l_msgr_migrated_out_connections);
+    logger->dec(l_msgr_active_connections);
+    worker->release_worker();
+    new_worker->references++;
+    logger = new_worker->get_perf_counter();
+    logger->inc(l_msgr_migrated_in_connections);
+    logger->inc(l_msgr_active_connections);
+    worker = new_worker;
+    center = &new_worker->center;
+
+    // park the connection until the new worker takes over.  events still
+    // queued on the old worker see that they are not in center's thread
+    // and return, and send_message() just queues
+    state = STATE_NONE;
+    can_write = WriteStatus::REPLACING;
+  }
+
+  AsyncConnectionRef self(this);
+  center->submit_to(center->get_id(), [self]() mutable {
+    std::lock_guard<std::mutex> l(self->lock);
+    if (self->state != STATE_NONE || self->replacing) {
+      // marked down or replaced meanwhile
+      return;
+    }
+    self->center->create_file_event(self->cs.fd(), EVENT_READABLE,
+                                    self->read_handler);
+    self->last_tick_id = self->center->create_time_event(
+      self->inactive_timeout_us, self->tick_handler);
+    {
+      std::lock_guard<std::mutex> wl(self->write_lock);
+      self->state = STATE_OPEN;
+      self->can_write = WriteStatus::CANWRITE;
+      if (self->is_queued())
+        self->center->dispatch_event_external(self->write_handler);
+    }
+    // there may be prefetched or unread data
+    self->center->dispatch_event_external(self->read_handler);
+  }, true);
+}
+
 void AsyncConnection::mark_down()
 {
   ldout(async_msgr->cct, 1) << __func__ << dendl;
@@ -2360,6 +2584,11 @@ void AsyncConnection::handle_write()
   ssize_t r = 0;
 
   write_lock.lock();
+  if (!center->in_thread()) {
+    // queued before we migrated away from this worker
+    write_lock.unlock();
+    return;
+  }
   if (can_write == WriteStatus::CANWRITE) {
     if (keepalive) {
       _append_keepalive_or_ack();
@@ -2367,26 +2596,49 @@ void AsyncConnection::handle_write()
     }
 
     auto start = ceph::mono_clock::now();
+    // with the peer's consent, take several queued messages at once so the
+    // small ones can share a frame and a single sendmsg
+    unsigned batch_max = 1;
+    if (batch_messages > 1 && HAVE_FEATURE(get_features(), MSGR_BATCH))
+      batch_max = batch_messages;
+    vector<pair<bufferlist, Message*> > msgs;
+    msgs.reserve(batch_max);
     bool more;
     do {
-      bufferlist data;
-      Message *m = _get_next_outgoing(&data);
-      if (!m)
-        break;
+      msgs.clear();
+      do {
+        bufferlist data;
+        Message *m = _get_next_outgoing(&data);
+        if (!m)
+          break;
 
-      if (!policy.lossy) {
-        // put on sent list
-        sent.push_back(m);
-        m->get();
-      }
-      more = _has_next_outgoing();
+        if (!policy.lossy) {
+          // put on sent list
+          sent.push_back(m);
+          m->get();
+        }
+        more = _has_next_outgoing();
+        msgs.emplace_back(std::move(data), m);
+      } while (more && msgs.size() < batch_max);
+      if (msgs.empty())
+        break;
       write_lock.unlock();
 
       // send_message or requeue messages may not encode message
-      if (!data.length())
-        prepare_send_message(get_features(), m, data);
+      for (auto& p : msgs) {
+        if (p.first.length())
+          continue;
+        auto encode_start = ceph::mono_clock::now();
+        prepare_send_message(get_features(), p.second, p.first);
+        logger->tinc(l_msgr_running_encode_time,
+                     ceph::mono_clock::now() - encode_start);
+        logger->inc(l_msgr_worker_encoded_messages);
+      }
 
-      r = write_message(m, data, more);
+      if (msgs.size() == 1)
+        r = write_message(msgs[0].second, msgs[0].first, more);
+      else
+        r = write_messages(msgs, more);
 
       write_lock.lock();
       if (r == 0) {
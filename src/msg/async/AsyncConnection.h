@@ -68,12 +68,17 @@ class AsyncConnection : public Connection {
   void was_session_reset();
   void fault();
   void discard_out_queue();
+  void discard_stale_encoding(uint64_t old_features);
   void discard_requeued_up_to(uint64_t seq);
   void requeue_sent();
   void randomize_out_seq();
   void handle_ack(uint64_t seq);
   void _append_keepalive_or_ack(bool ack=false, utime_t *t=NULL);
+  void _append_message(Message *m, bufferlist& bl, bool tag);
   ssize_t write_message(Message *m, bufferlist& bl, bool more);
+  ssize_t write_message_batch(pair<bufferlist, Message*> *msgs, unsigned n,
+                              bool more);
+  ssize_t write_messages(vector<pair<bufferlist, Message*> >& msgs, bool more);
   void inject_delay();
   ssize_t _reply_accept(char tag, ceph_msg_connect &connect, ceph_msg_connect_reply &reply,
                     bufferlist &authorizer_reply) {
@@ -219,6 +224,7 @@ class AsyncConnection : public Connection {
     STATE_OPEN_KEEPALIVE2,
     STATE_OPEN_KEEPALIVE2_ACK,
     STATE_OPEN_TAG_ACK,
+    STATE_OPEN_MESSAGE_BATCH,
     STATE_OPEN_MESSAGE_HEADER,
     STATE_OPEN_MESSAGE_THROTTLE_MESSAGE,
     STATE_OPEN_MESSAGE_THROTTLE_BYTES,
@@ -256,6 +262,7 @@ class AsyncConnection : public Connection {
                                         "STATE_OPEN_KEEPALIVE2",
                                         "STATE_OPEN_KEEPALIVE2_ACK",
                                         "STATE_OPEN_TAG_ACK",
+                                        "STATE_OPEN_MESSAGE_BATCH",
                                         "STATE_OPEN_MESSAGE_HEADER",
                                         "STATE_OPEN_MESSAGE_THROTTLE_MESSAGE",
                                         "STATE_OPEN_MESSAGE_THROTTLE_BYTES",
@@ -332,6 +339,9 @@ class AsyncConnection : public Connection {
   ceph::coarse_mono_clock::time_point last_active;
   uint64_t last_tick_id = 0;
   const uint64_t inactive_timeout_us;
+  const bool send_preencode; // ms_async_send_preencode
+  const unsigned batch_messages; // ms_async_batch_messages
+  const uint64_t batch_max_bytes; // ms_async_batch_max_bytes
 
   // Tis section are temp variables used by state transition
 
@@ -339,6 +349,7 @@ class AsyncConnection : public Connection {
   utime_t recv_stamp;
   utime_t throttle_stamp;
   unsigned msg_left;
+  uint32_t batch_left = 0; // messages still to read in this batch frame
   uint64_t cur_msg_size;
   ceph_msg_header current_header;
   bufferlist data_buf;
@@ -370,6 +381,8 @@ class AsyncConnection : public Connection {
   EventCenter *center;
   ceph::shared_ptr<AuthSessionHandler> session_security;
 
+  void _migrate(Worker *new_worker);
+
  public:
   // used by eventcallback
   void handle_write();
@@ -399,6 +412,16 @@ class AsyncConnection : public Connection {
   PerfCounters *get_perf_counter() {
     return logger;
   }
+
+  // used by AsyncMessenger::balance_workers()
+  std::atomic<uint64_t> traffic_bytes = {0}; ///< sent and received
+  uint64_t balance_last_bytes = 0;           ///< traffic_bytes last round
+  Worker *get_worker() {
+    std::lock_guard<std::mutex> l(lock);
+    return worker;
+  }
+  /// move an open connection to another worker once it is between messages
+  void migrate(Worker *new_worker);
 }; /* AsyncConnection */
 
 typedef boost::intrusive_ptr<AsyncConnection> AsyncConnectionRef;
@@ -23,6 +23,7 @@
 
 #include "common/config.h"
 #include "common/Timer.h"
+#include "include/str_list.h"
 #include "common/errno.h"
 
 #include "messages/MOSDOp.h"
@@ -217,9 +218,12 @@ struct StackSingleton {
   std::shared_ptr<NetworkStack> stack;
 
   StackSingleton(CephContext *c): cct(c) {}
-  void ready(std::string &type) {
-    if (!stack)
+  void ready(std::string &type, uint64_t busy_poll_us = 0) {
+    if (!stack) {
       stack = NetworkStack::create(cct, type);
+      if (busy_poll_us)
+        stack->set_busy_poll(busy_poll_us);
+    }
   }
   ~StackSingleton() {
     stack->stop();
@@ -238,6 +242,16 @@ class C_handle_reap : public EventCallback {
   }
 };
 
+class C_handle_balance : public EventCallback {
+  AsyncMessenger *msgr;
+
+  public:
+  explicit C_handle_balance(AsyncMessenger *m): msgr(m) {}
+  void do_request(uint64_t id) override {
+    msgr->balance_workers();
+  }
+};
+
 /*******************
  * AsyncMessenger
  */
@@ -257,15 +271,36 @@ AsyncMessenger::AsyncMessenger(CephContext *cct, entity_name_t name,
   else if (type.find("dpdk") != std::string::npos)
     transport_type = "dpdk";
 
+  // messengers that busy poll get workers of their own, so that e.g. the
+  // cluster network can spin without burning cpu for every client
+  uint64_t busy_poll_us = cct->_conf->get_val<uint64_t>("ms_async_busy_poll_us");
+  if (busy_poll_us) {
+    set<string> names;
+    get_str_set(cct->_conf->get_val<std::string>("ms_async_busy_poll_messengers"),
+                names);
+    if (!names.empty() && !names.count(mname))
+      busy_poll_us = 0;
+    // dpdk always polls and rdma polls its completion queues, so a second
+    // stack for them would only take another set of cores and devices
+    if (busy_poll_us && transport_type != "posix") {
+      ldout(cct, 1) << __func__ << " ms_async_busy_poll_us ignored for "
+                    << transport_type << dendl;
+      busy_poll_us = 0;
+    }
+  }
+
   StackSingleton *single;
-  cct->lookup_or_create_singleton_object<StackSingleton>(single, "AsyncMessenger::NetworkStack::"+transport_type);
-  single->ready(transport_type);
+  cct->lookup_or_create_singleton_object<StackSingleton>(
+    single, "AsyncMessenger::NetworkStack::" + transport_type +
+    (busy_poll_us ? "::busy_poll" : ""));
+  single->ready(transport_type, busy_poll_us);
   stack = single->stack.get();
   stack->start();
   local_worker = stack->get_worker();
   local_connection = new AsyncConnection(cct, this, &dispatch_queue, local_worker);
   init_local_connection();
   reap_handler = new C_handle_reap(this);
+  balance_handler = new C_handle_balance(this);
   unsigned processor_num = 1;
   if (stack->support_local_listen_table())
     processor_num = stack->get_num_worker();
@@ -280,6 +315,7 @@ AsyncMessenger::AsyncMessenger(CephContext *cct, entity_name_t name,
 AsyncMessenger::~AsyncMessenger()
 {
   delete reap_handler;
+  delete balance_handler;
   assert(!did_bind); // either we didn't bind or we shut down the Processor
   local_connection->mark_down();
   for (auto &&p : processors)
@@ -312,6 +348,13 @@ int AsyncMessenger::shutdown()
   // done!  clean up.
   for (auto &&p : processors)
     p->stop();
+  local_worker->center.submit_to(
+    local_worker->center.get_id(), [this]() {
+      if (balance_tick_id) {
+        local_worker->center.delete_time_event(balance_tick_id);
+        balance_tick_id = 0;
+      }
+    });
   mark_down_all();
   // break ref cycles on the loopback connection
   local_connection->set_priv(NULL);
@@ -465,6 +508,17 @@ int AsyncMessenger::start()
     _init_local_connection();
   }
 
+  double balance_interval = cct->_conf->get_val<double>(
+    "ms_async_balance_interval");
+  if (balance_interval > 0 && stack->get_num_worker() > 1 &&
+      stack->support_migration()) {
+    local_worker->center.submit_to(
+      local_worker->center.get_id(), [this, balance_interval]() {
+        balance_tick_id = local_worker->center.create_time_event(
+          balance_interval * 1000000, balance_handler);
+      }, true);
+  }
+
   lock.Unlock();
   return 0;
 }
@@ -730,6 +784,72 @@ void AsyncMessenger::learned_addr(const entity_addr_t &peer_addr_for_me)
   lock.Unlock();
 }
 
+void AsyncMessenger::balance_workers()
+{
+  balance_tick_id = 0;
+  const double interval = cct->_conf->get_val<double>(
+    "ms_async_balance_interval");
+  const double threshold = cct->_conf->get_val<double>(
+    "ms_async_balance_threshold");
+  if (interval <= 0 || !stack->support_migration())
+    return;
+
+  auto now = ceph::mono_clock::now();
+  const bool first = balance_stamp == ceph::mono_time();
+  const double elapsed = std::chrono::duration<double>(now - balance_stamp).count();
+  balance_stamp = now;
+
+  const unsigned n = stack->get_num_worker();
+  vector<Worker::load_t> loads(n);
+  unsigned busiest = 0, idlest = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    loads[i] = stack->get_worker(i)->sample_load(
+      ceph::make_timespan(interval / 2));
+    if (loads[i].busy > loads[busiest].busy)
+      busiest = i;
+    if (loads[i].busy < loads[idlest].busy)
+      idlest = i;
+  }
+  const double gap = loads[busiest].busy - loads[idlest].busy;
+  const bool unbalanced = !first && gap > threshold &&
+    loads[busiest].bytes_per_sec > 0;
+  Worker *from = stack->get_worker(busiest);
+
+  // estimate the share of the busy worker's time each connection costs
+  // from its share of the traffic, and take the largest one that fits in
+  // half the gap so that we don't just move the imbalance elsewhere
+  AsyncConnectionRef best;
+  double best_load = 0;
+  {
+    Mutex::Locker l(lock);
+    for (auto &p : conns) {
+      auto &conn = p.second;
+      uint64_t bytes = conn->traffic_bytes;
+      uint64_t delta = bytes - conn->balance_last_bytes;
+      conn->balance_last_bytes = bytes;
+      if (!unbalanced || conn->get_worker() != from)
+        continue;
+      double load = delta / elapsed / loads[busiest].bytes_per_sec *
+        loads[busiest].busy;
+      if (load <= gap / 2 && load > best_load) {
+        best = conn;
+        best_load = load;
+      }
+    }
+  }
+
+  if (best) {
+    ldout(cct, 1) << __func__ << " worker " << busiest << " busy "
+                  << loads[busiest].busy << " worker " << idlest << " busy "
+                  << loads[idlest].busy << ", moving " << best->get_peer_addr()
+                  << " (est. " << best_load << ")" << dendl;
+    best->migrate(stack->get_worker(idlest));
+  }
+
+  balance_tick_id = local_worker->center.create_time_event(
+    interval * 1000000, balance_handler);
+}
+
 int AsyncMessenger::reap_dead()
 {
   ldout(cct, 1) << __func__ << " start" << dendl;
@@ -295,6 +295,11 @@ private:
 
   EventCallbackRef reap_handler;
 
+  /// runs balance_workers() on local_worker, if enabled
+  EventCallbackRef balance_handler;
+  uint64_t balance_tick_id = 0;
+  ceph::mono_time balance_stamp;
+
   /// internal cluster protocol version, if any, for talking to entities of the same type.
   int cluster_protocol;
 
@@ -443,6 +448,17 @@ public:
    */
   int reap_dead();
 
+  /**
+   * Move a connection off the busiest worker
+   *
+   * Every ms_async_balance_interval seconds, if the busiest worker spends
+   * a larger fraction of its time handling events than the least busy one,
+   * by more than ms_async_balance_threshold, move one of our connections
+   * from the former to the latter.  The connection is picked by its
+   * share of the worker's traffic since the previous round.
+   */
+  void balance_workers();
+
   /**
    * @} // AsyncMessenger Internals
    */
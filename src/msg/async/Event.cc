@@ -365,7 +365,23 @@ int EventCenter::process_events(int timeout_microseconds,  ceph::timespan *worki
   auto now = clock_type::now();
 
   auto it = time_events.begin();
-  bool blocking = pollers.empty() && !external_num_events.load();
+  bool blocking = pollers.empty();
+  // with busy polling, spin instead of sleeping in the driver as long as
+  // something happened within the budget
+  spun = false;
+  if (blocking && busy_poll_us &&
+      now - last_busy < std::chrono::microseconds(busy_poll_us)) {
+    blocking = false;
+    spun = true;
+    spinning = true;
+  } else if (spinning.load(std::memory_order_relaxed)) {
+    // dispatch_event_external() doesn't write the notify pipe while we
+    // spin, so stop advertising it before the last look at the external
+    // queue below
+    spinning = false;
+  }
+  if (external_num_events.load())
+    blocking = false;
   // If exists external events or poller, don't block
   if (!blocking) {
     if (it != time_events.end() && now >= it->first)
@@ -443,6 +459,8 @@ int EventCenter::process_events(int timeout_microseconds,  ceph::timespan *worki
     for (uint32_t i = 0; i < pollers.size(); i++)
       numevents += pollers[i]->poll();
   }
+  if (numevents && busy_poll_us)
+    last_busy = clock_type::now();
 
   if (working_dur)
     *working_dur = ceph::mono_clock::now() - working_start;
@@ -456,7 +474,9 @@ void EventCenter::dispatch_event_external(EventCallbackRef e)
   bool wake = !external_num_events.load();
   uint64_t num = ++external_num_events;
   external_lock.unlock();
-  if (!in_thread() && wake)
+  // a spinning center picks the event up on its next pass without the
+  // syscall; see process_events() for the handshake
+  if (!in_thread() && wake && !spinning.load())
     wakeup();
 
   ldout(cct, 30) << __func__ << " " << e << " pending " << num << dendl;
@@ -175,6 +175,13 @@ class EventCenter {
   unsigned idx;
   AssociatedCenters *global_centers = nullptr;
 
+  // keep polling without blocking for this long after the last event
+  std::atomic<uint64_t> busy_poll_us = {0};
+  clock_type::time_point last_busy;
+  bool spun = false;  ///< the last process_events() polled instead of blocking
+  /// set while busy polling; external dispatchers skip the notify pipe
+  std::atomic<bool> spinning = {false};
+
   int process_time_events();
   FileEvent *_get_file_event(int fd) {
     assert(fd < nevent);
@@ -195,6 +202,9 @@ class EventCenter {
   void set_owner();
   pthread_t get_owner() const { return owner; }
   unsigned get_id() const { return idx; }
+  void set_busy_poll(uint64_t us) { busy_poll_us = us; }
+  uint64_t get_busy_poll() const { return busy_poll_us; }
+  bool last_spun() const { return spun; }
 
   EventDriver *get_driver() { return driver; }
 
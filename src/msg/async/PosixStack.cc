@@ -19,8 +19,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 
 #include <algorithm>
+#include <deque>
 
 #include "PosixStack.h"
 
@@ -31,20 +35,94 @@
 #include "common/dout.h"
 #include "msg/Messenger.h"
 #include "include/sock_compat.h"
+#include "common/perf_counters.h"
 
 #define dout_subsys ceph_subsys_ms
 #undef dout_prefix
 #define dout_prefix *_dout << "PosixStack "
 
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_MSG_ZEROCOPY
+#endif
+
+// collect the zero copy completions queued on fd's error queue and unpin
+// the buffers they cover.  returns false if the kernel had to copy the
+// data anyway (e.g. loopback), which is slower than a plain send
+static bool reap_zerocopy(int fd, std::deque<PosixZeroCopyPending> &pending,
+                          PerfCounters *logger)
+{
+  bool zerocopy = true;
+#ifdef HAVE_MSG_ZEROCOPY
+  while (!pending.empty()) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      break;
+    for (auto cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+        continue;
+      auto serr = reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cm));
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      // calls ee_info..ee_data are done; completions may be merged but
+      // are reported in order
+      const uint32_t hi = serr->ee_data;
+      while (!pending.empty() &&
+             static_cast<int32_t>(hi - pending.front().last_id) >= 0)
+        pending.pop_front();
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        logger->inc(l_msgr_send_zerocopy_copied);
+        zerocopy = false;
+      }
+    }
+  }
+#endif
+  return zerocopy;
+}
+
 class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
   NetHandler &handler;
   int _fd;
   entity_addr_t sa;
   bool connected;
+  bool closed = false;
+  PerfCounters *logger;
+  PosixWorker *worker;  ///< takes over zc_pending on close()
+
+  // sendmsg() calls carrying a segment of at least this many bytes are
+  // made with MSG_ZEROCOPY, or 0 if disabled
+  uint64_t zerocopy_threshold;
+  uint32_t zc_next_id = 0;
+  std::deque<PosixZeroCopyPending> zc_pending;
+
+  void enable_zerocopy() {
+#ifdef HAVE_MSG_ZEROCOPY
+    int one = 1;
+    if (zerocopy_threshold &&
+        ::setsockopt(_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+      return;
+#endif
+    zerocopy_threshold = 0;
+  }
+
+  void reap_zerocopy() {
+    // stop asking for zero copy once the kernel copies anyway
+    if (!::reap_zerocopy(_fd, zc_pending, logger))
+      zerocopy_threshold = 0;
+  }
 
  public:
-  explicit PosixConnectedSocketImpl(NetHandler &h, const entity_addr_t &sa, int f, bool connected)
-      : handler(h), _fd(f), sa(sa), connected(connected) {}
+  explicit PosixConnectedSocketImpl(NetHandler &h, const entity_addr_t &sa, int f, bool connected,
+                                    PosixWorker *w, uint64_t zerocopy_threshold)
+      : handler(h), _fd(f), sa(sa), connected(connected),
+        logger(w->get_perf_counter()), worker(w),
+        zerocopy_threshold(zerocopy_threshold) {
+    enable_zerocopy();
+  }
 
   int is_connected() override {
     if (connected)
@@ -69,27 +147,40 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
     ssize_t r = ::read(_fd, buf, len);
     if (r < 0)
       r = -errno;
+    // zero copy completions also wake up the reader
+    if (r == -EAGAIN && !zc_pending.empty())
+      reap_zerocopy();
     return r;
   }
 
   // return the sent length
   // < 0 means error occured
-  static ssize_t do_sendmsg(int fd, struct msghdr &msg, unsigned len, bool more)
+  static ssize_t do_sendmsg(int fd, struct msghdr &msg, unsigned len, bool more,
+                            int flags = 0, unsigned *calls = nullptr)
   {
     size_t sent = 0;
     while (1) {
       MSGR_SIGPIPE_STOPPER;
       ssize_t r;
-      r = ::sendmsg(fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+      r = ::sendmsg(fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0) | flags);
       if (r < 0) {
         if (errno == EINTR) {
           continue;
         } else if (errno == EAGAIN) {
           break;
         }
+#ifdef HAVE_MSG_ZEROCOPY
+        if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+          // out of optmem for pinning pages; send this one the usual way
+          flags &= ~MSG_ZEROCOPY;
+          continue;
+        }
+#endif
         return -errno;
       }
 
+      if (calls && (flags & MSG_ZEROCOPY))
+        ++*calls;
       sent += r;
       if (len == sent) break;
 
@@ -110,6 +201,9 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
   }
 
   ssize_t send(bufferlist &bl, bool more) override {
+    if (!zc_pending.empty())
+      reap_zerocopy();
+
     size_t sent_bytes = 0;
     std::list<bufferptr>::const_iterator pb = bl.buffers().begin();
     uint64_t left_pbrs = bl.buffers().size();
@@ -122,13 +216,39 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
       msg.msg_iovlen = size;
       msg.msg_iov = msgvec;
       unsigned msglen = 0;
+      bool zerocopy = false;
+      auto first = pb;
       for (auto iov = msgvec; iov != msgvec + size; iov++) {
 	iov->iov_base = (void*)(pb->c_str());
 	iov->iov_len = pb->length();
 	msglen += pb->length();
+	if (zerocopy_threshold && pb->length() >= zerocopy_threshold)
+	  zerocopy = true;
 	++pb;
       }
-      ssize_t r = do_sendmsg(_fd, msg, msglen, left_pbrs || more);
+      ssize_t r;
+      if (zerocopy) {
+#ifdef HAVE_MSG_ZEROCOPY
+        unsigned calls = 0;
+        r = do_sendmsg(_fd, msg, msglen, left_pbrs || more, MSG_ZEROCOPY,
+                       &calls);
+        if (calls) {
+          // pin the buffers until the kernel is done with them
+          PosixZeroCopyPending p;
+          for (auto i = first; i != pb; ++i)
+            p.bl.append(*i);
+          zc_next_id += calls;
+          p.last_id = zc_next_id - 1;
+          zc_pending.push_back(std::move(p));
+          if (r > 0)
+            logger->inc(l_msgr_send_zerocopy_bytes, r);
+        }
+#else
+        ceph_abort();
+#endif
+      } else {
+        r = do_sendmsg(_fd, msg, msglen, left_pbrs || more);
+      }
       if (r < 0)
         return r;
 
@@ -155,6 +275,17 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
     ::shutdown(_fd, SHUT_RDWR);
   }
   void close() override {
+    if (closed)
+      return;
+    closed = true;
+    if (!zc_pending.empty())
+      reap_zerocopy();
+    // the kernel may still be reading what is left; closing the fd would
+    // not stop that, but unpinning would let the buffers be reused
+    if (!zc_pending.empty()) {
+      worker->adopt_zerocopy(_fd, std::move(zc_pending));
+      return;
+    }
     ::close(_fd);
   }
   int fd() const override {
@@ -167,9 +298,11 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
 class PosixServerSocketImpl : public ServerSocketImpl {
   NetHandler &handler;
   int _fd;
+  uint64_t zerocopy_threshold;
 
  public:
-  explicit PosixServerSocketImpl(NetHandler &h, int f): handler(h), _fd(f) {}
+  explicit PosixServerSocketImpl(NetHandler &h, int f, uint64_t zerocopy_threshold)
+    : handler(h), _fd(f), zerocopy_threshold(zerocopy_threshold) {}
   int accept(ConnectedSocket *sock, const SocketOptions &opts, entity_addr_t *out, Worker *w) override;
   void abort_accept() override {
     ::close(_fd);
@@ -205,16 +338,99 @@ int PosixServerSocketImpl::accept(ConnectedSocket *sock, const SocketOptions &op
 
   out->set_sockaddr((sockaddr*)&ss);
   handler.set_priority(sd, opt.priority, out->get_family());
+  if (w->center.get_busy_poll())
+    handler.set_busy_poll(sd, w->center.get_busy_poll());
 
-  std::unique_ptr<PosixConnectedSocketImpl> csi(new PosixConnectedSocketImpl(handler, *out, sd, true));
+  std::unique_ptr<PosixConnectedSocketImpl> csi(
+    new PosixConnectedSocketImpl(handler, *out, sd, true,
+                                 static_cast<PosixWorker*>(w),
+                                 zerocopy_threshold));
   *sock = ConnectedSocket(std::move(csi));
   return 0;
 }
 
+class C_zc_reap : public EventCallback {
+  PosixWorker *worker;
+
+ public:
+  explicit C_zc_reap(PosixWorker *w): worker(w) {}
+  void do_request(uint64_t id) override {
+    worker->reap_zerocopy_orphans();
+  }
+};
+
+// how long a closed socket may keep its zero copy buffers pinned, e.g.
+// while retransmitting to a dead peer
+static const auto zc_orphan_timeout = std::chrono::seconds(10);
+static const uint64_t zc_reap_interval_us = 5000;
+
+PosixWorker::PosixWorker(CephContext *c, unsigned i)
+  : Worker(c, i), net(c),
+    zerocopy_threshold(c->_conf->get_val<uint64_t>("ms_async_zerocopy_threshold")),
+    zc_reap_handler(new C_zc_reap(this))
+{
+}
+
+PosixWorker::~PosixWorker()
+{
+  // the event loop is gone, reset whatever is left
+  for (auto &o : zc_orphans) {
+    struct linger l = {1, 0};
+    ::setsockopt(o.fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    ::close(o.fd);
+  }
+  delete zc_reap_handler;
+}
+
 void PosixWorker::initialize()
 {
 }
 
+void PosixWorker::adopt_zerocopy(int fd,
+                                 std::deque<PosixZeroCopyPending> &&pending)
+{
+  ldout(cct, 10) << __func__ << " fd " << fd << " with " << pending.size()
+                 << " zero copy sends in flight" << dendl;
+  perf_logger->inc(l_msgr_send_zerocopy_orphaned);
+  bool first;
+  {
+    std::lock_guard<std::mutex> l(zc_orphans_lock);
+    first = zc_orphans.empty();
+    zc_orphans.push_back(
+      zc_orphan_t{fd, std::move(pending),
+                  ceph::mono_clock::now() + zc_orphan_timeout});
+  }
+  // the reaper reschedules itself while there are orphans left
+  if (first)
+    center.dispatch_event_external(zc_reap_handler);
+}
+
+void PosixWorker::reap_zerocopy_orphans()
+{
+  std::lock_guard<std::mutex> l(zc_orphans_lock);
+  auto now = ceph::mono_clock::now();
+  for (auto o = zc_orphans.begin(); o != zc_orphans.end(); ) {
+    reap_zerocopy(o->fd, o->pending, perf_logger);
+    if (!o->pending.empty()) {
+      if (now < o->deadline) {
+        ++o;
+        continue;
+      }
+      // a reset purges the send queue, so the kernel is done with the
+      // buffers once the fd is closed
+      ldout(cct, 1) << __func__ << " fd " << o->fd << " still has "
+                    << o->pending.size() << " zero copy sends in flight after "
+                    << zc_orphan_timeout.count() << "s, resetting" << dendl;
+      struct linger lg = {1, 0};
+      ::setsockopt(o->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    ::close(o->fd);
+    o = zc_orphans.erase(o);
+  }
+  if (!zc_orphans.empty())
+    center.create_time_event(zc_reap_interval_us, zc_reap_handler);
+}
+
 int PosixWorker::listen(entity_addr_t &sa, const SocketOptions &opt,
                         ServerSocket *sock)
 {
@@ -255,7 +471,7 @@ int PosixWorker::listen(entity_addr_t &sa, const SocketOptions &opt,
 
   *sock = ServerSocket(
           std::unique_ptr<PosixServerSocketImpl>(
-              new PosixServerSocketImpl(net, listen_sd)));
+              new PosixServerSocketImpl(net, listen_sd, zerocopy_threshold)));
   return 0;
 }
 
@@ -273,8 +489,12 @@ int PosixWorker::connect(const entity_addr_t &addr, const SocketOptions &opts, C
   }
 
   net.set_priority(sd, opts.priority, addr.get_family());
+  if (center.get_busy_poll())
+    net.set_busy_poll(sd, center.get_busy_poll());
   *socket = ConnectedSocket(
-      std::unique_ptr<PosixConnectedSocketImpl>(new PosixConnectedSocketImpl(net, addr, sd, !opts.nonblock)));
+      std::unique_ptr<PosixConnectedSocketImpl>(
+        new PosixConnectedSocketImpl(net, addr, sd, !opts.nonblock, this,
+                                     zerocopy_threshold)));
   return 0;
 }
 
@@ -17,6 +17,9 @@
 #ifndef CEPH_MSG_ASYNC_POSIXSTACK_H
 #define CEPH_MSG_ASYNC_POSIXSTACK_H
 
+#include <deque>
+#include <list>
+#include <mutex>
 #include <thread>
 
 #include "msg/msg_types.h"
@@ -24,15 +27,41 @@
 
 #include "Stack.h"
 
+/// buffers handed to the kernel with MSG_ZEROCOPY.  it reads them after
+/// sendmsg() returns, so they stay pinned until it reports the call that
+/// last used them done on the socket error queue
+struct PosixZeroCopyPending {
+  uint32_t last_id;   ///< notification id of the last call using bl
+  bufferlist bl;
+};
+
 class PosixWorker : public Worker {
   NetHandler net;
+  const uint64_t zerocopy_threshold; // ms_async_zerocopy_threshold
+
+  // sockets closed before the kernel was done with their MSG_ZEROCOPY
+  // buffers.  they stay open, and the buffers pinned, until it is or
+  // until the deadline, when they are reset to drop the send queue
+  struct zc_orphan_t {
+    int fd;
+    std::deque<PosixZeroCopyPending> pending;
+    ceph::mono_time deadline;
+  };
+  std::mutex zc_orphans_lock;
+  std::list<zc_orphan_t> zc_orphans;
+  EventCallbackRef zc_reap_handler;
+
   void initialize() override;
  public:
-  PosixWorker(CephContext *c, unsigned i)
-      : Worker(c, i), net(c) {}
+  PosixWorker(CephContext *c, unsigned i);
+  ~PosixWorker() override;
   int listen(entity_addr_t &sa, const SocketOptions &opt,
                      ServerSocket *socks) override;
   int connect(const entity_addr_t &addr, const SocketOptions &opts, ConnectedSocket *socket) override;
+
+  /// take over a closing socket until its zero copy sends complete
+  void adopt_zerocopy(int fd, std::deque<PosixZeroCopyPending> &&pending);
+  void reap_zerocopy_orphans();
 };
 
 class PosixNetworkStack : public NetworkStack {
@@ -47,6 +76,7 @@ class PosixNetworkStack : public NetworkStack {
       return -1;
     return coreids[id % coreids.size()];
   }
+  bool support_migration() const override { return true; }
   void spawn_worker(unsigned i, std::function<void ()> &&func) override {
     threads.resize(i+1);
     threads[i] = std::thread(func);
@@ -50,6 +50,7 @@ std::function<void ()> NetworkStack::add_thread(unsigned i)
         ldout(cct, 30) << __func__ << " calling event process" << dendl;
 
         ceph::timespan dur;
+        auto start = ceph::mono_clock::now();
         int r = w->center.process_events(EventMaxWaitUs, &dur);
         if (r < 0) {
           ldout(cct, 20) << __func__ << " process events failed: "
@@ -57,12 +58,50 @@ std::function<void ()> NetworkStack::add_thread(unsigned i)
           // TODO do something?
         }
         w->perf_logger->tinc(l_msgr_running_total_time, dur);
+        if (r > 0)
+          w->perf_logger->inc(l_msgr_running_events, r);
+        if (w->center.last_spun()) {
+          if (r > 0) {
+            w->perf_logger->inc(l_msgr_busy_poll_hits);
+          } else {
+            w->perf_logger->inc(l_msgr_busy_poll_misses);
+            w->perf_logger->tinc(l_msgr_busy_poll_time,
+                                 ceph::mono_clock::now() - start);
+          }
+        }
       }
       w->reset();
       w->destroy();
   };
 }
 
+Worker::load_t Worker::sample_load(ceph::timespan min_interval)
+{
+  std::lock_guard<std::mutex> l(load_lock);
+  auto now = ceph::mono_clock::now();
+  if (load_stamp != ceph::mono_time() && now - load_stamp < min_interval)
+    return load;
+
+  uint64_t events = perf_logger->get(l_msgr_running_events);
+  uint64_t bytes = perf_logger->get(l_msgr_send_bytes) +
+    perf_logger->get(l_msgr_recv_bytes);
+  utime_t busy = perf_logger->tget(l_msgr_running_total_time);
+  if (load_stamp != ceph::mono_time()) {
+    double elapsed = std::chrono::duration<double>(now - load_stamp).count();
+    load.busy = std::min(1.0, (double)(busy - load_last_busy) / elapsed);
+    load.events_per_sec = (events - load_last_events) / elapsed;
+    load.bytes_per_sec = (bytes - load_last_bytes) / elapsed;
+    perf_logger->set(l_msgr_load_busy_pct, load.busy * 100);
+    perf_logger->set(l_msgr_load_events, load.events_per_sec);
+    perf_logger->set(l_msgr_load_bytes, load.bytes_per_sec);
+  }
+  load_stamp = now;
+  load_last_events = events;
+  load_last_bytes = bytes;
+  load_last_busy = busy;
+  return load;
+}
+
 std::shared_ptr<NetworkStack> NetworkStack::create(CephContext *c, const string &t)
 {
   if (t == "posix")
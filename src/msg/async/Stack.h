@@ -190,6 +190,7 @@ enum {
   l_msgr_send_messages,
   l_msgr_recv_bytes,
   l_msgr_send_bytes,
+  l_msgr_send_copy_bytes,
   l_msgr_created_connections,
   l_msgr_active_connections,
 
@@ -197,6 +198,22 @@ enum {
   l_msgr_running_send_time,
   l_msgr_running_recv_time,
   l_msgr_running_fast_dispatch_time,
+  l_msgr_running_encode_time,
+  l_msgr_worker_encoded_messages,
+  l_msgr_send_zerocopy_bytes,
+  l_msgr_send_zerocopy_copied,
+  l_msgr_send_zerocopy_orphaned,
+  l_msgr_running_events,
+  l_msgr_load_busy_pct,
+  l_msgr_load_events,
+  l_msgr_load_bytes,
+  l_msgr_migrated_in_connections,
+  l_msgr_migrated_out_connections,
+  l_msgr_busy_poll_hits,
+  l_msgr_busy_poll_misses,
+  l_msgr_busy_poll_time,
+  l_msgr_send_batch_messages,
+  l_msgr_recv_batch_messages,
 
   l_msgr_last,
 };
@@ -206,6 +223,21 @@ class Worker {
   std::condition_variable init_cond;
   bool init = false;
 
+ public:
+  struct load_t {
+    double busy = 0;          ///< fraction of time spent handling events
+    double events_per_sec = 0;
+    double bytes_per_sec = 0;
+  };
+
+ private:
+  std::mutex load_lock;
+  ceph::mono_time load_stamp;  ///< zero until the first sample
+  uint64_t load_last_events = 0;
+  uint64_t load_last_bytes = 0;
+  utime_t load_last_busy;
+  load_t load;
+
  public:
   bool done = false;
 
@@ -230,6 +262,7 @@ class Worker {
     plb.add_u64_counter(l_msgr_send_messages, "msgr_send_messages", "Network sent messages");
     plb.add_u64_counter(l_msgr_recv_bytes, "msgr_recv_bytes", "Network received bytes");
     plb.add_u64_counter(l_msgr_send_bytes, "msgr_send_bytes", "Network sent bytes");
+    plb.add_u64_counter(l_msgr_send_copy_bytes, "msgr_send_copy_bytes", "Message bytes copied while queueing for send");
     plb.add_u64_counter(l_msgr_active_connections, "msgr_active_connections", "Active connection number");
     plb.add_u64_counter(l_msgr_created_connections, "msgr_created_connections", "Created connection number");
 
@@ -237,6 +270,22 @@ class Worker {
     plb.add_time(l_msgr_running_send_time, "msgr_running_send_time", "The total time of message sending");
     plb.add_time(l_msgr_running_recv_time, "msgr_running_recv_time", "The total time of message receiving");
     plb.add_time(l_msgr_running_fast_dispatch_time, "msgr_running_fast_dispatch_time", "The total time of fast dispatch");
+    plb.add_time(l_msgr_running_encode_time, "msgr_running_encode_time", "The total time of message encoding on the worker");
+    plb.add_u64_counter(l_msgr_worker_encoded_messages, "msgr_worker_encoded_messages", "Messages encoded on the worker rather than the sender");
+    plb.add_u64_counter(l_msgr_send_zerocopy_bytes, "msgr_send_zerocopy_bytes", "Bytes sent with MSG_ZEROCOPY");
+    plb.add_u64_counter(l_msgr_send_zerocopy_copied, "msgr_send_zerocopy_copied", "Zero copy sends the kernel copied anyway");
+    plb.add_u64_counter(l_msgr_send_zerocopy_orphaned, "msgr_send_zerocopy_orphaned", "Sockets closed with zero copy sends in flight");
+    plb.add_u64_counter(l_msgr_running_events, "msgr_running_events", "Events handled");
+    plb.add_u64(l_msgr_load_busy_pct, "msgr_load_busy_pct", "Percentage of time spent handling events, as last sampled");
+    plb.add_u64(l_msgr_load_events, "msgr_load_events", "Events handled per second, as last sampled");
+    plb.add_u64(l_msgr_load_bytes, "msgr_load_bytes", "Bytes sent and received per second, as last sampled");
+    plb.add_u64_counter(l_msgr_migrated_in_connections, "msgr_migrated_in_connections", "Connections moved to this worker by the balancer");
+    plb.add_u64_counter(l_msgr_migrated_out_connections, "msgr_migrated_out_connections", "Connections moved off this worker by the balancer");
+    plb.add_u64_counter(l_msgr_busy_poll_hits, "msgr_busy_poll_hits", "Busy polls that found events, saving a wakeup");
+    plb.add_u64_counter(l_msgr_busy_poll_misses, "msgr_busy_poll_misses", "Busy polls that found nothing");
+    plb.add_time(l_msgr_busy_poll_time, "msgr_busy_poll_time", "The total time spent in busy polls that found nothing");
+    plb.add_u64_avg(l_msgr_send_batch_messages, "msgr_send_batch_messages", "Messages per batched frame sent");
+    plb.add_u64_avg(l_msgr_recv_batch_messages, "msgr_recv_batch_messages", "Messages per batched frame received");
 
     perf_logger = plb.create_perf_counters();
     cct->get_perfcounters_collection()->add(perf_logger);
@@ -256,6 +305,9 @@ class Worker {
 
   virtual void initialize() {}
   PerfCounters *get_perf_counter() { return perf_logger; }
+  /// recompute the load over the time since the previous sample, unless
+  /// that was less than min_interval ago (several messengers share us)
+  load_t sample_load(ceph::timespan min_interval);
   void release_worker() {
     int oldref = references.fetch_sub(1);
     assert(oldref > 0);
@@ -320,9 +372,18 @@ class NetworkStack : public CephContext::ForkWatcher {
   // need to let each thread do binding port.
   virtual bool support_local_listen_table() const { return false; }
   virtual bool nonblock_connect_need_writable_event() const { return true; }
+  // backend need to override this method if a connected socket can be
+  // handed to another worker (see AsyncConnection::migrate()).  rdma and
+  // dpdk sockets are bound to the worker that created them.
+  virtual bool support_migration() const { return false; }
 
   void start();
   void stop();
+  /// have the workers poll for up to us microseconds before blocking
+  void set_busy_poll(uint64_t us) {
+    for (auto &&w : workers)
+      w->center.set_busy_poll(us);
+  }
   virtual Worker *get_worker();
   Worker *get_worker(unsigned i) {
     return workers[i];
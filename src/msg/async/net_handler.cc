@@ -21,6 +21,8 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 
+#include <atomic>
+
 #include "net_handler.h"
 #include "common/errno.h"
 #include "common/debug.h"
@@ -172,6 +174,29 @@ void NetHandler::set_priority(int sd, int prio, int domain)
 #endif	// SO_PRIORITY
 }
 
+void NetHandler::set_busy_poll(int sd, int us)
+{
+#ifdef SO_BUSY_POLL
+  // values above net.core.busy_read need CAP_NET_ADMIN; once that has
+  // been refused there is no point in trying (and complaining) per socket
+  static std::atomic<bool> denied = {false};
+  if (denied)
+    return;
+  int r = ::setsockopt(sd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+  if (r < 0) {
+    r = errno;
+    if (r == EPERM && !denied.exchange(true)) {
+      ldout(cct, 0) << __func__ << " couldn't set SO_BUSY_POLL to " << us
+                    << ": " << cpp_strerror(r) << ", raise net.core.busy_read"
+                    << " or grant CAP_NET_ADMIN; not trying again" << dendl;
+    } else {
+      ldout(cct, 10) << __func__ << " couldn't set SO_BUSY_POLL to " << us
+                     << ": " << cpp_strerror(r) << dendl;
+    }
+  }
+#endif
+}
+
 int NetHandler::generic_connect(const entity_addr_t& addr, const entity_addr_t &bind_addr, bool nonblock)
 {
   int ret;
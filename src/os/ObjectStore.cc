@@ -155,6 +155,40 @@ int ObjectStore::read_meta(const std::string& key,
 
 
 
+int ObjectStore::collection_list_meta(
+  CollectionHandle &c,
+  const ghobject_t& start, const ghobject_t& end, int max,
+  const set<string> &attrs,
+  vector<object_meta_t> *ls, ghobject_t *next)
+{
+  vector<ghobject_t> oids;
+  int r = collection_list(c, start, end, max, &oids, next);
+  if (r < 0)
+    return r;
+  ls->reserve(ls->size() + oids.size());
+  for (auto& oid : oids) {
+    object_meta_t m;
+    r = stat(c, oid, &m.st);
+    for (auto p = attrs.begin(); r >= 0 && p != attrs.end(); ++p) {
+      bufferptr bp;
+      r = getattr(c, oid, p->c_str(), bp);
+      if (r == -ENODATA) {
+	r = 0;
+	continue;
+      }
+      if (r >= 0)
+	m.attrs[*p] = std::move(bp);
+    }
+    if (r == -ENOENT)
+      continue;  // removed since it was listed
+    if (r < 0)
+      return r;
+    m.oid = oid;
+    ls->push_back(std::move(m));
+  }
+  return 0;
+}
+
 ostream& operator<<(ostream& out, const ObjectStore::Sequencer& s)
 {
   return out << "osr(" << s.get_name() << " " << &s << ")";
@@ -1530,6 +1530,11 @@ public:
   virtual void get_db_statistics(Formatter *f) { }
   virtual void generate_db_histogram(Formatter *f) { }
   virtual void flush_cache() { }
+  virtual void dump_cache_stats(Formatter *f) { }
+  /// record allocator activity to path (stop if empty) for offline replay
+  virtual int set_alloc_trace(const string& path) {
+    return -EOPNOTSUPP;
+  }
   virtual void dump_perf_counters(Formatter *f) {}
 
   virtual string get_type() = 0;
@@ -1689,6 +1694,7 @@ public:
    * @param oid oid of object
    * @param st output information for the object
    * @param allow_eio if false, assert on -EIO operation failure
+   * @param op_flags is CEPH_OSD_OP_FLAG_* (cache hints only)
    * @returns 0 on success, negative error code on failure.
    */
   virtual int stat(
@@ -1700,7 +1706,8 @@ public:
     CollectionHandle &c,
     const ghobject_t& oid,
     struct stat *st,
-    bool allow_eio = false) {
+    bool allow_eio = false,
+    uint32_t op_flags = 0) {
     return stat(c->get_cid(), oid, st, allow_eio);
   }
 
@@ -1777,7 +1784,8 @@ public:
   virtual int getattr(const coll_t& cid, const ghobject_t& oid,
 		      const char *name, bufferptr& value) = 0;
   virtual int getattr(CollectionHandle &c, const ghobject_t& oid,
-		      const char *name, bufferptr& value) {
+		      const char *name, bufferptr& value,
+		      uint32_t op_flags = 0) {
     return getattr(c->get_cid(), oid, name, value);
   }
 
@@ -1825,7 +1833,8 @@ public:
   virtual int getattrs(const coll_t& cid, const ghobject_t& oid,
 		       map<string,bufferptr>& aset) = 0;
   virtual int getattrs(CollectionHandle &c, const ghobject_t& oid,
-		       map<string,bufferptr>& aset) {
+		       map<string,bufferptr>& aset,
+		       uint32_t op_flags = 0) {
     return getattrs(c->get_cid(), oid, aset);
   }
 
@@ -1920,6 +1929,43 @@ public:
     return collection_list(c->get_cid(), start, end, max, ls, next);
   }
 
+  /// an object listed by collection_list_meta()
+  struct object_meta_t {
+    ghobject_t oid;
+    struct stat st;                  ///< as returned by stat()
+    map<string, bufferptr> attrs;    ///< the requested xattrs it has
+
+    object_meta_t() {
+      memset(&st, 0, sizeof(st));
+    }
+  };
+
+  /**
+   * list contents of a collection along with their metadata
+   *
+   * Like collection_list(), but also returns each object's stat and the
+   * xattrs named in attrs, so that a caller scanning the collection does
+   * not need a stat() or getattr() per object.  Backends that keep the
+   * metadata next to the object name return it from the same pass over
+   * their index.
+   *
+   * @param c collection
+   * @param start list object that sort >= this value
+   * @param end list objects that sort < this value
+   * @param max return no more than this many results
+   * @param attrs names of the xattrs to return
+   * @param ls [out] result
+   * @param next [out] next item sorts >= this value
+   * @return zero on success, or negative error
+   */
+  virtual int collection_list_meta(CollectionHandle &c,
+				   const ghobject_t& start,
+				   const ghobject_t& end,
+				   int max,
+				   const set<string> &attrs,
+				   vector<object_meta_t> *ls,
+				   ghobject_t *next);
+
 
   /// OMAP
   /// Get omap contents
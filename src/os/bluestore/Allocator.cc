@@ -4,6 +4,7 @@
 #include "Allocator.h"
 #include "StupidAllocator.h"
 #include "BitMapAllocator.h"
+#include "AvlAllocator.h"
 #include "common/debug.h"
 
 #define dout_subsys ceph_subsys_bluestore
@@ -12,9 +13,11 @@ Allocator *Allocator::create(CephContext* cct, string type,
                              int64_t size, int64_t block_size)
 {
   if (type == "stupid") {
-    return new StupidAllocator(cct);
+    return new StupidAllocator(cct, block_size);
   } else if (type == "bitmap") {
     return new BitMapAllocator(cct, size, block_size);
+  } else if (type == "avl") {
+    return new AvlAllocator(cct, size, block_size);
   }
   lderr(cct) << "Allocator::" << __func__ << " unknown alloc type "
 	     << type << dendl;
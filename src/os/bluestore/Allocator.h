@@ -13,6 +13,7 @@
 #define CEPH_OS_BLUESTORE_ALLOCATOR_H
 
 #include <ostream>
+#include <functional>
 #include "include/assert.h"
 #include "os/bluestore/bluestore_types.h"
 
@@ -52,6 +53,17 @@ public:
 
   virtual uint64_t get_free() = 0;
 
+  /// 0 (all free space is contiguous) .. 1 (free space is all single blocks)
+  virtual double get_fragmentation() {
+    return 0.0;
+  }
+
+  /// walk the free extents in offset order; -EOPNOTSUPP if not supported
+  virtual int foreach_free(
+    std::function<void(uint64_t offset, uint64_t length)> notify) {
+    return -EOPNOTSUPP;
+  }
+
   virtual void shutdown() = 0;
   static Allocator *create(CephContext* cct, string type, int64_t size,
 			   int64_t block_size);
@@ -0,0 +1,334 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "AvlAllocator.h"
+#include "bluestore_types.h"
+#include "common/debug.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bluestore
+#undef dout_prefix
+#define dout_prefix *_dout << "avlalloc "
+
+MEMPOOL_DEFINE_OBJECT_FACTORY(range_seg_t, range_seg_t, bluestore_alloc);
+
+namespace {
+  // a light-weight "range_seg_t", used as the key when searching the trees
+  struct range_t {
+    uint64_t start;
+    uint64_t end;
+  };
+}
+
+AvlAllocator::AvlAllocator(CephContext* cct,
+			   int64_t device_size,
+			   int64_t block_size)
+  : cct(cct),
+    num_total(device_size),
+    block_size(block_size)
+{
+}
+
+AvlAllocator::~AvlAllocator()
+{
+  shutdown();
+}
+
+void AvlAllocator::_add_to_tree(uint64_t start, uint64_t size)
+{
+  assert(size != 0);
+
+  uint64_t end = start + size;
+
+  auto rs_after = range_tree.upper_bound(range_t{start, end},
+					 range_tree.key_comp());
+
+  /* Make sure we don't overlap with either of our neighbors */
+  auto rs_before = range_tree.end();
+  if (rs_after != range_tree.begin()) {
+    rs_before = std::prev(rs_after);
+    assert(rs_before->end <= start);
+  }
+
+  bool merge_before = (rs_before != range_tree.end() &&
+		       rs_before->end == start);
+  bool merge_after = (rs_after != range_tree.end() && rs_after->start == end);
+
+  if (merge_before && merge_after) {
+    range_size_tree.erase(range_size_tree.iterator_to(*rs_before));
+    range_size_tree.erase(range_size_tree.iterator_to(*rs_after));
+    rs_after->start = rs_before->start;
+    range_tree.erase_and_dispose(rs_before, dispose_rs{});
+    range_size_tree.insert(*rs_after);
+  } else if (merge_before) {
+    range_size_tree.erase(range_size_tree.iterator_to(*rs_before));
+    rs_before->end = end;
+    range_size_tree.insert(*rs_before);
+  } else if (merge_after) {
+    range_size_tree.erase(range_size_tree.iterator_to(*rs_after));
+    rs_after->start = start;
+    range_size_tree.insert(*rs_after);
+  } else {
+    auto new_rs = new range_seg_t{start, end};
+    range_tree.insert_before(rs_after, *new_rs);
+    range_size_tree.insert(*new_rs);
+  }
+  num_free += size;
+}
+
+void AvlAllocator::_remove_from_tree(uint64_t start, uint64_t size)
+{
+  uint64_t end = start + size;
+
+  assert(size != 0);
+  assert(size <= num_free);
+
+  auto rs = range_tree.find(range_t{start, end}, range_tree.key_comp());
+  /* Make sure we completely overlap with someone */
+  assert(rs != range_tree.end());
+  assert(rs->start <= start);
+  assert(rs->end >= end);
+
+  bool left_over = (rs->start != start);
+  bool right_over = (rs->end != end);
+
+  range_size_tree.erase(range_size_tree.iterator_to(*rs));
+
+  if (left_over && right_over) {
+    auto new_seg = new range_seg_t{end, rs->end};
+    rs->end = start;
+    range_tree.insert_before(std::next(rs), *new_seg);
+    range_size_tree.insert(*new_seg);
+    range_size_tree.insert(*rs);
+  } else if (left_over) {
+    rs->end = start;
+    range_size_tree.insert(*rs);
+  } else if (right_over) {
+    rs->start = end;
+    range_size_tree.insert(*rs);
+  } else {
+    range_tree.erase_and_dispose(rs, dispose_rs{});
+  }
+  num_free -= size;
+}
+
+int AvlAllocator::_allocate(
+  uint64_t want,
+  uint64_t unit,
+  uint64_t hint,
+  uint64_t *offset,
+  uint64_t *length)
+{
+  // first fit, starting with the extent at or after the hint
+  if (hint < num_total) {
+    auto rs = range_tree.lower_bound(range_t{hint, hint + 1},
+				     range_tree.key_comp());
+    for (unsigned n = 0;
+	 rs != range_tree.end() && n < max_search_count;
+	 ++rs, ++n) {
+      if (_aligned_len(*rs, unit) >= want) {
+	*offset = _aligned_start(*rs, unit);
+	*length = want;
+	ldout(cct, 30) << __func__ << " first fit 0x" << std::hex << *offset
+		       << "~" << *length << std::dec << dendl;
+	return 0;
+      }
+    }
+  }
+
+  // best fit: the shortest extent that is long enough
+  for (auto rs = range_size_tree.lower_bound(range_t{0, want},
+					     range_size_tree.key_comp());
+       rs != range_size_tree.end();
+       ++rs) {
+    if (_aligned_len(*rs, unit) >= want) {
+      *offset = _aligned_start(*rs, unit);
+      *length = want;
+      ldout(cct, 30) << __func__ << " best fit 0x" << std::hex << *offset
+		     << "~" << *length << std::dec << dendl;
+      return 0;
+    }
+  }
+
+  // nothing is long enough: take as much as we can from the longest
+  for (auto rs = range_size_tree.rbegin();
+       rs != range_size_tree.rend() && rs->length() >= unit;
+       ++rs) {
+    uint64_t len = P2ALIGN(_aligned_len(*rs, unit), unit);
+    if (len >= unit) {
+      *offset = _aligned_start(*rs, unit);
+      *length = len;
+      ldout(cct, 30) << __func__ << " partial 0x" << std::hex << *offset
+		     << "~" << *length << std::dec << dendl;
+      return 0;
+    }
+  }
+  return -ENOSPC;
+}
+
+int AvlAllocator::reserve(uint64_t need)
+{
+  std::lock_guard<std::mutex> l(lock);
+  ldout(cct, 10) << __func__ << " need 0x" << std::hex << need
+		 << " num_free 0x" << num_free
+		 << " num_reserved 0x" << num_reserved << std::dec << dendl;
+  if (need > num_free - num_reserved)
+    return -ENOSPC;
+  num_reserved += need;
+  return 0;
+}
+
+void AvlAllocator::unreserve(uint64_t unused)
+{
+  std::lock_guard<std::mutex> l(lock);
+  ldout(cct, 10) << __func__ << " unused 0x" << std::hex << unused
+		 << " num_free 0x" << num_free
+		 << " num_reserved 0x" << num_reserved << std::dec << dendl;
+  assert(num_reserved >= unused);
+  num_reserved -= unused;
+}
+
+int64_t AvlAllocator::allocate(
+  uint64_t want_size,
+  uint64_t alloc_unit,
+  uint64_t max_alloc_size,
+  int64_t hint,
+  AllocExtentVector *extents)
+{
+  ldout(cct, 10) << __func__ << " want_size 0x" << std::hex << want_size
+		 << " alloc_unit 0x" << alloc_unit
+		 << " max_alloc_size 0x" << max_alloc_size
+		 << " hint 0x" << hint << std::dec
+		 << dendl;
+  assert(ISP2(alloc_unit));
+
+  if (max_alloc_size == 0) {
+    max_alloc_size = want_size;
+  }
+  // AllocExtent lengths are 32 bits
+  max_alloc_size = std::min<uint64_t>(
+    max_alloc_size,
+    P2ALIGN(std::numeric_limits<uint32_t>::max(), alloc_unit));
+
+  ExtentList block_list = ExtentList(extents, 1, max_alloc_size);
+
+  std::lock_guard<std::mutex> l(lock);
+  if (!hint)
+    hint = last_alloc;
+
+  uint64_t allocated_size = 0;
+  while (allocated_size < want_size) {
+    uint64_t want = std::max(alloc_unit,
+			     std::min(max_alloc_size,
+				      want_size - allocated_size));
+    uint64_t offset = 0, length = 0;
+    if (_allocate(want, alloc_unit, hint, &offset, &length) < 0) {
+      break;
+    }
+    if (cct->_conf->bluestore_debug_small_allocations) {
+      uint64_t max =
+	alloc_unit * (rand() % cct->_conf->bluestore_debug_small_allocations);
+      if (max && length > max) {
+	ldout(cct, 10) << __func__ << " shortening allocation of 0x"
+		       << std::hex << length << " -> 0x" << max
+		       << " due to debug_small_allocations" << std::dec
+		       << dendl;
+	length = max;
+      }
+    }
+    _remove_from_tree(offset, length);
+    assert(num_reserved >= length);
+    num_reserved -= length;
+    block_list.add_extents(offset, length);
+    allocated_size += length;
+    hint = last_alloc = offset + length;
+  }
+
+  if (allocated_size == 0) {
+    return -ENOSPC;
+  }
+  return allocated_size;
+}
+
+void AvlAllocator::release(const interval_set<uint64_t>& release_set)
+{
+  std::lock_guard<std::mutex> l(lock);
+  for (auto p = release_set.begin(); p != release_set.end(); ++p) {
+    const auto offset = p.get_start();
+    const auto length = p.get_len();
+    ldout(cct, 10) << __func__ << " 0x" << std::hex << offset << "~" << length
+		   << std::dec << dendl;
+    _add_to_tree(offset, length);
+  }
+}
+
+uint64_t AvlAllocator::get_free()
+{
+  std::lock_guard<std::mutex> l(lock);
+  return num_free;
+}
+
+double AvlAllocator::_get_fragmentation() const
+{
+  // 0 if all free space is one extent, 1 if no two free blocks are adjacent
+  auto free_blocks = P2ALIGN(num_free, block_size) / block_size;
+  if (free_blocks <= 1) {
+    return .0;
+  }
+  return (static_cast<double>(range_tree.size() - 1) / (free_blocks - 1));
+}
+
+double AvlAllocator::get_fragmentation()
+{
+  std::lock_guard<std::mutex> l(lock);
+  return _get_fragmentation();
+}
+
+void AvlAllocator::dump()
+{
+  std::lock_guard<std::mutex> l(lock);
+  ldout(cct, 0) << __func__ << " range_tree: " << range_tree.size()
+		<< " extents, free 0x" << std::hex << num_free << std::dec
+		<< dendl;
+  for (auto& rs : range_tree) {
+    ldout(cct, 0) << __func__ << "  0x" << std::hex << rs.start << "~"
+		  << rs.length() << std::dec << dendl;
+  }
+  ldout(cct, 0) << __func__ << " fragmentation " << _get_fragmentation()
+		<< dendl;
+}
+
+int AvlAllocator::foreach_free(
+  std::function<void(uint64_t offset, uint64_t length)> notify)
+{
+  std::lock_guard<std::mutex> l(lock);
+  for (auto& rs : range_tree) {
+    notify(rs.start, rs.length());
+  }
+  return 0;
+}
+
+void AvlAllocator::init_add_free(uint64_t offset, uint64_t length)
+{
+  std::lock_guard<std::mutex> l(lock);
+  ldout(cct, 10) << __func__ << " 0x" << std::hex << offset << "~" << length
+		 << std::dec << dendl;
+  _add_to_tree(offset, length);
+}
+
+void AvlAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  std::lock_guard<std::mutex> l(lock);
+  ldout(cct, 10) << __func__ << " 0x" << std::hex << offset << "~" << length
+		 << std::dec << dendl;
+  _remove_from_tree(offset, length);
+}
+
+void AvlAllocator::shutdown()
+{
+  std::lock_guard<std::mutex> l(lock);
+  ldout(cct, 1) << __func__ << dendl;
+  range_size_tree.clear();
+  range_tree.clear_and_dispose(dispose_rs{});
+  num_free = 0;
+}
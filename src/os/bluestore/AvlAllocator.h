@@ -0,0 +1,146 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_OS_BLUESTORE_AVLALLOCATOR_H
+#define CEPH_OS_BLUESTORE_AVLALLOCATOR_H
+
+#include <mutex>
+#include <boost/intrusive/avl_set.hpp>
+
+#include "Allocator.h"
+#include "os/bluestore/bluestore_types.h"
+#include "include/mempool.h"
+
+/// a free extent, linked into both of AvlAllocator's trees
+struct range_seg_t {
+  MEMPOOL_CLASS_HELPERS();  ///< memory monitoring
+  uint64_t start;   ///< starting offset of this segment
+  uint64_t end;	    ///< ending offset (non-inclusive)
+
+  range_seg_t(uint64_t start, uint64_t end)
+    : start{start},
+      end{end}
+  {}
+  uint64_t length() const {
+    return end - start;
+  }
+
+  // Tree is sorted by offset, greater offsets at the end of the tree.
+  struct before_t {
+    template<typename KeyLeft, typename KeyRight>
+    bool operator()(const KeyLeft& lhs, const KeyRight& rhs) const {
+      return lhs.end <= rhs.start;
+    }
+  };
+  boost::intrusive::avl_set_member_hook<> offset_hook;
+
+  // Tree is sorted by size, larger sizes at the end of the tree.
+  struct shorter_t {
+    template<typename KeyType>
+    bool operator()(const range_seg_t& lhs, const KeyType& rhs) const {
+      auto lhs_size = lhs.end - lhs.start;
+      auto rhs_size = rhs.end - rhs.start;
+      if (lhs_size < rhs_size) {
+	return true;
+      } else if (lhs_size > rhs_size) {
+	return false;
+      } else {
+	return lhs.start < rhs.start;
+      }
+    }
+  };
+  boost::intrusive::avl_set_member_hook<> size_hook;
+};
+
+/**
+ * Free space is kept as extents indexed twice: by offset, so that a
+ * release coalesces with its neighbours immediately, and by length, so
+ * that finding an extent big enough for a request is O(log n) no matter
+ * how fragmented the device is.
+ *
+ * Allocation first tries the extents at and after the hint (first fit,
+ * to keep sequential writes contiguous), and otherwise takes the
+ * smallest extent that fits (best fit), which preserves large extents.
+ */
+class AvlAllocator : public Allocator {
+  struct dispose_rs {
+    void operator()(range_seg_t* p)
+    {
+      delete p;
+    }
+  };
+
+  using range_tree_t =
+    boost::intrusive::avl_set<
+      range_seg_t,
+      boost::intrusive::compare<range_seg_t::before_t>,
+      boost::intrusive::member_hook<
+	range_seg_t,
+	boost::intrusive::avl_set_member_hook<>,
+	&range_seg_t::offset_hook>>;
+  using range_size_tree_t =
+    boost::intrusive::avl_multiset<
+      range_seg_t,
+      boost::intrusive::compare<range_seg_t::shorter_t>,
+      boost::intrusive::member_hook<
+	range_seg_t,
+	boost::intrusive::avl_set_member_hook<>,
+	&range_seg_t::size_hook>>;
+
+  CephContext* cct;
+  std::mutex lock;
+
+  const uint64_t num_total;   ///< device size
+  const uint64_t block_size;
+
+  range_tree_t range_tree;    ///< main range tree, by offset
+  range_size_tree_t range_size_tree;  ///< same extents, by length
+
+  uint64_t num_free = 0;      ///< total bytes in freelist
+  uint64_t num_reserved = 0;  ///< reserved bytes
+  uint64_t last_alloc = 0;    ///< end of the last allocation, default hint
+
+  /// max extents examined near the hint before falling back to best fit
+  static constexpr unsigned max_search_count = 16;
+
+  void _add_to_tree(uint64_t start, uint64_t size);
+  void _remove_from_tree(uint64_t start, uint64_t size);
+
+  /// offset at which an extent can satisfy unit alignment, or end if none
+  uint64_t _aligned_start(const range_seg_t& rs, uint64_t unit) const {
+    return std::min(P2ROUNDUP(rs.start, unit), rs.end);
+  }
+  uint64_t _aligned_len(const range_seg_t& rs, uint64_t unit) const {
+    return rs.end - _aligned_start(rs, unit);
+  }
+  int _allocate(uint64_t want, uint64_t unit, uint64_t hint,
+		uint64_t *offset, uint64_t *length);
+  double _get_fragmentation() const;
+
+public:
+  AvlAllocator(CephContext* cct, int64_t device_size, int64_t block_size);
+  ~AvlAllocator() override;
+
+  int reserve(uint64_t need) override;
+  void unreserve(uint64_t unused) override;
+
+  int64_t allocate(
+    uint64_t want_size, uint64_t alloc_unit, uint64_t max_alloc_size,
+    int64_t hint, AllocExtentVector *extents) override;
+
+  void release(const interval_set<uint64_t>& release_set) override;
+
+  uint64_t get_free() override;
+  double get_fragmentation() override;
+
+  void dump() override;
+  int foreach_free(
+    std::function<void(uint64_t offset, uint64_t length)> notify) override;
+
+  void init_add_free(uint64_t offset, uint64_t length) override;
+  void init_rm_free(uint64_t offset, uint64_t length) override;
+
+  void shutdown() override;
+};
+
+#endif
@@ -51,7 +51,8 @@ void IOContext::aio_wait()
 }
 
 BlockDevice *BlockDevice::create(CephContext* cct, const string& path,
-				 aio_callback_t cb, void *cbpriv)
+				 aio_callback_t cb, void *cbpriv,
+				 bool emulate_pmem)
 {
   string type = "kernel";
   char buf[PATH_MAX + 1];
@@ -68,11 +69,16 @@ BlockDevice *BlockDevice::create(CephContext* cct, const string& path,
     int is_pmem = 0;
     void *addr = pmem_map_file(path.c_str(), 1024*1024, PMEM_FILE_EXCL, O_RDONLY, NULL, &is_pmem);
     if (addr != NULL) {
-      if (is_pmem)
+      if (is_pmem || emulate_pmem)
 	type = "pmem";
       pmem_unmap(addr, 1024*1024);
     }
   }
+#else
+  if (emulate_pmem) {
+    derr << __func__ << " built without libpmem, not emulating pmem for "
+	 << path << dendl;
+  }
 #endif
 
   dout(1) << __func__ << " path " << path << " type " << type << dendl;
@@ -116,10 +116,14 @@ public:
  {}
   virtual ~BlockDevice() = default;
 
+  /// @param emulate_pmem map a regular file as persistent memory (testing)
   static BlockDevice *create(
-    CephContext* cct, const std::string& path, aio_callback_t cb, void *cbpriv);
+    CephContext* cct, const std::string& path, aio_callback_t cb, void *cbpriv,
+    bool emulate_pmem = false);
   virtual bool supported_bdev_label() { return true; }
   virtual bool is_rotational() { return rotational; }
+  /// writes are durable once they return, without a flush
+  virtual bool is_pmem() { return false; }
 
   virtual void aio_submit(IOContext *ioc) = 0;
 
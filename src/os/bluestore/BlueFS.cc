@@ -82,6 +82,10 @@ void BlueFS::_init_logger()
 	    "jlen", PerfCountersBuilder::PRIO_INTERESTING);
   b.add_u64_counter(l_bluefs_log_compactions, "log_compactions",
 		    "Compactions of the metadata log");
+  b.add_time_avg(l_bluefs_log_compaction_lat, "log_compaction_lat",
+		 "Duration of metadata log compactions");
+  b.add_time_avg(l_bluefs_log_compaction_lock_lat, "log_compaction_lock_lat",
+		 "Longest time a log compaction held the BlueFS lock at once");
   b.add_u64_counter(l_bluefs_logged_bytes, "logged_bytes",
 		    "Bytes written to the metadata log", "j",
 		    PerfCountersBuilder::PRIO_CRITICAL);
@@ -95,6 +99,17 @@ void BlueFS::_init_logger()
   b.add_u64_counter(l_bluefs_bytes_written_sst, "bytes_written_sst",
 		    "Bytes written to SSTs", "sst",
 		    PerfCountersBuilder::PRIO_CRITICAL);
+  b.add_u64_counter(l_bluefs_wal_fsync_log_writes, "wal_fsync_log_writes",
+		    "WAL fsyncs that also had to write the metadata log");
+  b.add_u64_counter(l_bluefs_wal_fsync_log_writes_saved,
+		    "wal_fsync_log_writes_saved",
+		    "WAL fsyncs that were a data write only");
+  b.add_u64_counter(l_bluefs_wal_flushes, "wal_flushes",
+		    "Flushes of the WAL device");
+  b.add_u64_counter(l_bluefs_db_flushes, "db_flushes",
+		    "Flushes of the DB device");
+  b.add_u64_counter(l_bluefs_slow_flushes, "slow_flushes",
+		    "Flushes of the slow device");
   logger = b.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
 }
@@ -103,6 +118,7 @@ void BlueFS::_shutdown_logger()
 {
   cct->get_perfcounters_collection()->remove(logger);
   delete logger;
+  logger = nullptr;
 }
 
 void BlueFS::_update_logger_stats()
@@ -128,12 +144,13 @@ void BlueFS::_update_logger_stats()
   }
 }
 
-int BlueFS::add_block_device(unsigned id, const string& path)
+int BlueFS::add_block_device(unsigned id, const string& path,
+			     bool emulate_pmem)
 {
   dout(10) << __func__ << " bdev " << id << " path " << path << dendl;
   assert(id < bdev.size());
   assert(bdev[id] == NULL);
-  BlockDevice *b = BlockDevice::create(cct, path, NULL, NULL);
+  BlockDevice *b = BlockDevice::create(cct, path, NULL, NULL, emulate_pmem);
   int r = b->open(path);
   if (r < 0) {
     delete b;
@@ -962,6 +979,7 @@ void BlueFS::_drop_link(FileRef file)
   if (file->refs == 0) {
     dout(20) << __func__ << " destroying " << file->fnode << dendl;
     assert(file->num_reading.load() == 0);
+    _compact_note_remove(file.get());
     log_t.op_file_remove(file->fnode.ino);
     for (auto& r : file->fnode.extents) {
       pending_release[r.bdev].insert(r.offset, r.length);
@@ -1145,6 +1163,9 @@ uint64_t BlueFS::_estimate_log_size()
 void BlueFS::compact_log()
 {
   std::unique_lock<std::mutex> l(lock);
+  while (new_log) {
+    log_cond.wait(l);
+  }
   if (cct->_conf->bluefs_compact_log_sync) {
      _compact_log_sync();
   } else {
@@ -1207,6 +1228,7 @@ void BlueFS::_compact_log_dump_metadata(bluefs_transaction_t *t)
 void BlueFS::_compact_log_sync()
 {
   dout(10) << __func__ << dendl;
+  auto start = ceph::mono_clock::now();
   File *log_file = log_writer->file.get();
 
   // clear out log (be careful who calls us!!!)
@@ -1263,19 +1285,27 @@ void BlueFS::_compact_log_sync()
   }
 
   logger->inc(l_bluefs_log_compactions);
+  auto dur = ceph::mono_clock::now() - start;
+  logger->tinc(l_bluefs_log_compaction_lat, dur);
+  logger->tinc(l_bluefs_log_compaction_lock_lat, dur);
 }
 
 /*
  * 1. Allocate a new extent to continue the log, and then log an event
  * that jumps the log write position to the new extent.  At this point, the
  * old extent(s) won't be written to, and reflect everything to compact.
- * New events will be written to the new region that we'll keep.
+ * New events will be written to the new region that we'll keep.  This is
+ * the checkpoint the new beginning of the log has to describe.
  *
- * 2. While still holding the lock, encode a bufferlist that dumps all of the
- * in-memory fnodes and names.  This will become the new beginning of the
- * log.  The last event will jump to the log continuation extent from #1.
+ * 2. Dump the in-memory fnodes and names into a bufferlist that will
+ * become the new beginning of the log, bluefs_log_compact_batch entries
+ * per hold of the lock.  Everything that changes meanwhile is also
+ * logged after the checkpoint and will be replayed on top of the dump,
+ * so an entry that changes before the dump reaches it is dumped as it
+ * was at the checkpoint instead (see _compact_note_*).  The last event
+ * jumps to the log continuation extent from #1.
  *
- * 3. Queue a write to a new extent for the new beginnging of the log.
+ * 3. Queue a write to a new extent for the new beginning of the log.
  *
  * 4. Drop lock and wait
  *
@@ -1293,6 +1323,19 @@ void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
   File *log_file = log_writer->file.get();
   assert(!new_log);
   assert(!new_log_writer);
+  assert(!compact_state);
+
+  // track the longest stretch we hold the lock for
+  auto start = ceph::mono_clock::now();
+  auto held_since = start;
+  ceph::timespan max_held = ceph::timespan::zero();
+  auto dropping_lock = [&]() {
+    max_held = std::max<ceph::timespan>(max_held,
+					ceph::mono_clock::now() - held_since);
+  };
+  auto got_lock = [&]() {
+    held_since = ceph::mono_clock::now();
+  };
 
   // create a new log [writer] so that we know compaction is in progress
   // (see _should_compact_log)
@@ -1304,7 +1347,9 @@ void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
   // our entries and our jump_to update won't be correct.)
   while (log_flushing) {
     dout(10) << __func__ << " log is currently flushing, waiting" << dendl;
+    dropping_lock();
     log_cond.wait(l);
+    got_lock();
   }
 
   // 1. allocate new log space and jump to it.
@@ -1328,23 +1373,112 @@ void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
 
   flush_bdev();  // FIXME?
 
+  dropping_lock();
   _flush_and_sync_log(l, 0, old_log_jump_to);
+  got_lock();
 
-  // 2. prepare compacted log
-  bluefs_transaction_t t;
-  //avoid record two times in log_t and _compact_log_dump_metadata.
+  // 2. prepare compacted log, starting with what is cheap to copy now
+  //avoid record two times in log_t and the dump.
   log_t.clear();
-  _compact_log_dump_metadata(&t);
+  compact_state.reset(new compact_log_state_t);
+  compact_state->seq = log_seq;
+  compact_state->ino_max = ino_last;
+
+  bluefs_transaction_t t;
+  t.seq = 1;
+  t.uuid = super.uuid;
+  t.op_init();
+  for (unsigned bdev = 0; bdev < MAX_BDEV; ++bdev) {
+    interval_set<uint64_t>& p = block_all[bdev];
+    for (interval_set<uint64_t>::iterator q = p.begin(); q != p.end(); ++q) {
+      t.op_alloc_add(bdev, q.get_start(), q.get_len());
+    }
+  }
+  for (auto& p : dir_map) {
+    t.op_dir_create(p.first);
+  }
+  vector<uint64_t> inos;
+  inos.reserve(file_map.size());
+  for (auto& p : file_map) {
+    if (p.first > 1) {
+      inos.push_back(p.first);
+    }
+  }
+  dropping_lock();
+  l.unlock();
+  std::sort(inos.begin(), inos.end());
+  dout(10) << __func__ << " checkpoint at seq " << compact_state->seq
+	   << ", dumping " << inos.size() << " files" << dendl;
+
+  unsigned batch = std::max<uint64_t>(
+    1, cct->_conf->get_val<uint64_t>("bluefs_log_compact_batch"));
+  auto i = inos.begin();
+  while (i != inos.end()) {
+    l.lock();
+    got_lock();
+    for (unsigned n = 0; n < batch && i != inos.end(); ++n, ++i) {
+      auto p = file_map.find(*i);
+      if (p != file_map.end()) {
+	t.op_file_update(p->second->fnode);
+      } else {
+	auto q = compact_state->removed.find(*i);
+	assert(q != compact_state->removed.end());
+	t.op_file_update(q->second);
+	compact_state->removed.erase(q);
+      }
+      compact_state->ino_done = *i;
+    }
+    dropping_lock();
+    l.unlock();
+  }
+
+  bool links_done = false;
+  while (!links_done) {
+    l.lock();
+    got_lock();
+    compact_log_state_t& cs = *compact_state;
+    cs.ino_done = cs.ino_max;
+    unsigned n = 0;
+    auto d = dir_map.lower_bound(cs.link_done.first);
+    while (d != dir_map.end() && n < batch) {
+      auto& fm = d->second->file_map;
+      auto f = d->first == cs.link_done.first ?
+	fm.upper_bound(cs.link_done.second) : fm.begin();
+      for (; f != fm.end() && n < batch; ++f, ++n) {
+	auto key = make_pair(d->first, f->first);
+	if (!cs.links.count(key)) {
+	  t.op_dir_link(d->first, f->first, f->second->fnode.ino);
+	}
+	cs.link_done = key;
+      }
+      if (f != fm.end()) {
+	break;
+      }
+      ++d;
+    }
+    if (d == dir_map.end()) {
+      for (auto& p : cs.links) {
+	if (p.second) {
+	  t.op_dir_link(p.first.first, p.first.second, p.second);
+	}
+      }
+      links_done = true;
+    }
+    dropping_lock();
+    l.unlock();
+  }
 
   // conservative estimate for final encoded size
   new_log_jump_to = ROUND_UP_TO(t.op_bl.length() + super.block_size * 2,
                                 cct->_conf->bluefs_alloc_size);
-  t.op_jump(log_seq, new_log_jump_to);
+  t.op_jump(compact_state->seq, new_log_jump_to);
 
   bufferlist bl;
   ::encode(t, bl);
   _pad_bl(bl);
 
+  l.lock();
+  got_lock();
   dout(10) << __func__ << " new_log_jump_to 0x" << std::hex << new_log_jump_to
 	   << std::dec << dendl;
 
@@ -1361,7 +1495,9 @@ void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
   assert(r == 0);
 
   // 4. wait
+  dropping_lock();
   _flush_bdev_safely(new_log_writer);
+  got_lock();
 
   // 5. update our log fnode
   // discard first old_log_jump_to extents
@@ -1408,9 +1544,11 @@ void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
   ++super.version;
   _write_super();
 
+  dropping_lock();
   lock.unlock();
   flush_bdev();
   lock.lock();
+  got_lock();
 
   // 7. release old space
   dout(10) << __func__ << " release old log extents " << old_extents << dendl;
@@ -1427,10 +1565,39 @@ void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
   }
   new_log_writer = nullptr;
   new_log = nullptr;
+  compact_state.reset();
   log_cond.notify_all();
 
   dout(10) << __func__ << " log extents " << log_file->fnode.extents << dendl;
   logger->inc(l_bluefs_log_compactions);
+  dropping_lock();
+  logger->tinc(l_bluefs_log_compaction_lat,
+	       ceph::mono_clock::now() - start);
+  logger->tinc(l_bluefs_log_compaction_lock_lat, max_held);
+}
+
+void BlueFS::_compact_note_link(const string& dirname, const string& filename,
+				uint64_t ino)
+{
+  if (!compact_state) {
+    return;
+  }
+  auto key = make_pair(dirname, filename);
+  if (key <= compact_state->link_done) {
+    return;  // already dumped
+  }
+  // only the first change after the checkpoint tells us what it was
+  compact_state->links.emplace(key, ino);
+}
+
+void BlueFS::_compact_note_remove(File *f)
+{
+  if (!compact_state ||
+      f->fnode.ino > compact_state->ino_max ||
+      f->fnode.ino <= compact_state->ino_done) {
+    return;
+  }
+  compact_state->removed.emplace(f->fnode.ino, f->fnode);
 }
 
 void BlueFS::_pad_bl(bufferlist& bl)
@@ -1499,7 +1666,9 @@ int BlueFS::_flush_and_sync_log(std::unique_lock<std::mutex>& l,
   if (runway < (int64_t)cct->_conf->bluefs_min_log_runway) {
     dout(10) << __func__ << " allocating more log runway (0x"
 	     << std::hex << runway << std::dec  << " remaining)" << dendl;
-    while (new_log_writer) {
+    // the log fnode we would log now still has the extents the
+    // compaction is about to drop
+    while (new_log_writer || compact_state) {
       dout(10) << __func__ << " waiting for async compaction" << dendl;
       log_cond.wait(l);
     }
@@ -1629,8 +1798,7 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
       return r;
     }
     h->file->fnode.recalc_allocated();
-    if (cct->_conf->bluefs_preextend_wal_files &&
-	h->writer_type == WRITER_WAL) {
+    if (_should_preextend(h)) {
       // NOTE: this *requires* that rocksdb also has log recycling
       // enabled and is therefore doing robust CRCs on the log
       // records.  otherwise, we will fail to reply the rocksdb log
@@ -1764,6 +1932,7 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
     } else {
       bdev[p->bdev]->aio_write(p->offset + x_off, t, h->iocv[p->bdev], buffered);
     }
+    h->dirty_devs[p->bdev] = true;
     bloff += x_len;
     length -= x_len;
     ++p;
@@ -1867,6 +2036,12 @@ int BlueFS::_truncate(FileWriter *h, uint64_t offset)
   if (offset > h->file->fnode.size) {
     assert(0 == "truncate up not supported");
   }
+  if (_should_preextend(h)) {
+    // keep the preextended size so that the next user of this (recycled)
+    // WAL does not grow it again, one log update per sync.
+    dout(20) << __func__ << " keeping preextended WAL size" << dendl;
+    return 0;
+  }
   assert(h->file->fnode.size >= offset);
   h->file->fnode.size = offset;
   log_t.op_file_update(h->file->fnode);
@@ -1883,6 +2058,10 @@ int BlueFS::_fsync(FileWriter *h, std::unique_lock<std::mutex>& l)
 
   _flush_bdev_safely(h);
 
+  if (h->writer_type == WRITER_WAL) {
+    logger->inc(old_dirty_seq ? l_bluefs_wal_fsync_log_writes :
+		l_bluefs_wal_fsync_log_writes_saved);
+  }
   if (old_dirty_seq) {
     uint64_t s = log_seq;
     dout(20) << __func__ << " file metadata was dirty (" << old_dirty_seq
@@ -1896,28 +2075,50 @@ int BlueFS::_fsync(FileWriter *h, std::unique_lock<std::mutex>& l)
 
 void BlueFS::_flush_bdev_safely(FileWriter *h)
 {
+  // a file's sync only needs the devices its data went to, e.g. just
+  // the (pmem) WAL device for the rocksdb WAL
+  std::array<bool,MAX_BDEV> flush_devs = h->dirty_devs;
+  h->dirty_devs.fill(false);
+  if (h->file->fnode.ino == 1) {
+    // the log can make data that other files have flushed but not
+    // synced reachable, wherever it is
+    flush_devs.fill(true);
+  }
   if (!cct->_conf->bluefs_sync_write) {
     list<aio_t> completed_ios;
     _claim_completed_aios(h, &completed_ios);
     lock.unlock();
     wait_for_aio(h);
     completed_ios.clear();
-    flush_bdev();
+    flush_bdev(flush_devs);
     lock.lock();
   } else {
     lock.unlock();
-    flush_bdev();
+    flush_bdev(flush_devs);
     lock.lock();
   }
 }
 
 void BlueFS::flush_bdev()
+{
+  std::array<bool,MAX_BDEV> all;
+  all.fill(true);
+  flush_bdev(all);
+}
+
+void BlueFS::flush_bdev(const std::array<bool,MAX_BDEV>& dirty_bdevs)
 {
   // NOTE: this is safe to call without a lock.
+  static const int counters[MAX_BDEV] = {
+    l_bluefs_wal_flushes, l_bluefs_db_flushes, l_bluefs_slow_flushes
+  };
   dout(20) << __func__ << dendl;
-  for (auto p : bdev) {
-    if (p)
-      p->flush();
+  for (unsigned i = 0; i < MAX_BDEV; ++i) {
+    if (bdev[i] && dirty_bdevs[i]) {
+      bdev[i]->flush();
+      if (logger)
+	logger->inc(counters[i]);
+    }
   }
 }
 
@@ -1980,8 +2181,9 @@ int BlueFS::_allocate(uint8_t id, uint64_t len,
   return 0;
 }
 
-int BlueFS::_preallocate(FileRef f, uint64_t off, uint64_t len)
+int BlueFS::_preallocate(FileWriter *h, uint64_t off, uint64_t len)
 {
+  FileRef f = h->file;
   dout(10) << __func__ << " file " << f->fnode << " 0x"
 	   << std::hex << off << "~" << len << std::dec << dendl;
   if (f->deleted) {
@@ -1996,6 +2198,15 @@ int BlueFS::_preallocate(FileRef f, uint64_t off, uint64_t len)
     if (r < 0)
       return r;
     f->fnode.recalc_allocated();
+    if (_should_preextend(h)) {
+      // rocksdb preallocates its WAL in big chunks; extend the size along
+      // with the allocation so that appends within the chunk never need to
+      // log a new size.  see _flush_range.
+      f->fnode.size = f->fnode.get_allocated();
+      dout(10) << __func__ << " extending WAL size to 0x" << std::hex
+	       << f->fnode.size << std::dec << " to include allocated"
+	       << dendl;
+    }
     log_t.op_file_update(f->fnode);
   }
   return 0;
@@ -2055,6 +2266,7 @@ int BlueFS::open_for_write(
     file = new File;
     file->fnode.ino = ++ino_last;
     file_map[ino_last] = file;
+    _compact_note_link(dirname, filename, 0);
     dir->file_map[filename] = file;
     ++file->refs;
     create = true;
@@ -2203,6 +2415,9 @@ int BlueFS::rename(
   }
   DirRef new_dir = p->second;
   q = new_dir->file_map.find(new_filename);
+  _compact_note_link(new_dirname, new_filename,
+		     q != new_dir->file_map.end() ? q->second->fnode.ino : 0);
+  _compact_note_link(old_dirname, old_filename, file->fnode.ino);
   if (q != new_dir->file_map.end()) {
     dout(20) << __func__ << " dir " << new_dirname << " (" << old_dir
 	     << ") file " << new_filename
@@ -2314,6 +2529,7 @@ int BlueFS::lock_file(const string& dirname, const string& filename,
     file->fnode.ino = ++ino_last;
     file->fnode.mtime = ceph_clock_now();
     file_map[ino_last] = file;
+    _compact_note_link(dirname, filename, 0);
     dir->file_map[filename] = file;
     ++file->refs;
     log_t.op_file_update(file->fnode);
@@ -2392,6 +2608,7 @@ int BlueFS::unlink(const string& dirname, const string& filename)
              << " is locked" << dendl;
     return -EBUSY;
   }
+  _compact_note_link(dirname, filename, file->fnode.ino);
   dir->file_map.erase(filename);
   log_t.op_dir_unlink(dirname, filename);
   _drop_link(file);
@@ -2404,3 +2621,8 @@ bool BlueFS::wal_is_rotational()
     return true;
   return false;
 }
+
+bool BlueFS::wal_is_pmem()
+{
+  return bdev[BDEV_WAL] && bdev[BDEV_WAL]->is_pmem();
+}
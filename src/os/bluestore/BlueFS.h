@@ -5,6 +5,7 @@
 
 #include <atomic>
 #include <mutex>
+#include <memory>
 
 #include "bluefs_types.h"
 #include "common/RefCountedObj.h"
@@ -30,11 +31,18 @@ enum {
   l_bluefs_num_files,
   l_bluefs_log_bytes,
   l_bluefs_log_compactions,
+  l_bluefs_log_compaction_lat,
+  l_bluefs_log_compaction_lock_lat,
   l_bluefs_logged_bytes,
   l_bluefs_files_written_wal,
   l_bluefs_files_written_sst,
   l_bluefs_bytes_written_wal,
   l_bluefs_bytes_written_sst,
+  l_bluefs_wal_fsync_log_writes,
+  l_bluefs_wal_fsync_log_writes_saved,
+  l_bluefs_wal_flushes,
+  l_bluefs_db_flushes,
+  l_bluefs_slow_flushes,
   l_bluefs_last,
 };
 
@@ -126,6 +134,7 @@ public:
 
     std::mutex lock;
     std::array<IOContext*,MAX_BDEV> iocv; ///< for each bdev
+    std::array<bool,MAX_BDEV> dirty_devs; ///< written since the last flush
 
     FileWriter(FileRef f)
       : file(f),
@@ -134,6 +143,7 @@ public:
 			  g_conf->bluefs_alloc_size / CEPH_PAGE_SIZE)) {
       ++file->num_writers;
       iocv.fill(nullptr);
+      dirty_devs.fill(false);
     }
     // NOTE: caller must call BlueFS::close_writer()
     ~FileWriter() {
@@ -220,6 +230,8 @@ private:
 
   PerfCounters *logger = nullptr;
 
+  bool preextend_wal_disabled = false;  ///< see disable_preextend_wal()
+
   // cache
   mempool::bluefs::map<string, DirRef> dir_map;              ///< dirname -> Dir
   mempool::bluefs::unordered_map<uint64_t,FileRef> file_map; ///< ino -> File
@@ -241,6 +253,20 @@ private:
   FileRef new_log = nullptr;
   FileWriter *new_log_writer = nullptr;
 
+  /// progress of an async log compaction dump, see _compact_log_async()
+  struct compact_log_state_t {
+    uint64_t seq = 0;          ///< log_seq at the checkpoint
+    uint64_t ino_max = 0;      ///< ino_last at the checkpoint
+    uint64_t ino_done = 0;     ///< files up to this ino are dumped
+    pair<string,string> link_done;  ///< links up to this one are dumped
+    /// files removed after the checkpoint, before they were dumped
+    map<uint64_t,bluefs_fnode_t> removed;
+    /// links changed after the checkpoint, before they were dumped, and
+    /// the ino they pointed to at the checkpoint (0 if none)
+    map<pair<string,string>,uint64_t> links;
+  };
+  std::unique_ptr<compact_log_state_t> compact_state;
+
   /*
    * There are up to 3 block devices:
    *
@@ -268,6 +294,12 @@ private:
 
   int _allocate(uint8_t bdev, uint64_t len,
 		mempool::bluefs::vector<bluefs_extent_t> *ev);
+  /// WAL files are sized to their allocation; requires rocksdb log recycling
+  bool _should_preextend(FileWriter *h) const {
+    return h->writer_type == WRITER_WAL &&
+      !preextend_wal_disabled &&
+      cct->_conf->bluefs_preextend_wal_files;
+  }
   int _flush_range(FileWriter *h, uint64_t offset, uint64_t length);
   int _flush(FileWriter *h, bool force);
   int _fsync(FileWriter *h, std::unique_lock<std::mutex>& l);
@@ -283,13 +315,17 @@ private:
   void _compact_log_dump_metadata(bluefs_transaction_t *t);
   void _compact_log_sync();
   void _compact_log_async(std::unique_lock<std::mutex>& l);
+  void _compact_note_link(const string& dirname, const string& filename,
+			  uint64_t ino);
+  void _compact_note_remove(File *f);
 
   //void _aio_finish(void *priv);
 
   void _flush_bdev_safely(FileWriter *h);
   void flush_bdev();  // this is safe to call without a lock
+  void flush_bdev(const std::array<bool,MAX_BDEV>& dirty_bdevs);  // ditto
 
-  int _preallocate(FileRef f, uint64_t off, uint64_t len);
+  int _preallocate(FileWriter *h, uint64_t off, uint64_t len);
   int _truncate(FileWriter *h, uint64_t off);
 
   int _read(
@@ -346,6 +382,9 @@ public:
   uint64_t get_free(unsigned id);
   void get_usage(vector<pair<uint64_t,uint64_t>> *usage); // [<free,total> ...]
   void dump_perf_counters(Formatter *f);
+  PerfCounters *get_perf_counters() const {
+    return logger;
+  }
 
   void dump_block_extents(ostream& out);
 
@@ -378,6 +417,11 @@ public:
   int mkdir(const string& dirname);
   int rmdir(const string& dirname);
   bool wal_is_rotational();
+  bool wal_is_pmem();
+  /// our user cannot tell a preextended WAL file from a recycled one
+  void disable_preextend_wal() {
+    preextend_wal_disabled = true;
+  }
 
   bool dir_exists(const string& dirname);
   int stat(const string& dirname, const string& filename,
@@ -392,7 +436,8 @@ public:
   /// sync any uncommitted state to disk
   void sync_metadata();
 
-  int add_block_device(unsigned bdev, const string& path);
+  int add_block_device(unsigned bdev, const string& path,
+		       bool emulate_pmem = false);
   bool bdev_support_label(unsigned id);
   uint64_t get_block_device_size(unsigned bdev);
 
@@ -433,9 +478,9 @@ public:
     std::lock_guard<std::mutex> l(lock);
     _invalidate_cache(f, offset, len);
   }
-  int preallocate(FileRef f, uint64_t offset, uint64_t len) {
+  int preallocate(FileWriter *h, uint64_t offset, uint64_t len) {
     std::lock_guard<std::mutex> l(lock);
-    return _preallocate(f, offset, len);
+    return _preallocate(h, offset, len);
   }
   int truncate(FileWriter *h, uint64_t offset) {
     std::lock_guard<std::mutex> l(lock);
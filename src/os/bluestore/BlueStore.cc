@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <thread>
 
 #include "include/cpp-btree/btree_set.h"
 
@@ -861,6 +862,7 @@ void BlueStore::LRUCache::_touch_onode(OnodeRef& o)
   auto p = onode_lru.iterator_to(*o);
   onode_lru.erase(p);
   onode_lru.push_front(*o);
+  o->lru_stamp = ceph::coarse_mono_clock::now();
 }
 
 void BlueStore::LRUCache::_trim(uint64_t onode_max, uint64_t buffer_max)
@@ -893,39 +895,47 @@ void BlueStore::LRUCache::_trim(uint64_t onode_max, uint64_t buffer_max)
   auto p = onode_lru.end();
   assert(p != onode_lru.begin());
   --p;
+  auto now = ceph::coarse_mono_clock::now();
   int skipped = 0;
   int max_skipped = g_conf->bluestore_cache_trim_max_skip_pinned;
-  while (num > 0) {
+  size_t left = onode_lru.size();  // visit each onode at most once
+  while (num > 0 && left-- > 0) {
     Onode *o = &*p;
-    int refs = o->nref.load();
-    if (refs > 1) {
-      dout(20) << __func__ << "  " << o->oid << " has " << refs
-	       << " refs, skipping" << dendl;
-      if (++skipped >= max_skipped) {
-        dout(20) << __func__ << " maximum skip pinned reached; stopping with "
-                 << num << " left to trim" << dendl;
-        break;
-      }
-
-      if (p == onode_lru.begin()) {
-        break;
+    bool last = p == onode_lru.begin() || left == 0;
+    auto next = last ? p : std::prev(p);
+    if (o->lru_touched.exchange(false) && onode_max > 0) {
+      // apply the touch deferred by OnodeSpace::lookup()
+      dout(30) << __func__ << "  " << o->oid << " touched, requeue" << dendl;
+      onode_lru.erase(p);
+      onode_lru.push_front(*o);
+      o->lru_stamp = now;
+    } else {
+      o->get();  // paranoia
+      if (o->c->onode_map.try_remove(o)) {
+	dout(30) << __func__ << "  rm " << o->oid << dendl;
+	onode_lru.erase(p);
+	if (onode_max > 0) {
+	  logger->tinc(l_bluestore_onode_lru_age,
+		       to_timespan(now - o->lru_stamp));
+	}
+	o->put();
+	--num;
       } else {
-        p--;
-        num--;
-        continue;
+	dout(20) << __func__ << "  " << o->oid << " has " << o->nref.load() - 1
+		 << " refs, skipping" << dendl;
+	o->put();
+	if (++skipped >= max_skipped) {
+	  dout(20) << __func__ << " maximum skip pinned reached; stopping with "
+		   << num << " left to trim" << dendl;
+	  break;
+	}
+	--num;
       }
     }
-    dout(30) << __func__ << "  rm " << o->oid << dendl;
-    if (p != onode_lru.begin()) {
-      onode_lru.erase(p--);
-    } else {
-      onode_lru.erase(p);
-      assert(num == 1);
+    if (last) {
+      break;
     }
-    o->get();  // paranoia
-    o->c->onode_map.remove(o->oid);
-    o->put();
-    --num;
+    p = next;
   }
 }
 
@@ -955,11 +965,109 @@ void BlueStore::LRUCache::_audit(const char *when)
 #define dout_prefix *_dout << "bluestore.2QCache(" << this << ") "
 
 
+void BlueStore::TwoQCache::_add_onode(OnodeRef& o, int level)
+{
+  if (level <= 0) {
+    // the caller hints this is a one-time access (e.g., a scan): start at
+    // the cold end of warm_in and never earn a place in hot.
+    o->cache_private = ONODE_WARM_IN_SCAN;
+    onode_warm_in.push_back(*o);
+  } else if (_forget_onode(std::hash<ghobject_t>()(o->oid))) {
+    // we evicted it from warm_in recently; this is a real re-reference
+    dout(20) << __func__ << " " << o->oid << " warm_out -> hot" << dendl;
+    o->cache_private = ONODE_HOT;
+    onode_hot.push_front(*o);
+  } else {
+    o->cache_private = ONODE_WARM_IN;
+    onode_warm_in.push_front(*o);
+  }
+}
+
 void BlueStore::TwoQCache::_touch_onode(OnodeRef& o)
 {
-  auto p = onode_lru.iterator_to(*o);
-  onode_lru.erase(p);
-  onode_lru.push_front(*o);
+  o->lru_stamp = ceph::coarse_mono_clock::now();
+  switch (o->cache_private) {
+  case ONODE_WARM_IN:
+  case ONODE_WARM_IN_SCAN:
+    // do nothing, as with buffers
+    break;
+  case ONODE_HOT:
+    onode_hot.erase(onode_hot.iterator_to(*o));
+    onode_hot.push_front(*o);
+    break;
+  default:
+    assert(0 == "bad cache_private");
+  }
+}
+
+bool BlueStore::TwoQCache::_forget_onode(size_t h)
+{
+  auto p = onode_warm_out_map.find(h);
+  if (p == onode_warm_out_map.end()) {
+    return false;
+  }
+  onode_warm_out.erase(p->second);
+  onode_warm_out_map.erase(p);
+  return true;
+}
+
+void BlueStore::TwoQCache::_trim_onodes(onode_list_t& list, int num,
+					bool requeue_touched, bool trim_all,
+					int *skipped)
+{
+  if (num <= 0 || list.empty())
+    return;
+
+  auto p = list.end();
+  --p;
+  auto now = ceph::coarse_mono_clock::now();
+  int max_skipped = g_conf->bluestore_cache_trim_max_skip_pinned;
+  size_t left = list.size();  // visit each onode at most once
+  while (num > 0 && left-- > 0) {
+    Onode *o = &*p;
+    bool last = p == list.begin() || left == 0;
+    auto next = last ? p : std::prev(p);
+    if (o->lru_touched.exchange(false) && requeue_touched) {
+      // apply the touch deferred by OnodeSpace::lookup()
+      dout(30) << __func__ << "  " << o->oid << " touched, requeue" << dendl;
+      list.erase(p);
+      list.push_front(*o);
+      o->lru_stamp = now;
+    } else {
+      o->get();  // paranoia
+      if (o->c->onode_map.try_remove(o)) {
+	dout(30) << __func__ << "  rm " << o->oid << dendl;
+	list.erase(p);
+	if (!trim_all) {
+	  logger->tinc(l_bluestore_onode_lru_age,
+		       to_timespan(now - o->lru_stamp));
+	}
+	if (o->cache_private == ONODE_WARM_IN) {
+	  size_t h = std::hash<ghobject_t>()(o->oid);
+	  _forget_onode(h);
+	  onode_warm_out.push_front(h);
+	  onode_warm_out_map[h] = onode_warm_out.begin();
+	}
+	o->cache_private = ONODE_NEW;
+	o->put();
+	--num;
+      } else {
+	dout(20) << __func__ << "  " << o->oid << " has " << o->nref.load() - 1
+		 << " refs, skipping" << dendl;
+	o->put();
+	if (++(*skipped) >= max_skipped) {
+	  dout(20) << __func__ << " maximum skip pinned reached; stopping with "
+		   << num << " left to trim" << dendl;
+	  return;
+	}
+	--num;
+      }
+    }
+    if (last) {
+      break;
+    }
+    p = next;
+  }
 }
 
 void BlueStore::TwoQCache::_add_buffer(Buffer *b, int level, Buffer *near)
@@ -1082,7 +1190,8 @@ void BlueStore::TwoQCache::_adjust_buffer_size(Buffer *b, int64_t delta)
 
 void BlueStore::TwoQCache::_trim(uint64_t onode_max, uint64_t buffer_max)
 {
-  dout(20) << __func__ << " onodes " << onode_lru.size() << " / " << onode_max
+  dout(20) << __func__ << " onodes " << onode_hot.size() << " hot + "
+	   << onode_warm_in.size() << " warm / " << onode_max
 	   << " buffers " << buffer_bytes << " / " << buffer_max
 	   << dendl;
 
@@ -1182,47 +1291,32 @@ void BlueStore::TwoQCache::_trim(uint64_t onode_max, uint64_t buffer_max)
   }
 
   // onodes
-  int num = onode_lru.size() - onode_max;
-  if (num <= 0)
-    return; // don't even try
-
-  auto p = onode_lru.end();
-  assert(p != onode_lru.begin());
-  --p;
-  int skipped = 0;
-  int max_skipped = g_conf->bluestore_cache_trim_max_skip_pinned;
-  while (num > 0) {
-    Onode *o = &*p;
-    dout(20) << __func__ << " considering " << o << dendl;
-    int refs = o->nref.load();
-    if (refs > 1) {
-      dout(20) << __func__ << "  " << o->oid << " has " << refs
-	       << " refs; skipping" << dendl;
-      if (++skipped >= max_skipped) {
-        dout(20) << __func__ << " maximum skip pinned reached; stopping with "
-                 << num << " left to trim" << dendl;
-        break;
-      }
+  uint64_t onode_num = onode_hot.size() + onode_warm_in.size();
+  if (onode_num > onode_max) {
+    uint64_t kin = onode_max * cct->_conf->bluestore_2q_cache_kin_ratio;
+    uint64_t khot = onode_max - kin;
+    uint64_t kout = onode_max * cct->_conf->bluestore_2q_cache_kout_ratio;
 
-      if (p == onode_lru.begin()) {
-        break;
-      } else {
-        p--;
-        num--;
-        continue;
-      }
+    if (onode_hot.size() < khot) {
+      // hot is small, give slack to warm_in
+      kin += khot - onode_hot.size();
+    } else if (onode_warm_in.size() < kin) {
+      // warm_in is small, give slack to hot
+      khot += kin - onode_warm_in.size();
     }
-    dout(30) << __func__ << " " << o->oid << " num=" << num <<" lru size="<<onode_lru.size()<< dendl;
-    if (p != onode_lru.begin()) {
-      onode_lru.erase(p--);
-    } else {
-      onode_lru.erase(p);
-      assert(num == 1);
+
+    // warm_in is a fifo, so one-touch onodes from scans age out of it
+    // without ever disturbing hot
+    int skipped = 0;
+    _trim_onodes(onode_warm_in, (int64_t)onode_warm_in.size() - (int64_t)kin,
+		 false, onode_max == 0, &skipped);
+    _trim_onodes(onode_hot, (int64_t)onode_hot.size() - (int64_t)khot,
+		 onode_max > 0, onode_max == 0, &skipped);
+
+    while (onode_warm_out.size() > kout) {
+      onode_warm_out_map.erase(onode_warm_out.back());
+      onode_warm_out.pop_back();
     }
-    o->get();  // paranoia
-    o->c->onode_map.remove(o->oid);
-    o->put();
-    --num;
   }
 }
 
@@ -1511,9 +1605,11 @@ void BlueStore::BufferSpace::split(Cache* cache, size_t pos, BlueStore::BufferSp
 #undef dout_prefix
 #define dout_prefix *_dout << "bluestore.OnodeSpace(" << this << " in " << cache << ") "
 
-BlueStore::OnodeRef BlueStore::OnodeSpace::add(const ghobject_t& oid, OnodeRef o)
+BlueStore::OnodeRef BlueStore::OnodeSpace::add(const ghobject_t& oid,
+						OnodeRef o, int level)
 {
   std::lock_guard<std::recursive_mutex> l(cache->lock);
+  RWLock::WLocker wl(lock);
   auto p = onode_map.find(oid);
   if (p != onode_map.end()) {
     ldout(cache->cct, 30) << __func__ << " " << oid << " " << o
@@ -1523,25 +1619,30 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::add(const ghobject_t& oid, OnodeRef o
   }
   ldout(cache->cct, 30) << __func__ << " " << oid << " " << o << dendl;
   onode_map[oid] = o;
-  cache->_add_onode(o, 1);
+  cache->_add_onode(o, level);
   return o;
 }
 
-BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
+BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid,
+						   bool touch)
 {
   ldout(cache->cct, 30) << __func__ << dendl;
   OnodeRef o;
   bool hit = false;
 
   {
-    std::lock_guard<std::recursive_mutex> l(cache->lock);
+    RWLock::RLocker l(lock);
     ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.find(oid);
     if (p == onode_map.end()) {
       ldout(cache->cct, 30) << __func__ << " " << oid << " miss" << dendl;
     } else {
       ldout(cache->cct, 30) << __func__ << " " << oid << " hit " << p->second
 			    << dendl;
-      cache->_touch_onode(p->second);
+      // the trimmer applies the touch; avoid dirtying the line if we can
+      if (touch &&
+	  !p->second->lru_touched.load(std::memory_order_relaxed)) {
+	p->second->lru_touched = true;
+      }
       hit = true;
       o = p->second;
     }
@@ -1555,9 +1656,21 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
   return o;
 }
 
+bool BlueStore::OnodeSpace::try_remove(Onode *o)
+{
+  RWLock::WLocker l(lock);
+  // one ref for the map, one for the caller
+  if (o->nref.load() > 2) {
+    return false;
+  }
+  onode_map.erase(o->oid);
+  return true;
+}
+
 void BlueStore::OnodeSpace::clear()
 {
   std::lock_guard<std::recursive_mutex> l(cache->lock);
+  RWLock::WLocker wl(lock);
   ldout(cache->cct, 10) << __func__ << dendl;
   for (auto &p : onode_map) {
     cache->_rm_onode(p.second);
@@ -1567,7 +1680,7 @@ void BlueStore::OnodeSpace::clear()
 
 bool BlueStore::OnodeSpace::empty()
 {
-  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  RWLock::RLocker l(lock);
   return onode_map.empty();
 }
 
@@ -1578,6 +1691,7 @@ void BlueStore::OnodeSpace::rename(
   const mempool::bluestore_cache_other::string& new_okey)
 {
   std::lock_guard<std::recursive_mutex> l(cache->lock);
+  RWLock::WLocker wl(lock);
   ldout(cache->cct, 30) << __func__ << " " << old_oid << " -> " << new_oid
 			<< dendl;
   ceph::unordered_map<ghobject_t,OnodeRef>::iterator po, pn;
@@ -1609,6 +1723,7 @@ void BlueStore::OnodeSpace::rename(
 bool BlueStore::OnodeSpace::map_any(std::function<bool(OnodeRef)> f)
 {
   std::lock_guard<std::recursive_mutex> l(cache->lock);
+  RWLock::RLocker rl(lock);
   ldout(cache->cct, 20) << __func__ << dendl;
   for (auto& i : onode_map) {
     if (f(i.second)) {
@@ -1620,6 +1735,7 @@ bool BlueStore::OnodeSpace::map_any(std::function<bool(OnodeRef)> f)
 
 void BlueStore::OnodeSpace::dump(CephContext *cct, int lvl)
 {
+  RWLock::RLocker l(lock);
   for (auto& i : onode_map) {
     ldout(cct, lvl) << i.first << " : " << i.second << dendl;
   }
@@ -2005,6 +2121,9 @@ void BlueStore::ExtentMap::update(KeyValueDB::Transaction t,
 	       << " extents" << dendl;
       if (!force && len > cct->_conf->bluestore_extent_map_shard_max_size) {
 	request_reshard(0, OBJECT_MAX_SIZE);
+	if (len > 2 * cct->_conf->bluestore_extent_map_shard_max_size) {
+	  reshard_required = true;
+	}
 	return;
       }
     }
@@ -2037,7 +2156,8 @@ void BlueStore::ExtentMap::update(KeyValueDB::Transaction t,
 	encoded_shards.emplace_back(dirty_shard_t(&(*p)));
         bufferlist& bl = encoded_shards.back().bl;
 	if (encode_some(p->shard_info->offset, endoff - p->shard_info->offset,
-			bl, &p->extents)) {
+			bl, &p->extents,
+			onode->c->store->extent_map_segment_extents)) {
 	  if (force) {
 	    derr << __func__ << "  encode_some needs reshard" << dendl;
 	    assert(!force);
@@ -2054,6 +2174,9 @@ void BlueStore::ExtentMap::update(KeyValueDB::Transaction t,
 	  if (len > cct->_conf->bluestore_extent_map_shard_max_size) {
 	    // we are big; reshard ourselves
 	    request_reshard(p->shard_info->offset, endoff);
+	    if (len > 2 * cct->_conf->bluestore_extent_map_shard_max_size) {
+	      reshard_required = true;
+	    }
 	  }
 	  // avoid resharding the trailing shard, even if it is small
 	  else if (n != shards.end() &&
@@ -2126,6 +2249,11 @@ void BlueStore::ExtentMap::reshard(
 {
   auto cct = onode->c->store->cct; // used by dout
 
+  if (has_deferred_reshard()) {
+    request_reshard(deferred_reshard_begin, deferred_reshard_end);
+    deferred_reshard_begin = deferred_reshard_end = 0;
+  }
+
   dout(10) << __func__ << " 0x[" << std::hex << needs_reshard_begin << ","
 	   << needs_reshard_end << ")" << std::dec
 	   << " of " << onode->onode.extent_map_shards.size()
@@ -2390,7 +2518,8 @@ bool BlueStore::ExtentMap::encode_some(
   uint32_t offset,
   uint32_t length,
   bufferlist& bl,
-  unsigned *pn)
+  unsigned *pn,
+  unsigned segment_extents)
 {
   auto cct = onode->c->store->cct; //used by dout
   Extent dummy(offset);
@@ -2414,6 +2543,7 @@ bool BlueStore::ExtentMap::encode_some(
 	       << std::dec << " hit new spanning blob " << *p << dendl;
       request_reshard(p->blob_start(), p->blob_end());
       must_reshard = true;
+      reshard_required = true;
     }
     if (!must_reshard) {
       denc_varint(0, bound); // blobid
@@ -2434,14 +2564,58 @@ bool BlueStore::ExtentMap::encode_some(
 
   denc(struct_v, bound);
   denc_varint(0, bound); // number of extents
+  if (pn) {
+    *pn = n;
+  }
+
+  // n is the index of the extent within its segment; pos and prev_len
+  // are the end and length of the extent encoded before it
+  auto encode_extent = [&](Extent& e, unsigned n, uint64_t& pos,
+			   uint64_t& prev_len,
+			   bufferlist::contiguous_appender& app) {
+    unsigned blobid;
+    bool include_blob = false;
+    if (e.blob->is_spanning()) {
+      blobid = e.blob->id << BLOBID_SHIFT_BITS;
+      blobid |= BLOBID_FLAG_SPANNING;
+    } else if (e.blob->last_encoded_id < 0) {
+      e.blob->last_encoded_id = n + 1;  // so it is always non-zero
+      include_blob = true;
+      blobid = 0;  // the decoder will infer the id from n
+    } else {
+      blobid = e.blob->last_encoded_id << BLOBID_SHIFT_BITS;
+    }
+    if (e.logical_offset == pos) {
+      blobid |= BLOBID_FLAG_CONTIGUOUS;
+    }
+    if (e.blob_offset == 0) {
+      blobid |= BLOBID_FLAG_ZEROOFFSET;
+    }
+    if (e.length == prev_len) {
+      blobid |= BLOBID_FLAG_SAMELENGTH;
+    } else {
+      prev_len = e.length;
+    }
+    denc_varint(blobid, app);
+    if ((blobid & BLOBID_FLAG_CONTIGUOUS) == 0) {
+      denc_varint_lowz(e.logical_offset - pos, app);
+    }
+    if ((blobid & BLOBID_FLAG_ZEROOFFSET) == 0) {
+      denc_varint_lowz(e.blob_offset, app);
+    }
+    if ((blobid & BLOBID_FLAG_SAMELENGTH) == 0) {
+      denc_varint_lowz(e.length, app);
+    }
+    pos = e.logical_end();
+    if (include_blob) {
+      e.blob->encode(app, struct_v, e.blob->shared_blob->get_sbid(), false);
+    }
+  };
 
-  {
+  if (!segment_extents || n <= segment_extents) {
     auto app = bl.get_contiguous_appender(bound);
     denc(struct_v, app);
     denc_varint(n, app);
-    if (pn) {
-      *pn = n;
-    }
 
     n = 0;
     uint64_t pos = 0;
@@ -2449,56 +2623,72 @@ bool BlueStore::ExtentMap::encode_some(
     for (auto p = start;
 	 p != extent_map.end() && p->logical_offset < end;
 	 ++p, ++n) {
-      unsigned blobid;
-      bool include_blob = false;
-      if (p->blob->is_spanning()) {
-	blobid = p->blob->id << BLOBID_SHIFT_BITS;
-	blobid |= BLOBID_FLAG_SPANNING;
-      } else if (p->blob->last_encoded_id < 0) {
-	p->blob->last_encoded_id = n + 1;  // so it is always non-zero
-	include_blob = true;
-	blobid = 0;  // the decoder will infer the id from n
-      } else {
-	blobid = p->blob->last_encoded_id << BLOBID_SHIFT_BITS;
-      }
-      if (p->logical_offset == pos) {
-	blobid |= BLOBID_FLAG_CONTIGUOUS;
-      }
-      if (p->blob_offset == 0) {
-	blobid |= BLOBID_FLAG_ZEROOFFSET;
-      }
-      if (p->length == prev_len) {
-	blobid |= BLOBID_FLAG_SAMELENGTH;
-      } else {
-	prev_len = p->length;
-      }
-      denc_varint(blobid, app);
-      if ((blobid & BLOBID_FLAG_CONTIGUOUS) == 0) {
-	denc_varint_lowz(p->logical_offset - pos, app);
-      }
-      if ((blobid & BLOBID_FLAG_ZEROOFFSET) == 0) {
-	denc_varint_lowz(p->blob_offset, app);
-      }
-      if ((blobid & BLOBID_FLAG_SAMELENGTH) == 0) {
-	denc_varint_lowz(p->length, app);
+      encode_extent(*p, n, pos, prev_len, app);
+    }
+    return false;
+  }
+
+  // Version 3 splits the extents into segments that each start a new
+  // blob id space and offset base, preceded by an index of (logical
+  // offset, end of the segment's encoding) pairs, so that a reader can
+  // decode just the segments it needs.  A segment may only start where
+  // no blob of the previous ones is used any more.
+  segment_extents = std::max(segment_extents,
+			     (n + MAX_SEGMENTS - 1) / MAX_SEGMENTS);
+  vector<pair<uint32_t,uint32_t>> index;
+  bufferlist body;
+  {
+    auto app = body.get_contiguous_appender(bound);
+    unsigned seg_n = 0;
+    uint64_t pos = 0;
+    uint64_t prev_len = 0;
+    uint32_t blobs_end = 0;  // end of the blobs used so far
+    for (auto p = start;
+	 p != extent_map.end() && p->logical_offset < end;
+	 ++p, ++seg_n) {
+      if (index.empty() ||
+	  (seg_n >= segment_extents && p->logical_offset >= blobs_end)) {
+	if (!index.empty()) {
+	  index.back().second = app.get_logical_offset();
+	}
+	index.emplace_back(p->logical_offset, 0);
+	seg_n = 0;
+	pos = p->logical_offset;
+	prev_len = 0;
       }
-      pos = p->logical_end();
-      if (include_blob) {
-	p->blob->encode(app, struct_v, p->blob->shared_blob->get_sbid(), false);
+      encode_extent(*p, seg_n, pos, prev_len, app);
+      if (!p->blob->is_spanning()) {
+	blobs_end = std::max(blobs_end, p->blob_end());
       }
     }
+    index.back().second = app.get_logical_offset();
   }
-  /*derr << __func__ << bl << dendl;
-  derr << __func__ << ":";
-  bl.hexdump(*_dout);
-  *_dout << dendl;
-  */
+  dout(30) << __func__ << " 0x" << std::hex << offset << "~" << length
+	   << std::dec << " " << n << " extents in " << index.size()
+	   << " segments" << dendl;
+
+  __u8 segmented_v = 3;
+  size_t header_bound = 0;
+  denc(segmented_v, header_bound);
+  denc_varint(n, header_bound);
+  denc_varint(index.size(), header_bound);
+  header_bound += index.size() * 2 * sizeof(uint32_t);
+  {
+    auto app = bl.get_contiguous_appender(header_bound);
+    denc(segmented_v, app);
+    denc_varint(n, app);
+    denc_varint(index.size(), app);
+    for (auto& i : index) {
+      denc(i.first, app);
+      denc(i.second, app);
+    }
+  }
+  bl.claim_append(body);
   return false;
 }
 
 unsigned BlueStore::ExtentMap::decode_some(bufferlist& bl)
 {
-  auto cct = onode->c->store->cct; //used by dout
   /*
   derr << __func__ << ":";
   bl.hexdump(*_dout);
@@ -2516,8 +2706,19 @@ unsigned BlueStore::ExtentMap::decode_some(bufferlist& bl)
 
   uint32_t num;
   denc_varint(num, p);
+  unsigned n = decode_extents(p, struct_v, 0, num);
+  assert(n == num);
+  return num;
+}
+
+unsigned BlueStore::ExtentMap::decode_extents(
+  bufferptr::iterator& p,
+  __u8 struct_v,
+  uint64_t pos,
+  unsigned num)
+{
+  auto cct = onode->c->store->cct; //used by dout
   vector<BlobRef> blobs(num);
-  uint64_t pos = 0;
   uint64_t prev_len = 0;
   unsigned n = 0;
 
@@ -2568,9 +2769,90 @@ unsigned BlueStore::ExtentMap::decode_some(bufferlist& bl)
     ++n;
     extent_map.insert(*le);
   }
+  return n;
+}
 
-  assert(n == num);
-  return num;
+void BlueStore::ExtentMap::decode_segments(
+  Shard *s,
+  uint32_t begin,
+  uint32_t end)
+{
+  auto cct = onode->c->store->cct; //used by dout
+  const bufferptr& bp = s->encoded.front();
+  auto p = bp.begin_deep();
+  __u8 struct_v;
+  denc(struct_v, p);
+  uint32_t num;
+  denc_varint(num, p);
+  if (struct_v < 3) {
+    s->extents = decode_some(s->encoded);
+    s->loaded = true;
+    onode->c->store->logger->inc(l_bluestore_onode_shard_decode_bytes,
+				 s->encoded.length());
+    s->encoded.clear();
+    return;
+  }
+
+  assert(struct_v == 3);
+  uint32_t nseg;
+  denc_varint(nseg, p);
+  assert(nseg > 0 && nseg <= MAX_SEGMENTS);
+  auto index = p;
+  p.advance(nseg * 2 * sizeof(uint32_t));
+  size_t body = p.get_offset();
+  auto seg_offset = [&](unsigned i) {
+    auto q = index;
+    q.advance(i * 2 * sizeof(uint32_t));
+    uint32_t v;
+    denc(v, q);
+    return v;
+  };
+  auto seg_end = [&](unsigned i) {
+    auto q = index;
+    q.advance(i * 2 * sizeof(uint32_t) + sizeof(uint32_t));
+    uint32_t v;
+    denc(v, q);
+    return v;
+  };
+  // the last segment starting at or before an offset holds it
+  auto find_segment = [&](uint32_t offset) {
+    unsigned left = 0, right = nseg;
+    while (right - left > 1) {
+      unsigned mid = left + (right - left) / 2;
+      if (seg_offset(mid) <= offset) {
+	left = mid;
+      } else {
+	right = mid;
+      }
+    }
+    return left;
+  };
+
+  unsigned first = find_segment(begin);
+  unsigned last = end > begin ? find_segment(end - 1) : first;
+  for (unsigned i = first; i <= last; ++i) {
+    if (s->segments_loaded & (1ull << i)) {
+      continue;
+    }
+    uint32_t from = i ? seg_end(i - 1) : 0;
+    uint32_t to = seg_end(i);
+    bufferptr seg(bp, body + from, to - from);
+    auto sp = seg.begin_deep();
+    unsigned n = decode_extents(sp, 2, seg_offset(i), num);
+    dout(30) << __func__ << " shard 0x" << std::hex << s->shard_info->offset
+	     << " segment 0x" << seg_offset(i) << std::dec << " " << n
+	     << " extents (" << (to - from) << " bytes)" << dendl;
+    s->segments_loaded |= 1ull << i;
+    onode->c->store->logger->inc(l_bluestore_onode_shard_decode_bytes,
+				 to - from);
+  }
+  if (s->segments_loaded ==
+      (nseg == MAX_SEGMENTS ? ~0ull : (1ull << nseg) - 1)) {
+    s->extents = num;
+    s->loaded = true;
+    s->encoded.clear();
+    s->segments_loaded = 0;
+  }
 }
 
 void BlueStore::ExtentMap::bound_encode_spanning_blobs(size_t& p)
@@ -2643,7 +2925,8 @@ void BlueStore::ExtentMap::init_shards(bool loaded, bool dirty)
 void BlueStore::ExtentMap::fault_range(
   KeyValueDB *db,
   uint32_t offset,
-  uint32_t length)
+  uint32_t length,
+  bool for_read)
 {
   auto cct = onode->c->store->cct; //used by dout
   dout(30) << __func__ << " 0x" << std::hex << offset << "~" << length
@@ -2659,14 +2942,18 @@ void BlueStore::ExtentMap::fault_range(
   while (start <= last) {
     assert((size_t)start < shards.size());
     auto p = &shards[start];
-    if (!p->loaded) {
+    if (p->loaded) {
+      onode->c->store->logger->inc(l_bluestore_onode_shard_hits);
+    } else if (p->encoded.length()) {
+      // partly decoded by an earlier read
+      onode->c->store->logger->inc(l_bluestore_onode_shard_hits);
+    } else {
       dout(30) << __func__ << " opening shard 0x" << std::hex
 	       << p->shard_info->offset << std::dec << dendl;
-      bufferlist v;
       generate_extent_shard_key_and_apply(
 	onode->key, p->shard_info->offset, &key,
         [&](const string& final_key) {
-          int r = db->get(PREFIX_OBJ, final_key, &v);
+          int r = db->get(PREFIX_OBJ, final_key, &p->encoded);
           if (r < 0) {
 	    derr << __func__ << " missing shard 0x" << std::hex
 		 << p->shard_info->offset << std::dec << " for " << onode->oid
@@ -2675,16 +2962,20 @@ void BlueStore::ExtentMap::fault_range(
           }
         }
       );
-      p->extents = decode_some(v);
-      p->loaded = true;
       dout(20) << __func__ << " open shard 0x" << std::hex
 	       << p->shard_info->offset << std::dec
-	       << " (" << v.length() << " bytes)" << dendl;
+	       << " (" << p->encoded.length() << " bytes)" << dendl;
       assert(p->dirty == false);
-      assert(v.length() == p->shard_info->bytes);
+      assert(p->encoded.length() == p->shard_info->bytes);
+      p->encoded.reassign_to_mempool(mempool::mempool_bluestore_cache_other);
       onode->c->store->logger->inc(l_bluestore_onode_shard_misses);
-    } else {
-      onode->c->store->logger->inc(l_bluestore_onode_shard_hits);
+    }
+    if (!p->loaded) {
+      if (for_read) {
+	decode_segments(p, offset, offset + length);
+      } else {
+	decode_segments(p, 0, OBJECT_MAX_SIZE);
+      }
     }
     ++start;
   }
@@ -3212,7 +3503,8 @@ uint64_t BlueStore::Collection::make_blob_unshared(SharedBlob *sb)
 
 BlueStore::OnodeRef BlueStore::Collection::get_onode(
   const ghobject_t& oid,
-  bool create)
+  bool create,
+  bool promote)
 {
   assert(create ? lock.is_wlocked() : lock.is_locked());
 
@@ -3225,7 +3517,7 @@ BlueStore::OnodeRef BlueStore::Collection::get_onode(
     }
   }
 
-  OnodeRef o = onode_map.lookup(oid);
+  OnodeRef o = onode_map.lookup(oid, promote);
   if (o)
     return o;
 
@@ -3270,7 +3562,7 @@ BlueStore::OnodeRef BlueStore::Collection::get_onode(
     }
   }
   o.reset(on);
-  return onode_map.add(oid, o);
+  return onode_map.add(oid, o, promote ? 1 : 0);
 }
 
 void BlueStore::Collection::split_cache(
@@ -3282,6 +3574,8 @@ void BlueStore::Collection::split_cache(
   std::lock(cache->lock, dest->cache->lock);
   std::lock_guard<std::recursive_mutex> l(cache->lock, std::adopt_lock);
   std::lock_guard<std::recursive_mutex> l2(dest->cache->lock, std::adopt_lock);
+  RWLock::WLocker ml(onode_map.lock);
+  RWLock::WLocker ml2(dest->onode_map.lock);
 
   int destbits = dest->cnode.bits;
   spg_t destpg;
@@ -3361,6 +3655,15 @@ void *BlueStore::MempoolThread::entry()
     }
 
     float bytes_per_onode = (float)meta_bytes / (float)onode_num;
+    if (store->cct->_conf->get_val<bool>("bluestore_cache_autotune")) {
+      utime_t now = ceph_clock_now();
+      double interval =
+	store->cct->_conf->get_val<double>("bluestore_cache_autotune_interval");
+      if ((double)(now - store->cache_tune_stamp) >= interval) {
+	store->_tune_cache_ratios(bytes_per_onode);
+      }
+    }
+
     size_t num_shards = store->cache_shards.size();
     float target_ratio = store->cache_meta_ratio + store->cache_data_ratio;
     // A little sloppy but should be close enough
@@ -3374,6 +3677,10 @@ void *BlueStore::MempoolThread::entry()
     }
 
     store->_update_cache_logger();
+    if (store->alloc) {
+      store->logger->set(l_bluestore_fragmentation,
+	(uint64_t)(store->alloc->get_fragmentation() * 1000000));
+    }
 
     utime_t wait;
     wait += store->cct->_conf->bluestore_cache_trim_interval;
@@ -3506,9 +3813,8 @@ BlueStore::BlueStore(CephContext *cct, const string& path)
 		       cct->_conf->bluestore_throttle_bytes +
 		       cct->_conf->bluestore_throttle_deferred_bytes),
     deferred_finisher(cct, "defered_finisher", "dfin"),
-    kv_sync_thread(this),
-    kv_finalize_thread(this),
-    mempool_thread(this)
+    mempool_thread(this),
+    reshard_thread(this)
 {
   _init_logger();
   cct->_conf->add_observer(this);
@@ -3525,11 +3831,10 @@ BlueStore::BlueStore(CephContext *cct,
 		       cct->_conf->bluestore_throttle_bytes +
 		       cct->_conf->bluestore_throttle_deferred_bytes),
     deferred_finisher(cct, "defered_finisher", "dfin"),
-    kv_sync_thread(this),
-    kv_finalize_thread(this),
     min_alloc_size(_min_alloc_size),
     min_alloc_size_order(ctz(_min_alloc_size)),
-    mempool_thread(this)
+    mempool_thread(this),
+    reshard_thread(this)
 {
   _init_logger();
   cct->_conf->add_observer(this);
@@ -3569,13 +3874,21 @@ const char **BlueStore::get_tracked_conf_keys() const
     "bluestore_compression_max_blob_size_ssd",
     "bluestore_compression_max_blob_size_hdd",
     "bluestore_compression_required_ratio",
+    "bluestore_compression_queue_max",
+    "bluestore_compression_estimator_history",
+    "bluestore_compression_estimator_probe",
+    "bluestore_compression_entropy_sample",
+    "bluestore_compression_entropy_max",
     "bluestore_max_alloc_size",
     "bluestore_prefer_deferred_size",
     "bluestore_prefer_deferred_size_hdd",
     "bluestore_prefer_deferred_size_ssd",
+    "bluestore_prefer_deferred_size_pmem",
     "bluestore_deferred_batch_ops",
     "bluestore_deferred_batch_ops_hdd",
     "bluestore_deferred_batch_ops_ssd",
+    "bluestore_deferred_aggregate",
+    "bluestore_deferred_max_delay",
     "bluestore_throttle_bytes",
     "bluestore_throttle_deferred_bytes",
     "bluestore_throttle_cost_per_io_hdd",
@@ -3584,6 +3897,8 @@ const char **BlueStore::get_tracked_conf_keys() const
     "bluestore_max_blob_size",
     "bluestore_max_blob_size_ssd",
     "bluestore_max_blob_size_hdd",
+    "bluestore_extent_map_shard_segment_extents",
+    "bluestore_extent_map_reshard_deferred",
     NULL
   };
   return KEYS;
@@ -3598,11 +3913,19 @@ void BlueStore::handle_conf_change(const struct md_config_t *conf,
   if (changed.count("bluestore_compression_mode") ||
       changed.count("bluestore_compression_algorithm") ||
       changed.count("bluestore_compression_min_blob_size") ||
-      changed.count("bluestore_compression_max_blob_size")) {
+      changed.count("bluestore_compression_max_blob_size") ||
+      changed.count("bluestore_compression_estimator_history") ||
+      changed.count("bluestore_compression_estimator_probe") ||
+      changed.count("bluestore_compression_entropy_sample") ||
+      changed.count("bluestore_compression_entropy_max")) {
     if (bdev) {
       _set_compression();
     }
   }
+  if (changed.count("bluestore_compression_queue_max")) {
+    compress_queue_max =
+      cct->_conf->get_val<uint64_t>("bluestore_compression_queue_max");
+  }
   if (changed.count("bluestore_max_blob_size") ||
       changed.count("bluestore_max_blob_size_ssd") ||
       changed.count("bluestore_max_blob_size_hdd")) {
@@ -3611,13 +3934,20 @@ void BlueStore::handle_conf_change(const struct md_config_t *conf,
       _set_blob_size();
     }
   }
+  if (changed.count("bluestore_extent_map_shard_segment_extents") ||
+      changed.count("bluestore_extent_map_reshard_deferred")) {
+    _set_extent_map_params();
+  }
   if (changed.count("bluestore_prefer_deferred_size") ||
       changed.count("bluestore_prefer_deferred_size_hdd") ||
       changed.count("bluestore_prefer_deferred_size_ssd") ||
+      changed.count("bluestore_prefer_deferred_size_pmem") ||
       changed.count("bluestore_max_alloc_size") ||
       changed.count("bluestore_deferred_batch_ops") ||
       changed.count("bluestore_deferred_batch_ops_hdd") ||
-      changed.count("bluestore_deferred_batch_ops_ssd")) {
+      changed.count("bluestore_deferred_batch_ops_ssd") ||
+      changed.count("bluestore_deferred_aggregate") ||
+      changed.count("bluestore_deferred_max_delay")) {
     if (bdev) {
       // only after startup
       _set_alloc_sizes();
@@ -3656,6 +3986,16 @@ void BlueStore::_set_compression()
 
   compressor = nullptr;
 
+  // pools may enable compression even if the store default is none
+  comp_estimator_history =
+    cct->_conf->get_val<uint64_t>("bluestore_compression_estimator_history");
+  comp_estimator_probe =
+    cct->_conf->get_val<uint64_t>("bluestore_compression_estimator_probe");
+  comp_entropy_sample =
+    cct->_conf->get_val<uint64_t>("bluestore_compression_entropy_sample");
+  comp_entropy_max =
+    cct->_conf->get_val<double>("bluestore_compression_entropy_max");
+
   if (comp_mode == Compressor::COMP_NONE) {
     dout(10) << __func__ << " compression mode set to 'none', "
              << "ignore other compression setttings" << dendl;
@@ -3742,6 +4082,25 @@ void BlueStore::_set_blob_size()
            << std::dec << dendl;
 }
 
+void BlueStore::_set_extent_map_params()
+{
+  extent_map_segment_extents = std::min<uint64_t>(
+    cct->_conf->get_val<uint64_t>("bluestore_extent_map_shard_segment_extents"),
+    std::numeric_limits<unsigned>::max());
+  if (extent_map_segment_extents &&
+      compat_ondisk_format < segmented_shards_ondisk_format) {
+    // older releases cannot decode them; _open_super_meta raises
+    // min_compat_ondisk_format first
+    dout(1) << __func__ << " segmented extent map shards take effect"
+	    << " on the next mount" << dendl;
+    extent_map_segment_extents = 0;
+  }
+  extent_map_reshard_deferred =
+    cct->_conf->get_val<bool>("bluestore_extent_map_reshard_deferred");
+  dout(10) << __func__ << " segment_extents " << extent_map_segment_extents
+	   << " reshard_deferred " << extent_map_reshard_deferred << dendl;
+}
+
 int BlueStore::_set_cache_sizes()
 {
   assert(bdev);
@@ -3847,6 +4206,8 @@ void BlueStore::_init_logger()
   b.add_time_avg(l_bluestore_kv_lat, "kv_lat",
 		 "Average kv_thread sync latency",
 		 "k_l", PerfCountersBuilder::PRIO_INTERESTING);
+  b.add_u64_counter(l_bluestore_kv_flushes, "kv_flushes",
+		    "kv_thread flushes of the main device");
   b.add_time_avg(l_bluestore_state_prepare_lat, "state_prepare_lat",
     "Average prepare state latency");
   b.add_time_avg(l_bluestore_state_aio_wait_lat, "state_aio_wait_lat",
@@ -3886,6 +4247,10 @@ void BlueStore::_init_logger()
     "Average read onode metadata latency");
   b.add_time_avg(l_bluestore_read_wait_aio_lat, "read_wait_aio_lat",
     "Average read latency");
+  b.add_u64_counter(l_bluestore_read_zero_copy_bytes, "read_zero_copy_bytes",
+    "Sum for bytes read straight from device or cache buffers");
+  b.add_u64_counter(l_bluestore_read_copy_bytes, "read_copy_bytes",
+    "Sum for bytes read into newly allocated buffers (decompressed)");
   b.add_time_avg(l_bluestore_compress_lat, "compress_lat",
     "Average compress latency");
   b.add_time_avg(l_bluestore_decompress_lat, "decompress_lat",
@@ -3896,12 +4261,40 @@ void BlueStore::_init_logger()
     "Sum for beneficial compress ops");
   b.add_u64_counter(l_bluestore_compress_rejected_count, "compress_rejected_count",
     "Sum for compress ops rejected due to low net gain of space");
+  b.add_u64_counter(l_bluestore_compress_attempt_count, "compress_attempt_count",
+    "Sum for blobs we tried to compress");
+  b.add_u64_counter(l_bluestore_compress_skipped_count, "compress_skipped_count",
+    "Sum for blobs not compressed because they were predicted incompressible");
+  b.add_u64_counter(l_bluestore_compress_saturated_count,
+    "compress_saturated_count",
+    "Sum for blobs stored uncompressed because the compress queue was full");
+  b.add_u64(l_bluestore_compress_queue_depth, "compress_queue_depth",
+    "Blobs waiting for a compression thread");
+  b.add_time_avg(l_bluestore_compress_cpu_lat, "compress_cpu_lat",
+    "Average CPU time spent compressing a blob");
   b.add_u64_counter(l_bluestore_write_pad_bytes, "write_pad_bytes",
     "Sum for write-op padded bytes");
   b.add_u64_counter(l_bluestore_deferred_write_ops, "deferred_write_ops",
 		    "Sum for deferred write op");
   b.add_u64_counter(l_bluestore_deferred_write_bytes, "deferred_write_bytes",
 		    "Sum for deferred write bytes", "def");
+  b.add_u64_counter(l_bluestore_deferred_aggregate_ops, "deferred_aggregate_ops",
+		    "Sum for aggregated deferred submissions");
+  b.add_u64_counter(l_bluestore_deferred_aggregate_batches,
+		    "deferred_aggregate_batches",
+		    "Sum for sequencer batches merged into aggregated submissions");
+  b.add_u64_counter(l_bluestore_deferred_aggregate_writes_in,
+		    "deferred_aggregate_writes_in",
+		    "Sum for writes the merged batches would have issued alone");
+  b.add_u64_counter(l_bluestore_deferred_aggregate_writes_out,
+		    "deferred_aggregate_writes_out",
+		    "Sum for writes issued by aggregated submissions");
+  b.add_u64_counter(l_bluestore_deferred_aggregate_seek_in,
+		    "deferred_aggregate_seek_in",
+		    "Sum for bytes of seek distance the merged batches would have covered alone");
+  b.add_u64_counter(l_bluestore_deferred_aggregate_seek_out,
+		    "deferred_aggregate_seek_out",
+		    "Sum for bytes of seek distance covered by aggregated submissions");
   b.add_u64_counter(l_bluestore_write_penalty_read_ops, "write_penalty_read_ops",
 		    "Sum for write penalty read ops");
   b.add_u64(l_bluestore_allocated, "bluestore_allocated",
@@ -3921,11 +4314,16 @@ void BlueStore::_init_logger()
 		    "Sum for onode-lookups hit in the cache");
   b.add_u64_counter(l_bluestore_onode_misses, "bluestore_onode_misses",
 		    "Sum for onode-lookups missed in the cache");
+  b.add_time_avg(l_bluestore_onode_lru_age, "bluestore_onode_lru_age",
+		 "Average time trimmed onodes had gone unused in the cache");
   b.add_u64_counter(l_bluestore_onode_shard_hits, "bluestore_onode_shard_hits",
 		    "Sum for onode-shard lookups hit in the cache");
   b.add_u64_counter(l_bluestore_onode_shard_misses,
 		    "bluestore_onode_shard_misses",
 		    "Sum for onode-shard lookups missed in the cache");
+  b.add_u64_counter(l_bluestore_onode_shard_decode_bytes,
+		    "bluestore_onode_shard_decode_bytes",
+		    "Sum for bytes of onode-shard extents decoded");
   b.add_u64(l_bluestore_extents, "bluestore_extents",
 	    "Number of extents in cache");
   b.add_u64(l_bluestore_blobs, "bluestore_blobs",
@@ -3965,6 +4363,9 @@ void BlueStore::_init_logger()
   b.add_u64_counter(l_bluestore_txc, "bluestore_txc", "Transactions committed");
   b.add_u64_counter(l_bluestore_onode_reshard, "bluestore_onode_reshard",
 		    "Onode extent map reshard events");
+  b.add_u64_counter(l_bluestore_onode_reshard_deferred,
+		    "bluestore_onode_reshard_deferred",
+		    "Onode extent map reshards left to the reshard thread");
   b.add_u64_counter(l_bluestore_blob_split, "bluestore_blob_split",
 		    "Sum for blob splitting due to resharding");
   b.add_u64_counter(l_bluestore_extent_compress, "bluestore_extent_compress",
@@ -3974,6 +4375,18 @@ void BlueStore::_init_logger()
 		    "collection");
   b.add_u64_counter(l_bluestore_read_eio, "bluestore_read_eio",
                     "Read EIO errors propagated to high level callers");
+  b.add_u64(l_bluestore_cache_meta_target, "bluestore_cache_meta_target",
+	    "Bytes of cache devoted to onode metadata");
+  b.add_u64(l_bluestore_cache_data_target, "bluestore_cache_data_target",
+	    "Bytes of cache devoted to object data buffers");
+  b.add_u64(l_bluestore_cache_kv_target, "bluestore_cache_kv_target",
+	    "Bytes of cache devoted to the kv database");
+  b.add_u64_counter(l_bluestore_cache_autotune_moves,
+		    "bluestore_cache_autotune_moves",
+		    "Chunks of memory moved between caches by the autotuner");
+  b.add_u64(l_bluestore_fragmentation, "bluestore_fragmentation_micros",
+	    "How fragmented free space is (0 = contiguous, 1000000 = "
+	    "all single blocks)");
   logger = b.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
 }
@@ -4142,6 +4555,11 @@ void BlueStore::_set_alloc_sizes(void)
 
   if (cct->_conf->bluestore_prefer_deferred_size) {
     prefer_deferred_size = cct->_conf->bluestore_prefer_deferred_size;
+  } else if (bluefs && bluefs->wal_is_pmem()) {
+    // the kv commit, and with it a deferred write, only costs a cache
+    // line flush to the pmem wal; the main device is written later.
+    prefer_deferred_size =
+      cct->_conf->get_val<uint64_t>("bluestore_prefer_deferred_size_pmem");
   } else {
     assert(bdev);
     if (bdev->is_rotational()) {
@@ -4161,6 +4579,10 @@ void BlueStore::_set_alloc_sizes(void)
       deferred_batch_ops = cct->_conf->bluestore_deferred_batch_ops_ssd;
     }
   }
+  deferred_aggregate =
+    cct->_conf->get_val<bool>("bluestore_deferred_aggregate");
+  deferred_max_delay =
+    cct->_conf->get_val<double>("bluestore_deferred_max_delay");
 
   dout(10) << __func__ << " min_alloc_size 0x" << std::hex << min_alloc_size
 	   << std::dec << " order " << min_alloc_size_order
@@ -4168,6 +4590,8 @@ void BlueStore::_set_alloc_sizes(void)
 	   << " prefer_deferred_size 0x" << prefer_deferred_size
 	   << std::dec
 	   << " deferred_batch_ops " << deferred_batch_ops
+	   << " deferred_aggregate " << deferred_aggregate
+	   << " deferred_max_delay " << deferred_max_delay
 	   << dendl;
 }
 
@@ -4363,11 +4787,140 @@ int BlueStore::_open_alloc()
 void BlueStore::_close_alloc()
 {
   assert(alloc);
+  _alloc_trace_stop();
   alloc->shutdown();
   delete alloc;
   alloc = NULL;
 }
 
+// Allocation trace, replayed by ceph_perf_allocator.  One record per
+// line, numbers in hex except the timestamp (usec since trace start):
+//
+//  H <version> <device size> <block size> <min_alloc_size> <allocator>
+//  F <offset> <length>              free extent when the trace started
+//  A <usec> <want> <unit> <max> <hint> <got> [<offset>~<length> ...]
+//  R <usec> [<offset>~<length> ...]
+//
+// Allocator calls are serialized on alloc_trace_lock while a trace is
+// running so that the records are in the order the allocator saw them.
+// The others count themselves in alloc_untraced, and set_alloc_trace()
+// waits for them to drain before it takes the free space snapshot.
+
+int64_t BlueStore::_alloc_allocate(
+  uint64_t want_size, uint64_t alloc_unit, uint64_t max_alloc_size,
+  int64_t hint, AllocExtentVector *extents)
+{
+  if (!alloc_tracing) {
+    ++alloc_untraced;
+    if (!alloc_tracing) {
+      int64_t got = alloc->allocate(want_size, alloc_unit, max_alloc_size,
+				    hint, extents);
+      --alloc_untraced;
+      return got;
+    }
+    --alloc_untraced;
+  }
+  std::lock_guard<std::mutex> l(alloc_trace_lock);
+  size_t first = extents->size();
+  int64_t got = alloc->allocate(want_size, alloc_unit, max_alloc_size, hint,
+				extents);
+  if (alloc_trace.is_open()) {
+    auto t = std::chrono::duration_cast<std::chrono::microseconds>(
+      ceph::mono_clock::now() - alloc_trace_start).count();
+    alloc_trace << "A " << t << std::hex << " " << want_size
+		<< " " << alloc_unit << " " << max_alloc_size
+		<< " " << hint << " " << got;
+    for (size_t i = first; i < extents->size(); ++i) {
+      alloc_trace << " " << (*extents)[i].offset
+		  << "~" << (*extents)[i].length;
+    }
+    alloc_trace << std::dec << "\n";
+  }
+  return got;
+}
+
+void BlueStore::_alloc_release(const interval_set<uint64_t>& release_set)
+{
+  if (!alloc_tracing) {
+    ++alloc_untraced;
+    if (!alloc_tracing) {
+      alloc->release(release_set);
+      --alloc_untraced;
+      return;
+    }
+    --alloc_untraced;
+  }
+  std::lock_guard<std::mutex> l(alloc_trace_lock);
+  alloc->release(release_set);
+  if (alloc_trace.is_open() && !release_set.empty()) {
+    auto t = std::chrono::duration_cast<std::chrono::microseconds>(
+      ceph::mono_clock::now() - alloc_trace_start).count();
+    alloc_trace << "R " << t << std::hex;
+    for (auto p = release_set.begin(); p != release_set.end(); ++p) {
+      alloc_trace << " " << p.get_start() << "~" << p.get_len();
+    }
+    alloc_trace << std::dec << "\n";
+  }
+}
+
+void BlueStore::_alloc_trace_stop()
+{
+  std::lock_guard<std::mutex> l(alloc_trace_lock);
+  alloc_tracing = false;
+  if (alloc_trace.is_open()) {
+    dout(1) << __func__ << dendl;
+    alloc_trace.close();
+  }
+}
+
+int BlueStore::set_alloc_trace(const string& path)
+{
+  if (!mounted || !alloc) {
+    return -EAGAIN;
+  }
+  if (path.empty()) {
+    _alloc_trace_stop();
+    return 0;
+  }
+  std::lock_guard<std::mutex> l(alloc_trace_lock);
+  if (alloc_trace.is_open()) {
+    return -EBUSY;
+  }
+  alloc_trace.open(path, std::ios::out | std::ios::trunc);
+  if (!alloc_trace.is_open()) {
+    int r = -errno;
+    derr << __func__ << " failed to open " << path << ": "
+	 << cpp_strerror(r) << dendl;
+    return r;
+  }
+  alloc_trace << "H 1" << std::hex << " " << bdev->get_size()
+	      << " " << bdev->get_block_size() << " " << min_alloc_size
+	      << std::dec << " " << cct->_conf->bluestore_allocator << "\n";
+  // raise the flag first: callers that see it block on alloc_trace_lock
+  // until the free space snapshot below is written.  callers that missed
+  // it are done with the allocator once alloc_untraced drops to zero, so
+  // the snapshot includes their work.
+  alloc_tracing = true;
+  while (alloc_untraced.load()) {
+    std::this_thread::yield();
+  }
+  int r = alloc->foreach_free([&](uint64_t offset, uint64_t length) {
+      alloc_trace << "F" << std::hex << " " << offset << " " << length
+		  << std::dec << "\n";
+    });
+  if (r < 0) {
+    derr << __func__ << " allocator " << cct->_conf->bluestore_allocator
+	 << " cannot enumerate free space: " << cpp_strerror(r) << dendl;
+    alloc_tracing = false;
+    alloc_trace.close();
+    ::unlink(path.c_str());
+    return r;
+  }
+  alloc_trace_start = ceph::mono_clock::now();
+  dout(1) << __func__ << " tracing allocations to " << path << dendl;
+  return 0;
+}
+
 int BlueStore::_open_fsid(bool create)
 {
   assert(fsid_fd < 0);
@@ -4646,7 +5199,9 @@ int BlueStore::_open_db(bool create, bool to_repair_db)
       bfn = path + "/block.wal";
     }
     if (::stat(bfn.c_str(), &st) == 0) {
-      r = bluefs->add_block_device(BlueFS::BDEV_WAL, bfn);
+      r = bluefs->add_block_device(
+	BlueFS::BDEV_WAL, bfn,
+	cct->_conf->get_val<bool>("bluestore_block_wal_pmem_emulate"));
       if (r < 0) {
         derr << __func__ << " add block device(" << bfn << ") returned: " 
 	     << cpp_strerror(r) << dendl;
@@ -4777,10 +5332,28 @@ int BlueStore::_open_db(bool create, bool to_repair_db)
   db->set_merge_operator(PREFIX_STAT, merge_op);
 
   db->set_cache_size(cache_size * cache_kv_ratio);
+  if (cct->_conf->get_val<bool>("bluestore_cache_autotune")) {
+    // the autotuner needs the kv cache's hit rate
+    db->enable_cache_hit_stats();
+  }
 
   if (kv_backend == "rocksdb") {
     options = cct->_conf->bluestore_rocksdb_options;
 
+    if (bluefs && cct->_conf->bluefs_preextend_wal_files) {
+      // bluefs only gets away with sizing WAL files to their allocation
+      // if rocksdb can tell stale records from a recycled log apart
+      map<string,string> opts;
+      get_str_map(options, &opts, ",\n;");
+      auto p = opts.find("recycle_log_file_num");
+      if (p == opts.end() || atoi(p->second.c_str()) <= 0) {
+	derr << __func__ << " bluefs_preextend_wal_files requires"
+	     << " recycle_log_file_num > 0 in bluestore_rocksdb_options;"
+	     << " ignoring it" << dendl;
+	bluefs->disable_preextend_wal();
+      }
+    }
+
     map<string,string> cf_map;
     get_str_map(cct->_conf->get_val<string>("bluestore_rocksdb_cfs"), &cf_map,
 		" \t");
@@ -4965,7 +5538,7 @@ int BlueStore::_balance_bluefs_freespace(PExtentVector *extents)
     assert(r == 0);
 
     AllocExtentVector exts;
-    int64_t alloc_len = alloc->allocate(gift, cct->_conf->bluefs_alloc_size,
+    int64_t alloc_len = _alloc_allocate(gift, cct->_conf->bluefs_alloc_size,
 					0, 0, &exts);
 
     if (alloc_len < (int64_t)gift) {
@@ -5327,6 +5900,11 @@ int BlueStore::mkfs()
     }
 
     ondisk_format = latest_ondisk_format;
+    compat_ondisk_format = min_compat_ondisk_format;
+    if (cct->_conf->get_val<uint64_t>(
+	  "bluestore_extent_map_shard_segment_extents")) {
+      compat_ondisk_format = segmented_shards_ondisk_format;
+    }
     _prepare_ondisk_format_super(t);
     db->submit_transaction_sync(t);
   }
@@ -6351,49 +6929,211 @@ void BlueStore::_update_cache_logger()
   logger->set(l_bluestore_blobs, num_blobs);
   logger->set(l_bluestore_buffers, num_buffers);
   logger->set(l_bluestore_buffer_bytes, num_buffer_bytes);
+  logger->set(l_bluestore_cache_meta_target, cache_size * cache_meta_ratio);
+  logger->set(l_bluestore_cache_data_target, cache_size * cache_data_ratio);
+  logger->set(l_bluestore_cache_kv_target, cache_size * cache_kv_ratio);
 }
 
-// ---------------
-// read operations
-
-ObjectStore::CollectionHandle BlueStore::open_collection(const coll_t& cid)
-{
-  return _get_collection(cid);
-}
-
-bool BlueStore::exists(const coll_t& cid, const ghobject_t& oid)
-{
-  CollectionHandle c = _get_collection(cid);
-  if (!c)
-    return false;
-  return exists(c, oid);
-}
-
-bool BlueStore::exists(CollectionHandle &c_, const ghobject_t& oid)
+void BlueStore::_tune_cache_ratios(float bytes_per_onode)
 {
-  Collection *c = static_cast<Collection *>(c_.get());
-  dout(10) << __func__ << " " << c->cid << " " << oid << dendl;
-  if (!c->exists)
-    return false;
-
-  bool r = true;
-
-  {
-    RWLock::RLocker l(c->lock);
-    OnodeRef o = c->get_onode(oid, false);
-    if (!o || !o->exists)
-      r = false;
+  uint64_t chunk =
+    cct->_conf->get_val<uint64_t>("bluestore_cache_autotune_chunk_size");
+  double min_ratio =
+    cct->_conf->get_val<double>("bluestore_cache_autotune_min_ratio");
+  if (cache_size == 0 || chunk == 0) {
+    return;
   }
+  float chunk_ratio = (float)chunk / (float)cache_size;
+  float *ratio[CACHE_TYPE_MAX] = {
+    &cache_meta_ratio, &cache_data_ratio, &cache_kv_ratio
+  };
+  static const char *names[CACHE_TYPE_MAX] = { "meta", "data", "kv" };
 
-  return r;
-}
-
-int BlueStore::stat(
-    const coll_t& cid,
-    const ghobject_t& oid,
-    struct stat *st,
-    bool allow_eio)
-{
+  // sample fill level and hit/miss counters of each consumer
+  uint64_t num_onodes = 0;
+  uint64_t num_extents = 0;
+  uint64_t num_blobs = 0;
+  uint64_t num_buffers = 0;
+  uint64_t num_buffer_bytes = 0;
+  for (auto c : cache_shards) {
+    c->add_stats(&num_onodes, &num_extents, &num_blobs,
+		 &num_buffers, &num_buffer_bytes);
+  }
+  uint64_t usage[CACHE_TYPE_MAX];
+  usage[CACHE_META] = num_onodes * bytes_per_onode;
+  usage[CACHE_DATA] = num_buffer_bytes;
+  int64_t kv_usage = db->get_cache_usage();
+  if (kv_usage >= 0) {
+    usage[CACHE_KV] = kv_usage;
+  } else {
+    // assume the kv cache is full if it won't tell us
+    usage[CACHE_KV] = cache_size * cache_kv_ratio;
+  }
+
+  cache_tune_sample_t sample[CACHE_TYPE_MAX];
+  sample[CACHE_META].hits = logger->get(l_bluestore_onode_hits);
+  sample[CACHE_META].misses = logger->get(l_bluestore_onode_misses);
+  sample[CACHE_DATA].hits = logger->get(l_bluestore_buffer_hit_bytes);
+  sample[CACHE_DATA].misses = logger->get(l_bluestore_buffer_miss_bytes);
+  bool have_kv_stats =
+    db->get_cache_hit_stats(&sample[CACHE_KV].hits,
+			    &sample[CACHE_KV].misses) == 0;
+  // <count, sum ms> of the time trimmed onodes had gone unused
+  pair<uint64_t,uint64_t> age = logger->get_tavg_ms(l_bluestore_onode_lru_age);
+
+  std::lock_guard<std::mutex> l(cache_tune_lock);
+  cache_tune_stamp = ceph_clock_now();
+  cache_tune_kv_stats = have_kv_stats;
+  if (age.first >= cache_tune_last_age.first &&
+      age.second >= cache_tune_last_age.second) {
+    cache_tune_onode_trimmed = age.first - cache_tune_last_age.first;
+    cache_tune_onode_age = cache_tune_onode_trimmed ?
+      (double)(age.second - cache_tune_last_age.second) /
+      (double)cache_tune_onode_trimmed / 1000.0 : 0;
+  } else {
+    cache_tune_onode_trimmed = 0;
+    cache_tune_onode_age = 0;
+  }
+  cache_tune_last_age = age;
+  for (int i = 0; i < CACHE_TYPE_MAX; ++i) {
+    // tolerate counters that were reset underneath us
+    uint64_t hits = sample[i].hits >= cache_tune_last[i].hits ?
+      sample[i].hits - cache_tune_last[i].hits : sample[i].hits;
+    uint64_t misses = sample[i].misses >= cache_tune_last[i].misses ?
+      sample[i].misses - cache_tune_last[i].misses : sample[i].misses;
+    cache_tune_miss_ratio[i] =
+      hits + misses ? (double)misses / (double)(hits + misses) : 0;
+    cache_tune_usage[i] = usage[i];
+    cache_tune_last[i] = sample[i];
+  }
+
+  // the receiver is the full consumer that misses the most.  without
+  // rocksdb stats the kv cache can still give memory back, but never
+  // asks for more.
+  int to = -1;
+  for (int i = 0; i < CACHE_TYPE_MAX; ++i) {
+    if (i == CACHE_KV && !have_kv_stats) {
+      continue;
+    }
+    uint64_t target = cache_size * *ratio[i];
+    if (usage[i] + chunk < target || cache_tune_miss_ratio[i] == 0) {
+      continue;
+    }
+    if (to < 0 || cache_tune_miss_ratio[i] > cache_tune_miss_ratio[to]) {
+      to = i;
+    }
+  }
+  if (to == CACHE_KV &&
+      cache_size * (cache_kv_ratio + chunk_ratio) >
+      cct->_conf->bluestore_cache_kv_max) {
+    to = -1;
+  }
+  if (to < 0) {
+    cache_tune_last_decision = "no cache under pressure";
+    dout(20) << __func__ << " " << cache_tune_last_decision << dendl;
+    return;
+  }
+
+  // the donor is an idle consumer if there is one, otherwise the one
+  // with the lowest miss ratio, as long as it stays above the floor.
+  int from = -1;
+  bool from_idle = false;
+  for (int i = 0; i < CACHE_TYPE_MAX; ++i) {
+    if (i == to || *ratio[i] - chunk_ratio < min_ratio) {
+      continue;
+    }
+    uint64_t target = cache_size * *ratio[i];
+    bool idle = usage[i] + chunk < target;
+    if (!idle && cache_tune_miss_ratio[i] >= cache_tune_miss_ratio[to]) {
+      continue;
+    }
+    if (from < 0 ||
+	(idle && !from_idle) ||
+	(idle == from_idle &&
+	 cache_tune_miss_ratio[i] < cache_tune_miss_ratio[from])) {
+      from = i;
+      from_idle = idle;
+    }
+  }
+  if (from < 0) {
+    cache_tune_last_decision = string("no donor for ") + names[to];
+    dout(20) << __func__ << " " << cache_tune_last_decision << dendl;
+    return;
+  }
+
+  *ratio[from] -= chunk_ratio;
+  *ratio[to] += chunk_ratio;
+  if (from == CACHE_KV || to == CACHE_KV) {
+    db->set_cache_capacity(cache_size * cache_kv_ratio);
+  }
+  ++cache_tune_moves;
+  logger->inc(l_bluestore_cache_autotune_moves);
+
+  ostringstream ss;
+  ss << "move " << pretty_si_t(chunk) << " from " << names[from];
+  if (from_idle) {
+    ss << " (idle)";
+  } else {
+    ss << " (miss ratio " << cache_tune_miss_ratio[from] << ")";
+  }
+  ss << " to " << names[to]
+     << " (miss ratio " << cache_tune_miss_ratio[to] << ")";
+  cache_tune_last_decision = ss.str();
+  dout(10) << __func__ << " " << cache_tune_last_decision
+	   << "; meta " << cache_meta_ratio
+	   << " data " << cache_data_ratio
+	   << " kv " << cache_kv_ratio
+	   << "; onode lru age " << cache_tune_onode_age << "s" << dendl;
+}
+
+// ---------------
+// read operations
+
+ObjectStore::CollectionHandle BlueStore::open_collection(const coll_t& cid)
+{
+  return _get_collection(cid);
+}
+
+bool BlueStore::exists(const coll_t& cid, const ghobject_t& oid)
+{
+  CollectionHandle c = _get_collection(cid);
+  if (!c)
+    return false;
+  return exists(c, oid);
+}
+
+bool BlueStore::exists(CollectionHandle &c_, const ghobject_t& oid)
+{
+  Collection *c = static_cast<Collection *>(c_.get());
+  dout(10) << __func__ << " " << c->cid << " " << oid << dendl;
+  if (!c->exists)
+    return false;
+
+  bool r = true;
+
+  {
+    RWLock::RLocker l(c->lock);
+    OnodeRef o = c->get_onode(oid, false);
+    if (!o || !o->exists)
+      r = false;
+  }
+
+  return r;
+}
+
+// scans (scrub, backfill) hint that they won't be back for these onodes
+static bool _op_promotes_onode(uint32_t op_flags)
+{
+  return (op_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+		      CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)) == 0;
+}
+
+int BlueStore::stat(
+    const coll_t& cid,
+    const ghobject_t& oid,
+    struct stat *st,
+    bool allow_eio)
+{
   CollectionHandle c = _get_collection(cid);
   if (!c)
     return -ENOENT;
@@ -6404,7 +7144,8 @@ int BlueStore::stat(
   CollectionHandle &c_,
   const ghobject_t& oid,
   struct stat *st,
-  bool allow_eio)
+  bool allow_eio,
+  uint32_t op_flags)
 {
   Collection *c = static_cast<Collection *>(c_.get());
   if (!c->exists)
@@ -6413,7 +7154,7 @@ int BlueStore::stat(
 
   {
     RWLock::RLocker l(c->lock);
-    OnodeRef o = c->get_onode(oid, false);
+    OnodeRef o = c->get_onode(oid, false, _op_promotes_onode(op_flags));
     if (!o || !o->exists)
       return -ENOENT;
     st->st_size = o->onode.size;
@@ -6481,7 +7222,7 @@ int BlueStore::read(
   {
     RWLock::RLocker l(c->lock);
     utime_t start1 = ceph_clock_now();
-    OnodeRef o = c->get_onode(oid, false);
+    OnodeRef o = c->get_onode(oid, false, _op_promotes_onode(op_flags));
     logger->tinc(l_bluestore_read_onode_meta_lat, ceph_clock_now() - start1);
     if (!o || !o->exists) {
       r = -ENOENT;
@@ -6581,12 +7322,16 @@ int BlueStore::_do_read(
   }
 
   utime_t start = ceph_clock_now();
-  o->extent_map.fault_range(db, offset, length);
+  o->extent_map.fault_range(db, offset, length, true);
   logger->tinc(l_bluestore_read_onode_meta_lat, ceph_clock_now() - start);
   _dump_onode(o);
 
   ready_regions_t ready_regions;
 
+  // cached and uncompressed data is handed back by reference to the
+  // (page-aligned) buffers it was read into; only decompression copies.
+  uint64_t zero_copy_bytes = 0, copy_bytes = 0;
+
   // build blob-wise list to of stuff read (that isn't cached)
   blobs2read_t blobs2read;
   unsigned left = length;
@@ -6625,6 +7370,7 @@ int BlueStore::_do_read(
 	  pc->first == b_off) {
 	l = pc->second.length();
 	ready_regions[pos].claim(pc->second);
+	zero_copy_bytes += l;
 	dout(30) << __func__ << "    use cache 0x" << std::hex << pos << ": 0x"
 		 << b_off << "~" << l << std::dec << dendl;
 	++pc;
@@ -6774,6 +7520,7 @@ int BlueStore::_do_read(
       for (auto& i : b2r_it->second) {
 	ready_regions[i.logical_offset].substr_of(
 	  raw_bl, i.blob_xoffset, i.length);
+	copy_bytes += i.length;
       }
     } else {
       for (auto& reg : b2r_it->second) {
@@ -6789,6 +7536,7 @@ int BlueStore::_do_read(
 	// prune and keep result
 	ready_regions[reg.logical_offset].substr_of(
 	  reg.bl, reg.front, reg.length);
+	zero_copy_bytes += reg.length;
       }
     }
     ++b2r_it;
@@ -6822,6 +7570,8 @@ int BlueStore::_do_read(
   assert(bl.length() == length);
   assert(pos == length);
   assert(pr == pr_end);
+  logger->inc(l_bluestore_read_zero_copy_bytes, zero_copy_bytes);
+  logger->inc(l_bluestore_read_copy_bytes, copy_bytes);
   r = bl.length();
   return r;
 }
@@ -7037,7 +7787,8 @@ int BlueStore::getattr(
   CollectionHandle &c_,
   const ghobject_t& oid,
   const char *name,
-  bufferptr& value)
+  bufferptr& value,
+  uint32_t op_flags)
 {
   Collection *c = static_cast<Collection *>(c_.get());
   dout(15) << __func__ << " " << c->cid << " " << oid << " " << name << dendl;
@@ -7049,7 +7800,7 @@ int BlueStore::getattr(
     RWLock::RLocker l(c->lock);
     mempool::bluestore_cache_other::string k(name);
 
-    OnodeRef o = c->get_onode(oid, false);
+    OnodeRef o = c->get_onode(oid, false, _op_promotes_onode(op_flags));
     if (!o || !o->exists) {
       r = -ENOENT;
       goto out;
@@ -7087,7 +7838,8 @@ int BlueStore::getattrs(
 int BlueStore::getattrs(
   CollectionHandle &c_,
   const ghobject_t& oid,
-  map<string,bufferptr>& aset)
+  map<string,bufferptr>& aset,
+  uint32_t op_flags)
 {
   Collection *c = static_cast<Collection *>(c_.get());
   dout(15) << __func__ << " " << c->cid << " " << oid << dendl;
@@ -7098,7 +7850,7 @@ int BlueStore::getattrs(
   {
     RWLock::RLocker l(c->lock);
 
-    OnodeRef o = c->get_onode(oid, false);
+    OnodeRef o = c->get_onode(oid, false, _op_promotes_onode(op_flags));
     if (!o || !o->exists) {
       r = -ENOENT;
       goto out;
@@ -7193,9 +7945,64 @@ int BlueStore::collection_list(
   return r;
 }
 
+int BlueStore::collection_list_meta(
+  CollectionHandle &c_, const ghobject_t& start, const ghobject_t& end, int max,
+  const set<string> &attrs, vector<object_meta_t> *ls, ghobject_t *pnext)
+{
+  Collection *c = static_cast<Collection *>(c_.get());
+  dout(15) << __func__ << " " << c->cid
+           << " start " << start << " end " << end << " max " << max
+           << " attrs " << attrs << dendl;
+  int r;
+  {
+    RWLock::RLocker l(c->lock);
+    r = _collection_list(c, start, end, max, nullptr, pnext, &attrs, ls);
+  }
+
+  dout(10) << __func__ << " " << c->cid
+    << " start " << start << " end " << end << " max " << max
+    << " = " << r << ", ls.size() = " << ls->size()
+    << ", next = " << (pnext ? *pnext : ghobject_t())  << dendl;
+  return r;
+}
+
+bool BlueStore::_get_object_meta(
+  Collection *c, const ghobject_t& oid, KeyValueDB::Iterator& it,
+  const set<string>& attrs, object_meta_t *m)
+{
+  // a cached onode may be newer than what the kv store has; otherwise
+  // the onode is right under the iterator and we only need its head,
+  // not the extent map.
+  bluestore_onode_t decoded;
+  const bluestore_onode_t *onode = &decoded;
+  OnodeRef o = c->onode_map.lookup(oid, false);
+  if (o) {
+    if (!o->exists)
+      return false;
+    onode = &o->onode;
+  } else {
+    bufferptr v = it->value_as_ptr();
+    bufferptr::iterator p = v.begin_deep();
+    decoded.decode(p);
+  }
+  m->oid = oid;
+  m->st.st_size = onode->size;
+  m->st.st_blksize = 4096;
+  m->st.st_blocks = (m->st.st_size + m->st.st_blksize - 1) / m->st.st_blksize;
+  m->st.st_nlink = 1;
+  for (auto& name : attrs) {
+    auto p = onode->attrs.find(name.c_str());
+    if (p != onode->attrs.end()) {
+      m->attrs[name] = p->second;
+    }
+  }
+  return true;
+}
+
 int BlueStore::_collection_list(
   Collection *c, const ghobject_t& start, const ghobject_t& end, int max,
-  vector<ghobject_t> *ls, ghobject_t *pnext)
+  vector<ghobject_t> *ls, ghobject_t *pnext,
+  const set<string> *attrs, vector<object_meta_t> *meta)
 {
 
   if (!c->exists)
@@ -7209,6 +8016,7 @@ int BlueStore::_collection_list(
   bool set_next = false;
   string pend;
   bool temp;
+  unsigned listed = 0;
 
   if (!pnext)
     pnext = &static_next;
@@ -7225,7 +8033,14 @@ int BlueStore::_collection_list(
     << " and " << pretty_binary_string(start_key)
     << " to " << pretty_binary_string(end_key)
     << " start " << start << dendl;
-  it = db->get_iterator(PREFIX_OBJ);
+  if (meta) {
+    // we will walk the values as well as the keys
+    it = db->get_scan_iterator(
+      PREFIX_OBJ,
+      cct->_conf->get_val<uint64_t>("bluestore_collection_list_readahead"));
+  } else {
+    it = db->get_iterator(PREFIX_OBJ);
+  }
   if (start == ghobject_t() ||
     start.hobj == hobject_t() ||
     start == c->cid.get_min_hobj()) {
@@ -7288,13 +8103,21 @@ int BlueStore::_collection_list(
     int r = get_key_object(it->key(), &oid);
     assert(r == 0);
     dout(20) << __func__ << " oid " << oid << " end " << end << dendl;
-    if (ls->size() >= (unsigned)max) {
+    if (listed >= (unsigned)max) {
       dout(20) << __func__ << " reached max " << max << dendl;
       *pnext = oid;
       set_next = true;
       break;
     }
-    ls->push_back(oid);
+    if (meta) {
+      object_meta_t m;
+      if (_get_object_meta(c, oid, it, *attrs, &m)) {
+	meta->push_back(std::move(m));
+      }
+    } else {
+      ls->push_back(oid);
+    }
+    ++listed;
     it->next();
   }
 out:
@@ -7638,9 +8461,10 @@ ObjectMap::ObjectMapIterator BlueStore::get_omap_iterator(
 void BlueStore::_prepare_ondisk_format_super(KeyValueDB::Transaction& t)
 {
   dout(10) << __func__ << " ondisk_format " << ondisk_format
-	   << " min_compat_ondisk_format " << min_compat_ondisk_format
+	   << " min_compat_ondisk_format " << compat_ondisk_format
 	   << dendl;
   assert(ondisk_format == latest_ondisk_format);
+  assert(compat_ondisk_format >= min_compat_ondisk_format);
   {
     bufferlist bl;
     ::encode(ondisk_format, bl);
@@ -7648,7 +8472,7 @@ void BlueStore::_prepare_ondisk_format_super(KeyValueDB::Transaction& t)
   }
   {
     bufferlist bl;
-    ::encode(min_compat_ondisk_format, bl);
+    ::encode(compat_ondisk_format, bl);
     t->set(PREFIX_SUPER, "min_compat_ondisk_format", bl);
   }
 }
@@ -7721,7 +8545,6 @@ int BlueStore::_open_super_meta()
   }
 
   // ondisk format
-  int32_t compat_ondisk_format = 0;
   {
     bufferlist bl;
     int r = db->get(PREFIX_SUPER, "ondisk_format", &bl);
@@ -7769,6 +8592,18 @@ int BlueStore::_open_super_meta()
       return r;
     }
   }
+  if (compat_ondisk_format < segmented_shards_ondisk_format &&
+      cct->_conf->get_val<uint64_t>(
+	"bluestore_extent_map_shard_segment_extents")) {
+    dout(1) << __func__ << " raising min_compat_ondisk_format to "
+	    << segmented_shards_ondisk_format
+	    << " for segmented extent map shards" << dendl;
+    KeyValueDB::Transaction t = db->get_transaction();
+    compat_ondisk_format = segmented_shards_ondisk_format;
+    _prepare_ondisk_format_super(t);
+    int r = db->submit_transaction_sync(t);
+    assert(r == 0);
+  }
 
   {
     bufferlist bl;
@@ -7794,6 +8629,7 @@ int BlueStore::_open_super_meta()
   _set_csum();
   _set_compression();
   _set_blob_size();
+  _set_extent_map_params();
 
   return 0;
 }
@@ -7805,6 +8641,7 @@ int BlueStore::_upgrade_super()
   assert(ondisk_format > 0);
   assert(ondisk_format < latest_ondisk_format);
 
+  KeyValueDB::Transaction t = db->get_transaction();
   if (ondisk_format == 1) {
     // changes:
     // - super: added ondisk_format
@@ -7812,7 +8649,6 @@ int BlueStore::_upgrade_super()
     // - super: added min_compat_ondisk_format
     // - super: added min_alloc_size
     // - super: removed min_min_alloc_size
-    KeyValueDB::Transaction t = db->get_transaction();
     {
       bufferlist bl;
       db->get(PREFIX_SUPER, "min_min_alloc_size", &bl);
@@ -7829,10 +8665,18 @@ int BlueStore::_upgrade_super()
       t->rmkey(PREFIX_SUPER, "min_min_alloc_size");
     }
     ondisk_format = 2;
-    _prepare_ondisk_format_super(t);
-    int r = db->submit_transaction_sync(t);
-    assert(r == 0);
   }
+  if (ondisk_format == 2) {
+    // changes:
+    // - onode: extent map shards may be segmented (struct_v 3), once
+    //   min_compat_ondisk_format is raised to match
+    ondisk_format = 3;
+  }
+  compat_ondisk_format = std::max(compat_ondisk_format,
+				  min_compat_ondisk_format);
+  _prepare_ondisk_format_super(t);
+  int r = db->submit_transaction_sync(t);
+  assert(r == 0);
 
   // done
   dout(1) << __func__ << " done" << dendl;
@@ -7978,16 +8822,17 @@ void BlueStore::_txc_state_proc(TransContext *txc)
 	}
       }
       {
-	std::lock_guard<std::mutex> l(kv_lock);
-	kv_queue.push_back(txc);
-	kv_cond.notify_one();
+	KVShard *ks = _get_kv_shard(txc->osr.get());
+	std::lock_guard<std::mutex> l(ks->kv_lock);
+	ks->kv_queue.push_back(txc);
+	ks->kv_cond.notify_one();
 	if (txc->state != TransContext::STATE_KV_SUBMITTED) {
-	  kv_queue_unsubmitted.push_back(txc);
+	  ks->kv_queue_unsubmitted.push_back(txc);
 	  ++txc->osr->kv_committing_serially;
 	}
 	if (txc->had_ios)
-	  kv_ios++;
-	kv_throttle_costs += txc->cost;
+	  ks->kv_ios++;
+	ks->kv_throttle_costs += txc->cost;
       }
       return;
     case TransContext::STATE_KV_SUBMITTED:
@@ -8065,6 +8910,39 @@ void BlueStore::_txc_finish_io(TransContext *txc)
   }
 }
 
+void BlueStore::_record_onode(OnodeRef &o, KeyValueDB::Transaction t)
+{
+  // bound encode
+  size_t bound = 0;
+  denc(o->onode, bound);
+  o->extent_map.bound_encode_spanning_blobs(bound);
+  if (o->onode.extent_map_shards.empty()) {
+    denc(o->extent_map.inline_bl, bound);
+  }
+
+  // encode
+  bufferlist bl;
+  unsigned onode_part, blob_part, extent_part;
+  {
+    auto p = bl.get_contiguous_appender(bound, true);
+    denc(o->onode, p);
+    onode_part = p.get_logical_offset();
+    o->extent_map.encode_spanning_blobs(p);
+    blob_part = p.get_logical_offset() - onode_part;
+    if (o->onode.extent_map_shards.empty()) {
+      denc(o->extent_map.inline_bl, p);
+    }
+    extent_part = p.get_logical_offset() - onode_part - blob_part;
+  }
+
+  dout(20) << __func__  << " onode " << o->oid << " is " << bl.length()
+	   << " (" << onode_part << " bytes onode + "
+	   << blob_part << " bytes spanning blobs + "
+	   << extent_part << " bytes inline extents)"
+	   << dendl;
+  t->set(PREFIX_OBJ, o->key.c_str(), o->key.size(), bl);
+}
+
 void BlueStore::_txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t)
 {
   dout(20) << __func__ << " txc " << txc
@@ -8074,49 +8952,39 @@ void BlueStore::_txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t)
 
   // finalize onodes
   for (auto o : txc->onodes) {
+    if (o->reshard_committing.load()) {
+      // our commit must not overtake the reshard's (see _reshard_deferred)
+      std::unique_lock<std::mutex> l(o->flush_lock);
+      while (o->reshard_committing.load()) {
+	o->flush_cond.wait(l);
+      }
+    }
     // finalize extent_map shards
     o->extent_map.update(t, false);
     if (o->extent_map.needs_reshard()) {
-      o->extent_map.reshard(db, t);
-      o->extent_map.update(t, true);
-      if (o->extent_map.needs_reshard()) {
-	dout(20) << __func__ << " warning: still wants reshard, check options?"
-		 << dendl;
-	o->extent_map.clear_needs_reshard();
-      }
-      logger->inc(l_bluestore_onode_reshard);
-    }
-
-    // bound encode
-    size_t bound = 0;
-    denc(o->onode, bound);
-    o->extent_map.bound_encode_spanning_blobs(bound);
-    if (o->onode.extent_map_shards.empty()) {
-      denc(o->extent_map.inline_bl, bound);
-    }
-
-    // encode
-    bufferlist bl;
-    unsigned onode_part, blob_part, extent_part;
-    {
-      auto p = bl.get_contiguous_appender(bound, true);
-      denc(o->onode, p);
-      onode_part = p.get_logical_offset();
-      o->extent_map.encode_spanning_blobs(p);
-      blob_part = p.get_logical_offset() - onode_part;
-      if (o->onode.extent_map_shards.empty()) {
-	denc(o->extent_map.inline_bl, p);
+      if (!o->extent_map.reshard_required && extent_map_reshard_deferred) {
+	// the shards are only too big or too small; write them as they
+	// are and leave the reshard to the reshard thread
+	dout(20) << __func__ << " deferring reshard of " << o->oid << dendl;
+	o->extent_map.defer_reshard();
+	o->extent_map.update(t, true);
+	_reshard_queue(o);
+	logger->inc(l_bluestore_onode_reshard_deferred);
+      } else {
+	o->extent_map.reshard(db, t);
+	o->extent_map.update(t, true);
+	if (o->extent_map.needs_reshard()) {
+	  dout(20) << __func__ << " warning: still wants reshard, check options?"
+		   << dendl;
+	  o->extent_map.clear_needs_reshard();
+	}
+	logger->inc(l_bluestore_onode_reshard);
       }
-      extent_part = p.get_logical_offset() - onode_part - blob_part;
     }
 
-    dout(20) << __func__  << " onode " << o->oid << " is " << bl.length()
-	     << " (" << onode_part << " bytes onode + "
-	     << blob_part << " bytes spanning blobs + "
-	     << extent_part << " bytes inline extents)"
-	     << dendl;
-    t->set(PREFIX_OBJ, o->key.c_str(), o->key.size(), bl);
+    _record_onode(o, t);
     o->flushing_count++;
+    --o->txc_pending;
   }
 
   // objects we modified but didn't affect the onode
@@ -8337,7 +9205,7 @@ void BlueStore::_txc_release_alloc(TransContext *txc)
     bulk_release_extents.insert(txc->released);
   }
 
-  alloc->release(bulk_release_extents);
+  _alloc_release(bulk_release_extents);
   txc->allocated.clear();
   txc->released.clear();
 }
@@ -8358,8 +9226,9 @@ void BlueStore::_osr_drain_preceding(TransContext *txc)
   }
   {
     // wake up any previously finished deferred events
-    std::lock_guard<std::mutex> l(kv_lock);
-    kv_cond.notify_one();
+    KVShard *ks = _get_kv_shard(osr);
+    std::lock_guard<std::mutex> l(ks->kv_lock);
+    ks->kv_cond.notify_one();
   }
   osr->drain_preceding(txc);
   --deferred_aggressive;
@@ -8382,14 +9251,16 @@ void BlueStore::_osr_drain_all()
     // submit anything pending
     deferred_try_submit();
   }
-  {
-    // wake up any previously finished deferred events
-    std::lock_guard<std::mutex> l(kv_lock);
-    kv_cond.notify_one();
-  }
-  {
-    std::lock_guard<std::mutex> l(kv_finalize_lock);
-    kv_finalize_cond.notify_one();
+  for (auto ks : kv_shards) {
+    {
+      // wake up any previously finished deferred events
+      std::lock_guard<std::mutex> l(ks->kv_lock);
+      ks->kv_cond.notify_one();
+    }
+    {
+      std::lock_guard<std::mutex> l(ks->kv_finalize_lock);
+      ks->kv_finalize_cond.notify_one();
+    }
   }
   for (auto osr : s) {
     dout(20) << __func__ << " drain " << osr << dendl;
@@ -8400,6 +9271,39 @@ void BlueStore::_osr_drain_all()
   dout(10) << __func__ << " done" << dendl;
 }
 
+void BlueStore::_kv_barrier_preceding(OpSequencer *osr)
+{
+  // wait until every sequencer has handed what it has queued so far to
+  // the kv store, so that nothing queued before us on another shard can
+  // commit after us.
+  set<OpSequencerRef> s;
+  {
+    std::lock_guard<std::mutex> l(osr_lock);
+    s = osr_set;
+  }
+  dout(10) << __func__ << " osr " << osr << " waiting on " << s.size()
+	   << " osrs" << dendl;
+  for (auto& i : s) {
+    i->flush();
+  }
+  dout(10) << __func__ << " osr " << osr << " done" << dendl;
+}
+
+bool BlueStore::_is_collection_transaction(Transaction& t)
+{
+  for (Transaction::iterator i = t.begin(); i.have_op(); ) {
+    switch (i.decode_op()->op) {
+    case Transaction::OP_MKCOLL:
+    case Transaction::OP_RMCOLL:
+    case Transaction::OP_SPLIT_COLLECTION2:
+      return true;
+    default:
+      break;
+    }
+  }
+  return false;
+}
+
 void BlueStore::_osr_unregister_all()
 {
   set<OpSequencerRef> s;
@@ -8456,39 +9360,53 @@ void BlueStore::_kv_start()
   for (auto f : finishers) {
     f->start();
   }
-  kv_sync_thread.create("bstore_kv_sync");
-  kv_finalize_thread.create("bstore_kv_final");
+  _compress_start();
+  assert(kv_shards.empty());
+  unsigned num_kv_shards = cct->_conf->get_val<uint64_t>(
+    "bluestore_kv_sync_threads");
+  for (unsigned i = 0; i < num_kv_shards; ++i) {
+    kv_shards.push_back(new KVShard(this, i));
+  }
+  for (auto ks : kv_shards) {
+    ks->kv_sync_thread.create("bstore_kv_sync");
+    ks->kv_finalize_thread.create("bstore_kv_final");
+  }
+  _reshard_start();
 }
 
 void BlueStore::_kv_stop()
 {
   dout(10) << __func__ << dendl;
-  {
-    std::unique_lock<std::mutex> l(kv_lock);
-    while (!kv_sync_started) {
-      kv_cond.wait(l);
+  // before the kv threads, as pending reshards wait for txcs to commit
+  _reshard_stop();
+  // stop the sync threads first; they may still hand work to finalizers
+  for (auto ks : kv_shards) {
+    std::unique_lock<std::mutex> l(ks->kv_lock);
+    while (!ks->kv_sync_started) {
+      ks->kv_cond.wait(l);
     }
-    kv_stop = true;
-    kv_cond.notify_all();
+    ks->kv_stop = true;
+    ks->kv_cond.notify_all();
   }
-  {
-    std::unique_lock<std::mutex> l(kv_finalize_lock);
-    while (!kv_finalize_started) {
-      kv_finalize_cond.wait(l);
+  for (auto ks : kv_shards) {
+    ks->kv_sync_thread.join();
+  }
+  for (auto ks : kv_shards) {
+    std::unique_lock<std::mutex> l(ks->kv_finalize_lock);
+    while (!ks->kv_finalize_started) {
+      ks->kv_finalize_cond.wait(l);
     }
-    kv_finalize_stop = true;
-    kv_finalize_cond.notify_all();
+    ks->kv_finalize_stop = true;
+    ks->kv_finalize_cond.notify_all();
   }
-  kv_sync_thread.join();
-  kv_finalize_thread.join();
-  {
-    std::lock_guard<std::mutex> l(kv_lock);
-    kv_stop = false;
+  for (auto ks : kv_shards) {
+    ks->kv_finalize_thread.join();
   }
-  {
-    std::lock_guard<std::mutex> l(kv_finalize_lock);
-    kv_finalize_stop = false;
+  for (auto ks : kv_shards) {
+    delete ks;
   }
+  kv_shards.clear();
+  _compress_stop();
   dout(10) << __func__ << " stopping finishers" << dendl;
   deferred_finisher.wait_for_empty();
   deferred_finisher.stop();
@@ -8499,45 +9417,190 @@ void BlueStore::_kv_stop()
   dout(10) << __func__ << " stopped" << dendl;
 }
 
-void BlueStore::_kv_sync_thread()
+void BlueStore::_reshard_start()
+{
+  dout(10) << __func__ << dendl;
+  reshard_stop = false;
+  reshard_paused = false;
+  reshard_thread.create("bstore_reshard");
+}
+
+void BlueStore::_reshard_stop()
+{
+  dout(10) << __func__ << dendl;
+  {
+    std::lock_guard<std::mutex> l(reshard_lock);
+    reshard_stop = true;
+    reshard_cond.notify_all();
+  }
+  reshard_thread.join();
+  assert(reshard_queue.empty());
+}
+
+void BlueStore::_reshard_queue(OnodeRef &o)
+{
+  std::lock_guard<std::mutex> l(reshard_lock);
+  reshard_queue.emplace_back(CollectionRef(o->c), o->oid);
+  reshard_cond.notify_one();
+}
+
+void BlueStore::_reshard_thread()
 {
   dout(10) << __func__ << " start" << dendl;
-  std::unique_lock<std::mutex> l(kv_lock);
-  assert(!kv_sync_started);
-  kv_sync_started = true;
-  kv_cond.notify_all();
+  const auto min_backoff = std::chrono::milliseconds(10);
+  const auto max_backoff = std::chrono::milliseconds(1000);
+  auto backoff = min_backoff;
+  deque<pair<CollectionRef,ghobject_t>> busy;
+  std::unique_lock<std::mutex> l(reshard_lock);
   while (true) {
-    assert(kv_committing.empty());
-    if (kv_queue.empty() &&
-	((deferred_done_queue.empty() && deferred_stable_queue.empty()) ||
+    if ((reshard_queue.empty() && busy.empty()) ||
+	(reshard_paused && !reshard_stop)) {
+      if (reshard_stop)
+	break;
+      reshard_cond.wait(l);
+      continue;
+    }
+    deque<pair<CollectionRef,ghobject_t>> q;
+    q.swap(busy);
+    q.insert(q.end(), reshard_queue.begin(), reshard_queue.end());
+    reshard_queue.clear();
+    l.unlock();
+    for (auto& i : q) {
+      if (!_reshard_deferred(i.first, i.second)) {
+	busy.push_back(std::move(i));
+      }
+    }
+    l.lock();
+    if (busy.empty()) {
+      backoff = min_backoff;
+    } else if (reshard_stop) {
+      // leave the shards as they are; they are valid, just badly sized
+      dout(10) << __func__ << " dropping " << busy.size() << " busy onodes"
+	       << dendl;
+      busy.clear();
+    } else {
+      // retry once the txcs writing them have been applied.  an object
+      // that keeps being written keeps being busy, so back off rather
+      // than spin on it; newly queued onodes wait for the next round.
+      dout(20) << __func__ << " " << busy.size() << " busy onodes, retry in "
+	       << backoff.count() << "ms" << dendl;
+      auto until = std::chrono::steady_clock::now() + backoff;
+      while (!reshard_stop &&
+	     reshard_cond.wait_until(l, until) != std::cv_status::timeout) ;
+      backoff = std::min(backoff * 2, max_backoff);
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+bool BlueStore::_reshard_deferred(CollectionRef &c, const ghobject_t &oid)
+{
+  OnodeRef o;
+  KeyValueDB::Transaction t = db->get_transaction();
+  {
+    RWLock::WLocker l(c->lock);
+    o = c->onode_map.lookup(oid, false);
+    if (!o || !o->exists || !o->extent_map.has_deferred_reshard()) {
+      // gone from the cache, removed or resharded by a later write
+      return true;
+    }
+    if (o->txc_pending.load() || o->flushing_count.load()) {
+      return false;
+    }
+    dout(20) << __func__ << " " << c->cid << " " << oid << dendl;
+
+    // nobody else can change o while we hold c->lock, and no txc has a
+    // pending write of it.
+    o->extent_map.reshard(db, t);
+    o->extent_map.update(t, true);
+    if (o->extent_map.needs_reshard()) {
+      dout(20) << __func__ << " warning: still wants reshard, check options?"
+	       << dendl;
+      o->extent_map.clear_needs_reshard();
+    }
+    _record_onode(o, t);
+    o->flushing_count++;
+    o->reshard_committing = true;
+  }
+
+  // the txcs that write o from now on wait for this commit before they
+  // encode it, so that they land after us.  the rest of the collection
+  // goes on meanwhile.
+  int r = db->submit_transaction_sync(t);
+  assert(r == 0);
+  {
+    std::lock_guard<std::mutex> l(o->flush_lock);
+    o->reshard_committing = false;
+    --o->flushing_count;
+    o->flush_cond.notify_all();
+  }
+  logger->inc(l_bluestore_onode_reshard);
+  return true;
+}
+
+void BlueStore::inject_reshard_pause(bool pause)
+{
+  std::lock_guard<std::mutex> l(reshard_lock);
+  reshard_paused = pause;
+  reshard_cond.notify_all();
+}
+
+int BlueStore::get_extent_map_shards(const coll_t& cid, const ghobject_t& oid,
+				     vector<uint32_t> *offsets)
+{
+  CollectionRef c = _get_collection(cid);
+  if (!c)
+    return -ENOENT;
+  RWLock::RLocker l(c->lock);
+  OnodeRef o = c->get_onode(oid, false);
+  if (!o || !o->exists)
+    return -ENOENT;
+  offsets->clear();
+  for (auto& s : o->extent_map.shards) {
+    offsets->push_back(s.shard_info->offset);
+  }
+  return 0;
+}
+
+void BlueStore::_kv_sync_thread(KVShard *ks)
+{
+  dout(10) << __func__ << " start shard " << ks->id << dendl;
+  std::unique_lock<std::mutex> l(ks->kv_lock);
+  assert(!ks->kv_sync_started);
+  ks->kv_sync_started = true;
+  ks->kv_cond.notify_all();
+  while (true) {
+    assert(ks->kv_committing.empty());
+    if (ks->kv_queue.empty() &&
+	((ks->deferred_done_queue.empty() && ks->deferred_stable_queue.empty()) ||
 	 !deferred_aggressive)) {
-      if (kv_stop)
+      if (ks->kv_stop)
 	break;
       dout(20) << __func__ << " sleep" << dendl;
-      kv_cond.wait(l);
+      ks->kv_cond.wait(l);
       dout(20) << __func__ << " wake" << dendl;
     } else {
       deque<TransContext*> kv_submitting;
       deque<DeferredBatch*> deferred_done, deferred_stable;
       uint64_t aios = 0, costs = 0;
 
-      dout(20) << __func__ << " committing " << kv_queue.size()
-	       << " submitting " << kv_queue_unsubmitted.size()
-	       << " deferred done " << deferred_done_queue.size()
-	       << " stable " << deferred_stable_queue.size()
+      dout(20) << __func__ << " committing " << ks->kv_queue.size()
+	       << " submitting " << ks->kv_queue_unsubmitted.size()
+	       << " deferred done " << ks->deferred_done_queue.size()
+	       << " stable " << ks->deferred_stable_queue.size()
 	       << dendl;
-      kv_committing.swap(kv_queue);
-      kv_submitting.swap(kv_queue_unsubmitted);
-      deferred_done.swap(deferred_done_queue);
-      deferred_stable.swap(deferred_stable_queue);
-      aios = kv_ios;
-      costs = kv_throttle_costs;
-      kv_ios = 0;
-      kv_throttle_costs = 0;
+      ks->kv_committing.swap(ks->kv_queue);
+      kv_submitting.swap(ks->kv_queue_unsubmitted);
+      deferred_done.swap(ks->deferred_done_queue);
+      deferred_stable.swap(ks->deferred_stable_queue);
+      aios = ks->kv_ios;
+      costs = ks->kv_throttle_costs;
+      ks->kv_ios = 0;
+      ks->kv_throttle_costs = 0;
       utime_t start = ceph_clock_now();
       l.unlock();
 
-      dout(30) << __func__ << " committing " << kv_committing << dendl;
+      dout(30) << __func__ << " committing " << ks->kv_committing << dendl;
       dout(30) << __func__ << " submitting " << kv_submitting << dendl;
       dout(30) << __func__ << " deferred_done " << deferred_done << dendl;
       dout(30) << __func__ << " deferred_stable " << deferred_stable << dendl;
@@ -8550,14 +9613,18 @@ void BlueStore::_kv_sync_thread()
       if (bluefs_single_shared_device && bluefs) {
 	if (aios) {
 	  force_flush = true;
-	} else if (kv_committing.empty() && kv_submitting.empty() &&
+	} else if (ks->kv_committing.empty() && kv_submitting.empty() &&
 		   deferred_stable.empty()) {
 	  force_flush = true;  // there's nothing else to commit!
 	} else if (deferred_aggressive) {
 	  force_flush = true;
 	}
-      } else
+      } else if (aios || !deferred_done.empty()) {
+	// otherwise the kv commit only syncs the bluefs devices.  a commit
+	// of nothing but kv work, e.g. deferred writes staged in a pmem
+	// wal, needs no flush of ours.
 	force_flush = true;
+      }
 
       if (force_flush) {
 	dout(20) << __func__ << " num_aios=" << aios
@@ -8565,6 +9632,7 @@ void BlueStore::_kv_sync_thread()
 		 << ", flushing, deferred done->stable" << dendl;
 	// flush/barrier on block device
 	bdev->flush();
+	logger->inc(l_bluestore_kv_flushes);
 
 	// if we flush then deferred done are now deferred stable
 	deferred_stable.insert(deferred_stable.end(), deferred_done.begin(),
@@ -8579,9 +9647,17 @@ void BlueStore::_kv_sync_thread()
       // increase {nid,blobid}_max?  note that this covers both the
       // case where we are approaching the max and the case we passed
       // it.  in either case, we increase the max in the earlier txn
-      // we submit.
+      // we submit.  with several kv shards the increase is serialized:
+      // other shards needing one wait until ours is durable (and then
+      // see the new max), so no txc using a new id can commit first.
       uint64_t new_nid_max = 0, new_blobid_max = 0;
-      if (nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max) {
+      std::unique_lock<std::mutex> max_l(kv_max_lock, std::defer_lock);
+      if (nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max ||
+	  blobid_last + cct->_conf->bluestore_blobid_prealloc/2 > blobid_max) {
+	max_l.lock();
+      }
+      if (max_l.owns_lock() &&
+	  nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max) {
 	KeyValueDB::Transaction t =
 	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
 	new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
@@ -8590,7 +9666,8 @@ void BlueStore::_kv_sync_thread()
 	t->set(PREFIX_SUPER, "nid_max", bl);
 	dout(10) << __func__ << " new_nid_max " << new_nid_max << dendl;
       }
-      if (blobid_last + cct->_conf->bluestore_blobid_prealloc/2 > blobid_max) {
+      if (max_l.owns_lock() &&
+	  blobid_last + cct->_conf->bluestore_blobid_prealloc/2 > blobid_max) {
 	KeyValueDB::Transaction t =
 	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
 	new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
@@ -8600,7 +9677,7 @@ void BlueStore::_kv_sync_thread()
 	dout(10) << __func__ << " new_blobid_max " << new_blobid_max << dendl;
       }
 
-      for (auto txc : kv_committing) {
+      for (auto txc : ks->kv_committing) {
 	if (txc->state == TransContext::STATE_KV_QUEUED) {
 	  txc->log_state_latency(logger, l_bluestore_state_kv_queued_lat);
 	  int r = cct->_conf->bluestore_debug_omit_kv_commit ? 0 : db->submit_transaction(txc->t);
@@ -8633,7 +9710,7 @@ void BlueStore::_kv_sync_thread()
       throttle_bytes.put(costs);
 
       PExtentVector bluefs_gift_extents;
-      if (bluefs &&
+      if (bluefs && ks->id == 0 &&
 	  after_flush - bluefs_last_balance >
 	  cct->_conf->bluestore_bluefs_balance_interval) {
 	bluefs_last_balance = after_flush;
@@ -8667,26 +9744,26 @@ void BlueStore::_kv_sync_thread()
       assert(r == 0);
 
       {
-	std::unique_lock<std::mutex> m(kv_finalize_lock);
-	if (kv_committing_to_finalize.empty()) {
-	  kv_committing_to_finalize.swap(kv_committing);
+	std::unique_lock<std::mutex> m(ks->kv_finalize_lock);
+	if (ks->kv_committing_to_finalize.empty()) {
+	  ks->kv_committing_to_finalize.swap(ks->kv_committing);
 	} else {
-	  kv_committing_to_finalize.insert(
-	      kv_committing_to_finalize.end(),
-	      kv_committing.begin(),
-	      kv_committing.end());
-	  kv_committing.clear();
+	  ks->kv_committing_to_finalize.insert(
+	      ks->kv_committing_to_finalize.end(),
+	      ks->kv_committing.begin(),
+	      ks->kv_committing.end());
+	  ks->kv_committing.clear();
 	}
-	if (deferred_stable_to_finalize.empty()) {
-	  deferred_stable_to_finalize.swap(deferred_stable);
+	if (ks->deferred_stable_to_finalize.empty()) {
+	  ks->deferred_stable_to_finalize.swap(deferred_stable);
 	} else {
-	  deferred_stable_to_finalize.insert(
-	      deferred_stable_to_finalize.end(),
+	  ks->deferred_stable_to_finalize.insert(
+	      ks->deferred_stable_to_finalize.end(),
 	      deferred_stable.begin(),
 	      deferred_stable.end());
 	  deferred_stable.clear();
 	}
-	kv_finalize_cond.notify_one();
+	ks->kv_finalize_cond.notify_one();
       }
 
       if (new_nid_max) {
@@ -8697,13 +9774,16 @@ void BlueStore::_kv_sync_thread()
 	blobid_max = new_blobid_max;
 	dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
       }
+      if (max_l.owns_lock()) {
+	max_l.unlock();
+      }
 
       {
 	utime_t finish = ceph_clock_now();
 	utime_t dur_flush = after_flush - start;
 	utime_t dur_kv = finish - after_flush;
 	utime_t dur = finish - start;
-	dout(20) << __func__ << " committed " << kv_committing.size()
+	dout(20) << __func__ << " committed " << ks->kv_committing.size()
 	  << " cleaned " << deferred_stable.size()
 	  << " in " << dur
 	  << " (" << dur_flush << " flush + " << dur_kv << " kv commit)"
@@ -8713,14 +9793,14 @@ void BlueStore::_kv_sync_thread()
 	logger->tinc(l_bluestore_kv_lat, dur);
       }
 
-      if (bluefs) {
+      if (bluefs && ks->id == 0) {
 	if (!bluefs_gift_extents.empty()) {
 	  _commit_bluefs_freespace(bluefs_gift_extents);
 	}
 	if (!bluefs_extents_reclaiming.empty()) {
 	  dout(0) << __func__ << " releasing old bluefs 0x" << std::hex
 		   << bluefs_extents_reclaiming << std::dec << dendl;
-	  alloc->release(bluefs_extents_reclaiming);
+	  _alloc_release(bluefs_extents_reclaiming);
 	  bluefs_extents_reclaiming.clear();
 	}
       }
@@ -8728,35 +9808,50 @@ void BlueStore::_kv_sync_thread()
       l.lock();
       // previously deferred "done" are now "stable" by virtue of this
       // commit cycle.
-      deferred_stable_queue.swap(deferred_done);
+      ks->deferred_stable_queue.swap(deferred_done);
     }
   }
   dout(10) << __func__ << " finish" << dendl;
-  kv_sync_started = false;
+  ks->kv_sync_started = false;
 }
 
-void BlueStore::_kv_finalize_thread()
+void BlueStore::_kv_finalize_thread(KVShard *ks)
 {
   deque<TransContext*> kv_committed;
   deque<DeferredBatch*> deferred_stable;
   dout(10) << __func__ << " start" << dendl;
-  std::unique_lock<std::mutex> l(kv_finalize_lock);
-  assert(!kv_finalize_started);
-  kv_finalize_started = true;
-  kv_finalize_cond.notify_all();
+  std::unique_lock<std::mutex> l(ks->kv_finalize_lock);
+  assert(!ks->kv_finalize_started);
+  ks->kv_finalize_started = true;
+  ks->kv_finalize_cond.notify_all();
   while (true) {
     assert(kv_committed.empty());
     assert(deferred_stable.empty());
-    if (kv_committing_to_finalize.empty() &&
-	deferred_stable_to_finalize.empty()) {
-      if (kv_finalize_stop)
+    if (ks->kv_committing_to_finalize.empty() &&
+	ks->deferred_stable_to_finalize.empty()) {
+      if (ks->kv_finalize_stop)
 	break;
-      dout(20) << __func__ << " sleep" << dendl;
-      kv_finalize_cond.wait(l);
-      dout(20) << __func__ << " wake" << dendl;
+      double max_delay = deferred_max_delay;
+      if (ks->id == 0 && max_delay > 0 && deferred_queue_size > 0 &&
+	  !deferred_aggressive) {
+	// deferred ios are pending; do not let them sit forever waiting
+	// for deferred_batch_ops siblings on an idle store
+	dout(20) << __func__ << " sleep (deferred pending)" << dendl;
+	ks->kv_finalize_cond.wait_for(l, make_timespan(max_delay));
+	dout(20) << __func__ << " wake" << dendl;
+	l.unlock();
+	if (_deferred_expired()) {
+	  deferred_try_submit();
+	}
+	l.lock();
+      } else {
+	dout(20) << __func__ << " sleep" << dendl;
+	ks->kv_finalize_cond.wait(l);
+	dout(20) << __func__ << " wake" << dendl;
+      }
     } else {
-      kv_committed.swap(kv_committing_to_finalize);
-      deferred_stable.swap(deferred_stable_to_finalize);
+      kv_committed.swap(ks->kv_committing_to_finalize);
+      deferred_stable.swap(ks->deferred_stable_to_finalize);
       l.unlock();
       dout(20) << __func__ << " kv_committed " << kv_committed << dendl;
       dout(20) << __func__ << " deferred_stable " << deferred_stable << dendl;
@@ -8781,7 +9876,8 @@ void BlueStore::_kv_finalize_thread()
 
       if (!deferred_aggressive) {
 	if (deferred_queue_size >= deferred_batch_ops.load() ||
-	    throttle_deferred_bytes.past_midpoint()) {
+	    throttle_deferred_bytes.past_midpoint() ||
+	    _deferred_expired()) {
 	  deferred_try_submit();
 	}
       }
@@ -8793,7 +9889,7 @@ void BlueStore::_kv_finalize_thread()
     }
   }
   dout(10) << __func__ << " finish" << dendl;
-  kv_finalize_started = false;
+  ks->kv_finalize_started = false;
 }
 
 bluestore_deferred_op_t *BlueStore::_get_deferred_op(
@@ -8847,6 +9943,19 @@ void BlueStore::deferred_try_submit()
   for (auto& osr : deferred_queue) {
     osrs.push_back(&osr);
   }
+  if (deferred_aggregate) {
+    vector<OpSequencer*> ready;
+    for (auto& osr : osrs) {
+      if (osr->deferred_pending && !osr->deferred_running) {
+	ready.push_back(osr.get());
+      }
+    }
+    if (ready.size() > 1) {
+      _deferred_aggregate_submit_unlock(ready);
+      deferred_lock.lock();
+      return;
+    }
+  }
   for (auto& osr : osrs) {
     if (osr->deferred_pending) {
       if (!osr->deferred_running) {
@@ -8876,6 +9985,10 @@ void BlueStore::_deferred_submit_unlock(OpSequencer *osr)
 
   osr->deferred_running = osr->deferred_pending;
   osr->deferred_pending = nullptr;
+  if (!b->iomap.empty()) {
+    auto last = b->iomap.rbegin();
+    deferred_last_offset = last->first + last->second.bl.length();
+  }
 
   deferred_lock.unlock();
 
@@ -8927,11 +10040,140 @@ struct C_DeferredTrySubmit : public Context {
   }
 };
 
+void BlueStore::_deferred_aggregate_submit_unlock(vector<OpSequencer*>& osrs)
+{
+  DeferredAggregate *a = new DeferredAggregate(cct);
+  bool left_behind = false;
+  interval_set<uint64_t> extents;
+  map<uint64_t,bufferlist> iomap;
+  // without aggregation deferred_try_submit would issue these batches one
+  // after another, each in ascending order, from the current device position
+  uint64_t writes_in = 0, seek_in = 0;
+  uint64_t pos = deferred_last_offset;
+  auto seek = [](uint64_t from, uint64_t to) {
+    return from > to ? from - to : to - from;
+  };
+
+  for (auto osr : osrs) {
+    DeferredBatch *b = osr->deferred_pending;
+    bool overlaps = false;
+    for (auto& p : b->iomap) {
+      if (extents.intersects(p.first, p.second.bl.length())) {
+	overlaps = true;
+	break;
+      }
+    }
+    if (overlaps) {
+      // the device may reorder our aios; keep this batch pending until
+      // the earlier writes to the same blocks have completed
+      dout(20) << __func__ << " osr " << osr << " overlaps, leaving pending"
+	       << dendl;
+      left_behind = true;
+      continue;
+    }
+    dout(20) << __func__ << " osr " << osr
+	     << " " << b->iomap.size() << " ios" << dendl;
+    deferred_queue_size -= b->seq_bytes.size();
+    assert(deferred_queue_size >= 0);
+    osr->deferred_running = b;
+    osr->deferred_pending = nullptr;
+    a->batches.push_back(b);
+
+    // account for the writes this batch would have issued on its own
+    bool first = true;
+    for (auto& p : b->iomap) {
+      uint64_t length = p.second.bl.length();
+      if (first || p.first != pos) {
+	++writes_in;
+	seek_in += seek(pos, p.first);
+	first = false;
+      }
+      pos = p.first + length;
+      extents.union_insert(p.first, length);
+      iomap[p.first].claim(p.second.bl);
+    }
+  }
+
+  // coalesce adjacent ranges, then issue them in one ascending sweep that
+  // starts where the previous sweep left off
+  vector<pair<uint64_t,bufferlist>> writes;
+  for (auto& p : iomap) {
+    if (writes.empty() ||
+	writes.back().first + writes.back().second.length() != p.first) {
+      writes.emplace_back(p.first, bufferlist());
+    }
+    writes.back().second.claim_append(p.second);
+  }
+  auto from = std::lower_bound(
+    writes.begin(), writes.end(), deferred_last_offset,
+    [](const pair<uint64_t,bufferlist>& w, uint64_t offset) {
+      return w.first < offset;
+    });
+  std::rotate(writes.begin(), from, writes.end());
+  uint64_t seek_out = 0;
+  pos = deferred_last_offset;
+  for (auto& w : writes) {
+    seek_out += seek(pos, w.first);
+    pos = w.first + w.second.length();
+  }
+  deferred_last_offset = pos;
+  a->retry = left_behind;
+
+  deferred_lock.unlock();
+
+  dout(10) << __func__ << " " << a->batches.size() << " batches, "
+	   << writes_in << " -> " << writes.size() << " writes, seek 0x"
+	   << std::hex << seek_in << " -> 0x" << seek_out << std::dec
+	   << dendl;
+  logger->inc(l_bluestore_deferred_aggregate_ops);
+  logger->inc(l_bluestore_deferred_aggregate_batches, a->batches.size());
+  logger->inc(l_bluestore_deferred_aggregate_writes_in, writes_in);
+  logger->inc(l_bluestore_deferred_aggregate_writes_out, writes.size());
+  logger->inc(l_bluestore_deferred_aggregate_seek_in, seek_in);
+  logger->inc(l_bluestore_deferred_aggregate_seek_out, seek_out);
+
+  for (auto b : a->batches) {
+    for (auto& txc : b->txcs) {
+      txc.log_state_latency(logger, l_bluestore_state_deferred_queued_lat);
+    }
+  }
+  for (auto& w : writes) {
+    dout(20) << __func__ << " write 0x" << std::hex
+	     << w.first << "~" << w.second.length()
+	     << " crc " << w.second.crc32c(-1) << std::dec << dendl;
+    if (!g_conf->bluestore_debug_omit_block_device_write) {
+      logger->inc(l_bluestore_deferred_write_ops);
+      logger->inc(l_bluestore_deferred_write_bytes, w.second.length());
+      int r = bdev->aio_write(w.first, w.second, &a->ioc, false);
+      assert(r == 0);
+    }
+  }
+  bdev->aio_submit(&a->ioc);
+}
+
+bool BlueStore::_deferred_expired()
+{
+  double max_delay = deferred_max_delay;
+  if (max_delay <= 0) {
+    return false;
+  }
+  auto deadline = mono_clock::now() - make_timespan(max_delay);
+  std::lock_guard<std::mutex> l(deferred_lock);
+  for (auto& osr : deferred_queue) {
+    if (osr.deferred_pending && !osr.deferred_running &&
+	osr.deferred_pending->start <= deadline) {
+      return true;
+    }
+  }
+  return false;
+}
+
 void BlueStore::_deferred_aio_finish(OpSequencer *osr)
 {
   dout(10) << __func__ << " osr " << osr << dendl;
   assert(osr->deferred_running);
   DeferredBatch *b = osr->deferred_running;
+  KVShard *ks = _get_kv_shard(osr);
 
   {
     std::lock_guard<std::mutex> l(deferred_lock);
@@ -8960,18 +10202,33 @@ void BlueStore::_deferred_aio_finish(OpSequencer *osr)
     }
     osr->qcond.notify_all();
     throttle_deferred_bytes.put(costs);
-    std::lock_guard<std::mutex> l(kv_lock);
-    deferred_done_queue.emplace_back(b);
+    // the cleanup commits on the sequencer's own shard, in order with
+    // the rest of its txcs
+    std::lock_guard<std::mutex> l(ks->kv_lock);
+    ks->deferred_done_queue.emplace_back(b);
   }
 
   // in the normal case, do not bother waking up the kv thread; it will
   // catch us on the next commit anyway.
   if (deferred_aggressive) {
-    std::lock_guard<std::mutex> l(kv_lock);
-    kv_cond.notify_one();
+    std::lock_guard<std::mutex> l(ks->kv_lock);
+    ks->kv_cond.notify_one();
   }
 }
 
+void BlueStore::_deferred_aggregate_aio_finish(DeferredAggregate *a)
+{
+  dout(10) << __func__ << " " << a->batches.size() << " batches" << dendl;
+  for (auto b : a->batches) {
+    _deferred_aio_finish(b->osr);
+  }
+  if (a->retry) {
+    dout(20) << __func__ << " queuing async deferred_try_submit" << dendl;
+    deferred_finisher.queue(new C_DeferredTrySubmit(this));
+  }
+  delete a;
+}
+
 int BlueStore::_deferred_replay()
 {
   dout(10) << __func__ << " start" << dendl;
@@ -9042,10 +10299,30 @@ int BlueStore::queue_transactions(
   } else {
     osr = new OpSequencer(cct, this);
     osr->parent = posr;
+    osr->kv_shard = posr->shard_hint.hash_to_shard(kv_shards.size());
     posr->p = osr;
     dout(10) << __func__ << " new " << osr << " " << *osr << dendl;
   }
 
+  // collection ops commit in order with every kv shard.  wait before our
+  // txc is queued, so that concurrent barriers do not wait on each other.
+  bool kv_barrier = false;
+  if (kv_shards.size() > 1) {
+    for (auto& t : tls) {
+      if (_is_collection_transaction(t)) {
+	kv_barrier = true;
+	break;
+      }
+    }
+  }
+  if (kv_barrier) {
+    if (handle)
+      handle->suspend_tp_timeout();
+    _kv_barrier_preceding(osr);
+    if (handle)
+      handle->reset_tp_timeout();
+  }
+
   // prepare
   TransContext *txc = _txc_create(osr);
   txc->onreadable = onreadable;
@@ -9084,10 +10361,10 @@ int BlueStore::queue_transactions(
 	       << dendl;
       ++deferred_aggressive;
       deferred_try_submit();
-      {
+      for (auto ks : kv_shards) {
 	// wake up any previously finished deferred events
-	std::lock_guard<std::mutex> l(kv_lock);
-	kv_cond.notify_one();
+	std::lock_guard<std::mutex> l(ks->kv_lock);
+	ks->kv_cond.notify_one();
       }
       throttle_deferred_bytes.get(txc->cost);
       --deferred_aggressive;
@@ -9103,6 +10380,15 @@ int BlueStore::queue_transactions(
   // execute (start)
   _txc_state_proc(txc);
 
+  if (kv_barrier) {
+    // ... and nothing queued after us on another shard can commit first
+    if (handle)
+      handle->suspend_tp_timeout();
+    osr->flush();
+    if (handle)
+      handle->reset_tp_timeout();
+  }
+
   logger->tinc(l_bluestore_submit_lat, ceph_clock_now() - start);
   logger->tinc(l_bluestore_throttle_lat, tend - tstart);
   return 0;
@@ -10006,6 +11292,220 @@ void BlueStore::_do_write_big(
   }
 }
 
+void BlueStore::_compress_start()
+{
+  compress_queue_max =
+    cct->_conf->get_val<uint64_t>("bluestore_compression_queue_max");
+  unsigned n = cct->_conf->get_val<uint64_t>("bluestore_compression_threads");
+  dout(10) << __func__ << " " << n << " threads" << dendl;
+  assert(compress_threads.empty());
+  compress_stop = false;
+  for (unsigned i = 0; i < n; ++i) {
+    compress_threads.push_back(new CompressThread(this));
+    compress_threads.back()->create("bstore_compress");
+  }
+}
+
+void BlueStore::_compress_stop()
+{
+  dout(10) << __func__ << dendl;
+  {
+    std::lock_guard<std::mutex> l(compress_lock);
+    compress_stop = true;
+    compress_cond.notify_all();
+  }
+  for (auto t : compress_threads) {
+    t->join();
+    delete t;
+  }
+  compress_threads.clear();
+  assert(compress_queue.empty());
+}
+
+void BlueStore::_compress_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock<std::mutex> l(compress_lock);
+  while (true) {
+    if (compress_queue.empty()) {
+      if (compress_stop)
+	break;
+      compress_cond.wait(l);
+      continue;
+    }
+    CompressJob job = compress_queue.front();
+    compress_queue.pop_front();
+    logger->set(l_bluestore_compress_queue_depth, compress_queue.size());
+    l.unlock();
+
+    _compress_write_item(job.batch->c, *job.wi);
+    {
+      std::lock_guard<std::mutex> bl(job.batch->lock);
+      if (--job.batch->pending == 0) {
+	job.batch->cond.notify_all();
+      }
+    }
+
+    l.lock();
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+static ceph::timespan thread_cputime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+void BlueStore::_compress_write_item(
+  CompressorRef& c,
+  WriteContext::write_item& wi)
+{
+  utime_t start = ceph_clock_now();
+  auto cpu_start = thread_cputime();
+
+  assert(wi.b_off == 0);
+  assert(wi.blob_length == wi.bl.length());
+
+  // FIXME: memory alignment here is bad
+  bufferlist t;
+  int r = c->compress(wi.bl, t);
+  assert(r == 0);
+  logger->inc(l_bluestore_compress_attempt_count);
+
+  bluestore_compression_header_t chdr;
+  chdr.type = c->get_type();
+  chdr.length = t.length();
+  ::encode(chdr, wi.compressed_bl);
+  wi.compressed_bl.claim_append(t);
+  wi.compressed_len = wi.compressed_bl.length();
+
+  logger->tinc(l_bluestore_compress_cpu_lat, thread_cputime() - cpu_start);
+  logger->tinc(l_bluestore_compress_lat, ceph_clock_now() - start);
+}
+
+/// estimate the entropy (bits per byte) of bl from up to sample bytes,
+/// taken from a few evenly spaced spots since heads are often headers
+static double sample_entropy(const bufferlist& bl, unsigned sample)
+{
+  const unsigned spots = 4;
+  unsigned len = bl.length();
+  unsigned chunk = std::min(sample, len) / spots;
+  if (!chunk) {
+    return 0;
+  }
+  unsigned hist[256] = {0};
+  for (unsigned i = 0; i < spots; ++i) {
+    bufferlist::const_iterator p(&bl, (len - chunk) / (spots - 1) * i);
+    unsigned left = chunk;
+    while (left) {
+      const char *data;
+      size_t l = p.get_ptr_and_advance(left, &data);
+      for (size_t j = 0; j < l; ++j) {
+	++hist[(unsigned char)data[j]];
+      }
+      left -= l;
+    }
+  }
+  double n = chunk * spots;
+  double e = 0;
+  for (auto h : hist) {
+    if (h) {
+      double f = h / n;
+      e -= f * log2(f);
+    }
+  }
+  return e;
+}
+
+bool BlueStore::_compress_predict(
+  WriteContext *wctx,
+  WriteContext::write_item& wi)
+{
+  if (!wctx->estimator) {
+    return true;
+  }
+  if (!wctx->estimator->should_try(comp_estimator_history,
+				   comp_estimator_probe)) {
+    dout(20) << __func__ << " 0x" << std::hex << wi.logical_offset << std::dec
+	     << " skipping, last " << wctx->estimator->failures
+	     << " attempts failed" << dendl;
+    return false;
+  }
+  unsigned sample = comp_entropy_sample;
+  if (sample) {
+    double e = sample_entropy(wi.bl, sample);
+    if (e > comp_entropy_max) {
+      dout(20) << __func__ << " 0x" << std::hex << wi.logical_offset
+	       << std::dec << " skipping, sampled entropy " << e << dendl;
+      return false;
+    }
+  }
+  return true;
+}
+
+void BlueStore::_compress_writes(CompressorRef& c, WriteContext *wctx)
+{
+  // keep the first blob for ourselves and hand the rest to the compress
+  // threads; if they are backed up, store the remainder uncompressed
+  // rather than stall this writer (and every pg sharing its shard).
+  CompressBatch batch;
+  batch.c = c;
+  WriteContext::write_item *mine = nullptr;
+  vector<WriteContext::write_item*> inline_items;
+  unsigned saturated = 0, skipped = 0;
+  vector<WriteContext::write_item*> todo;
+  for (auto& wi : wctx->writes) {
+    if (wi.blob_length <= min_alloc_size) {
+      continue;
+    }
+    if (!_compress_predict(wctx, wi)) {
+      ++skipped;
+      continue;
+    }
+    todo.push_back(&wi);
+  }
+  if (skipped) {
+    logger->inc(l_bluestore_compress_skipped_count, skipped);
+  }
+  {
+    std::lock_guard<std::mutex> l(compress_lock);
+    for (auto wi : todo) {
+      if (compress_threads.empty()) {
+	inline_items.push_back(wi);
+      } else if (!mine) {
+	mine = wi;
+      } else if (compress_queue.size() < compress_queue_max) {
+	compress_queue.push_back(CompressJob{&batch, wi});
+	++batch.pending;
+      } else {
+	++saturated;
+      }
+    }
+    if (batch.pending) {
+      logger->set(l_bluestore_compress_queue_depth, compress_queue.size());
+      compress_cond.notify_all();
+    }
+  }
+  if (mine) {
+    inline_items.push_back(mine);
+  }
+  if (saturated) {
+    dout(20) << __func__ << " compress queue full, leaving " << saturated
+	     << " blobs uncompressed" << dendl;
+    logger->inc(l_bluestore_compress_saturated_count, saturated);
+  }
+
+  for (auto wi : inline_items) {
+    _compress_write_item(c, *wi);
+  }
+  std::unique_lock<std::mutex> l(batch.lock);
+  while (batch.pending) {
+    batch.cond.wait(l);
+  }
+}
+
 int BlueStore::_do_alloc_write(
   TransContext *txc,
   CollectionRef coll,
@@ -10068,26 +11568,11 @@ int BlueStore::_do_alloc_write(
   // compress (as needed) and calc needed space
   uint64_t need = 0;
   auto max_bsize = MAX(wctx->target_blob_size, min_alloc_size);
+  if (c) {
+    _compress_writes(c, wctx);
+  }
   for (auto& wi : wctx->writes) {
-    if (c && wi.blob_length > min_alloc_size) {
-      utime_t start = ceph_clock_now();
-
-      // compress
-      assert(wi.b_off == 0);
-      assert(wi.blob_length == wi.bl.length());
-
-      // FIXME: memory alignment here is bad
-      bufferlist t;
-      int r = c->compress(wi.bl, t);
-      assert(r == 0);
-
-      bluestore_compression_header_t chdr;
-      chdr.type = c->get_type();
-      chdr.length = t.length();
-      ::encode(chdr, wi.compressed_bl);
-      wi.compressed_bl.claim_append(t);
-
-      wi.compressed_len = wi.compressed_bl.length();
+    if (wi.compressed_len) {
       uint64_t newlen = P2ROUNDUP(wi.compressed_len, min_alloc_size);
       uint64_t want_len_raw = wi.blob_length * crr;
       uint64_t want_len = P2ROUNDUP(want_len_raw, min_alloc_size);
@@ -10106,6 +11591,9 @@ int BlueStore::_do_alloc_write(
 	logger->inc(l_bluestore_compress_success_count);
 	wi.compressed = true;
 	need += newlen;
+	if (wctx->estimator) {
+	  wctx->estimator->note(true);
+	}
       } else {
 	dout(20) << __func__ << std::hex << "  0x" << wi.blob_length
 		 << " compressed to 0x" << wi.compressed_len << " -> 0x" << newlen
@@ -10116,9 +11604,10 @@ int BlueStore::_do_alloc_write(
 		 << std::dec << dendl;
 	logger->inc(l_bluestore_compress_rejected_count);
 	need += wi.blob_length;
+	if (wctx->estimator) {
+	  wctx->estimator->note(false);
+	}
       }
-      logger->tinc(l_bluestore_compress_lat,
-		   ceph_clock_now() - start);
     } else {
       need += wi.blob_length;
     }
@@ -10132,7 +11621,7 @@ int BlueStore::_do_alloc_write(
   AllocExtentVector prealloc;
   prealloc.reserve(2 * wctx->writes.size());;
   int prealloc_left = 0;
-  prealloc_left = alloc->allocate(
+  prealloc_left = _alloc_allocate(
     need, min_alloc_size, need,
     0, &prealloc);
   assert(prealloc_left == (int64_t)need);
@@ -10413,6 +11902,9 @@ void BlueStore::_choose_write_options(
       (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_INCOMPRESSIBLE) == 0) ||
      (cm == Compressor::COMP_PASSIVE &&
       (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_COMPRESSIBLE)));
+  if (wctx->compress && cm != Compressor::COMP_FORCE) {
+    wctx->estimator = &c->compress_estimators[alloc_hints];
+  }
 
   if ((alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_SEQUENTIAL_READ) &&
       (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_RANDOM_READ) == 0 &&
@@ -11785,6 +13277,37 @@ void BlueStore::flush_cache()
   }
 }
 
+void BlueStore::dump_cache_stats(Formatter *f)
+{
+  std::lock_guard<std::mutex> l(cache_tune_lock);
+  float ratio[CACHE_TYPE_MAX] = {
+    cache_meta_ratio, cache_data_ratio, cache_kv_ratio
+  };
+  static const char *names[CACHE_TYPE_MAX] = { "meta", "data", "kv" };
+  f->open_object_section("bluestore_cache");
+  f->dump_unsigned("cache_size", cache_size);
+  f->dump_bool("autotune",
+	       cct->_conf->get_val<bool>("bluestore_cache_autotune"));
+  for (int i = 0; i < CACHE_TYPE_MAX; ++i) {
+    f->open_object_section(names[i]);
+    f->dump_float("ratio", ratio[i]);
+    f->dump_unsigned("target_bytes", cache_size * ratio[i]);
+    f->dump_unsigned("used_bytes", cache_tune_usage[i]);
+    f->dump_float("miss_ratio", cache_tune_miss_ratio[i]);
+    if (i == CACHE_META) {
+      f->dump_unsigned("lru_trimmed", cache_tune_onode_trimmed);
+      f->dump_float("lru_age", cache_tune_onode_age);
+    } else if (i == CACHE_KV) {
+      f->dump_bool("hit_stats", cache_tune_kv_stats);
+    }
+    f->close_section();
+  }
+  f->dump_unsigned("autotune_moves", cache_tune_moves);
+  f->dump_stream("last_autotune") << cache_tune_stamp;
+  f->dump_string("last_decision", cache_tune_last_decision);
+  f->close_section();
+}
+
 void BlueStore::_apply_padding(uint64_t head_pad,
 			       uint64_t tail_pad,
 			       bufferlist& padded)
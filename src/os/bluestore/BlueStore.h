@@ -20,6 +20,7 @@
 #include <unistd.h>
 
 #include <atomic>
+#include <fstream>
 #include <mutex>
 #include <condition_variable>
 
@@ -60,6 +61,7 @@ enum {
   l_bluestore_kv_flush_lat,
   l_bluestore_kv_commit_lat,
   l_bluestore_kv_lat,
+  l_bluestore_kv_flushes,
   l_bluestore_state_prepare_lat,
   l_bluestore_state_aio_wait_lat,
   l_bluestore_state_io_done_lat,
@@ -77,14 +79,27 @@ enum {
   l_bluestore_read_lat,
   l_bluestore_read_onode_meta_lat,
   l_bluestore_read_wait_aio_lat,
+  l_bluestore_read_zero_copy_bytes,
+  l_bluestore_read_copy_bytes,
   l_bluestore_compress_lat,
   l_bluestore_decompress_lat,
   l_bluestore_csum_lat,
   l_bluestore_compress_success_count,
   l_bluestore_compress_rejected_count,
+  l_bluestore_compress_attempt_count,
+  l_bluestore_compress_skipped_count,
+  l_bluestore_compress_saturated_count,
+  l_bluestore_compress_queue_depth,
+  l_bluestore_compress_cpu_lat,
   l_bluestore_write_pad_bytes,
   l_bluestore_deferred_write_ops,
   l_bluestore_deferred_write_bytes,
+  l_bluestore_deferred_aggregate_ops,
+  l_bluestore_deferred_aggregate_batches,
+  l_bluestore_deferred_aggregate_writes_in,
+  l_bluestore_deferred_aggregate_writes_out,
+  l_bluestore_deferred_aggregate_seek_in,
+  l_bluestore_deferred_aggregate_seek_out,
   l_bluestore_write_penalty_read_ops,
   l_bluestore_allocated,
   l_bluestore_stored,
@@ -94,8 +109,10 @@ enum {
   l_bluestore_onodes,
   l_bluestore_onode_hits,
   l_bluestore_onode_misses,
+  l_bluestore_onode_lru_age,
   l_bluestore_onode_shard_hits,
   l_bluestore_onode_shard_misses,
+  l_bluestore_onode_shard_decode_bytes,
   l_bluestore_extents,
   l_bluestore_blobs,
   l_bluestore_buffers,
@@ -113,10 +130,16 @@ enum {
   l_bluestore_write_small_new,
   l_bluestore_txc,
   l_bluestore_onode_reshard,
+  l_bluestore_onode_reshard_deferred,
   l_bluestore_blob_split,
   l_bluestore_extent_compress,
   l_bluestore_gc_merged,
   l_bluestore_read_eio,
+  l_bluestore_cache_meta_target,
+  l_bluestore_cache_data_target,
+  l_bluestore_cache_kv_target,
+  l_bluestore_cache_autotune_moves,
+  l_bluestore_fragmentation,
   l_bluestore_last
 };
 
@@ -737,19 +760,49 @@ public:
       unsigned extents = 0;  ///< count extents in this shard
       bool loaded = false;   ///< true if shard is loaded
       bool dirty = false;    ///< true if shard is dirty and needs reencoding
+      /// encoded shard, kept while only some of its segments are decoded
+      bufferlist encoded;
+      uint64_t segments_loaded = 0;  ///< bitmap of decoded segments
     };
     mempool::bluestore_cache_other::vector<Shard> shards;    ///< shards
 
+    /// shards are split into at most this many segments (see encode_some())
+    static const unsigned MAX_SEGMENTS = 64;
+
     bufferlist inline_bl;    ///< cached encoded map, if unsharded; empty=>dirty
 
     uint32_t needs_reshard_begin = 0;
     uint32_t needs_reshard_end = 0;
+    /// the reshard cannot wait, e.g. because a blob now escapes its shard
+    bool reshard_required = false;
+
+    /// range that wants resharding but was persisted as is; the reshard
+    /// thread (or the next required reshard) takes care of it
+    uint32_t deferred_reshard_begin = 0;
+    uint32_t deferred_reshard_end = 0;
 
     bool needs_reshard() const {
       return needs_reshard_end > needs_reshard_begin;
     }
     void clear_needs_reshard() {
       needs_reshard_begin = needs_reshard_end = 0;
+      reshard_required = false;
+    }
+    bool has_deferred_reshard() const {
+      return deferred_reshard_end > deferred_reshard_begin;
+    }
+    /// move the requested reshard range to the deferred one
+    void defer_reshard() {
+      if (has_deferred_reshard()) {
+	deferred_reshard_begin = std::min(deferred_reshard_begin,
+					  needs_reshard_begin);
+	deferred_reshard_end = std::max(deferred_reshard_end,
+					needs_reshard_end);
+      } else {
+	deferred_reshard_begin = needs_reshard_begin;
+	deferred_reshard_end = needs_reshard_end;
+      }
+      clear_needs_reshard();
     }
     void request_reshard(uint32_t begin, uint32_t end) {
       if (begin < needs_reshard_begin) {
@@ -774,11 +827,19 @@ public:
       shards.clear();
       inline_bl.clear();
       clear_needs_reshard();
+      deferred_reshard_begin = deferred_reshard_end = 0;
     }
 
+    /// encode the extents in a range; with segment_extents, split them
+    /// into independently decodable segments of about that many extents
     bool encode_some(uint32_t offset, uint32_t length, bufferlist& bl,
-		     unsigned *pn);
+		     unsigned *pn, unsigned segment_extents = 0);
     unsigned decode_some(bufferlist& bl);
+    /// decode extents from p (one encoded segment) until it is exhausted
+    unsigned decode_extents(bufferptr::iterator& p, __u8 struct_v,
+			    uint64_t pos, unsigned num);
+    /// decode the segments of p->encoded that overlap [begin, end)
+    void decode_segments(Shard *p, uint32_t begin, uint32_t end);
 
     void bound_encode_spanning_blobs(size_t& p);
     void encode_spanning_blobs(bufferlist::contiguous_appender& p);
@@ -839,9 +900,12 @@ public:
       return true;
     }
 
-    /// ensure that a range of the map is loaded
+    /// ensure that a range of the map is loaded.  for_read only decodes
+    /// the shard segments the range touches, so the range may be read
+    /// but not modified afterwards.
     void fault_range(KeyValueDB *db,
-		     uint32_t offset, uint32_t length);
+		     uint32_t offset, uint32_t length,
+		     bool for_read = false);
 
     /// ensure a range of the map is marked dirty
     void dirty_range(uint32_t offset, uint32_t length);
@@ -1007,6 +1071,12 @@ public:
     mempool::bluestore_cache_other::string key;
 
     boost::intrusive::list_member_hook<> lru_item;
+    /// looked up since the trimmer last passed us; the lru touch is
+    /// deferred so that lookups need not take the cache lock
+    std::atomic_bool lru_touched = {false};
+    /// when we were created or the lru last applied a touch
+    ceph::coarse_mono_time lru_stamp = ceph::coarse_mono_clock::now();
+    uint16_t cache_private = 0; ///< opaque (to us) value used by Cache impl
 
     bluestore_onode_t onode;  ///< metadata stored as value in kv store
     bool exists;              ///< true if object logically exists
@@ -1016,6 +1086,11 @@ public:
     // track txc's that have not been committed to kv store (and whose
     // effects cannot be read via the kvdb read methods)
     std::atomic<int> flushing_count = {0};
+    /// txc's that will write us but have not encoded us yet
+    std::atomic<int> txc_pending = {0};
+    /// a deferred reshard of us is being committed; txc's that write us
+    /// wait for it in _txc_write_nodes so that they commit after it
+    std::atomic<bool> reshard_committing = {false};
     std::mutex flush_lock;  ///< protect flush_txns
     std::condition_variable flush_cond;   ///< wait here for uncommitted txns
 
@@ -1200,16 +1275,15 @@ public:
 #endif
   };
 
-  // 2Q cache for buffers, LRU for onodes
+  // 2Q cache for buffers and onodes
   struct TwoQCache : public Cache {
   private:
-    // stick with LRU for onodes for now (fixme?)
     typedef boost::intrusive::list<
       Onode,
       boost::intrusive::member_hook<
         Onode,
 	boost::intrusive::list_member_hook<>,
-	&Onode::lru_item> > onode_lru_list_t;
+	&Onode::lru_item> > onode_list_t;
     typedef boost::intrusive::list<
       Buffer,
       boost::intrusive::member_hook<
@@ -1217,7 +1291,20 @@ public:
 	boost::intrusive::list_member_hook<>,
 	&Buffer::lru_item> > buffer_list_t;
 
-    onode_lru_list_t onode_lru;
+    onode_list_t onode_hot;        ///< "Am" hot onodes
+    onode_list_t onode_warm_in;    ///< "A1in" newly warm onodes
+    /// "A1out" hashes of onodes we've evicted from warm_in, newest first
+    mempool::bluestore_cache_other::list<size_t> onode_warm_out;
+    mempool::bluestore_cache_other::unordered_map<
+      size_t, mempool::bluestore_cache_other::list<size_t>::iterator>
+      onode_warm_out_map;
+
+    enum {
+      ONODE_NEW = 0,
+      ONODE_WARM_IN,       ///< in onode_warm_in
+      ONODE_WARM_IN_SCAN,  ///< in onode_warm_in; don't remember on eviction
+      ONODE_HOT,           ///< in onode_hot
+    };
 
     buffer_list_t buffer_hot;      ///< "Am" hot buffers
     buffer_list_t buffer_warm_in;  ///< "A1in" newly warm buffers
@@ -1237,17 +1324,22 @@ public:
   public:
     TwoQCache(CephContext* cct) : Cache(cct) {}
     uint64_t _get_num_onodes() override {
-      return onode_lru.size();
-    }
-    void _add_onode(OnodeRef& o, int level) override {
-      if (level > 0)
-	onode_lru.push_front(*o);
-      else
-	onode_lru.push_back(*o);
+      return onode_hot.size() + onode_warm_in.size();
     }
+    void _add_onode(OnodeRef& o, int level) override;
     void _rm_onode(OnodeRef& o) override {
-      auto q = onode_lru.iterator_to(*o);
-      onode_lru.erase(q);
+      switch (o->cache_private) {
+      case ONODE_WARM_IN:
+      case ONODE_WARM_IN_SCAN:
+	onode_warm_in.erase(onode_warm_in.iterator_to(*o));
+	break;
+      case ONODE_HOT:
+	onode_hot.erase(onode_hot.iterator_to(*o));
+	break;
+      default:
+	assert(0 == "bad cache_private");
+      }
+      o->cache_private = ONODE_NEW;
     }
     void _touch_onode(OnodeRef& o) override;
 
@@ -1278,12 +1370,19 @@ public:
 
     void _trim(uint64_t onode_max, uint64_t buffer_max) override;
 
+    /// evict up to num onodes from the cold end of list, skipping pinned
+    /// ones (and touched ones, if requeue_touched)
+    void _trim_onodes(onode_list_t& list, int num, bool requeue_touched,
+		      bool trim_all, int *skipped);
+    /// drop h from warm_out; return true if it was there
+    bool _forget_onode(size_t h);
+
     void add_stats(uint64_t *onodes, uint64_t *extents,
 		   uint64_t *blobs,
 		   uint64_t *buffers,
 		   uint64_t *bytes) override {
       std::lock_guard<std::recursive_mutex> l(lock);
-      *onodes += onode_lru.size();
+      *onodes += onode_hot.size() + onode_warm_in.size();
       *extents += num_extents;
       *blobs += num_blobs;
       *buffers += buffer_hot.size() + buffer_warm_in.size();
@@ -1299,22 +1398,28 @@ public:
   private:
     Cache *cache;
 
+    /// protect onode_map.  lookup() takes only this (shared); everything
+    /// that also modifies the lru takes cache->lock first.
+    RWLock lock;
+
     /// forward lookups
     mempool::bluestore_cache_other::unordered_map<ghobject_t,OnodeRef> onode_map;
 
     friend class Collection; // for split_cache()
 
   public:
-    OnodeSpace(Cache *c) : cache(c) {}
+    OnodeSpace(Cache *c)
+      : cache(c),
+	lock("BlueStore::OnodeSpace::lock", false, false) {}
     ~OnodeSpace() {
       clear();
     }
 
-    OnodeRef add(const ghobject_t& oid, OnodeRef o);
-    OnodeRef lookup(const ghobject_t& o);
-    void remove(const ghobject_t& oid) {
-      onode_map.erase(oid);
-    }
+    OnodeRef add(const ghobject_t& oid, OnodeRef o, int level = 1);
+    OnodeRef lookup(const ghobject_t& o, bool touch = true);
+    /// drop o from the map unless someone besides the map and the
+    /// caller holds a ref.  caller holds cache->lock.
+    bool try_remove(Onode *o);
     void rename(OnodeRef& o, const ghobject_t& old_oid,
 		const ghobject_t& new_oid,
 		const mempool::bluestore_cache_other::string& new_okey);
@@ -1327,6 +1432,32 @@ public:
     bool map_any(std::function<bool(OnodeRef)> f);
   };
 
+  /// recent compression outcomes for similar writes, used to skip
+  /// compressing data that is not going to meet the required ratio
+  struct CompressEstimator {
+    uint32_t failures = 0;  ///< consecutive rejected attempts
+    uint32_t skipped = 0;   ///< blobs skipped since the last probe
+
+    bool should_try(unsigned history, unsigned probe) {
+      if (!history || failures < history) {
+	return true;
+      }
+      if (++skipped >= probe) {
+	skipped = 0;
+	return true;
+      }
+      return false;
+    }
+    void note(bool success) {
+      if (success) {
+	failures = 0;
+	skipped = 0;
+      } else {
+	++failures;
+      }
+    }
+  };
+
   struct Collection : public CollectionImpl {
     BlueStore *store;
     Cache *cache;       ///< our cache shard
@@ -1345,7 +1476,12 @@ public:
     //pool options
     pool_opts_t pool_opts;
 
-    OnodeRef get_onode(const ghobject_t& oid, bool create);
+    /// compression outcomes by object alloc hint flags; protected by lock
+    map<uint32_t,CompressEstimator> compress_estimators;
+
+    /// promote=false hints a one-time access (scrub, backfill scans)
+    OnodeRef get_onode(const ghobject_t& oid, bool create,
+		       bool promote = true);
 
     // the terminology is confusing here, sorry!
     //
@@ -1579,7 +1715,9 @@ public:
     }
 
     void write_onode(OnodeRef &o) {
-      onodes.insert(o);
+      if (onodes.insert(o).second) {
+	++o->txc_pending;
+      }
     }
     void write_shared_blob(SharedBlobRef &sb) {
       shared_blobs.insert(sb);
@@ -1594,7 +1732,9 @@ public:
       modified_objects.insert(o);
     }
     void removed(OnodeRef& o) {
-      onodes.erase(o);
+      if (onodes.erase(o)) {
+	--o->txc_pending;
+      }
       modified_objects.erase(o);
     }
 
@@ -1621,6 +1761,7 @@ public:
     IOContext ioc;                   ///< our aios
     /// bytes of pending io for each deferred seq (may be 0)
     map<uint64_t,int> seq_bytes;
+    ceph::mono_time start = ceph::mono_clock::now(); ///< first io queued
 
     void _discard(CephContext *cct, uint64_t offset, uint64_t length);
     void _audit(CephContext *cct);
@@ -1638,6 +1779,20 @@ public:
     }
   };
 
+  /// deferred batches from several osrs written out as one elevator pass
+  struct DeferredAggregate : public AioContext {
+    vector<DeferredBatch*> batches;  ///< running batches we complete
+    IOContext ioc;                   ///< our aios
+    bool retry = false;              ///< retry submit once we land
+
+    explicit DeferredAggregate(CephContext *cct)
+      : ioc(cct, this) {}
+
+    void aio_finish(BlueStore *store) override {
+      store->_deferred_aggregate_aio_finish(this);
+    }
+  };
+
   class OpSequencer : public Sequencer_impl {
   public:
     std::mutex qlock;
@@ -1666,6 +1821,8 @@ public:
 
     std::atomic_int kv_submitted_waiters = {0};
 
+    unsigned kv_shard = 0;  ///< index into BlueStore::kv_shards
+
     std::atomic_bool registered = {true}; ///< registered in BlueStore's osr_set
     std::atomic_bool zombie = {false};    ///< owning Sequencer has gone away
 
@@ -1769,23 +1926,64 @@ public:
       boost::intrusive::list_member_hook<>,
       &OpSequencer::deferred_osr_queue_item> > deferred_osr_queue_t;
 
+  struct KVShard;
+
   struct KVSyncThread : public Thread {
     BlueStore *store;
-    explicit KVSyncThread(BlueStore *s) : store(s) {}
+    KVShard *shard;
+    KVSyncThread(BlueStore *s, KVShard *ks) : store(s), shard(ks) {}
     void *entry() override {
-      store->_kv_sync_thread();
+      store->_kv_sync_thread(shard);
       return NULL;
     }
   };
   struct KVFinalizeThread : public Thread {
     BlueStore *store;
-    explicit KVFinalizeThread(BlueStore *s) : store(s) {}
+    KVShard *shard;
+    KVFinalizeThread(BlueStore *s, KVShard *ks) : store(s), shard(ks) {}
     void *entry() {
-      store->_kv_finalize_thread();
+      store->_kv_finalize_thread(shard);
       return NULL;
     }
   };
 
+  /// a kv_sync/kv_finalize thread pair.  every OpSequencer is pinned to
+  /// one shard, so per-sequencer commit order is kept (deferred cleanup
+  /// included); rocksdb orders submissions from different shards in its
+  /// WAL.  collection ops are a barrier across shards (see
+  /// _kv_barrier_preceding).  the deferred max_delay timer and bluefs
+  /// rebalancing are only done by shard 0.
+  struct KVShard {
+    const unsigned id;
+
+    KVSyncThread kv_sync_thread;
+    std::mutex kv_lock;
+    std::condition_variable kv_cond;
+    bool kv_sync_started = false;
+    bool kv_stop = false;
+    bool kv_finalize_started = false;
+    bool kv_finalize_stop = false;
+    deque<TransContext*> kv_queue;             ///< ready, already submitted
+    deque<TransContext*> kv_queue_unsubmitted; ///< ready, need submit by kv thread
+    deque<TransContext*> kv_committing;        ///< currently syncing
+    deque<DeferredBatch*> deferred_done_queue;   ///< deferred ios done
+    deque<DeferredBatch*> deferred_stable_queue; ///< deferred ios done + stable
+
+    uint64_t kv_ios = 0;
+    uint64_t kv_throttle_costs = 0;
+
+    KVFinalizeThread kv_finalize_thread;
+    std::mutex kv_finalize_lock;
+    std::condition_variable kv_finalize_cond;
+    deque<TransContext*> kv_committing_to_finalize;   ///< pending finalization
+    deque<DeferredBatch*> deferred_stable_to_finalize; ///< pending finalization
+
+    KVShard(BlueStore *store, unsigned i)
+      : id(i),
+	kv_sync_thread(store, this),
+	kv_finalize_thread(store, this) {}
+  };
+
   struct DBHistogram {
     struct value_dist {
       uint64_t count;
@@ -1822,6 +2020,13 @@ private:
   std::string freelist_type;
   FreelistManager *fm = nullptr;
   Allocator *alloc = nullptr;
+
+  std::mutex alloc_trace_lock;     ///< protects alloc_trace
+  std::atomic<bool> alloc_tracing = {false};
+  std::atomic<unsigned> alloc_untraced = {0};  ///< calls in flight, untraced
+  std::ofstream alloc_trace;       ///< see set_alloc_trace()
+  ceph::mono_time alloc_trace_start;
+
   uuid_d fsid;
   int path_fd = -1;  ///< open handle to $path
   int fsid_fd = -1;  ///< open handle (locked) to $path/fsid
@@ -1851,30 +2056,15 @@ private:
   deferred_osr_queue_t deferred_queue; ///< osr's with deferred io pending
   int deferred_queue_size = 0;         ///< num txc's queued across all osrs
   atomic_int deferred_aggressive = {0}; ///< aggressive wakeup of kv thread
+  uint64_t deferred_last_offset = 0;   ///< end of last submitted deferred write
   Finisher deferred_finisher;
 
   int m_finisher_num = 1;
   vector<Finisher*> finishers;
 
-  KVSyncThread kv_sync_thread;
-  std::mutex kv_lock;
-  std::condition_variable kv_cond;
   bool _kv_only = false;
-  bool kv_sync_started = false;
-  bool kv_stop = false;
-  bool kv_finalize_started = false;
-  bool kv_finalize_stop = false;
-  deque<TransContext*> kv_queue;             ///< ready, already submitted
-  deque<TransContext*> kv_queue_unsubmitted; ///< ready, need submit by kv thread
-  deque<TransContext*> kv_committing;        ///< currently syncing
-  deque<DeferredBatch*> deferred_done_queue;   ///< deferred ios done
-  deque<DeferredBatch*> deferred_stable_queue; ///< deferred ios done + stable
-
-  KVFinalizeThread kv_finalize_thread;
-  std::mutex kv_finalize_lock;
-  std::condition_variable kv_finalize_cond;
-  deque<TransContext*> kv_committing_to_finalize;   ///< pending finalization
-  deque<DeferredBatch*> deferred_stable_to_finalize; ///< pending finalization
+  vector<KVShard*> kv_shards;  ///< see KVShard
+  std::mutex kv_max_lock;      ///< serializes {nid,blobid}_max increases
 
   PerfCounters *logger = nullptr;
 
@@ -1904,6 +2094,12 @@ private:
   ///< number threshold for forced deferred writes
   std::atomic<int> deferred_batch_ops = {0};
 
+  ///< max time a deferred batch may wait for its siblings (0 = forever)
+  std::atomic<double> deferred_max_delay = {0};
+
+  ///< merge pending deferred batches across osrs into one submission
+  std::atomic<bool> deferred_aggregate = {false};
+
   ///< size threshold for forced deferred writes
   std::atomic<uint64_t> prefer_deferred_size = {0};
 
@@ -1915,11 +2111,17 @@ private:
   CompressorRef compressor;
   std::atomic<uint64_t> comp_min_blob_size = {0};
   std::atomic<uint64_t> comp_max_blob_size = {0};
+  std::atomic<unsigned> comp_estimator_history = {0};
+  std::atomic<unsigned> comp_estimator_probe = {1};
+  std::atomic<unsigned> comp_entropy_sample = {0};
+  std::atomic<double> comp_entropy_max = {8.0};
 
   std::atomic<uint64_t> max_blob_size = {0};  ///< maximum blob size
 
-  uint64_t kv_ios = 0;
-  uint64_t kv_throttle_costs = 0;
+  ///< extents per separately decodable segment of an extent map shard
+  std::atomic<unsigned> extent_map_segment_extents = {0};
+  ///< persist badly sized shards as they are and reshard them later
+  std::atomic<bool> extent_map_reshard_deferred = {false};
 
   // cache trim control
   uint64_t cache_size = 0;      ///< total cache size
@@ -1927,6 +2129,29 @@ private:
   float cache_kv_ratio = 0;     ///< cache ratio dedicated to kv (e.g., rocksdb)
   float cache_data_ratio = 0;   ///< cache ratio dedicated to object data
 
+  // cache autotuning (see _tune_cache_ratios)
+  enum {
+    CACHE_META = 0,
+    CACHE_DATA,
+    CACHE_KV,
+    CACHE_TYPE_MAX
+  };
+  struct cache_tune_sample_t {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+  std::mutex cache_tune_lock;   ///< protect ratios and tune state vs dump
+  cache_tune_sample_t cache_tune_last[CACHE_TYPE_MAX]; ///< counters last pass
+  double cache_tune_miss_ratio[CACHE_TYPE_MAX] = {0};  ///< over last interval
+  uint64_t cache_tune_usage[CACHE_TYPE_MAX] = {0};     ///< bytes at last pass
+  pair<uint64_t,uint64_t> cache_tune_last_age; ///< onode lru age count, sum ms
+  uint64_t cache_tune_onode_trimmed = 0; ///< onodes trimmed in last interval
+  double cache_tune_onode_age = 0;  ///< their mean time unused, seconds
+  bool cache_tune_kv_stats = false; ///< kv cache hits/misses were available
+  utime_t cache_tune_stamp;      ///< time of last autotune pass
+  uint64_t cache_tune_moves = 0; ///< chunks moved since mount
+  string cache_tune_last_decision;
+
   std::mutex vstatfs_lock;
   volatile_statfs vstatfs;
 
@@ -1953,6 +2178,21 @@ private:
     }
   } mempool_thread;
 
+  /// reshards extent maps whose reshard was deferred by _txc_write_nodes
+  struct ReshardThread : public Thread {
+    BlueStore *store;
+    explicit ReshardThread(BlueStore *s) : store(s) {}
+    void *entry() override {
+      store->_reshard_thread();
+      return NULL;
+    }
+  } reshard_thread;
+  std::mutex reshard_lock;
+  std::condition_variable reshard_cond;
+  deque<pair<CollectionRef,ghobject_t>> reshard_queue;
+  bool reshard_stop = false;
+  bool reshard_paused = false;  ///< for tests, see inject_reshard_pause()
+
   // --------------------------------------------------------
   // private methods
 
@@ -1969,6 +2209,7 @@ private:
   void _close_fsid();
   void _set_alloc_sizes();
   void _set_blob_size();
+  void _set_extent_map_params();
 
   int _open_bdev(bool create);
   void _close_bdev();
@@ -1982,6 +2223,12 @@ private:
   void _close_fm();
   int _open_alloc();
   void _close_alloc();
+  /// allocate/release through these so that an active trace sees them
+  int64_t _alloc_allocate(uint64_t want_size, uint64_t alloc_unit,
+			  uint64_t max_alloc_size, int64_t hint,
+			  AllocExtentVector *extents);
+  void _alloc_release(const interval_set<uint64_t>& release_set);
+  void _alloc_trace_stop();
   int _open_collections(int *errors=0);
   void _close_collections();
 
@@ -2009,6 +2256,7 @@ private:
   void _queue_reap_collection(CollectionRef& c);
   void _reap_collections();
   void _update_cache_logger();
+  void _tune_cache_ratios(float bytes_per_onode);
 
   void _assign_nid(TransContext *txc, OnodeRef o);
   uint64_t _assign_blobid(TransContext *txc);
@@ -2022,6 +2270,7 @@ private:
   void _txc_add_transaction(TransContext *txc, Transaction *t);
   void _txc_calc_cost(TransContext *txc);
   void _txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t);
+  void _record_onode(OnodeRef &o, KeyValueDB::Transaction t);
   void _txc_state_proc(TransContext *txc);
   void _txc_aio_submit(TransContext *txc);
 public:
@@ -2038,12 +2287,22 @@ private:
 
   void _osr_drain_preceding(TransContext *txc);
   void _osr_drain_all();
+  void _kv_barrier_preceding(OpSequencer *osr);
+  static bool _is_collection_transaction(Transaction& t);
   void _osr_unregister_all();
 
   void _kv_start();
   void _kv_stop();
-  void _kv_sync_thread();
-  void _kv_finalize_thread();
+  void _reshard_start();
+  void _reshard_stop();
+  void _reshard_thread();
+  void _reshard_queue(OnodeRef &o);
+  bool _reshard_deferred(CollectionRef &c, const ghobject_t &oid);
+  void _kv_sync_thread(KVShard *ks);
+  void _kv_finalize_thread(KVShard *ks);
+  KVShard *_get_kv_shard(OpSequencer *osr) {
+    return kv_shards[osr->kv_shard % kv_shards.size()];
+  }
 
   bluestore_deferred_op_t *_get_deferred_op(TransContext *txc, OnodeRef o);
   void _deferred_queue(TransContext *txc);
@@ -2051,7 +2310,10 @@ public:
   void deferred_try_submit();
 private:
   void _deferred_submit_unlock(OpSequencer *osr);
+  void _deferred_aggregate_submit_unlock(vector<OpSequencer*>& osrs);
+  bool _deferred_expired();
   void _deferred_aio_finish(OpSequencer *osr);
+  void _deferred_aggregate_aio_finish(DeferredAggregate *a);
   int _deferred_replay();
 
 public:
@@ -2080,7 +2342,12 @@ private:
 
   int _collection_list(
     Collection *c, const ghobject_t& start, const ghobject_t& end,
-    int max, vector<ghobject_t> *ls, ghobject_t *next);
+    int max, vector<ghobject_t> *ls, ghobject_t *next,
+    const set<string> *attrs = nullptr,
+    vector<object_meta_t> *meta = nullptr);
+  bool _get_object_meta(
+    Collection *c, const ghobject_t& oid, KeyValueDB::Iterator& it,
+    const set<string>& attrs, object_meta_t *m);
 
   template <typename T, typename F>
   T select_option(const std::string& opt_name, T val1, F f) {
@@ -2098,12 +2365,15 @@ private:
 
   // -- ondisk version ---
 public:
-  const int32_t latest_ondisk_format = 2;        ///< our version
+  const int32_t latest_ondisk_format = 3;        ///< our version
   const int32_t min_readable_ondisk_format = 1;  ///< what we can read
   const int32_t min_compat_ondisk_format = 2;    ///< who can read us
+  /// who can read us once extent map shards may be segmented
+  const int32_t segmented_shards_ondisk_format = 3;
 
 private:
   int32_t ondisk_format = 0;  ///< value detected on mount
+  int32_t compat_ondisk_format = 0;  ///< who can read us, as in the super
 
   int _upgrade_super();  ///< upgrade (called during open_super)
   void _prepare_ondisk_format_super(KeyValueDB::Transaction& t);
@@ -2189,6 +2459,8 @@ public:
   void generate_db_histogram(Formatter *f) override;
   void _flush_cache();
   void flush_cache() override;
+  void dump_cache_stats(Formatter *f) override;
+  int set_alloc_trace(const string& path) override;
   void dump_perf_counters(Formatter *f) override {
     f->open_object_section("perf_counters");
     logger->dump_formatted(f, false);
@@ -2223,7 +2495,8 @@ public:
     CollectionHandle &c,
     const ghobject_t& oid,
     struct stat *st,
-    bool allow_eio = false) override;
+    bool allow_eio = false,
+    uint32_t op_flags = 0) override;
   int read(
     const coll_t& cid,
     const ghobject_t& oid,
@@ -2263,12 +2536,12 @@ public:
   int getattr(const coll_t& cid, const ghobject_t& oid, const char *name,
 	      bufferptr& value) override;
   int getattr(CollectionHandle &c, const ghobject_t& oid, const char *name,
-	      bufferptr& value) override;
+	      bufferptr& value, uint32_t op_flags = 0) override;
 
   int getattrs(const coll_t& cid, const ghobject_t& oid,
 	       map<string,bufferptr>& aset) override;
   int getattrs(CollectionHandle &c, const ghobject_t& oid,
-	       map<string,bufferptr>& aset) override;
+	       map<string,bufferptr>& aset, uint32_t op_flags = 0) override;
 
   int list_collections(vector<coll_t>& ls) override;
 
@@ -2288,6 +2561,13 @@ public:
 		      const ghobject_t& end,
 		      int max,
 		      vector<ghobject_t> *ls, ghobject_t *next) override;
+  int collection_list_meta(CollectionHandle &c,
+			   const ghobject_t& start,
+			   const ghobject_t& end,
+			   int max,
+			   const set<string> &attrs,
+			   vector<object_meta_t> *ls,
+			   ghobject_t *next) override;
 
   int omap_get(
     const coll_t& cid,                ///< [in] Collection containing oid
@@ -2413,6 +2693,11 @@ public:
     RWLock::WLocker l(debug_read_error_lock);
     debug_mdata_error_objects.insert(o);
   }
+  /// hold deferred reshards in the queue until unpaused or unmounted
+  void inject_reshard_pause(bool pause);
+  /// offsets of the extent map shards of an object, for tests
+  int get_extent_map_shards(const coll_t& cid, const ghobject_t& oid,
+			    vector<uint32_t> *offsets);
   void compact() override {
     assert(db);
     db->compact();
@@ -2465,6 +2750,7 @@ private:
     bool compress = false;          ///< compressed write
     uint64_t target_blob_size = 0;  ///< target (max) blob size
     unsigned csum_order = 0;        ///< target checksum chunk order
+    CompressEstimator *estimator = nullptr; ///< null: always try to compress
 
     old_extent_map_t old_extents;   ///< must deref these blobs
 
@@ -2513,6 +2799,7 @@ private:
       compress = other.compress;
       target_blob_size = other.target_blob_size;
       csum_order = other.csum_order;
+      estimator = other.estimator;
     }
     void write(
       uint64_t loffs,
@@ -2542,6 +2829,40 @@ private:
       uint64_t min_alloc_size);
   };
 
+  /// blobs of one _do_alloc_write being compressed by the compress threads
+  struct CompressBatch {
+    CompressorRef c;
+    std::mutex lock;
+    std::condition_variable cond;
+    unsigned pending = 0;  ///< jobs not yet done
+  };
+  struct CompressJob {
+    CompressBatch *batch;
+    WriteContext::write_item *wi;
+  };
+  struct CompressThread : public Thread {
+    BlueStore *store;
+    explicit CompressThread(BlueStore *s) : store(s) {}
+    void *entry() override {
+      store->_compress_thread();
+      return NULL;
+    }
+  };
+
+  vector<CompressThread*> compress_threads;
+  std::mutex compress_lock;
+  std::condition_variable compress_cond;
+  deque<CompressJob> compress_queue;
+  bool compress_stop = false;
+  std::atomic<uint64_t> compress_queue_max = {0};
+
+  void _compress_start();
+  void _compress_stop();
+  void _compress_thread();
+  void _compress_write_item(CompressorRef& c, WriteContext::write_item& wi);
+  bool _compress_predict(WriteContext *wctx, WriteContext::write_item& wi);
+  void _compress_writes(CompressorRef& c, WriteContext *wctx);
+
   void _do_write_small(
     TransContext *txc,
     CollectionRef &c,
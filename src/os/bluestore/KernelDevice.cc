@@ -19,6 +19,7 @@
 #include <fcntl.h>
 
 #include "KernelDevice.h"
+#include "ioring.h"
 #include "include/types.h"
 #include "include/compat.h"
 #include "include/stringify.h"
@@ -38,11 +39,27 @@ KernelDevice::KernelDevice(CephContext* cct, aio_callback_t cb, void *cbpriv)
     fd_buffered(-1),
     fs(NULL), aio(false), dio(false),
     debug_lock("KernelDevice::debug_lock"),
-    aio_queue(cct->_conf->bdev_aio_max_queue_depth),
     aio_stop(false),
     aio_thread(this),
     injecting_crash(0)
 {
+  unsigned iodepth = cct->_conf->bdev_aio_max_queue_depth;
+  const string& engine = cct->_conf->get_val<string>("bdev_ioengine");
+
+  if (engine == "io_uring") {
+    if (ioring_queue_t::supported()) {
+      io_queue = std::unique_ptr<io_queue_t>(
+	new ioring_queue_t(
+	  iodepth,
+	  cct->_conf->get_val<bool>("bdev_ioring_sqthread_poll")));
+    } else {
+      derr << __func__ << " io_uring is not supported by this build or"
+	   << " kernel, falling back to libaio" << dendl;
+    }
+  }
+  if (!io_queue) {
+    io_queue = std::unique_ptr<io_queue_t>(new aio_queue_t(iodepth));
+  }
 }
 
 int KernelDevice::_lock()
@@ -316,7 +333,9 @@ int KernelDevice::_aio_start()
 {
   if (aio) {
     dout(10) << __func__ << dendl;
-    int r = aio_queue.init();
+    // only O_DIRECT io goes through the queue
+    std::vector<int> fds = { fd_direct };
+    int r = io_queue->init(fds);
     if (r < 0) {
       if (r == -EAGAIN) {
 	derr << __func__ << " io_setup(2) failed with EAGAIN; "
@@ -338,7 +357,7 @@ void KernelDevice::_aio_stop()
     aio_stop = true;
     aio_thread.join();
     aio_stop = false;
-    aio_queue.shutdown();
+    io_queue->shutdown();
   }
 }
 
@@ -350,7 +369,7 @@ void KernelDevice::_aio_thread()
     dout(40) << __func__ << " polling" << dendl;
     int max = cct->_conf->bdev_aio_reap_max;
     aio_t *aio[max];
-    int r = aio_queue.get_next_completed(cct->_conf->bdev_aio_poll_ms,
+    int r = io_queue->get_next_completed(cct->_conf->bdev_aio_poll_ms,
 					 aio, max);
     if (r < 0) {
       derr << __func__ << " got " << cpp_strerror(r) << dendl;
@@ -533,7 +552,7 @@ void KernelDevice::aio_submit(IOContext *ioc)
 
   void *priv = static_cast<void*>(ioc);
   int r, retries = 0;
-  r = aio_queue.submit_batch(ioc->running_aios.begin(), e, 
+  r = io_queue->submit_batch(ioc->running_aios.begin(), e, 
 			     pending, priv, &retries);
   
   if (retries)
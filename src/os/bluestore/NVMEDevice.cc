@@ -25,6 +25,7 @@
 #include <chrono>
 #include <functional>
 #include <map>
+#include <memory>
 #include <thread>
 
 #include <spdk/nvme.h>
@@ -45,8 +46,6 @@
 #undef dout_prefix
 #define dout_prefix *_dout << "bdev(" << sn << ") "
 
-thread_local SharedDriverQueueData *queue_t;
-
 static constexpr uint16_t data_buffer_default_num = 1024;
 
 static constexpr uint32_t data_buffer_size = 8192;
@@ -90,6 +89,7 @@ class SharedDriverData {
 
   public:
   std::vector<NVMEDevice*> registered_devices;
+  std::atomic_int queue_number = {0};
   friend class SharedDriverQueueData;
   SharedDriverData(unsigned _id, const std::string &sn_tag,
                    spdk_nvme_ctrlr *c, spdk_nvme_ns *ns)
@@ -128,7 +128,6 @@ class SharedDriverData {
 };
 
 class SharedDriverQueueData {
-  NVMEDevice *bdev;
   SharedDriverData *driver;
   spdk_nvme_ctrlr *ctrlr;
   spdk_nvme_ns *ns;
@@ -137,7 +136,8 @@ class SharedDriverQueueData {
   uint32_t sector_size;
   uint32_t max_queue_depth;
   struct spdk_nvme_qpair *qpair;
-  bool reap_io = false;
+  uint32_t max_io_completion;
+  uint64_t io_sleep_in_us;
   int alloc_buf_from_pool(Task *t, bool write);
 
   public:
@@ -145,15 +145,17 @@ class SharedDriverQueueData {
     std::atomic_ulong completed_op_seq, queue_op_seq;
     std::vector<void*> data_buf_mempool;
     PerfCounters *logger = nullptr;
-    void _aio_handle(Task *t, IOContext *ioc);
+    void _aio_handle(NVMEDevice *bdev, Task *t, IOContext *ioc);
 
-    SharedDriverQueueData(NVMEDevice *bdev, SharedDriverData *driver)
-      : bdev(bdev),
-        driver(driver) {
+    explicit SharedDriverQueueData(SharedDriverData *driver)
+      : driver(driver) {
     ctrlr = driver->ctrlr;
     ns = driver->ns;
     block_size = driver->block_size;
     sector_size = driver->sector_size;
+    max_io_completion =
+      (uint32_t)g_conf->get_val<uint64_t>("bluestore_spdk_max_io_completion");
+    io_sleep_in_us = g_conf->get_val<uint64_t>("bluestore_spdk_io_sleep");
 
     struct spdk_nvme_io_qpair_opts opts = {};
     spdk_nvme_ctrlr_get_default_io_qpair_opts(ctrlr, &opts, sizeof(opts));
@@ -186,16 +188,14 @@ class SharedDriverQueueData {
     b.add_u64_counter(l_bluestore_nvmedevice_buffer_alloc_failed, "buffer_alloc_failed", "Alloc data buffer failed count");
     logger = b.create_perf_counters();
     g_ceph_context->get_perfcounters_collection()->add(logger);
-    bdev->queue_number++;
-    if(bdev->queue_number.load() == 1)
-      reap_io = true;
+    driver->queue_number++;
   }
 
   ~SharedDriverQueueData() {
     g_ceph_context->get_perfcounters_collection()->remove(logger);
-    if (!qpair) {
+    if (qpair) {
       spdk_nvme_ctrlr_free_io_qpair(qpair);
-      bdev->queue_number--;
+      driver->queue_number--;
     }
 
     // free all spdk dma memory;
@@ -212,6 +212,12 @@ class SharedDriverQueueData {
   }
 };
 
+// every thread submitting I/O owns a qpair per controller, polled inline
+// by that thread, so no I/O is ever handed to another thread.  they live
+// as long as the thread (the drivers outlive it).
+thread_local std::map<SharedDriverData*,
+                      std::unique_ptr<SharedDriverQueueData>> queue_t;
+
 struct Task {
   NVMEDevice *device;
   IOContext *ctx = nullptr;
@@ -352,14 +358,13 @@ int SharedDriverQueueData::alloc_buf_from_pool(Task *t, bool write)
   return 0;
 }
 
-void SharedDriverQueueData::_aio_handle(Task *t, IOContext *ioc)
+void SharedDriverQueueData::_aio_handle(NVMEDevice *bdev, Task *t,
+				       IOContext *ioc)
 {
   dout(20) << __func__ << " start" << dendl;
 
   int r = 0;
   uint64_t lba_off, lba_count;
-  uint32_t max_io_completion = (uint32_t)g_conf->get_val<uint64_t>("bluestore_spdk_max_io_completion");
-  uint64_t io_sleep_in_us = g_conf->get_val<uint64_t>("bluestore_spdk_io_sleep");
 
   ceph::coarse_real_clock::time_point cur, start
     = ceph::coarse_real_clock::now();
@@ -370,7 +375,7 @@ void SharedDriverQueueData::_aio_handle(Task *t, IOContext *ioc)
       r = spdk_nvme_qpair_process_completions(qpair, max_io_completion);
       if (r < 0) {
         ceph_abort();
-      } else if (r == 0) {
+      } else if (r == 0 && io_sleep_in_us) {
         usleep(io_sleep_in_us);
       }
     }
@@ -458,8 +463,7 @@ void SharedDriverQueueData::_aio_handle(Task *t, IOContext *ioc)
     start = ceph::coarse_real_clock::now();
   }
 
-  if(reap_io)
-    bdev->reap_ioc();
+  bdev->reap_ioc();
   dout(20) << __func__ << " end" << dendl;
 }
 
@@ -506,8 +510,8 @@ class NVMEManager {
     dout(1) << __func__ << " successfully attach nvme device at" << spdk_pci_device_get_bus(pci_dev)
             << ":" << spdk_pci_device_get_dev(pci_dev) << ":" << spdk_pci_device_get_func(pci_dev) << dendl;
 
-    // only support one device per osd now!
-    assert(shared_driver_datas.empty());
+    // threads keep a queue pair per controller (see queue_t), so e.g.
+    // block and block.db may be on different devices
     // index 0 is occured by master thread
     shared_driver_datas.push_back(new SharedDriverData(shared_driver_datas.size()+1, sn_tag, c, ns));
     *driver = shared_driver_datas.back();
@@ -838,9 +842,10 @@ void NVMEDevice::aio_submit(IOContext *ioc)
     assert(ioc->num_pending.load() == 0);  // we should be only thread doing this
     // Only need to push the first entry
     ioc->nvme_task_first = ioc->nvme_task_last = nullptr;
-    if(!queue_t)
-	queue_t = new SharedDriverQueueData(this, driver);
-    queue_t->_aio_handle(t, ioc);
+    auto &queue = queue_t[driver];
+    if (!queue)
+      queue.reset(new SharedDriverQueueData(driver));
+    queue->_aio_handle(this, t, ioc);
   }
 }
 
@@ -28,6 +28,7 @@ class PMEMDevice : public BlockDevice {
   int fd;
   char *addr; //the address of mmap
   std::string path;
+  bool emulated = false;  ///< a regular file standing in for pmem
 
   Mutex debug_lock;
   interval_set<uint64_t> debug_inflight;
@@ -39,6 +40,8 @@ public:
   PMEMDevice(CephContext *cct, aio_callback_t cb, void *cbpriv);
 
 
+  bool is_pmem() override { return true; }
+
   void aio_submit(IOContext *ioc) override;
 
   int collect_metadata(const std::string& prefix, map<std::string,std::string> *pm) const override;
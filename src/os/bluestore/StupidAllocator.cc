@@ -10,8 +10,8 @@
 #undef dout_prefix
 #define dout_prefix *_dout << "stupidalloc "
 
-StupidAllocator::StupidAllocator(CephContext* cct)
-  : cct(cct), num_free(0),
+StupidAllocator::StupidAllocator(CephContext* cct, int64_t block_size)
+  : cct(cct), block_size(block_size), num_free(0),
     num_reserved(0),
     free(10),
     last_alloc(0)
@@ -263,9 +263,32 @@ uint64_t StupidAllocator::get_free()
   return num_free;
 }
 
+double StupidAllocator::get_fragmentation()
+{
+  std::lock_guard<std::mutex> l(lock);
+  return _get_fragmentation();
+}
+
+double StupidAllocator::_get_fragmentation()
+{
+  // extents in different bins may be adjacent, so this slightly
+  // overestimates.
+  uint64_t free_blocks = num_free / block_size;
+  if (free_blocks <= 1) {
+    return .0;
+  }
+  uint64_t num_extents = 0;
+  for (auto& bin : free) {
+    num_extents += bin.num_intervals();
+  }
+  return (static_cast<double>(num_extents - 1) / (free_blocks - 1));
+}
+
 void StupidAllocator::dump()
 {
   std::lock_guard<std::mutex> l(lock);
+  ldout(cct, 0) << __func__ << " fragmentation " << _get_fragmentation()
+		<< dendl;
   for (unsigned bin = 0; bin < free.size(); ++bin) {
     ldout(cct, 0) << __func__ << " free bin " << bin << ": "
 	    	  << free[bin].num_intervals() << " extents" << dendl;
@@ -278,6 +301,27 @@ void StupidAllocator::dump()
   }
 }
 
+int StupidAllocator::foreach_free(
+  std::function<void(uint64_t offset, uint64_t length)> notify)
+{
+  // the bins are not ordered relative to each other and may hold
+  // adjacent extents; merge them so callers see what a single free
+  // map would look like.
+  interval_set<uint64_t> all;
+  {
+    std::lock_guard<std::mutex> l(lock);
+    for (auto& bin : free) {
+      for (auto p = bin.begin(); p != bin.end(); ++p) {
+	all.insert(p.get_start(), p.get_len());
+      }
+    }
+  }
+  for (auto p = all.begin(); p != all.end(); ++p) {
+    notify(p.get_start(), p.get_len());
+  }
+  return 0;
+}
+
 void StupidAllocator::init_add_free(uint64_t offset, uint64_t length)
 {
   std::lock_guard<std::mutex> l(lock);
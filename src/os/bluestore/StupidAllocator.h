@@ -14,6 +14,7 @@
 
 class StupidAllocator : public Allocator {
   CephContext* cct;
+  const uint64_t block_size;
   std::mutex lock;
 
   int64_t num_free;     ///< total bytes in freelist
@@ -29,13 +30,14 @@ class StupidAllocator : public Allocator {
 
   unsigned _choose_bin(uint64_t len);
   void _insert_free(uint64_t offset, uint64_t len);
+  double _get_fragmentation();
 
   uint64_t _aligned_len(
     interval_set_t::iterator p,
     uint64_t alloc_unit);
 
 public:
-  StupidAllocator(CephContext* cct);
+  StupidAllocator(CephContext* cct, int64_t block_size);
   ~StupidAllocator() override;
 
   int reserve(uint64_t need) override;
@@ -53,8 +55,11 @@ public:
     const interval_set<uint64_t>& release_set) override;
 
   uint64_t get_free() override;
+  double get_fragmentation() override;
 
   void dump() override;
+  int foreach_free(
+    std::function<void(uint64_t offset, uint64_t length)> notify) override;
 
   void init_add_free(uint64_t offset, uint64_t length) override;
   void init_rm_free(uint64_t offset, uint64_t length) override;
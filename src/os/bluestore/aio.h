@@ -36,7 +36,8 @@ struct aio_t {
     offset = _offset;
     length = len;
     bufferptr p = buffer::create_page_aligned(length);
-    io_prep_pread(&iocb, fd, p.c_str(), length, offset);
+    iov.push_back({p.c_str(), (size_t)length});
+    io_prep_preadv(&iocb, fd, &iov[0], iov.size(), offset);
     bl.append(std::move(p));
   }
 
@@ -52,21 +53,33 @@ typedef boost::intrusive::list<
     boost::intrusive::list_member_hook<>,
     &aio_t::queue_item> > aio_list_t;
 
-struct aio_queue_t {
+/// submission/completion queue for aio_t's; see bdev_ioengine
+struct io_queue_t {
+  typedef list<aio_t>::iterator aio_iter;
+
+  virtual ~io_queue_t() {}
+
+  /// @param fds files that will be used for io (may be registered)
+  virtual int init(std::vector<int> &fds) = 0;
+  virtual void shutdown() = 0;
+  virtual int submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size,
+			   void *priv, int *retries) = 0;
+  virtual int get_next_completed(int timeout_ms, aio_t **paio, int max) = 0;
+};
+
+struct aio_queue_t final : public io_queue_t {
   int max_iodepth;
   io_context_t ctx;
 
-  typedef list<aio_t>::iterator aio_iter;
-
   explicit aio_queue_t(unsigned max_iodepth)
     : max_iodepth(max_iodepth),
       ctx(0) {
   }
-  ~aio_queue_t() {
+  ~aio_queue_t() final {
     assert(ctx == 0);
   }
 
-  int init() {
+  int init(std::vector<int> &fds) final {
     assert(ctx == 0);
     int r = io_setup(max_iodepth, &ctx);
     if (r < 0) {
@@ -77,7 +90,7 @@ struct aio_queue_t {
     }
     return r;
   }
-  void shutdown() {
+  void shutdown() final {
     if (ctx) {
       int r = io_destroy(ctx);
       assert(r == 0);
@@ -86,8 +99,8 @@ struct aio_queue_t {
   }
 
   int submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size, 
-		   void *priv, int *retries);
-  int get_next_completed(int timeout_ms, aio_t **paio, int max);
+		   void *priv, int *retries) final;
+  int get_next_completed(int timeout_ms, aio_t **paio, int max) final;
 };
 
 #endif
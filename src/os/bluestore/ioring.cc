@@ -0,0 +1,251 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "ioring.h"
+
+#if defined(HAVE_LIBAIO)
+
+#if defined(HAVE_LIBURING)
+
+#include <liburing.h>
+#include <sys/epoll.h>
+
+#include <map>
+#include <mutex>
+
+#include "include/compat.h"
+
+struct ioring_data {
+  struct io_uring io_uring;
+  std::mutex sq_mutex;        ///< the sq ring is not safe for concurrent use
+  int epoll_fd = -1;
+  std::map<int, int> fixed_fds_map;  ///< real fd -> registered index
+};
+
+static int ioring_get_cqe(ioring_data *d, unsigned int max,
+			  struct aio_t **paio)
+{
+  struct io_uring *ring = &d->io_uring;
+  struct io_uring_cqe *cqe;
+
+  unsigned nr = 0;
+  unsigned head;
+  io_uring_for_each_cqe(ring, head, cqe) {
+    struct aio_t *io = (struct aio_t *)(uintptr_t) io_uring_cqe_get_data(cqe);
+    io->rval = cqe->res;
+
+    paio[nr++] = io;
+
+    if (nr == max)
+      break;
+  }
+  io_uring_cq_advance(ring, nr);
+
+  return nr;
+}
+
+static int find_fixed_fd(ioring_data *d, int real_fd)
+{
+  auto it = d->fixed_fds_map.find(real_fd);
+  if (it == d->fixed_fds_map.end())
+    return -1;
+
+  return it->second;
+}
+
+static void init_sqe(ioring_data *d, struct io_uring_sqe *sqe,
+		     struct aio_t *io)
+{
+  int fixed_fd = find_fixed_fd(d, io->fd);
+
+  assert(fixed_fd != -1);
+
+  if (io->iocb.aio_lio_opcode == IO_CMD_PWRITEV)
+    io_uring_prep_writev(sqe, fixed_fd, &io->iov[0],
+			 io->iov.size(), io->offset);
+  else if (io->iocb.aio_lio_opcode == IO_CMD_PREADV)
+    io_uring_prep_readv(sqe, fixed_fd, &io->iov[0],
+			io->iov.size(), io->offset);
+  else
+    assert(0 == "unexpected aio opcode");
+
+  io_uring_sqe_set_data(sqe, io);
+  io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+}
+
+ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool sq_thread_)
+  : d(new ioring_data),
+    iodepth(iodepth_),
+    sq_thread(sq_thread_)
+{
+}
+
+ioring_queue_t::~ioring_queue_t()
+{
+}
+
+bool ioring_queue_t::supported()
+{
+  struct io_uring ring;
+  int ret = io_uring_queue_init(16, &ring, 0);
+  if (ret < 0)
+    return false;
+  io_uring_queue_exit(&ring);
+  return true;
+}
+
+int ioring_queue_t::init(std::vector<int> &fds)
+{
+  unsigned flags = 0;
+
+  if (sq_thread)
+    flags |= IORING_SETUP_SQPOLL;
+
+  int ret = io_uring_queue_init(iodepth, &d->io_uring, flags);
+  if (ret < 0)
+    return ret;
+
+  ret = io_uring_register_files(&d->io_uring, &fds[0], fds.size());
+  if (ret < 0)
+    goto close_ring_fd;
+
+  for (unsigned i = 0; i < fds.size(); i++)
+    d->fixed_fds_map[fds[i]] = i;
+
+  d->epoll_fd = epoll_create1(0);
+  if (d->epoll_fd < 0) {
+    ret = -errno;
+    goto close_ring_fd;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ret = epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, d->io_uring.ring_fd, &ev);
+  if (ret < 0) {
+    ret = -errno;
+    goto close_epoll_fd;
+  }
+
+  return 0;
+
+close_epoll_fd:
+  VOID_TEMP_FAILURE_RETRY(::close(d->epoll_fd));
+  d->epoll_fd = -1;
+close_ring_fd:
+  io_uring_queue_exit(&d->io_uring);
+  d->fixed_fds_map.clear();
+
+  return ret;
+}
+
+void ioring_queue_t::shutdown()
+{
+  d->fixed_fds_map.clear();
+  VOID_TEMP_FAILURE_RETRY(::close(d->epoll_fd));
+  d->epoll_fd = -1;
+  io_uring_queue_exit(&d->io_uring);
+}
+
+int ioring_queue_t::submit_batch(aio_iter beg, aio_iter end,
+				 uint16_t aios_size, void *priv,
+				 int *retries)
+{
+  // 2^16 * 125us = ~8 seconds, so max sleep is ~16 seconds
+  int attempts = 16;
+  int delay = 125;
+
+  std::lock_guard<std::mutex> l(d->sq_mutex);
+
+  int done = 0;
+  aio_iter cur = beg;
+  while (cur != end) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&d->io_uring);
+    if (!sqe) {
+      // sq ring is full: push out what we have and try again
+      int r = io_uring_submit(&d->io_uring);
+      if (r < 0)
+	return r;
+      if (r == 0) {
+	if (attempts-- <= 0)
+	  return -EAGAIN;
+	usleep(delay);
+	delay *= 2;
+	(*retries)++;
+      }
+      continue;
+    }
+    cur->priv = priv;
+    init_sqe(d.get(), sqe, &*cur);
+    ++cur;
+    ++done;
+  }
+  assert(aios_size >= done);
+
+  int r = io_uring_submit(&d->io_uring);
+  if (r < 0)
+    return r;
+  return done;
+}
+
+int ioring_queue_t::get_next_completed(int timeout_ms, aio_t **paio, int max)
+{
+get_cqe:
+  int events = ioring_get_cqe(d.get(), max, paio);
+
+  if (events == 0) {
+    struct epoll_event ev;
+    int ret = epoll_wait(d->epoll_fd, &ev, 1, timeout_ms);
+    if (ret < 0 && errno != EINTR)
+      events = -errno;
+    else if (ret > 0)
+      // Time to reap
+      goto get_cqe;
+  }
+
+  return events;
+}
+
+#else // #if defined(HAVE_LIBURING)
+
+struct ioring_data {};
+
+ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool sq_thread_)
+{
+  ceph_abort();
+}
+
+ioring_queue_t::~ioring_queue_t()
+{
+  ceph_abort();
+}
+
+bool ioring_queue_t::supported()
+{
+  return false;
+}
+
+int ioring_queue_t::init(std::vector<int> &fds)
+{
+  ceph_abort();
+}
+
+void ioring_queue_t::shutdown()
+{
+  ceph_abort();
+}
+
+int ioring_queue_t::submit_batch(aio_iter beg, aio_iter end,
+				 uint16_t aios_size, void *priv,
+				 int *retries)
+{
+  ceph_abort();
+}
+
+int ioring_queue_t::get_next_completed(int timeout_ms, aio_t **paio, int max)
+{
+  ceph_abort();
+}
+
+#endif // #if defined(HAVE_LIBURING)
+
+#endif // #if defined(HAVE_LIBAIO)
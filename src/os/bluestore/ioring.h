@@ -0,0 +1,37 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#pragma once
+
+#include "acconfig.h"
+#ifdef HAVE_LIBAIO
+
+#include <memory>
+
+#include "aio.h"
+
+struct ioring_data;
+
+/// io_uring based io_queue_t.  fds passed to init() are registered with
+/// the ring; with sq_thread a kernel thread polls the submission queue,
+/// so submit_batch usually needs no syscall at all.
+struct ioring_queue_t final : public io_queue_t {
+  std::unique_ptr<ioring_data> d;
+  unsigned iodepth = 0;
+  bool sq_thread = false;
+
+  ioring_queue_t(unsigned iodepth_, bool sq_thread_);
+  ~ioring_queue_t() final;
+
+  /// true if we were built with liburing and the kernel supports it
+  static bool supported();
+
+  int init(std::vector<int> &fds) final;
+  void shutdown() final;
+
+  int submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size,
+		   void *priv, int *retries) final;
+  int get_next_completed(int timeout_ms, aio_t **paio, int max) final;
+};
+
+#endif
@@ -158,7 +158,7 @@ int MemStore::_load()
     int r = cbl.read_file(fn.c_str(), &err);
     if (r < 0)
       return r;
-    CollectionRef c(new Collection(cct, *q));
+    CollectionRef c(new Collection(cct, *q, page_arena));
     bufferlist::iterator p = cbl.begin();
     c->decode(p);
     coll_map[*q] = c;
@@ -287,7 +287,8 @@ int MemStore::stat(
   CollectionHandle &c_,
   const ghobject_t& oid,
   struct stat *st,
-  bool allow_eio)
+  bool allow_eio,
+  uint32_t op_flags)
 {
   Collection *c = static_cast<Collection*>(c_.get());
   dout(10) << __func__ << " " << c->cid << " " << oid << dendl;
@@ -393,7 +394,7 @@ int MemStore::getattr(const coll_t& cid, const ghobject_t& oid,
 }
 
 int MemStore::getattr(CollectionHandle &c_, const ghobject_t& oid,
-		      const char *name, bufferptr& value)
+		      const char *name, bufferptr& value, uint32_t op_flags)
 {
   Collection *c = static_cast<Collection*>(c_.get());
   dout(10) << __func__ << " " << c->cid << " " << oid << " " << name << dendl;
@@ -421,7 +422,7 @@ int MemStore::getattrs(const coll_t& cid, const ghobject_t& oid,
 }
 
 int MemStore::getattrs(CollectionHandle &c_, const ghobject_t& oid,
-		       map<string,bufferptr>& aset)
+		       map<string,bufferptr>& aset, uint32_t op_flags)
 {
   Collection *c = static_cast<Collection*>(c_.get());
   dout(10) << __func__ << " " << c->cid << " " << oid << dendl;
@@ -1368,7 +1369,7 @@ int MemStore::_create_collection(const coll_t& cid, int bits)
   auto result = coll_map.insert(std::make_pair(cid, CollectionRef()));
   if (!result.second)
     return -EEXIST;
-  result.first->second.reset(new Collection(cct, cid));
+  result.first->second.reset(new Collection(cct, cid, page_arena));
   result.first->second->bits = bits;
   return 0;
 }
@@ -1584,14 +1585,22 @@ int BufferlistObject::truncate(uint64_t size)
 
 struct MemStore::PageSetObject : public Object {
   PageSet data;
-  uint64_t data_len;
+  // writers to disjoint ranges may race to extend the object
+  std::atomic<uint64_t> data_len;
 #if defined(__GLIBCXX__)
   // use a thread-local vector for the pages returned by PageSet, so we
   // can avoid allocations in read/write()
   static thread_local PageSet::page_vector tls_pages;
 #endif
 
-  explicit PageSetObject(size_t page_size) : data(page_size), data_len(0) {}
+  PageSetObject(size_t page_size, unsigned stripes,
+                std::shared_ptr<PageArena> arena)
+    : data(page_size, stripes, std::move(arena)), data_len(0) {}
+
+  void extend(uint64_t offset) {
+    uint64_t len = data_len;
+    while (len < offset && !data_len.compare_exchange_weak(len, offset)) ;
+  }
 
   size_t get_size() const override { return data_len; }
 
@@ -1603,14 +1612,17 @@ struct MemStore::PageSetObject : public Object {
 
   void encode(bufferlist& bl) const override {
     ENCODE_START(1, 1, bl);
-    ::encode(data_len, bl);
+    uint64_t len = data_len;
+    ::encode(len, bl);
     data.encode(bl);
     encode_base(bl);
     ENCODE_FINISH(bl);
   }
   void decode(bufferlist::iterator& p) override {
     DECODE_START(1, p);
-    ::decode(data_len, p);
+    uint64_t len;
+    ::decode(len, p);
+    data_len = len;
     data.decode(p);
     decode_base(p);
     DECODE_FINISH(p);
@@ -1696,8 +1708,7 @@ int MemStore::PageSetObject::write(uint64_t offset, const bufferlist &src)
     if (count == pageoff)
       ++page;
   }
-  if (data_len < offset)
-    data_len = offset;
+  extend(offset);
   tls_pages.clear(); // drop page refs
   return 0;
 }
@@ -1787,8 +1798,7 @@ int MemStore::PageSetObject::clone(Object *src, uint64_t srcoff,
   }
 
   // update object size
-  if (data_len < dstoff)
-    data_len = dstoff;
+  extend(dstoff);
   return 0;
 }
 
@@ -1818,6 +1828,7 @@ int MemStore::PageSetObject::truncate(uint64_t size)
 
 MemStore::ObjectRef MemStore::Collection::create_object() const {
   if (use_page_set)
-    return new PageSetObject(cct->_conf->memstore_page_size);
+    return new PageSetObject(cct->_conf->memstore_page_size,
+                             page_set_stripes, page_arena);
   return new BufferlistObject();
 }
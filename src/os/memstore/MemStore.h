@@ -98,6 +98,8 @@ public:
     int bits = 0;
     CephContext *cct;
     bool use_page_set;
+    unsigned page_set_stripes;
+    std::shared_ptr<PageArena> page_arena; ///< or nullptr to use the heap
     ceph::unordered_map<ghobject_t, ObjectRef> object_hash;  ///< for lookup
     map<ghobject_t, ObjectRef> object_map;        ///< for iteration
     map<string,bufferptr> xattr;
@@ -177,10 +179,14 @@ public:
       return result;
     }
 
-    explicit Collection(CephContext *cct, coll_t c)
+    Collection(CephContext *cct, coll_t c,
+	       std::shared_ptr<PageArena> arena = nullptr)
       : cid(c),
 	cct(cct),
 	use_page_set(cct->_conf->memstore_page_set),
+	page_set_stripes(cct->_conf->get_val<uint64_t>(
+			   "memstore_page_set_stripes")),
+	page_arena(std::move(arena)),
         lock("MemStore::Collection::lock", true, false),
 	exists(true) {}
   };
@@ -199,6 +205,9 @@ private:
 
   uint64_t used_bytes;
 
+  /// shared by the page sets of all collections, if enabled
+  std::shared_ptr<PageArena> page_arena;
+
   void _do_transaction(Transaction& t);
 
   int _touch(const coll_t& cid, const ghobject_t& oid);
@@ -241,7 +250,15 @@ public:
     : ObjectStore(cct, path),
       coll_lock("MemStore::coll_lock"),
       finisher(cct),
-      used_bytes(0) {}
+      used_bytes(0) {
+    if (cct->_conf->memstore_page_set &&
+	cct->_conf->get_val<bool>("memstore_page_set_arena")) {
+      page_arena = std::make_shared<PageArena>(
+	cct->_conf->memstore_page_size,
+	cct->_conf->get_val<uint64_t>("memstore_page_set_arena_chunk_size"),
+	cct->_conf->get_val<bool>("memstore_page_set_huge_pages"));
+    }
+  }
   ~MemStore() override { }
 
   string get_type() override {
@@ -292,7 +309,8 @@ public:
   int stat(const coll_t& cid, const ghobject_t& oid,
 	   struct stat *st, bool allow_eio = false) override;
   int stat(CollectionHandle &c, const ghobject_t& oid,
-	   struct stat *st, bool allow_eio = false) override;
+	   struct stat *st, bool allow_eio = false,
+	   uint32_t op_flags = 0) override;
   int set_collection_opts(
     const coll_t& cid,
     const pool_opts_t& opts) override;
@@ -316,11 +334,11 @@ public:
   int getattr(const coll_t& cid, const ghobject_t& oid, const char *name,
 	      bufferptr& value) override;
   int getattr(CollectionHandle &c, const ghobject_t& oid, const char *name,
-	      bufferptr& value) override;
+	      bufferptr& value, uint32_t op_flags = 0) override;
   int getattrs(const coll_t& cid, const ghobject_t& oid,
 	       map<string,bufferptr>& aset) override;
   int getattrs(CollectionHandle &c, const ghobject_t& oid,
-	       map<string,bufferptr>& aset) override;
+	       map<string,bufferptr>& aset, uint32_t op_flags = 0) override;
 
   int list_collections(vector<coll_t>& ls) override;
 
@@ -18,13 +18,19 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <vector>
+#include <sys/mman.h>
 #include <boost/intrusive/avl_set.hpp>
 #include <boost/intrusive_ptr.hpp>
 
 #include "include/encoding.h"
 
+class PageArena;
+
 struct Page {
   char *const data;
   boost::intrusive::avl_set_member_hook<> hook;
@@ -33,7 +39,7 @@ struct Page {
   // avoid RefCountedObject because it has a virtual destructor
   std::atomic<uint16_t> nrefs;
   void get() { ++nrefs; }
-  void put() { if (--nrefs == 0) delete this; }
+  void put() { if (--nrefs == 0) release(); }
 
   typedef boost::intrusive_ptr<Page> Ref;
   friend void intrusive_ptr_add_ref(Page *p) { p->get(); }
@@ -69,24 +75,168 @@ struct Page {
     // place the Page structure at the end of the buffer
     return new (buffer + page_size) Page(buffer, offset);
   }
+  // take the Page and its data from an arena instead of the heap
+  static inline Ref create(PageArena *arena, uint64_t offset = 0);
 
   // copy disabled
   Page(const Page&) = delete;
   const Page& operator=(const Page&) = delete;
 
  private: // private constructor, use create() instead
-  Page(char *data, uint64_t offset) : data(data), offset(offset), nrefs(1) {}
+  friend class PageArena;
+  Page(char *data, uint64_t offset, PageArena *arena = nullptr)
+    : data(data), offset(offset), nrefs(1), arena(arena) {}
+
+  PageArena *const arena; // or nullptr if allocated by create(page_size)
+
+  inline void release();
 
   static void operator delete(void *p) {
     delete[] reinterpret_cast<Page*>(p)->data;
   }
 };
 
+// hands out pages carved from large chunks, optionally backed by huge
+// pages, and recycles freed pages rather than returning them to malloc.
+// the data of each page is page_size aligned within its chunk, and the
+// Page structures live in a separate array so they don't break that up
+class PageArena {
+ public:
+  static constexpr size_t huge_page_size = 2 << 20;
+
+ private:
+  struct Chunk {
+    char *data;
+    size_t length;
+    char *headers;
+  };
+  struct Slot {
+    char *data;
+    void *header;
+  };
+
+  const size_t page_size;
+  const size_t chunk_size; // a multiple of page_size
+  const bool huge_pages;
+
+  std::mutex mutex;
+  std::vector<Chunk> chunks;
+  std::vector<Slot> free_slots;
+
+  static size_t round_chunk_size(size_t page_size, size_t chunk_size,
+                                 bool huge_pages) {
+    if (huge_pages)
+      chunk_size = std::max(chunk_size, huge_page_size);
+    chunk_size = std::max(chunk_size, page_size);
+    return (chunk_size + page_size - 1) / page_size * page_size;
+  }
+
+  char *map_chunk() {
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge_pages && chunk_size % huge_page_size == 0)
+      p = ::mmap(nullptr, chunk_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+      // no reserved huge pages; fall back to transparent huge pages
+      p = ::mmap(nullptr, chunk_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED)
+        throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+      if (huge_pages)
+        ::madvise(p, chunk_size, MADV_HUGEPAGE);
+#endif
+    }
+    return static_cast<char*>(p);
+  }
+
+  // call with mutex held
+  void add_chunk() {
+    const size_t count = chunk_size / page_size;
+    Chunk chunk;
+    chunk.data = map_chunk();
+    chunk.length = chunk_size;
+    chunk.headers = new char[count * sizeof(Page)];
+    chunks.push_back(chunk);
+    // hand out the lowest addresses first
+    free_slots.reserve(free_slots.size() + count);
+    for (size_t i = count; i > 0; i--)
+      free_slots.push_back(Slot{chunk.data + (i - 1) * page_size,
+                                chunk.headers + (i - 1) * sizeof(Page)});
+  }
+
+ public:
+  PageArena(size_t page_size, size_t chunk_size, bool huge_pages = false)
+    : page_size(page_size),
+      chunk_size(round_chunk_size(page_size, chunk_size, huge_pages)),
+      huge_pages(huge_pages) {}
+  ~PageArena() {
+    // every page must have been released back to the arena
+    assert(free_slots.size() == chunks.size() * (chunk_size / page_size));
+    for (auto &chunk : chunks) {
+      ::munmap(chunk.data, chunk.length);
+      delete[] chunk.headers;
+    }
+  }
+
+  // disable copy
+  PageArena(const PageArena&) = delete;
+  const PageArena& operator=(const PageArena&) = delete;
+
+  size_t get_page_size() const { return page_size; }
+  size_t get_chunk_size() const { return chunk_size; }
+
+  // bytes mapped for page data, and pages that are not in use
+  size_t get_mapped() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return chunks.size() * chunk_size;
+  }
+  size_t get_free_pages() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return free_slots.size();
+  }
+
+  Page::Ref alloc(uint64_t offset) {
+    Slot slot;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (free_slots.empty())
+        add_chunk();
+      slot = free_slots.back();
+      free_slots.pop_back();
+    }
+    return new (slot.header) Page(slot.data, offset, this);
+  }
+
+  void free(Page *page) {
+    Slot slot{page->data, page};
+    page->~Page();
+    std::lock_guard<std::mutex> lock(mutex);
+    free_slots.push_back(slot);
+  }
+};
+
+Page::Ref Page::create(PageArena *arena, uint64_t offset) {
+  return arena->alloc(offset);
+}
+
+void Page::release() {
+  if (arena)
+    arena->free(this);
+  else
+    delete this;
+}
+
 class PageSet {
  public:
   // alloc_range() and get_range() return page refs in a vector
   typedef std::vector<Page::Ref> page_vector;
 
+  // pages are striped over the trees in runs of this many pages
+  static constexpr uint64_t stripe_pages = 16;
+
  private:
   // store pages in a boost intrusive avl_set
   typedef Page::Less page_cmp;
@@ -98,13 +248,43 @@ class PageSet {
 
   typedef typename page_set::iterator iterator;
 
-  page_set pages;
+  typedef std::mutex lock_type;
+
+  // each stripe has its own tree and lock, so that writers to disjoint
+  // ranges of the same object don't serialize on a single mutex
+  struct Stripe {
+    page_set pages;
+    lock_type mutex;
+  };
+
   uint64_t page_size;
+  unsigned nstripes;
+  std::unique_ptr<Stripe[]> stripes;
+  std::shared_ptr<PageArena> arena;
 
-  typedef std::mutex lock_type;
-  lock_type mutex;
+  Stripe& stripe_of(uint64_t offset) const {
+    return stripes[(offset / page_size / stripe_pages) % nstripes];
+  }
+  // first and last+1 byte of the run of pages containing offset
+  uint64_t run_start(uint64_t offset) const {
+    if (nstripes == 1)
+      return 0;
+    return offset - offset % (page_size * stripe_pages);
+  }
+  uint64_t run_end(uint64_t offset) const {
+    if (nstripes == 1)
+      return std::numeric_limits<uint64_t>::max();
+    return run_start(offset) + page_size * stripe_pages;
+  }
 
-  void free_pages(iterator cur, iterator end) {
+  Page::Ref create_page(uint64_t offset = 0) {
+    // decode() may have changed our page size
+    if (arena && arena->get_page_size() == page_size)
+      return Page::create(arena.get(), offset);
+    return Page::create(page_size, offset);
+  }
+
+  static void free_pages(page_set &pages, iterator cur, iterator end) {
     while (cur != end) {
       Page *page = &*cur;
       cur = pages.erase(cur);
@@ -127,61 +307,90 @@ class PageSet {
   }
 
  public:
-  explicit PageSet(size_t page_size) : page_size(page_size) {}
+  explicit PageSet(size_t page_size, unsigned nstripes = 1,
+                   std::shared_ptr<PageArena> arena = nullptr)
+    : page_size(page_size),
+      nstripes(std::max(nstripes, 1u)),
+      stripes(new Stripe[this->nstripes]),
+      arena(std::move(arena)) {}
   PageSet(PageSet &&rhs)
-    : pages(std::move(rhs.pages)), page_size(rhs.page_size) {}
+    : page_size(rhs.page_size),
+      nstripes(rhs.nstripes),
+      stripes(std::move(rhs.stripes)),
+      arena(std::move(rhs.arena)) {}
   ~PageSet() {
-    free_pages(pages.begin(), pages.end());
+    if (!stripes)
+      return; // moved from
+    for (unsigned i = 0; i < nstripes; i++)
+      free_pages(stripes[i].pages, stripes[i].pages.begin(),
+                 stripes[i].pages.end());
   }
 
   // disable copy
   PageSet(const PageSet&) = delete;
   const PageSet& operator=(const PageSet&) = delete;
 
-  bool empty() const { return pages.empty(); }
-  size_t size() const { return pages.size(); }
+  bool empty() const {
+    for (unsigned i = 0; i < nstripes; i++)
+      if (!stripes[i].pages.empty())
+        return false;
+    return true;
+  }
+  size_t size() const {
+    size_t count = 0;
+    for (unsigned i = 0; i < nstripes; i++)
+      count += stripes[i].pages.size();
+    return count;
+  }
   size_t get_page_size() const { return page_size; }
+  unsigned get_num_stripes() const { return nstripes; }
 
   // allocate all pages that intersect the range [offset,length)
   void alloc_range(uint64_t offset, uint64_t length, page_vector &range) {
     // loop in reverse so we can provide hints to avl_set::insert_check()
-    //	and get O(1) insertions after the first
+    //	and get O(1) insertions after the first in each run
     uint64_t position = offset + length - 1;
 
     range.resize(count_pages(offset, length));
     auto out = range.rbegin();
 
-    std::lock_guard<lock_type> lock(mutex);
-    iterator cur = pages.end();
     while (length) {
-      const uint64_t page_offset = position & ~(page_size-1);
-
-      typename page_set::insert_commit_data commit;
-      auto insert = pages.insert_check(cur, page_offset, page_cmp(), commit);
-      if (insert.second) {
-        auto page = Page::create(page_size, page_offset);
-        cur = pages.insert_commit(*page, commit);
-
-        // assume that the caller will write to the range [offset,length),
-        //  so we only need to zero memory outside of this range
-
-        // zero end of page past offset + length
-        if (offset + length < page->offset + page_size)
-          std::fill(page->data + offset + length - page->offset,
-                    page->data + page_size, 0);
-        // zero front of page between page_offset and offset
-        if (offset > page->offset)
-          std::fill(page->data, page->data + offset - page->offset, 0);
-      } else { // exists
-        cur = insert.first;
+      Stripe &stripe = stripe_of(position);
+      const uint64_t start = run_start(position);
+
+      std::lock_guard<lock_type> lock(stripe.mutex);
+      iterator cur = stripe.pages.end();
+      while (length && position >= start) {
+        const uint64_t page_offset = position & ~(page_size-1);
+
+        typename page_set::insert_commit_data commit;
+        auto insert = stripe.pages.insert_check(cur, page_offset, page_cmp(),
+                                                commit);
+        if (insert.second) {
+          auto page = create_page(page_offset);
+          cur = stripe.pages.insert_commit(*page, commit);
+
+          // assume that the caller will write to the range [offset,length),
+          //  so we only need to zero memory outside of this range
+
+          // zero end of page past offset + length
+          if (offset + length < page->offset + page_size)
+            std::fill(page->data + offset + length - page->offset,
+                      page->data + page_size, 0);
+          // zero front of page between page_offset and offset
+          if (offset > page->offset)
+            std::fill(page->data, page->data + offset - page->offset, 0);
+        } else { // exists
+          cur = insert.first;
+        }
+        // add a reference to output vector
+        out->reset(&*cur);
+        ++out;
+
+        auto c = std::min(length, (position & (page_size-1)) + 1);
+        position -= c;
+        length -= c;
       }
-      // add a reference to output vector
-      out->reset(&*cur);
-      ++out;
-
-      auto c = std::min(length, (position & (page_size-1)) + 1);
-      position -= c;
-      length -= c;
     }
     // make sure we sized the vector correctly
     assert(out == range.rend());
@@ -189,38 +398,65 @@ class PageSet {
 
   // return all allocated pages that intersect the range [offset,length)
   void get_range(uint64_t offset, uint64_t length, page_vector &range) {
-    auto cur = pages.lower_bound(offset & ~(page_size-1), page_cmp());
-    while (cur != pages.end() && cur->offset < offset + length)
-      range.push_back(&*cur++);
+    const uint64_t end = offset + length;
+    uint64_t position = offset & ~(page_size-1);
+    while (position < end) {
+      Stripe &stripe = stripe_of(position);
+      const uint64_t stop = std::min(end, run_end(position));
+
+      std::lock_guard<lock_type> lock(stripe.mutex);
+      auto cur = stripe.pages.lower_bound(position, page_cmp());
+      while (cur != stripe.pages.end() && cur->offset < stop)
+        range.push_back(&*cur++);
+      position = stop;
+    }
   }
 
   void free_pages_after(uint64_t offset) {
-    std::lock_guard<lock_type> lock(mutex);
-    auto cur = pages.lower_bound(offset & ~(page_size-1), page_cmp());
-    if (cur == pages.end())
-      return;
-    if (cur->offset < offset)
-      cur++;
-    free_pages(cur, pages.end());
+    for (unsigned i = 0; i < nstripes; i++) {
+      auto &pages = stripes[i].pages;
+      std::lock_guard<lock_type> lock(stripes[i].mutex);
+      auto cur = pages.lower_bound(offset & ~(page_size-1), page_cmp());
+      if (cur == pages.end())
+        continue;
+      if (cur->offset < offset)
+        cur++;
+      free_pages(pages, cur, pages.end());
+    }
   }
 
   void encode(bufferlist &bl) const {
     ::encode(page_size, bl);
-    unsigned count = pages.size();
+    unsigned count = size();
     ::encode(count, bl);
-    for (auto p = pages.rbegin(); p != pages.rend(); ++p)
-      p->encode(bl, page_size);
+    if (nstripes == 1) {
+      for (auto p = stripes[0].pages.rbegin(); p != stripes[0].pages.rend(); ++p)
+        p->encode(bl, page_size);
+      return;
+    }
+    // merge the stripes so the encoding doesn't depend on the striping
+    std::vector<const Page*> sorted;
+    sorted.reserve(count);
+    for (unsigned i = 0; i < nstripes; i++)
+      for (auto &page : stripes[i].pages)
+        sorted.push_back(&page);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const Page *l, const Page *r) { return l->offset > r->offset; });
+    for (auto page : sorted)
+      page->encode(bl, page_size);
   }
   void decode(bufferlist::iterator &p) {
     assert(empty());
     ::decode(page_size, p);
     unsigned count;
     ::decode(count, p);
-    auto cur = pages.end();
+    // pages are encoded in descending order, so each one goes at the
+    // front of its stripe
     for (unsigned i = 0; i < count; i++) {
-      auto page = Page::create(page_size);
+      auto page = create_page();
       page->decode(p, page_size);
-      cur = pages.insert_before(cur, *page);
+      auto &pages = stripe_of(page->offset).pages;
+      pages.insert_before(pages.begin(), *page);
     }
   }
 };
@@ -2268,6 +2268,22 @@ will start to track new ops received afterwards.";
     store->generate_db_histogram(f);
   } else if (admin_command == "flush_store_cache") {
     store->flush_cache();
+  } else if (admin_command == "dump_objectstore_cache_stats") {
+    store->dump_cache_stats(f);
+  } else if (admin_command == "bluestore_allocator_trace") {
+    string action, path;
+    cmd_getval(cct, cmdmap, "action", action);
+    cmd_getval(cct, cmdmap, "path", path);
+    int r = 0;
+    if (action == "start" && path.empty()) {
+      r = -EINVAL;
+    } else {
+      r = store->set_alloc_trace(action == "start" ? path : string());
+    }
+    f->open_object_section("result");
+    f->dump_string("error", cpp_strerror(r));
+    f->dump_bool("success", r >= 0);
+    f->close_section();
   } else if (admin_command == "dump_pgstate_history") {
     f->open_object_section("pgstate_history");
     RWLock::RLocker l2(pg_map_lock);
@@ -2811,6 +2827,18 @@ void OSD::final_init()
                                      asok_hook,
                                      "Flush bluestore internal cache");
   assert(r == 0);
+  r = admin_socket->register_command("dump_objectstore_cache_stats",
+                                     "dump_objectstore_cache_stats",
+                                     asok_hook,
+                                     "Show bluestore cache sizing and autotune decisions");
+  assert(r == 0);
+  r = admin_socket->register_command("bluestore_allocator_trace",
+                                     "bluestore_allocator_trace " \
+                                     "name=action,type=CephChoices,strings=start|stop " \
+                                     "name=path,type=CephString,req=false",
+                                     asok_hook,
+                                     "Record bluestore allocations to a file for ceph_perf_allocator");
+  assert(r == 0);
   r = admin_socket->register_command("dump_pgstate_history", "dump_pgstate_history",
 				     asok_hook,
 				     "show recent state history");
@@ -3305,6 +3333,8 @@ int OSD::shutdown()
   cct->get_admin_socket()->unregister_command("dump_scrubs");
   cct->get_admin_socket()->unregister_command("calc_objectstore_db_histogram");
   cct->get_admin_socket()->unregister_command("flush_store_cache");
+  cct->get_admin_socket()->unregister_command("dump_objectstore_cache_stats");
+  cct->get_admin_socket()->unregister_command("bluestore_allocator_trace");
   cct->get_admin_socket()->unregister_command("dump_pgstate_history");
   cct->get_admin_socket()->unregister_command("compact");
   delete asok_hook;
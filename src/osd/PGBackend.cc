@@ -377,6 +377,53 @@ int PGBackend::objects_list_partial(
   return r;
 }
 
+int PGBackend::objects_list_partial_meta(
+  const hobject_t &begin,
+  int min,
+  int max,
+  const set<string> &attrs,
+  vector<ObjectStore::object_meta_t> *ls,
+  hobject_t *next)
+{
+  assert(ls);
+  // As above, start with the smallest generation of the marker object.
+  ghobject_t _next;
+  if (!begin.is_min())
+    _next = ghobject_t(begin, 0, get_parent()->whoami_shard().shard);
+  ls->reserve(max);
+  int r = 0;
+
+  if (min > max)
+    min = max;
+
+  while (!_next.is_max() && ls->size() < (unsigned)min) {
+    vector<ObjectStore::object_meta_t> objects;
+    r = store->collection_list_meta(
+      ch,
+      _next,
+      ghobject_t::get_max(),
+      max - ls->size(),
+      attrs,
+      &objects,
+      &_next);
+    if (r != 0) {
+      derr << __func__ << " list collection " << ch << " got: " << cpp_strerror(r) << dendl;
+      break;
+    }
+    for (auto& i : objects) {
+      if (i.oid.is_pgmeta() || i.oid.hobj.is_temp()) {
+	continue;
+      }
+      if (i.oid.is_no_gen()) {
+	ls->push_back(std::move(i));
+      }
+    }
+  }
+  if (r == 0)
+    *next = _next.hobj;
+  return r;
+}
+
 int PGBackend::objects_list_range(
   const hobject_t &start,
   const hobject_t &end,
@@ -412,14 +459,16 @@ int PGBackend::objects_list_range(
 int PGBackend::objects_get_attr(
   const hobject_t &hoid,
   const string &attr,
-  bufferlist *out)
+  bufferlist *out,
+  uint32_t op_flags)
 {
   bufferptr bp;
   int r = store->getattr(
     ch,
     ghobject_t(hoid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
     attr.c_str(),
-    bp);
+    bp,
+    op_flags);
   if (r >= 0 && out) {
     out->clear();
     out->push_back(std::move(bp));
@@ -586,13 +635,16 @@ void PGBackend::be_scan_list(
     handle.reset_tp_timeout();
     hobject_t poid = *p;
 
+    // a scrub touches each object once; don't let it evict the
+    // working set from the store's metadata cache
     struct stat st;
     int r = store->stat(
       ch,
       ghobject_t(
 	poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
       &st,
-      true);
+      true,
+      CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
     if (r == 0) {
       ScrubMap::object &o = map.objects[poid];
       o.size = st.st_size;
@@ -601,7 +653,8 @@ void PGBackend::be_scan_list(
 	ch,
 	ghobject_t(
 	  poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
-	o.attrs);
+	o.attrs,
+	CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
 
       // calculate the CRC32 on deep scrubs
       if (deep) {
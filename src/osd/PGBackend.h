@@ -529,6 +529,15 @@ typedef ceph::shared_ptr<const OSDMap> OSDMapRef;
      vector<hobject_t> *ls,
      hobject_t *next);
 
+   /// List objects in collection with their stat and the named xattrs
+   int objects_list_partial_meta(
+     const hobject_t &begin,
+     int min,
+     int max,
+     const set<string> &attrs,
+     vector<ObjectStore::object_meta_t> *ls,
+     hobject_t *next);
+
    int objects_list_range(
      const hobject_t &start,
      const hobject_t &end,
@@ -539,7 +548,8 @@ typedef ceph::shared_ptr<const OSDMap> OSDMapRef;
    int objects_get_attr(
      const hobject_t &hoid,
      const string &attr,
-     bufferlist *out);
+     bufferlist *out,
+     uint32_t op_flags = 0);
 
    virtual int objects_get_attrs(
      const hobject_t &hoid,
@@ -12159,36 +12159,33 @@ void PrimaryLogPG::scan_range(
   dout(10) << "scan_range from " << bi->begin << dendl;
   bi->clear_objects();
 
-  vector<hobject_t> ls;
+  // list the object infos along with the names, so that the store can
+  // return them from the same pass over its index
+  vector<ObjectStore::object_meta_t> ls;
   ls.reserve(max);
-  int r = pgbackend->objects_list_partial(bi->begin, min, max, &ls, &bi->end);
+  const set<string> attrs = { OI_ATTR };
+  int r = pgbackend->objects_list_partial_meta(bi->begin, min, max, attrs,
+					       &ls, &bi->end);
   assert(r >= 0);
   dout(10) << " got " << ls.size() << " items, next " << bi->end << dendl;
-  dout(20) << ls << dendl;
 
-  for (vector<hobject_t>::iterator p = ls.begin(); p != ls.end(); ++p) {
+  for (auto& m : ls) {
     handle.reset_tp_timeout();
+    const hobject_t& soid = m.oid.hobj;
     ObjectContextRef obc;
     if (is_primary())
-      obc = object_contexts.lookup(*p);
+      obc = object_contexts.lookup(soid);
     if (obc) {
-      bi->objects[*p] = obc->obs.oi.version;
-      dout(20) << "  " << *p << " " << obc->obs.oi.version << dendl;
+      bi->objects[soid] = obc->obs.oi.version;
+      dout(20) << "  " << soid << " " << obc->obs.oi.version << dendl;
     } else {
+      auto p = m.attrs.find(OI_ATTR);
+      assert(p != m.attrs.end());
       bufferlist bl;
-      int r = pgbackend->objects_get_attr(*p, OI_ATTR, &bl);
-
-      /* If the object does not exist here, it must have been removed
-	 * between the collection_list_partial and here.  This can happen
-	 * for the first item in the range, which is usually last_backfill.
-	 */
-      if (r == -ENOENT)
-	continue;
-
-      assert(r >= 0);
+      bl.push_back(p->second);
       object_info_t oi(bl);
-      bi->objects[*p] = oi.version;
-      dout(20) << "  " << *p << " " << oi.version << dendl;
+      bi->objects[soid] = oi.version;
+      dout(20) << "  " << soid << " " << oi.version << dendl;
     }
   }
 }
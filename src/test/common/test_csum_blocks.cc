@@ -0,0 +1,155 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <iostream>
+#include <string.h>
+
+#include "include/types.h"
+#include "include/buffer.h"
+#include "include/utime.h"
+#include "common/Clock.h"
+#include "common/Checksummer.h"
+#include "common/csum_blocks.h"
+#include "arch/probe.h"
+#include "arch/intel.h"
+
+#include "gtest/gtest.h"
+
+#if defined(__x86_64__)
+static bool have_sse42() { ceph_arch_probe(); return ceph_arch_intel_sse42; }
+static bool have_avx2() { ceph_arch_probe(); return ceph_arch_intel_avx2; }
+static bool have_avx512() { ceph_arch_probe(); return ceph_arch_intel_avx512; }
+#else
+static bool have_sse42() { return false; }
+static bool have_avx2() { return false; }
+static bool have_avx512() { return false; }
+#endif
+
+static bufferptr random_buffer(size_t len)
+{
+  bufferptr bp(len);
+  for (size_t i = 0; i < len; ++i) {
+    bp[i] = rand();
+  }
+  return bp;
+}
+
+// every kernel must agree with the scalar one, including for block sizes
+// and counts that are not a multiple of its stripe and lane count
+static const size_t block_sizes[] = { 8, 16, 32, 48, 100, 512, 4096 };
+static const size_t block_counts[] = { 1, 3, 4, 7, 8, 9, 33 };
+
+template<typename T, typename F>
+static void check_kernel(F scalar, F kernel, T seed)
+{
+  for (auto bs : block_sizes) {
+    for (auto n : block_counts) {
+      bufferptr bp = random_buffer(bs * n);
+      vector<T> expected(n), actual(n);
+      scalar(seed, (unsigned char const *)bp.c_str(), bs, n, &expected[0]);
+      kernel(seed, (unsigned char const *)bp.c_str(), bs, n, &actual[0]);
+      ASSERT_EQ(expected, actual) << "block_size " << bs << " blocks " << n;
+    }
+  }
+}
+
+TEST(CsumBlocks, crc32c) {
+  check_kernel<uint32_t>(ceph_csum_crc32c_blocks_scalar,
+			 ceph_csum_crc32c_blocks, -1);
+  if (have_sse42()) {
+    check_kernel<uint32_t>(ceph_csum_crc32c_blocks_scalar,
+			   ceph_csum_crc32c_blocks_sse42, 0);
+  }
+}
+
+TEST(CsumBlocks, xxhash32) {
+  check_kernel<uint32_t>(ceph_csum_xxhash32_blocks_scalar,
+			 ceph_csum_xxhash32_blocks, -1);
+  if (have_avx2()) {
+    check_kernel<uint32_t>(ceph_csum_xxhash32_blocks_scalar,
+			   ceph_csum_xxhash32_blocks_avx2, 1234);
+  }
+  if (have_avx512()) {
+    check_kernel<uint32_t>(ceph_csum_xxhash32_blocks_scalar,
+			   ceph_csum_xxhash32_blocks_avx512, 1234);
+  }
+}
+
+TEST(CsumBlocks, xxhash64) {
+  check_kernel<uint64_t>(ceph_csum_xxhash64_blocks_scalar,
+			 ceph_csum_xxhash64_blocks, -1);
+  if (have_avx512()) {
+    check_kernel<uint64_t>(ceph_csum_xxhash64_blocks_scalar,
+			   ceph_csum_xxhash64_blocks_avx512, 1234);
+  }
+}
+
+TEST(CsumBlocks, Checksummer) {
+  // blocks straddling buffer boundaries take the single block path
+  const size_t bs = 4096, blocks = 40;
+  bufferlist contiguous, fragmented;
+  contiguous.append(random_buffer(bs * blocks));
+  size_t pos = 0;
+  while (pos < contiguous.length()) {
+    size_t len = std::min<size_t>(contiguous.length() - pos,
+				  1 + rand() % (3 * bs));
+    fragmented.append(bufferptr(contiguous.front(), pos, len));
+    pos += len;
+  }
+
+  bufferptr a(blocks * 8), b(blocks * 8);
+  Checksummer::calculate<Checksummer::xxhash64>(
+    bs, 0, bs * blocks, contiguous, &a);
+  Checksummer::calculate<Checksummer::xxhash64>(
+    bs, 0, bs * blocks, fragmented, &b);
+  ASSERT_EQ(0, memcmp(a.c_str(), b.c_str(), a.length()));
+  ASSERT_EQ(-1, Checksummer::verify<Checksummer::xxhash64>(
+	      bs, 0, bs * blocks, fragmented, a));
+
+  // corrupt one block past the first batch
+  bufferlist bad;
+  bad.append(contiguous.c_str(), contiguous.length());
+  bad.c_str()[bs * 21 + 7] ^= 1;
+  uint64_t bad_csum;
+  ASSERT_EQ((int)(bs * 21), Checksummer::verify<Checksummer::xxhash64>(
+	      bs, 0, bs * blocks, bad, a, &bad_csum));
+}
+
+template<typename T, typename F>
+static void bench_kernel(const char *name, F kernel, T seed)
+{
+  const size_t bs = 4096, blocks = 256, count = 1000;
+  bufferptr bp = random_buffer(bs * blocks);
+  vector<T> out(blocks);
+  utime_t start = ceph_clock_now();
+  for (size_t i = 0; i < count; ++i) {
+    kernel(seed, (unsigned char const *)bp.c_str(), bs, blocks, &out[0]);
+  }
+  utime_t end = ceph_clock_now();
+  float rate = (float)(bs * blocks * count) / (float)(1024*1024) /
+    (float)(end - start);
+  std::cout << name << " = " << rate << " MB/sec" << std::endl;
+}
+
+TEST(CsumBlocks, Performance) {
+  bench_kernel<uint32_t>("crc32c scalar", ceph_csum_crc32c_blocks_scalar, -1);
+  if (have_sse42()) {
+    bench_kernel<uint32_t>("crc32c sse42", ceph_csum_crc32c_blocks_sse42, -1);
+  }
+  bench_kernel<uint32_t>("xxhash32 scalar", ceph_csum_xxhash32_blocks_scalar,
+			 -1);
+  if (have_avx2()) {
+    bench_kernel<uint32_t>("xxhash32 avx2", ceph_csum_xxhash32_blocks_avx2,
+			   -1);
+  }
+  if (have_avx512()) {
+    bench_kernel<uint32_t>("xxhash32 avx512",
+			   ceph_csum_xxhash32_blocks_avx512, -1);
+  }
+  bench_kernel<uint64_t>("xxhash64 scalar", ceph_csum_xxhash64_blocks_scalar,
+			 -1);
+  if (have_avx512()) {
+    bench_kernel<uint64_t>("xxhash64 avx512",
+			   ceph_csum_xxhash64_blocks_avx512, -1);
+  }
+}
@@ -25,6 +25,7 @@ using namespace std;
 #include "common/ceph_argparse.h"
 #include "common/debug.h"
 #include "common/Cycles.h"
+#include "common/Formatter.h"
 #include "global/global_init.h"
 #include "msg/Messenger.h"
 #include "messages/MOSDOp.h"
@@ -171,6 +172,8 @@ void usage(const string &name) {
   cerr << "       [ios]: how much messages sent for each client" << std::endl;
   cerr << "       [thinktime]: sleep time when do fast dispatching(match client logic)" << std::endl;
   cerr << "       [msg length]: message data bytes" << std::endl;
+  cerr << " To compare small message batching, run both sides with and without" << std::endl;
+  cerr << " --ms_async_batch_messages, e.g. 16, and a small [msg length]" << std::endl;
 }
 
 int main(int argc, char **argv)
@@ -213,5 +216,12 @@ int main(int argc, char **argv)
   uint64_t stop = Cycles::rdtsc();
   cerr << " Total op " << ios << " run time " << Cycles::to_microseconds(stop - start) << "us." << std::endl;
 
+  // messages per frame on this side, zero when nothing was batched
+  JSONFormatter f(true);
+  g_ceph_context->get_perfcounters_collection()->dump_formatted(
+    &f, false, "", "msgr_send_batch_messages");
+  f.flush(cerr);
+  cerr << std::endl;
+
   return 0;
 }
@@ -137,6 +137,8 @@ void usage(const string &name) {
   cerr << "       [bind ip:port]: The ip:port pair to bind, client need to specify this pair to connect" << std::endl;
   cerr << "       [server worker threads]: threads will process incoming messages and reply(matching pg threads)" << std::endl;
   cerr << "       [thinktime]: sleep time when do dispatching(match fast dispatch logic in OSD.cc)" << std::endl;
+  cerr << " Replies are batched with --ms_async_batch_messages, see msgr_send_batch_messages" << std::endl;
+  cerr << " in the admin socket perf dump" << std::endl;
 }
 
 int main(int argc, char **argv)
@@ -280,6 +280,7 @@ class Worker : public Thread {
 
  public:
   EventCenter center;
+  std::atomic<unsigned> spins = { 0 };
   explicit Worker(CephContext *c, int idx): cct(c), done(false), center(c) {
     center.init(100, idx, "posix");
   }
@@ -289,8 +290,11 @@ class Worker : public Thread {
   }
   void* entry() override {
     center.set_owner();
-    while (!done)
+    while (!done) {
       center.process_events(1000000);
+      if (center.last_spun())
+        ++spins;
+    }
     return 0;
   }
 };
@@ -332,6 +336,30 @@ TEST(EventCenterTest, DispatchTest) {
   worker2.join();
 }
 
+TEST(EventCenterTest, BusyPollDispatchTest) {
+  // producers skip the notify pipe while the center spins; pausing around
+  // the budget makes the center drop back to blocking in between, and a
+  // lost wakeup would leave an event sitting until the 1s timeout
+  Worker worker(g_ceph_context, 1);
+  worker.center.set_busy_poll(50);
+  std::atomic<unsigned> count = { 0 };
+  Mutex lock("BusyPollDispatchTest::lock");
+  Cond cond;
+  worker.create("worker_1");
+  for (int i = 0; i < 2000; ++i) {
+    count++;
+    worker.center.dispatch_event_external(EventCallbackRef(new CountEvent(&count, &lock, &cond)));
+    Mutex::Locker l(lock);
+    while (count)
+      ASSERT_NE(ETIMEDOUT, cond.WaitInterval(lock, utime_t(0, 500000000)));
+    if (i % 4)
+      usleep(rand() % 100);
+  }
+  ASSERT_GT(worker.spins.load(), 0u);
+  worker.stop();
+  worker.join();
+}
+
 INSTANTIATE_TEST_CASE_P(
   AsyncMessenger,
   EventDriverTest,
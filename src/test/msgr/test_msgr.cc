@@ -22,14 +22,18 @@
 #include "common/Mutex.h"
 #include "common/Cond.h"
 #include "common/ceph_argparse.h"
+#include "common/perf_counters.h"
 #include "global/global_init.h"
 #include "msg/Dispatcher.h"
 #include "msg/msg_types.h"
 #include "msg/Message.h"
 #include "msg/Messenger.h"
 #include "msg/Connection.h"
+#include "msg/async/AsyncMessenger.h"
+#include "msg/async/AsyncConnection.h"
 #include "messages/MPing.h"
 #include "messages/MCommand.h"
+#include "messages/MOSDOp.h"
 
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int.hpp>
@@ -57,6 +61,36 @@ typedef boost::mt11213b gen_type;
   }                                     \
 } while(0);
 
+// number of samples of an average counter, summed over the async workers
+static uint64_t worker_avgcount(const string &name)
+{
+  uint64_t n = 0;
+  g_ceph_context->get_perfcounters_collection()->with_counters(
+    [&](const PerfCountersCollection::CounterMap &by_path) {
+      for (auto &p : by_path) {
+        if (p.first.compare(0, 22, "AsyncMessenger::Worker") == 0 &&
+            p.first.substr(p.first.rfind('.') + 1) == name)
+          n += p.second.data->avgcount;
+      }
+    });
+  return n;
+}
+
+// value of a u64 counter, summed over the async workers
+static uint64_t worker_u64(const string &name)
+{
+  uint64_t n = 0;
+  g_ceph_context->get_perfcounters_collection()->with_counters(
+    [&](const PerfCountersCollection::CounterMap &by_path) {
+      for (auto &p : by_path) {
+        if (p.first.compare(0, 22, "AsyncMessenger::Worker") == 0 &&
+            p.first.substr(p.first.rfind('.') + 1) == name)
+          n += p.second.data->u64;
+      }
+    });
+  return n;
+}
+
 class MessengerTest : public ::testing::TestWithParam<const char*> {
  public:
   Messenger *server_msgr;
@@ -380,6 +414,114 @@ TEST_P(MessengerTest, FeatureTest) {
   client_msgr->wait();
 }
 
+class EncodingCheckDispatcher : public Dispatcher {
+ public:
+  Mutex lock;
+  Cond cond;
+  uint64_t received = 0, luminous = 0, mismatched = 0, reordered = 0;
+  uint64_t last_tid = 0;
+
+  EncodingCheckDispatcher(): Dispatcher(g_ceph_context),
+                             lock("EncodingCheckDispatcher::lock") {}
+  bool ms_can_fast_dispatch_any() const override { return true; }
+  bool ms_can_fast_dispatch(const Message *m) const override {
+    return m->get_type() == CEPH_MSG_OSD_OP;
+  }
+  void ms_fast_dispatch(Message *m) override {
+    // MOSDOp is encoded as v8 only for peers with RESEND_ON_SPLIT; a message
+    // must match the features of the session it arrives on
+    bool has = HAVE_FEATURE(m->get_connection()->get_features(),
+                            RESEND_ON_SPLIT);
+    Mutex::Locker l(lock);
+    if (has != (m->get_header().version == 8))
+      mismatched++;
+    if (has)
+      luminous++;
+    if (received && m->get_tid() <= last_tid)
+      reordered++;
+    last_tid = m->get_tid();
+    received++;
+    cond.Signal();
+    m->put();
+  }
+  bool ms_dispatch(Message *m) override {
+    m->put();
+    return true;
+  }
+  bool ms_handle_reset(Connection *con) override { return true; }
+  void ms_handle_remote_reset(Connection *con) override {}
+  bool ms_handle_refused(Connection *con) override { return false; }
+  bool ms_verify_authorizer(Connection *con, int peer_type, int protocol,
+                            bufferlist& authorizer, bufferlist& authorizer_reply,
+                            bool& isvalid, CryptoKey& session_key) override {
+    isvalid = true;
+    return true;
+  }
+};
+
+TEST_P(MessengerTest, PreencodeFeatureChangeTest) {
+  // messages encoded by send_message() and still queued or unacked when
+  // the session is replaced must be encoded again for the new features
+  if (string(GetParam()) == "simple")
+    return;
+  g_ceph_context->_conf->set_val("ms_async_send_preencode", "true");
+  g_ceph_context->_conf->set_val("ms_inject_socket_failures", "20");
+  EncodingCheckDispatcher srv_dispatcher;
+  FakeDispatcher cli_dispatcher(false);
+  entity_addr_t bind_addr;
+  bind_addr.parse("127.0.0.1");
+  Messenger::Policy full = Messenger::Policy::stateful_server(0);
+  Messenger::Policy reduced = full;
+  reduced.features_supported &= ~CEPH_FEATURE_RESEND_ON_SPLIT;
+  server_msgr->set_policy(entity_name_t::TYPE_CLIENT, full);
+  client_msgr->set_policy(entity_name_t::TYPE_OSD,
+                          Messenger::Policy::lossless_client(0));
+
+  server_msgr->bind(bind_addr);
+  server_msgr->add_dispatcher_head(&srv_dispatcher);
+  server_msgr->start();
+  client_msgr->add_dispatcher_head(&cli_dispatcher);
+  client_msgr->start();
+
+  ConnectionRef conn = client_msgr->get_connection(server_msgr->get_myinst());
+  object_t oid("object");
+  object_locator_t oloc(1, 1);
+  pg_t pgid;
+  const uint64_t total = 2000;
+  for (uint64_t i = 0; i < total; ++i) {
+    // the server accepts each reconnect with the policy set at that time
+    if (i % 100 == 0)
+      server_msgr->set_policy(entity_name_t::TYPE_CLIENT,
+                              (i / 100) % 2 ? reduced : full);
+    hobject_t hobj(oid, oloc.key, CEPH_NOSNAP, pgid.ps(), pgid.pool(),
+                   oloc.nspace);
+    spg_t spgid(pgid);
+    MOSDOp *m = new MOSDOp(0, i, hobj, spgid, 0, 0, 0);
+    bufferlist bl;
+    bl.append_zero(128);
+    m->write(0, bl.length(), bl);
+    ASSERT_EQ(conn->send_message(m), 0);
+    if (i % 10 == 0)
+      usleep(1000);
+  }
+  {
+    Mutex::Locker l(srv_dispatcher.lock);
+    while (srv_dispatcher.received < total)
+      srv_dispatcher.cond.Wait(srv_dispatcher.lock);
+    // both kinds of sessions were seen and nothing was sent stale
+    ASSERT_LT(0u, srv_dispatcher.luminous);
+    ASSERT_GT(total, srv_dispatcher.luminous);
+    ASSERT_EQ(0u, srv_dispatcher.mismatched);
+  }
+
+  server_msgr->shutdown();
+  client_msgr->shutdown();
+  server_msgr->wait();
+  client_msgr->wait();
+  g_ceph_context->_conf->set_val("ms_async_send_preencode", "false");
+  g_ceph_context->_conf->set_val("ms_inject_socket_failures", "0");
+}
+
 TEST_P(MessengerTest, TimeoutTest) {
   g_ceph_context->_conf->set_val("ms_tcp_read_timeout", "1");
   FakeDispatcher cli_dispatcher(false), srv_dispatcher(true);
@@ -1220,6 +1362,171 @@ TEST_P(MessengerTest, SyntheticStressTest1) {
   test_msg.wait_for_done();
 }
 
+TEST_P(MessengerTest, BatchFrameTest) {
+  // messages queued before the connection is ready are all written by the
+  // first handle_write(), so they must go out in batch frames
+  g_ceph_context->_conf->set_val("ms_async_batch_messages", "16");
+  EncodingCheckDispatcher srv_dispatcher;
+  FakeDispatcher cli_dispatcher(false);
+  entity_addr_t bind_addr;
+  bind_addr.parse("127.0.0.1");
+  server_msgr->set_policy(entity_name_t::TYPE_CLIENT,
+                          Messenger::Policy::stateful_server(0));
+  client_msgr->set_policy(entity_name_t::TYPE_OSD,
+                          Messenger::Policy::lossless_client(0));
+  server_msgr->bind(bind_addr);
+  server_msgr->add_dispatcher_head(&srv_dispatcher);
+  server_msgr->start();
+  client_msgr->add_dispatcher_head(&cli_dispatcher);
+  client_msgr->start();
+
+  uint64_t sent_batches = worker_avgcount("msgr_send_batch_messages");
+  uint64_t recv_batches = worker_avgcount("msgr_recv_batch_messages");
+  ConnectionRef conn = client_msgr->get_connection(server_msgr->get_myinst());
+  object_t oid("object");
+  object_locator_t oloc(1, 1);
+  pg_t pgid;
+  const uint64_t total = 64;
+  for (uint64_t i = 0; i < total; ++i) {
+    hobject_t hobj(oid, oloc.key, CEPH_NOSNAP, pgid.ps(), pgid.pool(),
+                   oloc.nspace);
+    spg_t spgid(pgid);
+    ASSERT_EQ(conn->send_message(new MOSDOp(0, i, hobj, spgid, 0, 0, 0)), 0);
+  }
+  {
+    Mutex::Locker l(srv_dispatcher.lock);
+    while (srv_dispatcher.received < total)
+      srv_dispatcher.cond.Wait(srv_dispatcher.lock);
+  }
+  g_ceph_context->_conf->set_val("ms_async_batch_messages", "0");
+  ASSERT_EQ(0u, srv_dispatcher.mismatched);
+  if (string(GetParam()) != "simple") {
+    ASSERT_LT(sent_batches, worker_avgcount("msgr_send_batch_messages"));
+    ASSERT_LT(recv_batches, worker_avgcount("msgr_recv_batch_messages"));
+  }
+
+  server_msgr->shutdown();
+  client_msgr->shutdown();
+  server_msgr->wait();
+  client_msgr->wait();
+}
+
+TEST_P(MessengerTest, MigrateTest) {
+  // connections moved between workers, by the balancer and by hand while
+  // messages are in flight, must not lose or reorder anything
+  if (string(GetParam()) == "simple")
+    return;
+  g_ceph_context->_conf->set_val("ms_async_balance_interval", "0.05");
+  g_ceph_context->_conf->set_val("ms_async_balance_threshold", "0");
+  EncodingCheckDispatcher srv_dispatcher;
+  FakeDispatcher cli_dispatcher(false);
+  entity_addr_t bind_addr;
+  bind_addr.parse("127.0.0.1");
+  server_msgr->set_policy(entity_name_t::TYPE_CLIENT,
+                          Messenger::Policy::stateful_server(0));
+  client_msgr->set_policy(entity_name_t::TYPE_OSD,
+                          Messenger::Policy::lossless_client(0));
+  server_msgr->bind(bind_addr);
+  server_msgr->add_dispatcher_head(&srv_dispatcher);
+  server_msgr->start();
+  client_msgr->add_dispatcher_head(&cli_dispatcher);
+  client_msgr->start();
+
+  NetworkStack *stack = static_cast<AsyncMessenger*>(client_msgr)->get_stack();
+  ASSERT_TRUE(stack->support_migration());
+  ASSERT_LT(1u, stack->get_num_worker());
+  uint64_t migrated_out = worker_u64("msgr_migrated_out_connections");
+  uint64_t migrated_in = worker_u64("msgr_migrated_in_connections");
+  ConnectionRef conn = client_msgr->get_connection(server_msgr->get_myinst());
+  AsyncConnection *aconn = static_cast<AsyncConnection*>(conn.get());
+  object_t oid("object");
+  object_locator_t oloc(1, 1);
+  pg_t pgid;
+  bufferlist data;
+  data.append(string(4096, 'a'));
+  const uint64_t rounds = 10, per_round = 1000;
+  uint64_t tid = 0;
+  for (uint64_t r = 0; r < rounds; ++r) {
+    Worker *from = aconn->get_worker();
+    Worker *to = stack->get_worker((from->id + 1) % stack->get_num_worker());
+    for (uint64_t i = 0; i < per_round; ++i) {
+      hobject_t hobj(oid, oloc.key, CEPH_NOSNAP, pgid.ps(), pgid.pool(),
+                     oloc.nspace);
+      spg_t spgid(pgid);
+      MOSDOp *m = new MOSDOp(0, ++tid, hobj, spgid, 0, 0, 0);
+      m->write(0, data.length(), data);
+      ASSERT_EQ(conn->send_message(m), 0);
+      // the move only happens between messages, so it may be skipped here
+      if (i == per_round / 2)
+        aconn->migrate(to);
+    }
+    {
+      Mutex::Locker l(srv_dispatcher.lock);
+      while (srv_dispatcher.received < tid)
+        srv_dispatcher.cond.Wait(srv_dispatcher.lock);
+    }
+    // an idle connection always moves
+    for (int i = 0; i < 1000 && aconn->get_worker() == from; ++i) {
+      aconn->migrate(to);
+      usleep(1000);
+    }
+    ASSERT_NE(from, aconn->get_worker());
+  }
+  g_ceph_context->_conf->set_val("ms_async_balance_interval", "0");
+  g_ceph_context->_conf->set_val("ms_async_balance_threshold", "0.2");
+  {
+    Mutex::Locker l(srv_dispatcher.lock);
+    ASSERT_EQ(tid, srv_dispatcher.received);
+    ASSERT_EQ(0u, srv_dispatcher.reordered);
+    ASSERT_EQ(0u, srv_dispatcher.mismatched);
+  }
+  ASSERT_LE(migrated_out + rounds, worker_u64("msgr_migrated_out_connections"));
+  ASSERT_LE(migrated_in + rounds, worker_u64("msgr_migrated_in_connections"));
+
+  server_msgr->shutdown();
+  client_msgr->shutdown();
+  server_msgr->wait();
+  client_msgr->wait();
+}
+
+TEST_P(MessengerTest, SyntheticBatchTest) {
+  // batch frames across reconnects, checked by the workload's payload seqs
+  uint64_t sent_batches = worker_avgcount("msgr_send_batch_messages");
+  g_ceph_context->_conf->set_val("ms_async_batch_messages", "16");
+  g_ceph_context->_conf->set_val("ms_async_batch_max_bytes", "65536");
+  g_ceph_context->_conf->set_val("ms_inject_socket_failures", "50");
+  SyntheticWorkload test_msg(4, 16, GetParam(), 100,
+                             Messenger::Policy::lossless_peer_reuse(0),
+                             Messenger::Policy::lossless_peer_reuse(0));
+  for (int i = 0; i < 10; ++i) {
+    if (!(i % 10)) lderr(g_ceph_context) << "seeding connection " << i << dendl;
+    test_msg.generate_connection();
+  }
+  gen_type rng(time(NULL));
+  for (int i = 0; i < 5000; ++i) {
+    if (!(i % 10)) {
+      lderr(g_ceph_context) << "Op " << i << ": " << dendl;
+      test_msg.print_internal_state();
+    }
+    boost::uniform_int<> true_false(0, 99);
+    int val = true_false(rng);
+    if (val > 95) {
+      test_msg.generate_connection();
+    } else if (val > 90) {
+      test_msg.drop_connection();
+    } else if (val > 1) {
+      test_msg.send_message();
+    } else {
+      usleep(rand() % 1000 + 500);
+    }
+  }
+  test_msg.wait_for_done();
+  g_ceph_context->_conf->set_val("ms_async_batch_messages", "0");
+  g_ceph_context->_conf->set_val("ms_async_batch_max_bytes", "4096");
+  g_ceph_context->_conf->set_val("ms_inject_socket_failures", "0");
+  if (string(GetParam()) != "simple")
+    ASSERT_LT(sent_batches, worker_avgcount("msgr_send_batch_messages"));
+}
 
 TEST_P(MessengerTest, SyntheticInjectTest) {
   uint64_t dispatch_throttle_bytes = g_ceph_context->_conf->ms_dispatch_throttle_bytes;
@@ -218,7 +218,7 @@ TEST_P(AllocTest, test_alloc_big)
 
 TEST_P(AllocTest, test_alloc_hint_bmap)
 {
-  if (GetParam() == std::string("stupid")) {
+  if (GetParam() != std::string("bitmap")) {
     return;
   }
   int64_t blocks = BitMapArea::get_level_factor(g_ceph_context, 2) * 4;
@@ -290,11 +290,85 @@ TEST_P(AllocTest, test_alloc_non_aligned_len)
   EXPECT_EQ(want_size, alloc->allocate(want_size, alloc_unit, 0, &extents));
 }
 
+TEST_P(AllocTest, test_alloc_fragmentation)
+{
+  if (GetParam() == std::string("bitmap")) {
+    return;
+  }
+  // a block size other than bdev_block_size, too
+  for (int64_t block_size : {4096, 65536}) {
+    int64_t blocks = 1024;
+    init_alloc(blocks * block_size, block_size);
+    alloc->init_add_free(0, blocks * block_size);
+    EXPECT_EQ(0.0, alloc->get_fragmentation());
+
+    // allocate everything one block at a time, then free every other one
+    EXPECT_EQ(0, alloc->reserve(blocks * block_size));
+    AllocExtentVector extents;
+    EXPECT_EQ(blocks * block_size,
+	      alloc->allocate(blocks * block_size, block_size, block_size,
+			      (int64_t) 0, &extents));
+    ASSERT_EQ((size_t)blocks, extents.size());
+    interval_set<uint64_t> release_set;
+    for (size_t i = 0; i < extents.size(); i += 2) {
+      release_set.insert(extents[i].offset, extents[i].length);
+    }
+    alloc->release(release_set);
+    EXPECT_EQ(1.0, alloc->get_fragmentation());
+
+    // freeing the rest coalesces back into a single extent
+    release_set.clear();
+    for (size_t i = 1; i < extents.size(); i += 2) {
+      release_set.insert(extents[i].offset, extents[i].length);
+    }
+    alloc->release(release_set);
+    EXPECT_EQ((uint64_t)(blocks * block_size), alloc->get_free());
+    if (GetParam() == std::string("avl")) {
+      EXPECT_EQ(0.0, alloc->get_fragmentation());
+
+      // and a full-size allocation is again a single extent
+      EXPECT_EQ(0, alloc->reserve(blocks * block_size));
+      extents.clear();
+      EXPECT_EQ(blocks * block_size,
+	        alloc->allocate(blocks * block_size, block_size,
+			        (int64_t) 0, &extents));
+      EXPECT_EQ(1u, extents.size());
+    }
+  }
+}
+
+TEST_P(AllocTest, test_alloc_foreach_free)
+{
+  if (GetParam() == std::string("bitmap")) {
+    return;
+  }
+  int64_t block_size = 4096;
+  int64_t blocks = 64;
+  init_alloc(blocks * block_size, block_size);
+  // adjacent extents land in different stupid bins; they must be merged
+  alloc->init_add_free(0, block_size);
+  alloc->init_add_free(block_size, 4 * block_size);
+  alloc->init_add_free(16 * block_size, 2 * block_size);
+
+  interval_set<uint64_t> seen;
+  uint64_t last = 0;
+  unsigned calls = 0;
+  EXPECT_EQ(0, alloc->foreach_free([&](uint64_t offset, uint64_t length) {
+	++calls;
+	EXPECT_LE(last, offset);
+	last = offset + length;
+	seen.insert(offset, length);
+      }));
+  EXPECT_EQ(2u, calls);
+  EXPECT_EQ(0u, seen.range_start());
+  EXPECT_EQ((uint64_t)(7 * block_size), seen.size());
+  EXPECT_TRUE(seen.contains(16 * block_size, 2 * block_size));
+}
 
 INSTANTIATE_TEST_CASE_P(
   Allocator,
   AllocTest,
-  ::testing::Values("stupid", "bitmap"));
+  ::testing::Values("stupid", "bitmap", "avl"));
 
 #else
 
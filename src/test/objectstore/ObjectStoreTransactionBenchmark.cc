@@ -16,6 +16,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/stat.h>
 #include <string>
 #include <iostream>
 
@@ -24,6 +25,10 @@ using namespace std;
 #include "common/ceph_argparse.h"
 #include "common/debug.h"
 #include "common/Cycles.h"
+#include "common/Cond.h"
+#include "common/errno.h"
+#include "common/Mutex.h"
+#include "include/stringify.h"
 #include "global/global_init.h"
 #include "os/ObjectStore.h"
 
@@ -236,9 +241,144 @@ const ghobject_t PerfCase::info_oid(hobject_t(sobject_t(object_t("infos"), 0)));
 Transaction::Tick Transaction::write_ticks, Transaction::setattr_ticks, Transaction::omap_setkeys_ticks, Transaction::omap_rmkeys_ticks;
 Transaction::Tick Transaction::encode_ticks, Transaction::decode_ticks, Transaction::iterate_ticks;
 
+/*
+ * Commit throughput of a real store: small writes spread over many
+ * sequencers (one per pg, as the OSD does), measured for an increasing
+ * number of BlueStore kv_sync threads.
+ */
+class CommitCase {
+  ObjectStore *store;
+  vector<coll_t> cids;
+  vector<ObjectStore::Sequencer*> osrs;
+  bufferlist data;
+
+  Mutex lock;
+  Cond cond;
+  uint64_t in_flight = 0;
+
+  struct C_Committed : public Context {
+    CommitCase *c;
+    explicit C_Committed(CommitCase *c) : c(c) {}
+    void finish(int r) override {
+      Mutex::Locker l(c->lock);
+      --c->in_flight;
+      c->cond.Signal();
+    }
+  };
+
+ public:
+  CommitCase(ObjectStore *store, unsigned num_pgs)
+    : store(store), lock("CommitCase::lock") {
+    data.append(string(4096, 'a'));
+    for (unsigned i = 0; i < num_pgs; ++i) {
+      spg_t pgid(pg_t(i, 0));
+      cids.push_back(coll_t(pgid));
+      osrs.push_back(new ObjectStore::Sequencer(stringify(pgid)));
+      osrs.back()->shard_hint = pgid;
+    }
+  }
+  ~CommitCase() {
+    for (auto osr : osrs) {
+      delete osr;
+    }
+  }
+
+  int setup() {
+    for (unsigned i = 0; i < cids.size(); ++i) {
+      ObjectStore::Transaction t;
+      t.create_collection(cids[i], 0);
+      int r = store->apply_transaction(osrs[i], std::move(t));
+      if (r < 0)
+        return r;
+    }
+    return 0;
+  }
+
+  // returns ticks spent until the last commit
+  uint64_t run(uint64_t times, uint64_t max_in_flight) {
+    uint64_t start_time = Cycles::rdtsc();
+    for (uint64_t i = 0; i < times; ++i) {
+      unsigned pg = i % cids.size();
+      ghobject_t oid(hobject_t(sobject_t(object_t("obj_" + stringify(i)), 0)));
+      map<string, bufferlist> omap;
+      omap["pglog_" + stringify(i)] = data;
+      ObjectStore::Transaction t;
+      t.write(cids[pg], oid, 0, data.length(), data);
+      t.omap_setkeys(cids[pg], oid, omap);
+      {
+        Mutex::Locker l(lock);
+        while (in_flight >= max_in_flight)
+          cond.Wait(lock);
+        ++in_flight;
+      }
+      store->queue_transaction(osrs[pg], std::move(t), nullptr,
+                               new C_Committed(this));
+    }
+    Mutex::Locker l(lock);
+    while (in_flight)
+      cond.Wait(lock);
+    return Cycles::rdtsc() - start_time;
+  }
+};
+
+int commit_bench(const string& type, const string& path, uint64_t times,
+                 unsigned num_pgs, unsigned max_sync_threads)
+{
+  for (unsigned n = 1; n <= max_sync_threads; n *= 2) {
+    g_ceph_context->_conf->set_val("bluestore_kv_sync_threads", stringify(n));
+    g_ceph_context->_conf->apply_changes(NULL);
+
+    string data_path = path + "/kv_sync_threads_" + stringify(n);
+    if (::mkdir(data_path.c_str(), 0777) < 0 && errno != EEXIST) {
+      int r = -errno;
+      cerr << "failed to create " << data_path << ": "
+           << cpp_strerror(r) << std::endl;
+      return r;
+    }
+    ObjectStore *store = ObjectStore::create(g_ceph_context, type, data_path,
+                                             string());
+    if (!store) {
+      cerr << "unknown objectstore type " << type << std::endl;
+      return -EINVAL;
+    }
+    int r = store->mkfs();
+    if (r == 0)
+      r = store->mount();
+    if (r < 0) {
+      cerr << "failed to mkfs/mount " << data_path << ": "
+           << cpp_strerror(r) << std::endl;
+      delete store;
+      return r;
+    }
+    uint64_t ticks;
+    {
+      CommitCase c(store, num_pgs);
+      r = c.setup();
+      if (r < 0) {
+        cerr << "failed to create collections: " << cpp_strerror(r)
+             << std::endl;
+        store->umount();
+        delete store;
+        return r;
+      }
+      ticks = c.run(times, num_pgs * 4);
+      store->umount();
+    }
+    delete store;
+
+    double secs = Cycles::to_seconds(ticks);
+    cerr << " kv_sync_threads " << n << ": " << times << " commits in "
+         << secs << "s, " << (secs > 0 ? times / secs : 0) << " commits/s"
+         << std::endl;
+  }
+  return 0;
+}
+
 void usage(const string &name) {
   cerr << "Usage: " << name << " [times] "
        << std::endl;
+  cerr << "       " << name << " --commit <type> <path> <times> "
+       << "[pgs] [max kv_sync_threads]" << std::endl;
 }
 
 int main(int argc, char **argv)
@@ -258,6 +398,18 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  if (string(args[0]) == "--commit") {
+    if (args.size() < 4) {
+      usage(argv[0]);
+      return 1;
+    }
+    unsigned num_pgs = args.size() > 4 ? atoi(args[4]) : 64;
+    unsigned max_sync_threads = args.size() > 5 ? atoi(args[5]) : 8;
+    int r = commit_bench(args[1], args[2], atoll(args[3]),
+                         num_pgs, max_sync_threads);
+    return r < 0 ? 1 : 0;
+  }
+
   uint64_t times = atoi(args[0]);
   PerfCase c;
   uint64_t ticks = c.rados_write_4k(times);
@@ -0,0 +1,498 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Replay a BlueStore allocation trace (see "bluestore_allocator_trace"
+ * admin socket command) against one or more Allocator implementations
+ * and report throughput, latency, extent counts and fragmentation.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "common/ceph_argparse.h"
+#include "common/ceph_time.h"
+#include "common/Formatter.h"
+#include "common/errno.h"
+#include "global/global_context.h"
+#include "global/global_init.h"
+#include "include/interval_set.h"
+#include "include/str_list.h"
+#include "os/bluestore/Allocator.h"
+
+using namespace std;
+
+struct trace_op_t {
+  char type = 0;              ///< 'A'llocate or 'R'elease
+  uint64_t usec = 0;          ///< since trace start
+  uint64_t want = 0, unit = 0, max = 0;
+  int64_t hint = 0;
+  int64_t got = 0;
+  vector<pair<uint64_t,uint64_t>> extents;
+};
+
+struct trace_t {
+  uint64_t size = 0;
+  uint64_t block_size = 0;
+  uint64_t min_alloc_size = 0;
+  string allocator;           ///< what the traced OSD was running
+  vector<pair<uint64_t,uint64_t>> free;  ///< free space at trace start
+  vector<trace_op_t> ops;
+};
+
+static int parse_extents(istream& is, vector<pair<uint64_t,uint64_t>> *out)
+{
+  string e;
+  while (is >> e) {
+    auto tilde = e.find('~');
+    if (tilde == string::npos) {
+      return -EINVAL;
+    }
+    out->emplace_back(strtoull(e.c_str(), nullptr, 16),
+		      strtoull(e.c_str() + tilde + 1, nullptr, 16));
+  }
+  return 0;
+}
+
+static int load_trace(const string& fn, trace_t *trace)
+{
+  ifstream in(fn);
+  if (!in.is_open()) {
+    int r = -errno;
+    cerr << "failed to open " << fn << ": " << cpp_strerror(r) << std::endl;
+    return r;
+  }
+  string line;
+  unsigned lineno = 0;
+  bool have_header = false;
+  while (getline(in, line)) {
+    ++lineno;
+    if (line.empty()) {
+      continue;
+    }
+    istringstream is(line);
+    char type;
+    is >> type;
+    int r = 0;
+    switch (type) {
+    case 'H':
+      {
+	unsigned version;
+	is >> version >> std::hex >> trace->size >> trace->block_size
+	   >> trace->min_alloc_size >> std::dec >> trace->allocator;
+	if (version != 1) {
+	  cerr << fn << ": unsupported trace version " << version << std::endl;
+	  return -EINVAL;
+	}
+	have_header = true;
+      }
+      break;
+    case 'F':
+      {
+	uint64_t offset, length;
+	is >> std::hex >> offset >> length;
+	trace->free.emplace_back(offset, length);
+      }
+      break;
+    case 'A':
+      {
+	trace_op_t op;
+	op.type = type;
+	is >> op.usec >> std::hex >> op.want >> op.unit >> op.max >> op.hint
+	   >> op.got;
+	r = parse_extents(is, &op.extents);
+	trace->ops.push_back(std::move(op));
+      }
+      break;
+    case 'R':
+      {
+	trace_op_t op;
+	op.type = type;
+	is >> op.usec;
+	r = parse_extents(is, &op.extents);
+	trace->ops.push_back(std::move(op));
+      }
+      break;
+    default:
+      r = -EINVAL;
+    }
+    if (r < 0 || is.bad() || (is.fail() && !is.eof())) {
+      cerr << fn << ":" << lineno << ": malformed record" << std::endl;
+      return -EINVAL;
+    }
+  }
+  if (!have_header) {
+    cerr << fn << ": missing header" << std::endl;
+    return -EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * Replays a trace against a single allocator.
+ *
+ * The replayed allocator hands out different offsets than the traced
+ * one, so every traced allocation is mapped, byte range by byte range,
+ * onto what the replay got back; a traced release is translated through
+ * that map.  Ranges that were already allocated when the trace started
+ * have no mapping and are released as is, which is correct because the
+ * replay starts from the same free space.
+ */
+class Replay {
+  struct piece_t {
+    uint64_t length;
+    uint64_t replay_offset;   ///< or NONE if the replay ran out of space
+  };
+  static constexpr uint64_t NONE = ~0ull;
+
+  const trace_t& trace;
+  Allocator *alloc;
+
+  map<uint64_t, piece_t> pieces;  ///< traced offset -> replay location
+  interval_set<uint64_t> in_use;  ///< what the replay allocator handed out
+
+  vector<uint32_t> alloc_nsec, release_nsec;
+  uint64_t alloc_total_nsec = 0, release_total_nsec = 0;
+  map<unsigned, uint64_t> extent_hist;  ///< power of two bucket -> count
+  uint64_t enospc = 0;        ///< allocations the replay could not satisfy
+  uint64_t skipped_bytes = 0; ///< released bytes the replay never allocated
+
+  // split pieces at offset and offset + length, then pass every piece
+  // inside to f and forget it
+  template<typename F>
+  void _carve(uint64_t offset, uint64_t length, F&& f) {
+    uint64_t end = offset + length;
+    auto p = pieces.lower_bound(offset);
+    if (p != pieces.begin()) {
+      auto q = std::prev(p);
+      if (q->first + q->second.length > offset) {
+	p = _split(q, offset);
+      }
+    }
+    while (p != pieces.end() && p->first < end) {
+      if (p->first + p->second.length > end) {
+	_split(p, end);
+      }
+      f(p->first, p->second);
+      p = pieces.erase(p);
+    }
+  }
+
+  map<uint64_t, piece_t>::iterator _split(map<uint64_t, piece_t>::iterator p,
+					  uint64_t at) {
+    uint64_t head = at - p->first;
+    piece_t tail{p->second.length - head,
+		 p->second.replay_offset == NONE ?
+		   NONE : p->second.replay_offset + head};
+    p->second.length = head;
+    return pieces.emplace_hint(std::next(p), at, tail);
+  }
+
+  void _map(uint64_t offset, uint64_t length, uint64_t replay_offset) {
+    // a range the trace allocates twice without a release means we
+    // missed an event; the older mapping is stale.
+    _carve(offset, length, [](uint64_t, const piece_t&) {});
+    pieces.emplace(offset, piece_t{length, replay_offset});
+  }
+
+  void _release_replay(uint64_t offset, uint64_t length,
+		       interval_set<uint64_t> *release) {
+    interval_set<uint64_t> r, ok;
+    r.insert(offset, length);
+    ok.intersection_of(r, in_use);
+    skipped_bytes += length - ok.size();
+    for (auto p = ok.begin(); p != ok.end(); ++p) {
+      in_use.erase(p.get_start(), p.get_len());
+      release->insert(p.get_start(), p.get_len());
+    }
+  }
+
+  void do_allocate(const trace_op_t& op);
+  void do_release(const trace_op_t& op);
+  void sample(Formatter *f, size_t opno, uint64_t usec);
+
+public:
+  Replay(const trace_t& t, Allocator *a) : trace(t), alloc(a) {}
+
+  void run(Formatter *f, size_t sample_every);
+};
+
+void Replay::do_allocate(const trace_op_t& op)
+{
+  if (alloc->reserve(op.want) < 0) {
+    ++enospc;
+    for (auto& e : op.extents) {
+      _map(e.first, e.second, NONE);
+    }
+    return;
+  }
+  AllocExtentVector exts;
+  auto start = ceph::mono_clock::now();
+  int64_t got = alloc->allocate(op.want, op.unit, op.max, op.hint, &exts);
+  auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    ceph::mono_clock::now() - start).count();
+  alloc_nsec.push_back(nsec);
+  alloc_total_nsec += nsec;
+  if (got < (int64_t)op.want) {
+    ++enospc;
+    alloc->unreserve(op.want - std::max<int64_t>(got, 0));
+  }
+  if (got > 0) {
+    unsigned bucket = 1;
+    while (bucket < exts.size()) {
+      bucket <<= 1;
+    }
+    ++extent_hist[bucket];
+  }
+
+  // lay the traced extents over what we got, in order
+  size_t i = 0;
+  uint64_t pos = 0;
+  for (auto& e : op.extents) {
+    uint64_t offset = e.first, length = e.second;
+    while (length > 0) {
+      if (i >= exts.size()) {
+	_map(offset, length, NONE);
+	break;
+      }
+      uint64_t n = std::min<uint64_t>(length, exts[i].length - pos);
+      _map(offset, n, exts[i].offset + pos);
+      in_use.insert(exts[i].offset + pos, n);
+      offset += n;
+      length -= n;
+      pos += n;
+      if (pos == exts[i].length) {
+	++i;
+	pos = 0;
+      }
+    }
+  }
+  // the traced allocation was short; give back what it did not use
+  interval_set<uint64_t> extra;
+  for (; i < exts.size(); ++i, pos = 0) {
+    extra.insert(exts[i].offset + pos, exts[i].length - pos);
+  }
+  if (!extra.empty()) {
+    alloc->release(extra);
+  }
+}
+
+void Replay::do_release(const trace_op_t& op)
+{
+  interval_set<uint64_t> release;
+  for (auto& e : op.extents) {
+    uint64_t pos = e.first, end = e.first + e.second;
+    _carve(e.first, e.second, [&](uint64_t offset, const piece_t& p) {
+	if (offset > pos) {
+	  _release_replay(pos, offset - pos, &release);
+	}
+	if (p.replay_offset != NONE) {
+	  _release_replay(p.replay_offset, p.length, &release);
+	}
+	pos = offset + p.length;
+      });
+    if (pos < end) {
+      _release_replay(pos, end - pos, &release);
+    }
+  }
+  if (release.empty()) {
+    return;
+  }
+  auto start = ceph::mono_clock::now();
+  alloc->release(release);
+  auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    ceph::mono_clock::now() - start).count();
+  release_nsec.push_back(nsec);
+  release_total_nsec += nsec;
+}
+
+void Replay::sample(Formatter *f, size_t opno, uint64_t usec)
+{
+  // derive fragmentation from our own view of the device rather than
+  // Allocator::get_fragmentation() so that every allocator is scored
+  // the same way.
+  uint64_t free_extents = 0, max_free = 0, last = 0;
+  for (auto p = in_use.begin(); p != in_use.end(); ++p) {
+    if (p.get_start() > last) {
+      ++free_extents;
+      max_free = std::max(max_free, p.get_start() - last);
+    }
+    last = p.get_start() + p.get_len();
+  }
+  if (trace.size > last) {
+    ++free_extents;
+    max_free = std::max(max_free, trace.size - last);
+  }
+  uint64_t free_blocks = (trace.size - in_use.size()) / trace.min_alloc_size;
+  double frag = free_blocks > 1 && free_extents > 0 ?
+    (double)(free_extents - 1) / (free_blocks - 1) : 0.0;
+
+  f->open_object_section("sample");
+  f->dump_unsigned("op", opno);
+  f->dump_unsigned("trace_usec", usec);
+  f->dump_unsigned("free", alloc->get_free());
+  f->dump_unsigned("free_extents", free_extents);
+  f->dump_unsigned("max_free_extent", max_free);
+  f->dump_float("fragmentation", frag);
+  f->close_section();
+}
+
+static void dump_latency(Formatter *f, const char *name,
+			 vector<uint32_t>& v, uint64_t total_nsec)
+{
+  f->open_object_section(name);
+  f->dump_unsigned("count", v.size());
+  if (!v.empty()) {
+    std::sort(v.begin(), v.end());
+    f->dump_float("ops_per_sec", total_nsec ?
+		  (double)v.size() * 1000000000ull / total_nsec : 0.0);
+    f->dump_unsigned("avg_nsec", total_nsec / v.size());
+    f->dump_unsigned("p50_nsec", v[v.size() / 2]);
+    f->dump_unsigned("p99_nsec", v[v.size() * 99 / 100]);
+    f->dump_unsigned("p999_nsec", v[v.size() * 999 / 1000]);
+    f->dump_unsigned("max_nsec", v.back());
+  }
+  f->close_section();
+}
+
+void Replay::run(Formatter *f, size_t sample_every)
+{
+  in_use.insert(0, trace.size);
+  for (auto& e : trace.free) {
+    alloc->init_add_free(e.first, e.second);
+    in_use.erase(e.first, e.second);
+  }
+
+  f->open_array_section("fragmentation");
+  sample(f, 0, 0);
+  for (size_t n = 0; n < trace.ops.size(); ++n) {
+    auto& op = trace.ops[n];
+    if (op.type == 'A') {
+      do_allocate(op);
+    } else {
+      do_release(op);
+    }
+    if (sample_every && (n + 1) % sample_every == 0) {
+      sample(f, n + 1, op.usec);
+    }
+  }
+  if (!sample_every || trace.ops.size() % sample_every) {
+    sample(f, trace.ops.size(),
+	   trace.ops.empty() ? 0 : trace.ops.back().usec);
+  }
+  f->close_section();
+
+  dump_latency(f, "allocate", alloc_nsec, alloc_total_nsec);
+  dump_latency(f, "release", release_nsec, release_total_nsec);
+  f->dump_unsigned("enospc", enospc);
+  f->dump_unsigned("skipped_release_bytes", skipped_bytes);
+  f->open_array_section("extents_per_allocation");
+  for (auto& p : extent_hist) {
+    f->open_object_section("bucket");
+    f->dump_unsigned("max_extents", p.first);
+    f->dump_unsigned("count", p.second);
+    f->close_section();
+  }
+  f->close_section();
+}
+
+static void usage(const char *name)
+{
+  cout << "usage: " << name << " [options] <trace file>\n"
+       << "  --allocators <a,b,...>  allocators to replay against"
+       << " (default stupid,bitmap,avl)\n"
+       << "  --sample-every <n>      fragmentation sample interval in ops"
+       << " (default 10000)\n"
+       << "\n"
+       << "Record a trace with\n"
+       << "  ceph daemon osd.<id> bluestore_allocator_trace start <path>\n"
+       << "  ceph daemon osd.<id> bluestore_allocator_trace stop\n"
+       << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, (const char **)argv, args);
+  env_to_vec(args);
+
+  auto cct = global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT,
+			 CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+
+  string allocators = "stupid,bitmap,avl";
+  int sample_every = 10000;
+  string val;
+  std::ostringstream err;
+  for (auto i = args.begin(); i != args.end(); ) {
+    if (ceph_argparse_double_dash(args, i)) {
+      break;
+    } else if (ceph_argparse_flag(args, i, "-h", "--help", (char*)NULL)) {
+      usage(argv[0]);
+      return 0;
+    } else if (ceph_argparse_witharg(args, i, &val, "--allocators",
+				     (char*)NULL)) {
+      allocators = val;
+    } else if (ceph_argparse_witharg(args, i, &sample_every, err,
+				     "--sample-every", (char*)NULL)) {
+      if (!err.str().empty() || sample_every < 0) {
+	cerr << err.str() << std::endl;
+	return 1;
+      }
+    } else {
+      ++i;
+    }
+  }
+  if (args.size() != 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  trace_t trace;
+  int r = load_trace(args[0], &trace);
+  if (r < 0) {
+    return 1;
+  }
+  cerr << args[0] << ": " << trace.ops.size() << " ops, "
+       << trace.free.size() << " free extents, recorded with "
+       << trace.allocator << std::endl;
+
+  std::unique_ptr<Formatter> f(Formatter::create("json-pretty"));
+  f->open_object_section("replay");
+  f->dump_unsigned("device_size", trace.size);
+  f->dump_unsigned("min_alloc_size", trace.min_alloc_size);
+  f->dump_string("traced_allocator", trace.allocator);
+  f->dump_unsigned("ops", trace.ops.size());
+  list<string> types;
+  get_str_list(allocators, ",", types);
+  for (auto& type : types) {
+    std::unique_ptr<Allocator> alloc(
+      Allocator::create(g_ceph_context, type, trace.size,
+			trace.min_alloc_size));
+    if (!alloc) {
+      cerr << "unknown allocator " << type << std::endl;
+      return 1;
+    }
+    cerr << "replaying against " << type << std::endl;
+    Replay replay(trace, alloc.get());
+    f->open_object_section(type.c_str());
+    replay.run(f.get(), sample_every);
+    f->close_section();
+    alloc->shutdown();
+  }
+  f->close_section();
+  f->flush(cout);
+  cout << std::endl;
+  return 0;
+}
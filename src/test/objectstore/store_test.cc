@@ -17,6 +17,8 @@
 #include <string.h>
 #include <iostream>
 #include <time.h>
+#include <fstream>
+#include <thread>
 #include <sys/mount.h>
 #include <boost/scoped_ptr.hpp>
 #include <boost/random/mersenne_twister.hpp>
@@ -36,6 +38,7 @@
 #include "common/Cond.h"
 #include "common/errno.h"
 #include "include/stringify.h"
+#include "include/scope_guard.h"
 #include "include/coredumpctl.h"
 
 #include "include/unordered_map.h"
@@ -2553,6 +2556,82 @@ TEST_P(StoreTest, ListEndTest) {
   }
 }
 
+TEST_P(StoreTest, ListMetaTest) {
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid(spg_t(pg_t(0, 1), shard_id_t(1)));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  map<ghobject_t, int> all;
+  {
+    ObjectStore::Transaction t;
+    for (int i=0; i<200; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("object_" + stringify(i),
+					  CEPH_NOSNAP)),
+		      ghobject_t::NO_GEN, shard_id_t(1));
+      hoid.hobj.pool = 1;
+      all[hoid] = i;
+      bufferlist bl;
+      bl.append(string(i, 'x'));
+      t.write(cid, hoid, 0, bl.length(), bl);
+      if (i % 2) {
+	bufferlist attr;
+	attr.append(stringify(i));
+	t.setattr(cid, hoid, "odd", attr);
+      }
+      t.setattr(cid, hoid, "other", bl);
+    }
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, all.begin()->first);
+    all.erase(all.begin());
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ObjectStore::CollectionHandle ch = store->open_collection(cid);
+  set<string> attrs = { "odd", "missing" };
+  ghobject_t start, next;
+  size_t listed = 0;
+  while (true) {
+    vector<ObjectStore::object_meta_t> ls;
+    r = store->collection_list_meta(ch, start, ghobject_t::get_max(), 50,
+				    attrs, &ls, &next);
+    ASSERT_EQ(r, 0);
+    for (auto& m : ls) {
+      ASSERT_TRUE(all.count(m.oid));
+      int i = all[m.oid];
+      ASSERT_EQ(i, m.st.st_size);
+      if (i % 2) {
+	ASSERT_EQ(1u, m.attrs.size());
+	ASSERT_EQ(stringify(i), string(m.attrs["odd"].c_str(),
+				       m.attrs["odd"].length()));
+      } else {
+	ASSERT_TRUE(m.attrs.empty());
+      }
+    }
+    listed += ls.size();
+    if (next.is_max())
+      break;
+    start = next;
+  }
+  ASSERT_EQ(all.size(), listed);
+  {
+    ObjectStore::Transaction t;
+    for (auto& p : all)
+      t.remove(cid, p.first);
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, Sort) {
   {
     hobject_t a(sobject_t("a", CEPH_NOSNAP));
@@ -5197,6 +5276,125 @@ TEST_P(StoreTest, ColSplitTest3) {
 }
 #endif
 
+TEST_P(StoreTest, ColSplitKVShards) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  // the parent and child pgs below hash to different kv shards
+  g_conf->set_val("bluestore_kv_sync_threads", "4");
+  g_conf->apply_changes(NULL);
+  auto restore = make_scope_guard([] {
+    g_conf->set_val("bluestore_kv_sync_threads", "1");
+    g_conf->apply_changes(NULL);
+  });
+  store->umount();
+  ASSERT_EQ(0, store->mount());
+
+  // other sequencers create and remove collections meanwhile; these are
+  // barriers too and must not wait on ours
+  std::atomic<bool> stop = {false};
+  std::thread churn([&]() {
+    for (unsigned n = 0; !stop; ++n) {
+      for (unsigned ps = 2; ps < 4; ++ps) {
+	spg_t pgid(pg_t(ps, 53), shard_id_t::NO_SHARD);
+	ObjectStore::Sequencer osr("churn");
+	osr.shard_hint = pgid;
+	coll_t cid(pgid);
+	ghobject_t hoid(hobject_t(sobject_t("churn", CEPH_NOSNAP)));
+	ObjectStore::Transaction t;
+	t.create_collection(cid, 0);
+	t.touch(cid, hoid);
+	ASSERT_EQ(0, apply_transaction(store, &osr, std::move(t)));
+	t = ObjectStore::Transaction();
+	t.remove(cid, hoid);
+	t.remove_collection(cid);
+	ASSERT_EQ(0, apply_transaction(store, &osr, std::move(t)));
+      }
+    }
+  });
+
+  const unsigned num_rounds = 8;
+  const unsigned num_objects = 32;
+  auto obj = [](unsigned i) {
+    return ghobject_t(hobject_t(
+      "obj" + stringify(i), "", CEPH_NOSNAP, i, 52, ""));
+  };
+  bufferlist before, after;
+  before.append("before");
+  after.append("after split");
+  for (unsigned r = 0; r < num_rounds; ++r) {
+    spg_t ppg(pg_t(4 * r, 52), shard_id_t::NO_SHARD);
+    spg_t cpg(pg_t(4 * r + 1, 52), shard_id_t::NO_SHARD);
+    ObjectStore::Sequencer posr("parent"), cosr("child");
+    posr.shard_hint = ppg;
+    cosr.shard_hint = cpg;
+    coll_t cid(ppg), tid(cpg);
+    {
+      ObjectStore::Transaction t;
+      t.create_collection(cid, 0);
+      for (unsigned i = 0; i < num_objects; ++i) {
+	t.write(cid, obj(i), 0, before.length(), before, 0);
+      }
+      ASSERT_EQ(0, apply_transaction(store, &posr, std::move(t)));
+    }
+
+    // do not wait for the split to commit before the child, on another
+    // shard, overwrites the objects it got
+    C_SaferCond split_done, child_done;
+    {
+      ObjectStore::Transaction t;
+      t.create_collection(tid, 1);
+      t.split_collection(cid, 1, 1, tid);
+      store->queue_transaction(&posr, std::move(t), nullptr, &split_done);
+    }
+    {
+      ObjectStore::Transaction t;
+      for (unsigned i = 1; i < num_objects; i += 2) {
+	t.write(tid, obj(i), 0, after.length(), after, 0);
+      }
+      store->queue_transaction(&cosr, std::move(t), nullptr, &child_done);
+    }
+    ASSERT_EQ(0, split_done.wait());
+    ASSERT_EQ(0, child_done.wait());
+  }
+  stop = true;
+  churn.join();
+
+  auto verify = [&]() {
+    for (unsigned r = 0; r < num_rounds; ++r) {
+      coll_t cid(spg_t(pg_t(4 * r, 52), shard_id_t::NO_SHARD));
+      coll_t tid(spg_t(pg_t(4 * r + 1, 52), shard_id_t::NO_SHARD));
+      for (unsigned i = 0; i < num_objects; ++i) {
+	bufferlist bl;
+	const coll_t& in = i % 2 ? tid : cid;
+	bufferlist expected = i % 2 ? after : before;
+	ASSERT_EQ((int)expected.length(),
+		  store->read(in, obj(i), 0, expected.length(), bl));
+	ASSERT_TRUE(bl_eq(expected, bl));
+	ASSERT_FALSE(store->exists(i % 2 ? cid : tid, obj(i)));
+      }
+    }
+  };
+  verify();
+  store->umount();
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->mount());
+  verify();
+
+  for (unsigned r = 0; r < num_rounds; ++r) {
+    ObjectStore::Sequencer osr("cleanup");
+    coll_t cid(spg_t(pg_t(4 * r, 52), shard_id_t::NO_SHARD));
+    coll_t tid(spg_t(pg_t(4 * r + 1, 52), shard_id_t::NO_SHARD));
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < num_objects; ++i) {
+      t.remove(i % 2 ? tid : cid, obj(i));
+    }
+    t.remove_collection(cid);
+    t.remove_collection(tid);
+    ASSERT_EQ(0, apply_transaction(store, &osr, std::move(t)));
+  }
+}
+
 /**
  * This test tests adding two different groups
  * of objects, each with 1 common prefix and 1
@@ -5945,6 +6143,73 @@ TEST_P(StoreTestSpecificAUSize, OnodeSizeTracking) {
 
 }
 
+TEST_P(StoreTest, CacheAutotune) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  // the onode share of the (4MB) test cache is tiny, so looking up more
+  // objects than it holds keeps missing while the kv cache sits idle
+  g_conf->set_val("bluestore_cache_autotune", "true");
+  g_conf->set_val("bluestore_cache_autotune_interval", "0.1");
+  g_conf->set_val("bluestore_cache_autotune_chunk_size", "262144");
+  g_conf->apply_changes(NULL);
+  auto restore = make_scope_guard([] {
+    g_conf->set_val("bluestore_cache_autotune", "false");
+    g_conf->set_val("bluestore_cache_autotune_interval", "5");
+    g_conf->set_val("bluestore_cache_autotune_chunk_size", "33554432");
+    g_conf->apply_changes(NULL);
+  });
+  // kv hit stats are only collected if autotuning is on at mount
+  store->umount();
+  ASSERT_EQ(0, store->mount());
+
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  const unsigned num_objects = 1000;
+  auto obj = [](unsigned i) {
+    return ghobject_t(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP)));
+  };
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    for (unsigned i = 0; i < num_objects; ++i) {
+      t.touch(cid, obj(i));
+    }
+    ASSERT_EQ(0, apply_transaction(store, &osr, std::move(t)));
+  }
+
+  const PerfCounters* logger = store->get_perf_counters();
+  uint64_t moves = logger->get(l_bluestore_cache_autotune_moves);
+  uint64_t meta_target = logger->get(l_bluestore_cache_meta_target);
+  uint64_t trimmed = logger->get_tavg_ms(l_bluestore_onode_lru_age).first;
+  utime_t start = ceph_clock_now();
+  while (logger->get(l_bluestore_cache_autotune_moves) == moves ||
+	 logger->get(l_bluestore_cache_meta_target) <= meta_target) {
+    ASSERT_LT((double)(ceph_clock_now() - start), 60.0);
+    for (unsigned i = 0; i < num_objects; ++i) {
+      struct stat st;
+      ASSERT_EQ(0, store->stat(cid, obj(i), &st));
+    }
+  }
+  ASSERT_GT(logger->get_tavg_ms(l_bluestore_onode_lru_age).first, trimmed);
+
+  JSONFormatter f(false);
+  store->dump_cache_stats(&f);
+  stringstream ss;
+  f.flush(ss);
+  cout << ss.str() << std::endl;
+  ASSERT_NE(string::npos, ss.str().find("\"hit_stats\":true"));
+
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < num_objects; ++i) {
+      t.remove(cid, obj(i));
+    }
+    t.remove_collection(cid);
+    ASSERT_EQ(0, apply_transaction(store, &osr, std::move(t)));
+  }
+}
+
 TEST_P(StoreTestSpecificAUSize, BlobReuseOnOverwrite) {
 
   if (string(GetParam()) != "bluestore")
@@ -6466,6 +6731,723 @@ TEST_P(StoreTestSpecificAUSize, SmallWriteOnShardedExtents) {
   g_conf->set_val("bluestore_csum_type", "crc32c");
 }
 
+TEST_P(StoreTestSpecificAUSize, DeferredWriteAggregation) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  // hold deferred writes until the max delay expires so that every
+  // sequencer has a batch pending when the queue is flushed
+  g_conf->set_val("bluestore_prefer_deferred_size", "65536");
+  g_conf->set_val("bluestore_deferred_batch_ops", "1000");
+  const double max_delay = 2;
+  g_conf->set_val("bluestore_deferred_max_delay", stringify(max_delay));
+  g_conf->set_val("bluestore_deferred_aggregate", "true");
+  size_t block_size = 4096;
+  StartDeferred(block_size);
+
+  const unsigned num_colls = 4;
+  const unsigned num_writes = 4;
+  const PerfCounters* logger = store->get_perf_counters();
+  uint64_t ops = logger->get(l_bluestore_deferred_aggregate_ops);
+  uint64_t batches = logger->get(l_bluestore_deferred_aggregate_batches);
+  uint64_t writes_in = logger->get(l_bluestore_deferred_aggregate_writes_in);
+  uint64_t writes_out = logger->get(l_bluestore_deferred_aggregate_writes_out);
+  uint64_t seek_in = logger->get(l_bluestore_deferred_aggregate_seek_in);
+
+  int r;
+  vector<std::unique_ptr<ObjectStore::Sequencer>> osrs;
+  vector<coll_t> cids;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  for (unsigned i = 0; i < num_colls; ++i) {
+    osrs.emplace_back(new ObjectStore::Sequencer("test"));
+    cids.push_back(coll_t(spg_t(pg_t(i, 1), shard_id_t::NO_SHARD)));
+    ObjectStore::Transaction t;
+    t.create_collection(cids.back(), 0);
+    r = apply_transaction(store, osrs.back().get(), std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  utime_t start = ceph_clock_now();
+  for (unsigned j = 0; j < num_writes; ++j) {
+    for (unsigned i = 0; i < num_colls; ++i) {
+      ObjectStore::Transaction t;
+      bufferlist bl;
+      bl.append(std::string(block_size, 'a' + i + j));
+      t.write(cids[i], hoid, j * block_size, bl.length(), bl, 0);
+      r = apply_transaction(store, osrs[i].get(), std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  }
+
+  // nothing is submitted before the oldest batch is max_delay old ...
+  if ((double)(ceph_clock_now() - start) < max_delay * 0.5) {
+    ASSERT_EQ(logger->get(l_bluestore_deferred_aggregate_ops), ops);
+  }
+  // ... and then every sequencer's batch goes out together
+  while (logger->get(l_bluestore_deferred_aggregate_batches) - batches <
+	 num_colls) {
+    ASSERT_LT((double)(ceph_clock_now() - start), max_delay * 10);
+    usleep(10000);
+  }
+  ASSERT_GE((double)(ceph_clock_now() - start), max_delay);
+  ASSERT_GE(logger->get(l_bluestore_deferred_aggregate_ops) - ops, 1u);
+  ASSERT_LE(logger->get(l_bluestore_deferred_aggregate_writes_out) - writes_out,
+	    logger->get(l_bluestore_deferred_aggregate_writes_in) - writes_in);
+  // the batches hold different blocks, so they could not all have been
+  // issued from one position without seeking
+  ASSERT_GT(logger->get(l_bluestore_deferred_aggregate_seek_in) - seek_in, 0u);
+
+  // read back from disk, not the cache
+  store->umount();
+  store->mount();
+  for (unsigned i = 0; i < num_colls; ++i) {
+    bufferlist bl, expected;
+    r = store->read(cids[i], hoid, 0, num_writes * block_size, bl);
+    ASSERT_EQ(r, (int)(num_writes * block_size));
+    for (unsigned j = 0; j < num_writes; ++j) {
+      expected.append(std::string(block_size, 'a' + i + j));
+    }
+    ASSERT_TRUE(bl_eq(expected, bl));
+  }
+  for (unsigned i = 0; i < num_colls; ++i) {
+    ObjectStore::Transaction t;
+    t.remove(cids[i], hoid);
+    t.remove_collection(cids[i]);
+    r = apply_transaction(store, osrs[i].get(), std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_prefer_deferred_size", "0");
+  g_conf->set_val("bluestore_deferred_batch_ops", "0");
+  g_conf->set_val("bluestore_deferred_max_delay", "0.1");
+}
+
+TEST_P(StoreTest, CompressionQueueSaturated) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  // with no room in the compress queue only the blob the writer compresses
+  // itself is stored compressed; the rest are written as is
+  g_conf->set_val("bluestore_compression_algorithm", "snappy");
+  g_conf->set_val("bluestore_compression_mode", "force");
+  g_conf->set_val("bluestore_compression_max_blob_size", "131072");
+  g_conf->set_val("bluestore_compression_queue_max", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  const PerfCounters* logger = store->get_perf_counters();
+  uint64_t saturated = logger->get(l_bluestore_compress_saturated_count);
+  uint64_t success = logger->get(l_bluestore_compress_success_count);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bufferlist data;
+  data.append(std::string(4 * 131072, 'a'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, data.length(), data, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_EQ(logger->get(l_bluestore_compress_success_count) - success, 1u);
+  ASSERT_EQ(logger->get(l_bluestore_compress_saturated_count) - saturated, 3u);
+  {
+    bufferlist bl;
+    r = store->read(cid, hoid, 0, data.length(), bl);
+    ASSERT_EQ(r, (int)data.length());
+    ASSERT_TRUE(bl_eq(data, bl));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_compression_mode", "none");
+  g_conf->set_val("bluestore_compression_max_blob_size", "0");
+  g_conf->set_val("bluestore_compression_queue_max", "64");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
+TEST_P(StoreTest, CompressionEstimator) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  g_conf->set_val("bluestore_compression_algorithm", "snappy");
+  g_conf->set_val("bluestore_compression_mode", "aggressive");
+  g_conf->set_val("bluestore_compression_min_blob_size", "131072");
+  g_conf->set_val("bluestore_compression_max_blob_size", "131072");
+  g_conf->set_val("bluestore_compression_estimator_history", "2");
+  g_conf->set_val("bluestore_compression_estimator_probe", "4");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  const PerfCounters* logger = store->get_perf_counters();
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const unsigned blob_size = 131072;
+  gen_type rng(0);
+  boost::uniform_int<> byte(0, 255);
+  auto random_blob = [&]() {
+    bufferptr bp(blob_size);
+    for (unsigned i = 0; i < blob_size; ++i) {
+      bp[i] = byte(rng);
+    }
+    bufferlist bl;
+    bl.append(bp);
+    return bl;
+  };
+  auto write = [&](unsigned n, bufferlist& bl) {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, n * blob_size, bl.length(), bl, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  };
+
+  // random data is rejected by the entropy check without being compressed
+  uint64_t attempts = logger->get(l_bluestore_compress_attempt_count);
+  uint64_t skipped = logger->get(l_bluestore_compress_skipped_count);
+  {
+    bufferlist bl = random_blob();
+    write(0, bl);
+  }
+  ASSERT_EQ(logger->get(l_bluestore_compress_attempt_count) - attempts, 0u);
+  ASSERT_EQ(logger->get(l_bluestore_compress_skipped_count) - skipped, 1u);
+
+  // without it, two failures stop further attempts until the 4th skip
+  g_conf->set_val("bluestore_compression_entropy_sample", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+  attempts = logger->get(l_bluestore_compress_attempt_count);
+  skipped = logger->get(l_bluestore_compress_skipped_count);
+  for (unsigned i = 0; i < 8; ++i) {
+    bufferlist bl = random_blob();
+    write(i, bl);
+  }
+  ASSERT_EQ(logger->get(l_bluestore_compress_attempt_count) - attempts, 3u);
+  ASSERT_EQ(logger->get(l_bluestore_compress_skipped_count) - skipped, 5u);
+
+  // a success resets the history
+  uint64_t success = logger->get(l_bluestore_compress_success_count);
+  for (unsigned i = 0; i < 4; ++i) {
+    bufferlist bl;
+    bl.append(std::string(blob_size, 'a'));
+    write(i, bl);
+  }
+  ASSERT_GE(logger->get(l_bluestore_compress_success_count) - success, 1u);
+  attempts = logger->get(l_bluestore_compress_attempt_count);
+  {
+    bufferlist bl = random_blob();
+    write(0, bl);
+  }
+  ASSERT_EQ(logger->get(l_bluestore_compress_attempt_count) - attempts, 1u);
+
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_compression_mode", "none");
+  g_conf->set_val("bluestore_compression_min_blob_size", "0");
+  g_conf->set_val("bluestore_compression_max_blob_size", "0");
+  g_conf->set_val("bluestore_compression_estimator_history", "8");
+  g_conf->set_val("bluestore_compression_estimator_probe", "16");
+  g_conf->set_val("bluestore_compression_entropy_sample", "4096");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
+TEST_P(StoreTest, ZeroCopyRead) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  ghobject_t hoid2(hobject_t(sobject_t("Object 2", CEPH_NOSNAP)));
+  const unsigned len = 131072;
+  bufferlist data;
+  data.append(std::string(len, 'a'));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, data.length(), data, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_compression_algorithm", "snappy");
+  g_conf->set_val("bluestore_compression_mode", "force");
+  g_ceph_context->_conf->apply_changes(NULL);
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid2, 0, data.length(), data, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_compression_mode", "none");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  // drop the buffer cache so the reads below go to the device
+  r = store->umount();
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  const PerfCounters* logger = store->get_perf_counters();
+
+  // uncompressed data comes back in the page-aligned device buffers
+  uint64_t zero_copy = logger->get(l_bluestore_read_zero_copy_bytes);
+  uint64_t copy = logger->get(l_bluestore_read_copy_bytes);
+  {
+    bufferlist bl;
+    r = store->read(cid, hoid, 0, len, bl);
+    ASSERT_EQ((int)len, r);
+    ASSERT_TRUE(bl_eq(data, bl));
+    ASSERT_TRUE(bl.is_page_aligned());
+  }
+  ASSERT_EQ(logger->get(l_bluestore_read_zero_copy_bytes) - zero_copy, len);
+  ASSERT_EQ(logger->get(l_bluestore_read_copy_bytes) - copy, 0u);
+
+  // decompressed data is counted as copied
+  zero_copy = logger->get(l_bluestore_read_zero_copy_bytes);
+  {
+    bufferlist bl;
+    r = store->read(cid, hoid2, 0, len, bl);
+    ASSERT_EQ((int)len, r);
+    ASSERT_TRUE(bl_eq(data, bl));
+  }
+  ASSERT_EQ(logger->get(l_bluestore_read_zero_copy_bytes) - zero_copy, 0u);
+  ASSERT_EQ(logger->get(l_bluestore_read_copy_bytes) - copy, len);
+
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove(cid, hoid2);
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, ExtentMapLazyDecode) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t whole(hobject_t(sobject_t("Whole", CEPH_NOSNAP)));
+  ghobject_t segmented(hobject_t(sobject_t("Segmented", CEPH_NOSNAP)));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // 4K written every 8K of a 4MB object, a few extents per txc, so
+  // that the extent map keeps outgrowing its shards
+  bufferlist data;
+  data.append(std::string(4096, 'x'));
+  auto fill = [&](const ghobject_t& hoid) {
+    for (unsigned i = 0; i < 512; i += 16) {
+      ObjectStore::Transaction t;
+      for (unsigned j = i; j < i + 16; ++j) {
+	t.write(cid, hoid, j * 8192, data.length(), data, 0);
+      }
+      r = apply_transaction(store, &osr, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+    // the reshard thread is done once we are unmounted
+    r = store->umount();
+    ASSERT_EQ(0, r);
+    r = store->mount();
+    ASSERT_EQ(0, r);
+  };
+  const PerfCounters* logger = store->get_perf_counters();
+  uint64_t deferred = logger->get(l_bluestore_onode_reshard_deferred);
+  g_conf->set_val("bluestore_extent_map_shard_segment_extents", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+  fill(whole);
+  logger = store->get_perf_counters();
+  ASSERT_GT(logger->get(l_bluestore_onode_reshard_deferred), deferred);
+  // segmented shards need min_compat_ondisk_format raised, on mount
+  g_conf->set_val("bluestore_extent_map_shard_segment_extents", "8");
+  g_ceph_context->_conf->apply_changes(NULL);
+  r = store->umount();
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  fill(segmented);
+  logger = store->get_perf_counters();
+
+  auto read_4k = [&](const ghobject_t& hoid) {
+    uint64_t decoded = logger->get(l_bluestore_onode_shard_decode_bytes);
+    bufferlist bl;
+    r = store->read(cid, hoid, 2 << 20, 4096, bl);
+    EXPECT_EQ(4096, r);
+    EXPECT_TRUE(bl_eq(data, bl));
+    return logger->get(l_bluestore_onode_shard_decode_bytes) - decoded;
+  };
+  uint64_t whole_bytes = read_4k(whole);
+  uint64_t segmented_bytes = read_4k(segmented);
+  ASSERT_GT(segmented_bytes, 0u);
+  ASSERT_LT(segmented_bytes * 2, whole_bytes);
+
+  // the rest of the shard is decoded on demand
+  {
+    bufferlist bl, zeros;
+    r = store->read(cid, segmented, 0, 4 << 20, bl);
+    ASSERT_EQ(511 * 8192 + 4096, r);
+    zeros.append_zero(4096);
+    for (unsigned i = 0; i < 512; ++i) {
+      bufferlist actual;
+      actual.substr_of(bl, i * 8192, 4096);
+      ASSERT_TRUE(bl_eq(data, actual));
+      if (i < 511) {
+	actual.substr_of(bl, i * 8192 + 4096, 4096);
+	ASSERT_TRUE(bl_eq(zeros, actual));
+      }
+    }
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, whole);
+    t.remove(cid, segmented);
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_extent_map_shard_segment_extents", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
+TEST_P(StoreTest, AllocTraceConsistent) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  auto object = [](unsigned i) {
+    return ghobject_t(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+  };
+  char cwd[PATH_MAX];
+  ASSERT_TRUE(getcwd(cwd, sizeof(cwd)) != nullptr);
+  string path = string(cwd) + "/store_test_temp_alloc_trace";
+  {
+    // allocate and release while traces start and stop
+    std::atomic<bool> stop = {false};
+    std::thread writer([&]() {
+	ObjectStore::Sequencer wosr("writer");
+	bufferlist bl;
+	bl.append(std::string(65536, 'a'));
+	for (unsigned i = 0; !stop; ++i) {
+	  ObjectStore::Transaction t;
+	  if (i % 32 < 16) {
+	    t.write(cid, object(i % 16), 0, bl.length(), bl);
+	  } else {
+	    t.remove(cid, object(i % 16));
+	  }
+	  apply_transaction(store, &wosr, std::move(t));
+	}
+      });
+    auto join = make_scope_guard([&] {
+	stop = true;
+	writer.join();
+	store->set_alloc_trace("");
+	::unlink(path.c_str());
+      });
+
+    for (unsigned round = 0; round < 10; ++round) {
+      ASSERT_EQ(0, store->set_alloc_trace(path));
+      usleep(50000);
+      ASSERT_EQ(0, store->set_alloc_trace(""));
+
+      // every traced allocation comes from space that was free at the
+      // start or released since, so no call went untraced
+      std::ifstream in(path);
+      interval_set<uint64_t> free;
+      unsigned allocs = 0;
+      string line;
+      while (std::getline(in, line)) {
+	std::istringstream ss(line);
+	string op;
+	ss >> op;
+	if (op == "F") {
+	  uint64_t offset, length;
+	  ss >> std::hex >> offset >> length;
+	  free.insert(offset, length);
+	  continue;
+	}
+	if (op != "A" && op != "R")
+	  continue;
+	string skip;
+	unsigned fields = op == "A" ? 6 : 1;
+	for (unsigned i = 0; i < fields; ++i)
+	  ss >> skip;
+	string extent;
+	while (ss >> extent) {
+	  auto tilde = extent.find('~');
+	  ASSERT_NE(string::npos, tilde);
+	  uint64_t offset = strtoull(extent.substr(0, tilde).c_str(), NULL, 16);
+	  uint64_t length = strtoull(extent.substr(tilde + 1).c_str(), NULL, 16);
+	  if (op == "A") {
+	    ASSERT_TRUE(free.contains(offset, length)) << line;
+	    free.erase(offset, length);
+	    ++allocs;
+	  } else {
+	    ASSERT_FALSE(free.intersects(offset, length)) << line;
+	    free.insert(offset, length);
+	  }
+	}
+      }
+      ASSERT_GT(free.size(), 0u);
+      cout << "round " << round << ": " << allocs << " extents allocated"
+	   << std::endl;
+    }
+  }
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < 16; ++i) {
+      t.remove(cid, object(i));
+    }
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, ExtentMapDeferredReshard) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  BlueStore *bstore = dynamic_cast<BlueStore*>(store.get());
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const PerfCounters* logger = store->get_perf_counters();
+  bstore->inject_reshard_pause(true);
+
+  // 4K written every 8K, until a txc leaves a deferred reshard behind
+  bufferlist data;
+  data.append(std::string(4096, 'x'));
+  unsigned n = 0;
+  while (n < 4096) {
+    uint64_t deferred = logger->get(l_bluestore_onode_reshard_deferred);
+    ObjectStore::Transaction t;
+    for (unsigned j = 0; j < 16; ++j, ++n) {
+      t.write(cid, hoid, n * 8192, data.length(), data, 0);
+    }
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+    if (n >= 256 &&
+	logger->get(l_bluestore_onode_reshard_deferred) > deferred) {
+      break;
+    }
+  }
+  ASSERT_LT(n, 4096u);
+  vector<uint32_t> deferred_shards;
+  ASSERT_EQ(0, bstore->get_extent_map_shards(cid, hoid, &deferred_shards));
+  uint64_t resharded = logger->get(l_bluestore_onode_reshard);
+
+  bstore->inject_reshard_pause(false);
+  for (unsigned i = 0; i < 1000; ++i) {
+    if (logger->get(l_bluestore_onode_reshard) > resharded)
+      break;
+    usleep(10000);
+  }
+  ASSERT_GT(logger->get(l_bluestore_onode_reshard), resharded);
+  vector<uint32_t> shards;
+  ASSERT_EQ(0, bstore->get_extent_map_shards(cid, hoid, &shards));
+  ASSERT_NE(deferred_shards, shards);
+
+  // the new layout is what was committed
+  r = store->umount();
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  vector<uint32_t> mounted_shards;
+  ASSERT_EQ(0, bstore->get_extent_map_shards(cid, hoid, &mounted_shards));
+  ASSERT_EQ(shards, mounted_shards);
+  {
+    bufferlist bl;
+    r = store->read(cid, hoid, 0, n * 8192, bl);
+    ASSERT_EQ((int)((n - 1) * 8192 + 4096), r);
+    for (unsigned i = 0; i < n; ++i) {
+      bufferlist actual;
+      actual.substr_of(bl, i * 8192, 4096);
+      ASSERT_TRUE(bl_eq(data, actual));
+    }
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTestSpecificAUSize, SeparateWalFlushes) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  char cwd[PATH_MAX];
+  ASSERT_TRUE(getcwd(cwd, sizeof(cwd)) != nullptr);
+  string wal_path = string(cwd) + "/store_test_temp_wal";
+  ::unlink(wal_path.c_str());
+  g_conf->set_val("bluestore_block_wal_path", wal_path);
+  g_conf->set_val("bluestore_block_wal_create", "true");
+  g_conf->set_val("bluestore_prefer_deferred_size", "65536");
+  g_conf->apply_changes(NULL);
+  StartDeferred(65536);
+
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const PerfCounters* logger = store->get_perf_counters();
+  bufferlist big, small;
+  big.append(std::string(131072, 'a'));
+  small.append(std::string(4096, 'b'));
+
+  // data written to the main device is flushed before its commit...
+  uint64_t flushes = logger->get(l_bluestore_kv_flushes);
+  for (unsigned i = 0; i < 10; ++i) {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, i * big.length(), big.length(), big);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_GE(logger->get(l_bluestore_kv_flushes) - flushes, 10u);
+
+  // ...while a deferred write only commits to the wal; the main device
+  // is flushed once the deferred writes have been applied
+  flushes = logger->get(l_bluestore_kv_flushes);
+  uint64_t deferred = logger->get(l_bluestore_deferred_write_ops);
+  for (unsigned i = 0; i < 100; ++i) {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, i * 8192, small.length(), small);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_GE(logger->get(l_bluestore_deferred_write_ops) - deferred, 100u);
+  ASSERT_LT(logger->get(l_bluestore_kv_flushes) - flushes, 50u);
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_block_wal_path", "");
+  g_conf->set_val("bluestore_block_wal_create", "false");
+  g_conf->set_val("bluestore_prefer_deferred_size", "0");
+  g_conf->apply_changes(NULL);
+  ::unlink(wal_path.c_str());
+}
+
+#if defined(HAVE_PMEM)
+TEST_P(StoreTestSpecificAUSize, PMEMWalDeferredWrite) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  char cwd[PATH_MAX];
+  ASSERT_TRUE(getcwd(cwd, sizeof(cwd)) != nullptr);
+  string wal_path = string(cwd) + "/store_test_temp_pmem_wal";
+  ::unlink(wal_path.c_str());
+  g_conf->set_val("bluestore_block_wal_path", wal_path);
+  g_conf->set_val("bluestore_block_wal_create", "true");
+  g_conf->set_val("bluestore_block_wal_pmem_emulate", "true");
+  g_conf->set_val("bluestore_prefer_deferred_size_pmem", "65536");
+  g_conf->apply_changes(NULL);
+  StartDeferred(65536);
+
+  map<string,string> pm;
+  store->collect_metadata(&pm);
+  ASSERT_EQ("PMEMDevice", pm["bluefs_wal_driver"]);
+
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // larger than the hdd and ssd defaults, so only deferred because
+  // the wal is on pmem
+  const PerfCounters* logger = store->get_perf_counters();
+  uint64_t deferred = logger->get(l_bluestore_deferred_write_ops);
+  bufferlist bl;
+  bl.append(std::string(49152, 'a'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_GT(logger->get(l_bluestore_deferred_write_ops), deferred);
+
+  // destaged to the main device and replayed from the wal
+  store->umount();
+  ASSERT_EQ(0, store->mount());
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, bl.length(), in);
+    ASSERT_EQ((int)bl.length(), r);
+    ASSERT_TRUE(bl_eq(bl, in));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_block_wal_path", "");
+  g_conf->set_val("bluestore_block_wal_create", "false");
+  g_conf->set_val("bluestore_block_wal_pmem_emulate", "false");
+  g_conf->set_val("bluestore_prefer_deferred_size_pmem", "32768");
+  g_conf->apply_changes(NULL);
+  ::unlink(wal_path.c_str());
+}
+#endif
+
 #endif //#if defined(WITH_BLUESTORE)
 
 TEST_P(StoreTest, KVDBHistogramTest) {
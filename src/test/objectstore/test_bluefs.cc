@@ -13,6 +13,7 @@
 #include "include/stringify.h"
 #include "include/scope_guard.h"
 #include "common/errno.h"
+#include "common/perf_counters.h"
 #include <gtest/gtest.h>
 
 #include "os/bluestore/BlueFS.h"
@@ -567,6 +568,196 @@ TEST(BlueFS, test_replay) {
   rm_temp_bdev(fn);
 }
 
+TEST(BlueFS, test_compaction_async_namespace_changes) {
+  uint64_t size = 1048576 * 128;
+  string fn = get_temp_bdev(size);
+  g_ceph_context->_conf->set_val(
+    "bluefs_compact_log_sync",
+    "false");
+  // hand the lock back after every entry so that the namespace changes
+  // below land in the middle of the dump
+  g_ceph_context->_conf->set_val(
+    "bluefs_log_compact_batch",
+    "1");
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, fn));
+  fs.add_block_extent(BlueFS::BDEV_DB, 1048576, size - 1048576);
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("dir"));
+  for (int i = 0; i < 200; i++) {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("dir", "file." + to_string(i), &h, false));
+    fs.close_writer(h);
+  }
+  fs.flush_log();
+
+  std::atomic<bool> stop = {false};
+  std::thread mutator([&] {
+      // unlink, rename over and recreate names on both sides of the
+      // dump cursor
+      for (int n = 0; !stop; n = (n + 1) % 200) {
+	string name = "file." + to_string(n);
+	if (n % 3 == 0) {
+	  fs.unlink("dir", name);
+	} else if (n % 3 == 1) {
+	  fs.rename("dir", name, "dir", "file." + to_string((n + 100) % 200));
+	} else {
+	  BlueFS::FileWriter *h;
+	  if (fs.open_for_write("dir", name, &h, false) == 0) {
+	    fs.close_writer(h);
+	  }
+	}
+	fs.flush_log();
+      }
+    });
+  for (int i = 0; i < 20; i++) {
+    fs.compact_log();
+  }
+  stop = true;
+  mutator.join();
+  fs.flush_log();
+
+  vector<string> before, after;
+  ASSERT_EQ(0, fs.readdir("dir", &before));
+  fs.umount();
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.readdir("dir", &after));
+  std::sort(before.begin(), before.end());
+  std::sort(after.begin(), after.end());
+  ASSERT_EQ(before, after);
+  fs.umount();
+  g_ceph_context->_conf->set_val(
+    "bluefs_log_compact_batch",
+    "1024");
+  rm_temp_bdev(fn);
+}
+
+TEST(BlueFS, test_preextend_wal) {
+  uint64_t size = 1048576 * 128;
+  string fn = get_temp_bdev(size);
+  bool preextend =
+    g_ceph_context->_conf->get_val<bool>("bluefs_preextend_wal_files");
+  auto restore = make_scope_guard([preextend] {
+      g_ceph_context->_conf->set_val("bluefs_preextend_wal_files",
+				     preextend ? "true" : "false");
+    });
+  g_ceph_context->_conf->set_val(
+    "bluefs_preextend_wal_files",
+    "true");
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, fn));
+  fs.add_block_extent(BlueFS::BDEV_DB, 1048576, size - 1048576);
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("dir"));
+  {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("dir", "000001.log", &h, false));
+    ASSERT_EQ(0, fs.preallocate(h, 0, 1048576));
+    uint64_t fsize;
+    utime_t mtime;
+    ASSERT_EQ(0, fs.stat("dir", "000001.log", &fsize, &mtime));
+    ASSERT_EQ(1048576u, fsize);
+
+    // appends within the preallocated space do not change the size...
+    char *buf = gen_buffer(4096);
+    h->append(buf, 4096);
+    fs.fsync(h);
+    ASSERT_EQ(0, fs.stat("dir", "000001.log", &fsize, &mtime));
+    ASSERT_EQ(1048576u, fsize);
+    // ...and neither does rocksdb's truncate on close
+    ASSERT_EQ(0, fs.truncate(h, 4096));
+    ASSERT_EQ(0, fs.stat("dir", "000001.log", &fsize, &mtime));
+    ASSERT_EQ(1048576u, fsize);
+    fs.close_writer(h);
+    delete[] buf;
+  }
+  {
+    // other files are sized by what is written
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("dir", "000002.sst", &h, false));
+    ASSERT_EQ(0, fs.preallocate(h, 0, 1048576));
+    uint64_t fsize;
+    utime_t mtime;
+    ASSERT_EQ(0, fs.stat("dir", "000002.sst", &fsize, &mtime));
+    ASSERT_EQ(0u, fsize);
+    fs.close_writer(h);
+  }
+  {
+    // and so are WAL files once our user has opted out, whatever the
+    // option says
+    fs.disable_preextend_wal();
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("dir", "000003.log", &h, false));
+    ASSERT_EQ(0, fs.preallocate(h, 0, 1048576));
+    uint64_t fsize;
+    utime_t mtime;
+    ASSERT_EQ(0, fs.stat("dir", "000003.log", &fsize, &mtime));
+    ASSERT_EQ(0u, fsize);
+    fs.close_writer(h);
+  }
+  ASSERT_TRUE(g_ceph_context->_conf->get_val<bool>("bluefs_preextend_wal_files"));
+  fs.umount();
+  rm_temp_bdev(fn);
+}
+
+TEST(BlueFS, test_wal_fsync_flushes) {
+  uint64_t size = 1048576 * 128;
+  string fn = get_temp_bdev(size);
+  string wal_fn = get_temp_bdev(size);
+  bool preextend =
+    g_ceph_context->_conf->get_val<bool>("bluefs_preextend_wal_files");
+  auto restore = make_scope_guard([preextend] {
+      g_ceph_context->_conf->set_val("bluefs_preextend_wal_files",
+				     preextend ? "true" : "false");
+    });
+  g_ceph_context->_conf->set_val(
+    "bluefs_preextend_wal_files",
+    "true");
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_WAL, wal_fn));
+  fs.add_block_extent(BlueFS::BDEV_WAL, 1048576, size - 1048576);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, fn));
+  fs.add_block_extent(BlueFS::BDEV_DB, 1048576, size - 1048576);
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("db.wal"));
+  {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("db.wal", "000001.log", &h, false));
+    ASSERT_EQ(0, fs.preallocate(h, 0, 1048576));
+    char *buf = gen_buffer(4096);
+    h->append(buf, 4096);
+    fs.fsync(h);
+
+    // with the file's size unchanged, a sync only flushes the device
+    // its data is on
+    PerfCounters *logger = fs.get_perf_counters();
+    uint64_t saved = logger->get(l_bluefs_wal_fsync_log_writes_saved);
+    uint64_t wal = logger->get(l_bluefs_wal_flushes);
+    uint64_t db = logger->get(l_bluefs_db_flushes);
+    for (unsigned i = 0; i < 10; ++i) {
+      h->append(buf, 4096);
+      fs.fsync(h);
+    }
+    ASSERT_EQ(10u, logger->get(l_bluefs_wal_fsync_log_writes_saved) - saved);
+    ASSERT_EQ(10u, logger->get(l_bluefs_wal_flushes) - wal);
+    ASSERT_EQ(0u, logger->get(l_bluefs_db_flushes) - db);
+    fs.close_writer(h);
+    delete[] buf;
+  }
+  fs.umount();
+  rm_temp_bdev(wal_fn);
+  rm_temp_bdev(fn);
+}
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
@@ -1030,6 +1030,87 @@ TEST(Blob, legacy_decode)
   }
 }
 
+TEST(OnodeSpace, deferred_touch)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  PerfCountersBuilder pcb(g_ceph_context, "test_onode_space",
+			  l_bluestore_first, l_bluestore_last);
+  pcb.add_u64_counter(l_bluestore_onode_hits, "onode_hits", "");
+  pcb.add_u64_counter(l_bluestore_onode_misses, "onode_misses", "");
+  PerfCounters *logger = pcb.create_perf_counters();
+  BlueStore::Cache *cache = BlueStore::Cache::create(
+    g_ceph_context, "lru", logger);
+  BlueStore::CollectionRef coll(new BlueStore::Collection(&store, cache, coll_t()));
+  ghobject_t a(hobject_t(sobject_t("a", CEPH_NOSNAP)));
+  ghobject_t b(hobject_t(sobject_t("b", CEPH_NOSNAP)));
+
+  // b is added last, so a is at the cold end of the lru
+  coll->onode_map.add(a, new BlueStore::Onode(coll.get(), a, "a"));
+  coll->onode_map.add(b, new BlueStore::Onode(coll.get(), b, "b"));
+  ASSERT_TRUE(coll->onode_map.lookup(a));
+  ASSERT_EQ(1u, logger->get(l_bluestore_onode_hits));
+
+  // the lookup only marked a; the trim applies the touch and evicts b
+  {
+    std::lock_guard<std::recursive_mutex> l(cache->lock);
+    cache->_trim(1, 0);
+  }
+  ASSERT_TRUE(coll->onode_map.lookup(a));
+  ASSERT_FALSE(coll->onode_map.lookup(b));
+  ASSERT_EQ(1u, logger->get(l_bluestore_onode_misses));
+
+  // a trim to zero ignores pending touches
+  cache->trim_all();
+  ASSERT_TRUE(coll->onode_map.empty());
+  delete logger;
+}
+
+TEST(OnodeSpace, twoq_scan_resistance)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  PerfCountersBuilder pcb(g_ceph_context, "test_onode_space_2q",
+			  l_bluestore_first, l_bluestore_last);
+  pcb.add_u64_counter(l_bluestore_onode_hits, "onode_hits", "");
+  pcb.add_u64_counter(l_bluestore_onode_misses, "onode_misses", "");
+  PerfCounters *logger = pcb.create_perf_counters();
+  BlueStore::Cache *cache = BlueStore::Cache::create(
+    g_ceph_context, "2q", logger);
+  BlueStore::CollectionRef coll(new BlueStore::Collection(&store, cache, coll_t()));
+  auto oid = [](const char *name) {
+    return ghobject_t(hobject_t(sobject_t(name, CEPH_NOSNAP)));
+  };
+  auto add = [&](const char *name, int level) {
+    ghobject_t o = oid(name);
+    coll->onode_map.add(o, new BlueStore::Onode(coll.get(), o, name), level);
+  };
+  auto trim = [&](uint64_t onode_max) {
+    std::lock_guard<std::recursive_mutex> l(cache->lock);
+    cache->_trim(onode_max, 0);
+  };
+
+  // a ages out of warm_in; referencing it again makes it hot
+  add("a", 1);
+  add("b", 1);
+  add("c", 1);
+  trim(2);
+  ASSERT_FALSE(coll->onode_map.lookup(oid("a")));
+  add("a", 1);
+
+  // a one-touch scan cannot push a out
+  add("s1", 0);
+  add("s2", 0);
+  add("s3", 0);
+  add("s4", 0);
+  trim(2);
+  ASSERT_TRUE(coll->onode_map.lookup(oid("a")));
+  ASSERT_FALSE(coll->onode_map.lookup(oid("s1")));
+  ASSERT_FALSE(coll->onode_map.lookup(oid("s4")));
+
+  cache->trim_all();
+  ASSERT_TRUE(coll->onode_map.empty());
+  delete logger;
+}
+
 TEST(ExtentMap, seek_lextent)
 {
   BlueStore store(g_ceph_context, "", 4096);
@@ -1126,6 +1207,58 @@ TEST(ExtentMap, has_any_lextents)
   ASSERT_FALSE(em.has_any_lextents(500, 1000));
 }
 
+TEST(ExtentMap, encode_decode_segments)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  BlueStore::LRUCache cache(g_ceph_context);
+  BlueStore::CollectionRef coll(new BlueStore::Collection(&store, &cache, coll_t()));
+  BlueStore::Onode onode(coll.get(), ghobject_t(), "");
+  BlueStore::ExtentMap em(&onode);
+  for (unsigned i = 0; i < 40; ++i) {
+    BlueStore::BlobRef b(new BlueStore::Blob);
+    b->shared_blob = new BlueStore::SharedBlob(coll.get());
+    b->dirty_blob().allocated_test(
+      bluestore_pextent_t(0x100000 + i * 0x2000, 0x1000));
+    em.extent_map.insert(*new BlueStore::Extent(i * 0x2000, 0, 0x1000, b));
+  }
+
+  // whole shards are v2, segmented ones v3 (5 segments of 8 extents)
+  for (unsigned segment_extents : {0, 8}) {
+    bufferlist bl;
+    unsigned n = 0;
+    ASSERT_FALSE(em.encode_some(0, 0x50000, bl, &n, segment_extents));
+    ASSERT_EQ(40u, n);
+    ASSERT_EQ(segment_extents ? 3 : 2, (int)(uint8_t)bl[0]);
+    bl.rebuild();
+
+    BlueStore::Onode onode2(coll.get(), ghobject_t(), "");
+    BlueStore::ExtentMap em2(&onode2);
+    bluestore_onode_t::shard_info si;
+    BlueStore::ExtentMap::Shard shard;
+    shard.shard_info = &si;
+    shard.encoded = bl;
+    if (segment_extents) {
+      em2.decode_segments(&shard, 0x11000, 0x12000);
+      ASSERT_FALSE(shard.loaded);
+      ASSERT_EQ(8u, em2.extent_map.size());
+      ASSERT_EQ(0x10000u, em2.extent_map.begin()->logical_offset);
+    }
+    em2.decode_segments(&shard, 0, 0x50000);
+    ASSERT_TRUE(shard.loaded);
+    ASSERT_EQ(40u, shard.extents);
+    ASSERT_EQ(40u, em2.extent_map.size());
+    auto p = em.extent_map.begin();
+    for (auto& e : em2.extent_map) {
+      ASSERT_EQ(p->logical_offset, e.logical_offset);
+      ASSERT_EQ(p->length, e.length);
+      ASSERT_EQ(p->blob_offset, e.blob_offset);
+      ASSERT_EQ(p->blob->get_blob().get_extents(),
+		e.blob->get_blob().get_extents());
+      ++p;
+    }
+  }
+}
+
 TEST(ExtentMap, compress_extent_map)
 {
   BlueStore store(g_ceph_context, "", 4096);
@@ -17,7 +17,9 @@
 #include <iostream>
 #include <time.h>
 #include <sys/mount.h>
+#include <unistd.h>
 #include "kv/KeyValueDB.h"
+#include "kv/RocksDBStore.h"
 #include "include/Context.h"
 #include "common/ceph_argparse.h"
 #include "global/global_init.h"
@@ -312,6 +314,78 @@ TEST_P(KVTest, RMRange) {
   fini();
 }
 
+TEST_P(KVTest, RMRangeLarge) {
+  if (string(GetParam()) != "rocksdb")
+    return;
+
+  // drop ranges of more than 10 keys with a range tombstone, and compact
+  // them away afterwards
+  g_ceph_context->_conf->set_val("rocksdb_delete_range_threshold", "10");
+  fini();
+  init();
+  // "prefix" lives in the default column family, "cf1" in its own
+  std::vector<KeyValueDB::ColumnFamily> cfs;
+  cfs.push_back(KeyValueDB::ColumnFamily("cf1", ""));
+  ASSERT_EQ(0, db->create_and_open(cout, cfs));
+  PerfCounters *logger = db->get_perf_counters();
+  bufferlist value;
+  value.append("value");
+  for (auto prefix : {"prefix", "cf1"}) {
+    cout << "prefix " << prefix << std::endl;
+    {
+      KeyValueDB::Transaction t = db->get_transaction();
+      for (int i = 0; i < 100; ++i) {
+	char key[16];
+	snprintf(key, sizeof(key), "key%03d", i);
+	t->set(prefix, key, value);
+      }
+      db->submit_transaction_sync(t);
+    }
+    uint64_t keys = logger->get(l_rocksdb_rmrange_keys);
+    uint64_t tombstones = logger->get(l_rocksdb_rmrange_tombstones);
+    uint64_t compactions = logger->get(l_rocksdb_compact_range);
+    {
+      // small range: point deletes
+      KeyValueDB::Transaction t = db->get_transaction();
+      t->rm_range_keys(prefix, "key000", "key005");
+      db->submit_transaction_sync(t);
+      bufferlist v;
+      ASSERT_EQ(-ENOENT, db->get(prefix, "key004", &v));
+      ASSERT_EQ(0, db->get(prefix, "key005", &v));
+      ASSERT_EQ(keys + 5, logger->get(l_rocksdb_rmrange_keys));
+      ASSERT_EQ(tombstones, logger->get(l_rocksdb_rmrange_tombstones));
+    }
+    {
+      // large range: one range tombstone, then a compaction
+      KeyValueDB::Transaction t = db->get_transaction();
+      t->rm_range_keys(prefix, "key010", "key090");
+      db->submit_transaction_sync(t);
+      bufferlist v;
+      ASSERT_EQ(0, db->get(prefix, "key009", &v));
+      v.clear();
+      ASSERT_EQ(-ENOENT, db->get(prefix, "key010", &v));
+      ASSERT_EQ(-ENOENT, db->get(prefix, "key050", &v));
+      ASSERT_EQ(-ENOENT, db->get(prefix, "key089", &v));
+      ASSERT_EQ(0, db->get(prefix, "key090", &v));
+      ASSERT_EQ(keys + 5, logger->get(l_rocksdb_rmrange_keys));
+      ASSERT_EQ(tombstones + 1, logger->get(l_rocksdb_rmrange_tombstones));
+      for (int i = 0; i < 1000 &&
+	     logger->get(l_rocksdb_compact_range) == compactions; ++i)
+	usleep(10000);
+      ASSERT_LT(compactions, logger->get(l_rocksdb_compact_range));
+    }
+    {
+      int n = 0;
+      KeyValueDB::Iterator it = db->get_iterator(prefix);
+      for (it->seek_to_first(); it->valid(); it->next())
+	++n;
+      ASSERT_EQ(100 - 5 - 80, n);
+    }
+  }
+  fini();
+  g_ceph_context->_conf->set_val("rocksdb_delete_range_threshold", "1024");
+}
+
 TEST_P(KVTest, RocksDBColumnFamilyTest) {
   if(string(GetParam()) != "rocksdb")
     return;
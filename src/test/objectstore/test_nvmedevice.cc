@@ -0,0 +1,157 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+//
+// Needs NVMe controllers bound to SPDK, named by serial number:
+//
+//   CEPH_TEST_NVME_SERIALS=<sn>[,<sn>...] ceph_test_nvmedevice
+//
+// The start of each device is overwritten.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <set>
+#include <thread>
+#include <gtest/gtest.h>
+
+#include "global/global_context.h"
+#include "global/global_init.h"
+#include "common/ceph_argparse.h"
+#include "common/perf_counters.h"
+#include "include/stringify.h"
+#include "include/str_list.h"
+#include "os/bluestore/BlockDevice.h"
+
+static void aio_cb(void *priv, void *priv2)
+{
+}
+
+// make BlockDevice::create() pick NVMEDevice: a link to "spdk:<sn>",
+// which holds the serial number
+static string make_path(const string &sn)
+{
+  string target = SPDK_PREFIX + sn + "." + stringify(getpid());
+  string path = "ceph_test_nvmedevice." + sn + "." + stringify(getpid());
+  int fd = ::open(target.c_str(), O_CREAT|O_RDWR|O_TRUNC, 0644);
+  assert(fd >= 0);
+  int r = ::write(fd, sn.c_str(), sn.length());
+  assert(r == (int)sn.length());
+  ::close(fd);
+  ::unlink(path.c_str());
+  r = ::symlink(target.c_str(), path.c_str());
+  assert(r == 0);
+  return path;
+}
+
+static void rm_path(const string &path)
+{
+  char buf[PATH_MAX + 1];
+  int r = ::readlink(path.c_str(), buf, sizeof(buf) - 1);
+  if (r >= 0) {
+    buf[r] = '\0';
+    ::unlink(buf);
+  }
+  ::unlink(path.c_str());
+}
+
+// names of the per-thread queue pairs' perf counters
+static std::set<string> queue_loggers()
+{
+  std::set<string> names;
+  g_ceph_context->get_perfcounters_collection()->with_counters(
+    [&](const PerfCountersCollection::CounterMap &by_path) {
+      for (auto &p : by_path) {
+        if (p.first.compare(0, 21, "NVMEDevice-AIOThread-") == 0)
+          names.insert(p.first.substr(0, p.first.find('.')));
+      }
+    });
+  return names;
+}
+
+static void write_and_verify(BlockDevice *bdev, uint64_t off, char c)
+{
+  bufferlist bl;
+  bl.append(string(bdev->get_block_size(), c));
+  ASSERT_EQ(0, bdev->write(off, bl, false));
+  IOContext ioc(g_ceph_context, NULL);
+  bufferlist out;
+  ASSERT_EQ(0, bdev->read(off, bl.length(), &out, &ioc, false));
+  ASSERT_TRUE(bl.contents_equal(out));
+}
+
+class NVMEDeviceTest : public ::testing::Test {
+ public:
+  vector<string> serials, paths;
+  vector<BlockDevice*> bdevs;
+
+  void SetUp() override {
+    const char *env = getenv("CEPH_TEST_NVME_SERIALS");
+    if (env)
+      get_str_vec(env, serials);
+    for (auto &sn : serials) {
+      paths.push_back(make_path(sn));
+      BlockDevice *bdev = BlockDevice::create(g_ceph_context, paths.back(),
+                                              aio_cb, NULL);
+      ASSERT_EQ(0, bdev->open(paths.back()));
+      bdevs.push_back(bdev);
+    }
+  }
+  void TearDown() override {
+    for (auto bdev : bdevs) {
+      bdev->close();
+      delete bdev;
+    }
+    for (auto &path : paths)
+      rm_path(path);
+  }
+};
+
+TEST_F(NVMEDeviceTest, QueuePerController) {
+  if (bdevs.empty()) {
+    cout << "SKIP: CEPH_TEST_NVME_SERIALS is not set" << std::endl;
+    return;
+  }
+  // a second device on the first controller shares its queue pair
+  string path = make_path(serials[0]);
+  paths.push_back(path);
+  BlockDevice *shared = BlockDevice::create(g_ceph_context, path, aio_cb, NULL);
+  ASSERT_EQ(0, shared->open(path));
+  bdevs.push_back(shared);
+
+  std::set<string> before = queue_loggers();
+  for (auto bdev : bdevs)
+    write_and_verify(bdev, 0, 'a');
+  std::set<string> mine = queue_loggers();
+  ASSERT_EQ(before.size() + serials.size(), mine.size());
+
+  // switching back and forth between controllers keeps the queues
+  for (int i = 0; i < 100; ++i) {
+    for (auto bdev : bdevs)
+      write_and_verify(bdev, bdev->get_block_size() * (i % 16), 'b' + i % 16);
+  }
+  ASSERT_EQ(mine, queue_loggers());
+
+  // another thread gets queues of its own, freed when it exits
+  std::thread t([&]() {
+    for (auto bdev : bdevs)
+      write_and_verify(bdev, 0, 'z');
+    ASSERT_EQ(mine.size() + serials.size(), queue_loggers().size());
+  });
+  t.join();
+  ASSERT_EQ(mine, queue_loggers());
+}
+
+int main(int argc, char **argv) {
+  vector<const char*> args;
+  argv_to_vec(argc, (const char **)argv, args);
+  env_to_vec(args);
+
+  auto cct = global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT,
+			 CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -281,3 +281,98 @@ TEST(PageSet, FreeHoles)
   pages.get_range(0, 8, range);
   ASSERT_EQ(0u, range.size());
 }
+
+TEST(PageSet, Arena)
+{
+  auto arena = std::make_shared<PageArena>(4096, 8192);
+  ASSERT_EQ(8192u, arena->get_chunk_size());
+  PageSet pages(4096, 1, arena);
+  PageSet::page_vector range;
+
+  // three pages need two chunks
+  pages.alloc_range(0, 3 * 4096, range);
+  ASSERT_EQ(3u, range.size());
+  for (auto &p : range)
+    ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(p->data) % 4096);
+  ASSERT_EQ(2u * 8192, arena->get_mapped());
+  ASSERT_EQ(1u, arena->get_free_pages());
+  range.clear();
+
+  // freed pages go back to the arena and get reused
+  pages.free_pages_after(4096);
+  ASSERT_EQ(3u, arena->get_free_pages());
+  pages.alloc_range(4096, 2 * 4096, range);
+  range.clear();
+  ASSERT_EQ(1u, arena->get_free_pages());
+  ASSERT_EQ(2u * 8192, arena->get_mapped());
+}
+
+TEST(PageSet, Striped)
+{
+  // 4 stripes of 16 one-byte pages
+  PageSet pages(1, 4);
+  PageSet::page_vector range;
+
+  // a write spanning all of the stripes and wrapping around
+  pages.alloc_range(10, 100, range);
+  ASSERT_EQ(100u, range.size());
+  for (uint64_t i = 0; i < 100; i++)
+    ASSERT_EQ(10 + i, range[i]->offset);
+  range.clear();
+  ASSERT_EQ(100u, pages.size());
+
+  // overlapping allocations return the existing pages in order
+  pages.alloc_range(0, 20, range);
+  ASSERT_EQ(20u, range.size());
+  for (uint64_t i = 0; i < 20; i++)
+    ASSERT_EQ(i, range[i]->offset);
+  range.clear();
+  ASSERT_EQ(110u, pages.size());
+
+  pages.get_range(5, 70, range);
+  ASSERT_EQ(70u, range.size());
+  for (uint64_t i = 0; i < 70; i++)
+    ASSERT_EQ(5 + i, range[i]->offset);
+  range.clear();
+
+  // free from the middle of a run
+  pages.free_pages_after(40);
+  ASSERT_EQ(40u, pages.size());
+  pages.get_range(0, 200, range);
+  ASSERT_EQ(40u, range.size());
+  ASSERT_EQ(39u, range.back()->offset);
+  range.clear();
+}
+
+TEST(PageSet, StripedEncode)
+{
+  PageSet striped(1, 3);
+  PageSet::page_vector range;
+  for (uint64_t i : {0, 17, 18, 40, 63, 64, 100})
+    striped.alloc_range(i, 1, range);
+  for (auto &page : range)
+    page->data[0] = page->offset;
+  range.clear();
+
+  // the encoding doesn't depend on the number of stripes
+  bufferlist bl;
+  striped.encode(bl);
+  PageSet flat(1);
+  auto p = bl.begin();
+  flat.decode(p);
+  ASSERT_EQ(7u, flat.size());
+
+  bufferlist bl2;
+  flat.encode(bl2);
+  ASSERT_TRUE(bl.contents_equal(bl2));
+
+  PageSet restriped(1, 5);
+  p = bl.begin();
+  restriped.decode(p);
+  restriped.get_range(0, 128, range);
+  ASSERT_EQ(7u, range.size());
+  for (size_t i = 1; i < range.size(); i++)
+    ASSERT_LT(range[i - 1]->offset, range[i]->offset);
+  for (auto &page : range)
+    ASSERT_EQ((char)page->offset, page->data[0]);
+}